@@ -0,0 +1,126 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "acks.h"
+#include "binarymessage.h"
+
+using namespace std;
+
+void AckSequencer::expect(uint8_t opcode, uint32_t opaque) {
+    Entry entry;
+    entry.opcode = opcode;
+    entry.opaque = opaque;
+    entry.status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    entry.answered = false;
+    waiting.insert(make_pair(opaque, first + entries.size()));
+    entries.push_back(entry);
+}
+
+bool AckSequencer::answer(uint32_t opaque, uint16_t status) {
+    // The entries with the same opaque are kept in insertion order
+    multimap<uint32_t, uint64_t>::iterator iter = waiting.lower_bound(opaque);
+    if (iter == waiting.end() || iter->first != opaque) {
+        return false;
+    }
+    Entry &entry = entries[iter->second - first];
+    entry.answered = true;
+    entry.status = status;
+    waiting.erase(iter);
+    return true;
+}
+
+BinaryMessage *AckSequencer::next() {
+    if (entries.empty() || !entries.front().answered) {
+        return NULL;
+    }
+    Entry &entry = entries.front();
+    BinaryMessage *msg = new ResponseBinaryMessage(entry.opcode, entry.opaque,
+                                                   entry.status);
+    entries.pop_front();
+    ++first;
+    return msg;
+}
+
+void AckSequencer::clear() {
+    first += entries.size();
+    entries.clear();
+    waiting.clear();
+}
+
+void FanoutAcks::expect(uint8_t opcode, uint32_t opaque,
+                        const vector<bool> &dropped) {
+    Entry &entry = entries[opaque];
+    entry.opcode = opcode;
+    entry.waiting.assign(dropped.size(), false);
+    entry.remaining = 0;
+    entry.failed = false;
+    for (size_t ii = 0; ii < dropped.size(); ++ii) {
+        if (!dropped[ii]) {
+            entry.waiting[ii] = true;
+            ++entry.remaining;
+        }
+    }
+}
+
+FanoutAcks::Outcome FanoutAcks::answer(uint32_t opaque, size_t group,
+                                       uint16_t status) {
+    map<uint32_t, Entry>::iterator iter = entries.find(opaque);
+    if (iter == entries.end()) {
+        return ACK_UNKNOWN;
+    }
+
+    Entry &entry = iter->second;
+    if (entry.waiting[group]) {
+        entry.waiting[group] = false;
+        --entry.remaining;
+    }
+
+    Outcome outcome = ACK_HELD;
+    if (!entry.failed) {
+        if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            // Don't wait for the other groups to fail it
+            entry.failed = true;
+            outcome = ACK_RELEASED;
+        } else if (entry.remaining == 0) {
+            outcome = ACK_RELEASED;
+        }
+    }
+    if (entry.remaining == 0) {
+        entries.erase(iter);
+    }
+    return outcome;
+}
+
+void FanoutAcks::drop(size_t group, vector<BinaryMessage*> &released) {
+    map<uint32_t, Entry>::iterator iter = entries.begin();
+    while (iter != entries.end()) {
+        Entry &entry = iter->second;
+        if (entry.waiting[group]) {
+            entry.waiting[group] = false;
+            if (--entry.remaining == 0) {
+                if (!entry.failed) {
+                    released.push_back(new ResponseBinaryMessage(entry.opcode,
+                                                                 iter->first,
+                                                                 PROTOCOL_BINARY_RESPONSE_SUCCESS));
+                }
+                entries.erase(iter++);
+                continue;
+            }
+        }
+        ++iter;
+    }
+}
@@ -0,0 +1,148 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef ACKS_H
+#define ACKS_H 1
+
+#include "config.h"
+#include <deque>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+class BinaryMessage;
+
+/**
+ * Passes the TAP acks on to a source in the order it asked for them.
+ *
+ * The source takes an ack as cumulative: acking a message acks
+ * everything it sent before it. The messages asking for an ack may be
+ * answered out of order, though, when they travel over different
+ * connections to the destinations (-c, -m). The ack of a later message
+ * is held back until all of the earlier ones are answered, so that the
+ * source never learns that a message is safe before the destinations
+ * have processed it.
+ */
+class AckSequencer {
+public:
+    AckSequencer() : first(0) { }
+
+    /**
+     * The source asked for an ack of a message. The acks are released
+     * in the order of the calls.
+     * @param opaque the opaque of the message (in network byte order)
+     */
+    void expect(uint8_t opcode, uint32_t opaque);
+
+    /**
+     * Record the answer to a message passed to expect(). If several of
+     * them have the same opaque, the oldest one is answered.
+     * @return false if no such message waits for an answer
+     */
+    bool answer(uint32_t opaque, uint16_t status);
+
+    /**
+     * Get the ack to send next, once it and everything expected before
+     * it is answered
+     * @return the response for the source, or NULL if there is none
+     */
+    BinaryMessage *next();
+
+    /**
+     * Forget about the acks, for a new connection to the source
+     */
+    void clear();
+
+    /**
+     * Get the number of acks expected, but not released yet
+     */
+    size_t getPending() const {
+        return entries.size();
+    }
+
+private:
+    class Entry {
+    public:
+        uint8_t opcode;
+        uint32_t opaque;
+        uint16_t status;
+        bool answered;
+    };
+
+    std::deque<Entry> entries;
+    /** The sequence number of the entry at the front */
+    uint64_t first;
+    /** The sequence numbers of the unanswered entries, by opaque */
+    std::multimap<uint32_t, uint64_t> waiting;
+};
+
+/**
+ * Collects the acks of the destination and its replicas (-R) for the
+ * messages sent to all of them. The source is answered once every
+ * group of connections not dropped acked a message, or as soon as one
+ * of them failed it. A failed message is kept until the other groups
+ * answered it too, so that their answers are dropped instead of
+ * reaching the source a second time.
+ */
+class FanoutAcks {
+public:
+    enum Outcome {
+        /** The message wasn't sent to all of the groups */
+        ACK_UNKNOWN,
+        /** The source was or will be answered by another response */
+        ACK_HELD,
+        /** Pass this response on to the source */
+        ACK_RELEASED
+    };
+
+    /**
+     * A message asking for an ack was sent to the groups not dropped
+     */
+    void expect(uint8_t opcode, uint32_t opaque,
+                const std::vector<bool> &dropped);
+
+    /**
+     * Record the response of a group to a message
+     */
+    Outcome answer(uint32_t opaque, size_t group, uint16_t status);
+
+    /**
+     * Stop waiting for the answers of a dropped group
+     * @param released the acks for the source completed by dropping it
+     */
+    void drop(size_t group, std::vector<BinaryMessage*> &released);
+
+    /**
+     * Get the number of messages some group still has to answer
+     */
+    size_t getPending() const {
+        return entries.size();
+    }
+
+private:
+    class Entry {
+    public:
+        uint8_t opcode;
+        std::vector<bool> waiting;
+        size_t remaining;
+        /** One of the groups failed the message, and the source knows */
+        bool failed;
+    };
+
+    std::map<uint32_t, Entry> entries;
+};
+
+#endif
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "backfill.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+void BackfillLog::load() throw (string) {
+    entries.clear();
+    ifstream in(path.c_str());
+    if (!in.is_open()) {
+        if (errno == ENOENT) {
+            return;
+        }
+        throw "Failed to open " + path + ": " + strerror(errno);
+    }
+
+    string line;
+    size_t lineno = 0;
+    while (getline(in, line)) {
+        ++lineno;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+        stringstream ss(line);
+        unsigned long vbucket;
+        uint64_t when;
+        string rest;
+        if (!(ss >> vbucket >> when) || vbucket > 0xffff || (ss >> rest)) {
+            stringstream error;
+            error << "Invalid line " << lineno << " in " << path
+                  << ": " << line;
+            throw error.str();
+        }
+        entries[static_cast<uint16_t>(vbucket)] = when;
+    }
+}
+
+uint64_t BackfillLog::getSince(const vector<uint16_t> &vbuckets) const {
+    uint64_t since = 0;
+    vector<uint16_t>::const_iterator iter;
+    for (iter = vbuckets.begin(); iter != vbuckets.end(); ++iter) {
+        map<uint16_t, uint64_t>::const_iterator e = entries.find(*iter);
+        if (e == entries.end()) {
+            return 0;
+        }
+        if (since == 0 || e->second < since) {
+            since = e->second;
+        }
+    }
+    return since;
+}
+
+void BackfillLog::update(const vector<uint16_t> &vbuckets,
+                         uint64_t when) throw (string) {
+    // Pick up the updates made by the others sharing the file
+    load();
+    vector<uint16_t>::const_iterator iter;
+    for (iter = vbuckets.begin(); iter != vbuckets.end(); ++iter) {
+        entries[*iter] = when;
+    }
+
+    // Replace the file in one go, so that we never leave half of it
+    // behind if we die while writing it
+    string tmp = path + ".tmp";
+    ofstream out(tmp.c_str(), ios::trunc);
+    map<uint16_t, uint64_t>::const_iterator e;
+    for (e = entries.begin(); e != entries.end(); ++e) {
+        out << e->first << " " << e->second << endl;
+    }
+    out.close();
+    if (out.fail() || rename(tmp.c_str(), path.c_str()) == -1) {
+        string error = "Failed to write " + path + ": " + strerror(errno);
+        remove(tmp.c_str());
+        throw error;
+    }
+}
@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef BACKFILL_H
+#define BACKFILL_H 1
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * Remembers, per vbucket, since when the destination has all of the
+ * data of the vbucket, so that a later run only has to ask the source
+ * for the changes made after that (TAP backfill from date).
+ *
+ * The log is a text file with a line per vbucket:
+ *
+ *   <vbucket> <seconds since the epoch>
+ *
+ * It is read again before every update, so several migrations (or
+ * rebalance moves) in the same process can share the file.
+ */
+class BackfillLog {
+public:
+    BackfillLog(const std::string &p) : path(p) { }
+
+    /**
+     * Read the file. A missing file is an empty log.
+     * @throw std::string if the file can't be read or parsed
+     */
+    void load() throw (std::string);
+
+    /**
+     * Get the time the source must backfill the vbuckets from
+     * @return the oldest time recorded for the vbuckets, or 0 if one
+     *         of them isn't in the log (a full backfill is needed)
+     */
+    uint64_t getSince(const std::vector<uint16_t> &vbuckets) const;
+
+    /**
+     * Record that the destination has the data of the vbuckets as of
+     * when, and write the file
+     * @throw std::string if the file can't be written
+     */
+    void update(const std::vector<uint16_t> &vbuckets,
+                uint64_t when) throw (std::string);
+
+private:
+    std::string path;
+    std::map<uint16_t, uint64_t> entries;
+};
+
+#endif
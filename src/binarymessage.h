@@ -24,6 +24,7 @@
 #include <iomanip>
 #include <cstring>
 #include <queue>
+#include <vector>
 #include <assert.h>
 #include <cerrno>
 #include <stdexcept>
@@ -31,6 +32,12 @@
 #include <memcached/protocol_binary.h>
 #include <memcached/vbucket.h>
 
+/**
+ * The TAP_OPAQUE command ep-engine sends once it is done backfilling a
+ * vbucket (carried in the engine specific data of the message)
+ */
+#define TAP_OPAQUE_CLOSE_BACKFILL 5
+
 class BinaryMessage {
 public:
     BinaryMessage() : size(0) {
@@ -59,36 +66,135 @@ public:
         return ntohs(data.req->request.vbucket);
     }
 
-    std::string getKey() const {
-        std::string key;
-        uint16_t keylen = ntohs(data.req->request.keylen);
-        char *ptr = data.rawBytes + sizeof(*data.req);
-        ptr += data.req->request.extlen;
-        key.assign(ptr, keylen);
+    /**
+     * Get the length of the engine specific data a TAP message carries
+     * between its extras and its key (0 for any other message)
+     */
+    uint16_t getEngineSpecificLength() const {
+        switch (data.req->request.opcode) {
+        case PROTOCOL_BINARY_CMD_TAP_MUTATION:
+        case PROTOCOL_BINARY_CMD_TAP_DELETE:
+        case PROTOCOL_BINARY_CMD_TAP_FLUSH:
+        case PROTOCOL_BINARY_CMD_TAP_OPAQUE:
+        case PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET:
+            if (data.req->request.magic == PROTOCOL_BINARY_REQ &&
+                data.req->request.extlen >= sizeof(data.mutation->message.body.tap)) {
+                return ntohs(data.mutation->message.body.tap.enginespecific_length);
+            }
+            return 0;
+        default:
+            return 0;
+        }
+    }
 
-        return key;
+    /**
+     * Get the offset of the key in the message
+     */
+    size_t getKeyOffset() const {
+        return sizeof(*data.req) + data.req->request.extlen +
+            getEngineSpecificLength();
     }
 
-    std::string getBody() const {
-        std::string key;
-        uint16_t bodylen = ntohl(data.req->request.bodylen);
-        char *ptr = data.rawBytes + sizeof(*data.req);
-        ptr += data.req->request.extlen + data.req->request.keylen;
-        key.assign(ptr, bodylen);
+    /**
+     * Get the key without copying it
+     */
+    const char *getKeyBytes() const {
+        return data.rawBytes + getKeyOffset();
+    }
 
-        return key;
+    uint16_t getKeyLength() const {
+        return ntohs(data.req->request.keylen);
     }
 
-    void setExpiry(uint32_t expiry) {
-        if (data.mutation->message.header.request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
-            data.mutation->message.body.item.expiration = htonl(expiry);
+    /**
+     * Replace the first oldlen bytes of the key with prefix. The
+     * message is reallocated if the length of the key changes.
+     */
+    void setKeyPrefix(uint16_t oldlen, const char *prefix, uint16_t newlen) {
+        uint16_t keylen = getKeyLength();
+        size_t offset = getKeyOffset();
+        assert(oldlen <= keylen);
+        assert(keylen - oldlen + newlen <= 0xffff);
+        if (newlen != oldlen) {
+            size_t newsize = size - oldlen + newlen;
+            char *bytes = new char[newsize];
+            memcpy(bytes, data.rawBytes, offset);
+            memcpy(bytes + offset + newlen, data.rawBytes + offset + oldlen,
+                   size - offset - oldlen);
+            delete []data.rawBytes;
+            data.rawBytes = bytes;
+            size = newsize;
+            data.req->request.keylen = htons(static_cast<uint16_t>(keylen - oldlen + newlen));
+            data.req->request.bodylen = htonl(static_cast<uint32_t>(newsize - sizeof(*data.req)));
         }
+        memcpy(data.rawBytes + offset, prefix, newlen);
     }
 
-    void setFlags(uint32_t flags) {
-        if (data.mutation->message.header.request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
-            data.mutation->message.body.item.flags = htonl(flags);
+    /**
+     * Get the value without copying it
+     */
+    const char *getValueBytes() const {
+        return getKeyBytes() + getKeyLength();
+    }
+
+    size_t getValueLength() const {
+        return data.rawBytes + size - getValueBytes();
+    }
+
+    /**
+     * Replace the value. bytes (allocated with new[]) must start with
+     * a copy of the header, extras and key of this message, followed
+     * by the new value, and the message takes over its ownership.
+     */
+    void replaceValue(char *bytes, size_t newsize) {
+        delete []data.rawBytes;
+        data.rawBytes = bytes;
+        size = newsize;
+        data.req->request.bodylen = htonl(static_cast<uint32_t>(newsize - sizeof(*data.req)));
+    }
+
+    std::string getKey() const {
+        return std::string(getKeyBytes(), getKeyLength());
+    }
+
+    std::string getBody() const {
+        return std::string(getValueBytes(), getValueLength());
+    }
+
+    /**
+     * Does this message carry a TAP request the other end must ack?
+     */
+    bool isTapAckRequested() const {
+        switch (data.req->request.opcode) {
+        case PROTOCOL_BINARY_CMD_TAP_MUTATION:
+        case PROTOCOL_BINARY_CMD_TAP_DELETE:
+        case PROTOCOL_BINARY_CMD_TAP_FLUSH:
+        case PROTOCOL_BINARY_CMD_TAP_OPAQUE:
+        case PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET:
+            return data.req->request.magic == PROTOCOL_BINARY_REQ &&
+                (ntohs(data.mutation->message.body.tap.flags) & TAP_FLAG_ACK);
+        default:
+            return false;
+        }
+    }
+
+    /**
+     * Get the command carried by a TAP_OPAQUE message
+     * @return the command, or 0xffffffff if there is none
+     */
+    uint32_t getTapOpaqueCommand() const {
+        if (data.req->request.opcode != PROTOCOL_BINARY_CMD_TAP_OPAQUE ||
+            data.req->request.extlen < sizeof(data.mutation->message.body.tap)) {
+            return 0xffffffff;
+        }
+        uint16_t nengine = getEngineSpecificLength();
+        size_t offset = sizeof(*data.req) + data.req->request.extlen;
+        uint32_t command;
+        if (nengine < sizeof(command) || offset + sizeof(command) > size) {
+            return 0xffffffff;
         }
+        memcpy(&command, data.rawBytes + offset, sizeof(command));
+        return ntohl(command);
     }
 
     std::string getComCode() const {
@@ -193,13 +299,86 @@ public:
     } data;
 };
 
+/**
+ * A SharedBinaryMessage lets several pipes send the same message
+ * without copying the payload. The payload belongs to the original
+ * message, which is deleted when the last share is deleted. The
+ * reference count isn't protected, so all of the shares must be
+ * deleted from the same thread.
+ */
+class SharedBinaryMessage : public BinaryMessage {
+public:
+    /**
+     * Create n shares of a message. The ownership of msg is transferred
+     * to the shares.
+     */
+    static void share(BinaryMessage *msg, size_t n,
+                      std::vector<BinaryMessage*> &shares) {
+        Payload *payload = new Payload(msg, n);
+        for (size_t ii = 0; ii < n; ++ii) {
+            shares.push_back(new SharedBinaryMessage(payload));
+        }
+    }
+
+    ~SharedBinaryMessage() {
+        // The payload isn't ours to free
+        data.rawBytes = NULL;
+        if (--payload->refcount == 0) {
+            delete payload;
+        }
+    }
+
+private:
+    class Payload {
+    public:
+        Payload(BinaryMessage *m, size_t n) : msg(m), refcount(n) { }
+        ~Payload() { delete msg; }
+
+        BinaryMessage *msg;
+        size_t refcount;
+    };
+
+    SharedBinaryMessage(Payload *p) : BinaryMessage(), payload(p) {
+        size = payload->msg->size;
+        data.rawBytes = payload->msg->data.rawBytes;
+    }
+
+    Payload *payload;
+};
+
+/**
+ * A response without any key, extras or body
+ */
+class ResponseBinaryMessage : public BinaryMessage {
+public:
+    ResponseBinaryMessage(uint8_t opcode, uint32_t opaque, uint16_t status)
+        : BinaryMessage()
+    {
+        size = sizeof(data.res->bytes);
+        data.rawBytes = new char[size];
+        data.res->response.magic = PROTOCOL_BINARY_RES;
+        data.res->response.opcode = opcode;
+        data.res->response.keylen = 0;
+        data.res->response.extlen = 0;
+        data.res->response.datatype = PROTOCOL_BINARY_RAW_BYTES;
+        data.res->response.status = htons(status);
+        data.res->response.bodylen = 0;
+        // opaque is kept in network byte order
+        data.res->response.opaque = opaque;
+        data.res->response.cas = 0;
+    }
+};
+
 class TapRequestBinaryMessage : public BinaryMessage {
 public:
     TapRequestBinaryMessage(const std::string &name, std::vector<uint16_t> buckets,
-                            bool takeover, bool tapAck, bool registeredTapClient) :
+                            bool takeover, bool tapAck, bool registeredTapClient,
+                            uint64_t backfillDate = 0, bool dump = false) :
         BinaryMessage()
     {
-        size = sizeof(data.tap_connect->bytes) + buckets.size() * 2 + 2 + name.length();
+        size_t nbackfill = backfillDate != 0 ? sizeof(backfillDate) : 0;
+        size = sizeof(data.tap_connect->bytes) + nbackfill +
+            buckets.size() * 2 + 2 + name.length();
         data.rawBytes = new char[size];
         data.req->request.magic = PROTOCOL_BINARY_REQ;
         data.req->request.opcode = PROTOCOL_BINARY_CMD_TAP_CONNECT;
@@ -207,8 +386,8 @@ public:
         data.req->request.extlen = 4;
         data.req->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
         data.req->request.vbucket = 0;
-        uint32_t bodylen = data.req->request.extlen + buckets.size() * 2 + 2 +
-            name.length();
+        uint32_t bodylen = data.req->request.extlen + nbackfill +
+            buckets.size() * 2 + 2 + name.length();
         data.req->request.bodylen = htonl(bodylen);;
         data.req->request.opaque = 0xcafecafe;
         data.req->request.cas = 0;
@@ -224,6 +403,13 @@ public:
         if (registeredTapClient) {
             flags |= TAP_CONNECT_CHECKPOINT | TAP_CONNECT_REGISTERED_CLIENT;
         }
+        if (backfillDate != 0) {
+            flags |= TAP_CONNECT_FLAG_BACKFILL;
+        }
+        // The source closes the stream once it sent what it has
+        if (dump) {
+            flags |= TAP_CONNECT_FLAG_DUMP;
+        }
 
         data.tap_connect->message.body.flags = htonl(flags);
         char *ptr = data.rawBytes + sizeof(data.tap_connect->bytes);
@@ -233,6 +419,15 @@ public:
             ptr += name.length();
         }
 
+        // Only the changes made since backfillDate are sent
+        if (backfillDate != 0) {
+            uint32_t hi = htonl(static_cast<uint32_t>(backfillDate >> 32));
+            uint32_t lo = htonl(static_cast<uint32_t>(backfillDate));
+            memcpy(ptr, &hi, 4);
+            memcpy(ptr + 4, &lo, 4);
+            ptr += 8;
+        }
+
         // To avoid alignment problems we have to do this the hard way..
         uint16_t val = htons(static_cast<uint16_t>(buckets.size()));
         memcpy(ptr, &val, 2);
@@ -297,7 +492,8 @@ public:
 
 class GetVBucketStateBinaryMessage : public BinaryMessage {
 public:
-    GetVBucketStateBinaryMessage(uint16_t bucket) : BinaryMessage()
+    GetVBucketStateBinaryMessage(uint16_t bucket,
+                                 uint32_t opaque = 0xcafecafe) : BinaryMessage()
     {
         size = sizeof(data.req->bytes);
         data.rawBytes = new char[size];
@@ -308,7 +504,8 @@ public:
         data.req->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
         data.req->request.vbucket = htons(bucket);
         data.req->request.bodylen = 0;
-        data.req->request.opaque = 0xcafecafe;
+        // opaque is kept in network byte order
+        data.req->request.opaque = opaque;
         data.req->request.cas = 0;
     }
 };
@@ -330,4 +527,42 @@ public:
     }
 };
 
+class DeleteQuietBinaryMessage : public BinaryMessage {
+public:
+    DeleteQuietBinaryMessage(uint16_t bucket, const char *key,
+                             uint16_t keylen) : BinaryMessage()
+    {
+        size = sizeof(data.req->bytes) + keylen;
+        data.rawBytes = new char[size];
+        data.req->request.magic = PROTOCOL_BINARY_REQ;
+        data.req->request.opcode = PROTOCOL_BINARY_CMD_DELETEQ;
+        data.req->request.keylen = htons(keylen);
+        data.req->request.extlen = 0;
+        data.req->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+        data.req->request.vbucket = htons(bucket);
+        data.req->request.bodylen = htonl(keylen);
+        data.req->request.opaque = 0xdeaddead;
+        data.req->request.cas = 0;
+        memcpy(data.rawBytes + sizeof(data.req->bytes), key, keylen);
+    }
+};
+
+class NoopBinaryMessage : public BinaryMessage {
+public:
+    NoopBinaryMessage(uint32_t opaque) : BinaryMessage() {
+        size = sizeof(data.req->bytes);
+        data.rawBytes = new char[size];
+        data.req->request.magic = PROTOCOL_BINARY_REQ;
+        data.req->request.opcode = PROTOCOL_BINARY_CMD_NOOP;
+        data.req->request.keylen = 0;
+        data.req->request.extlen = 0;
+        data.req->request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+        data.req->request.vbucket = 0;
+        data.req->request.bodylen = 0;
+        // opaque is kept in network byte order
+        data.req->request.opaque = opaque;
+        data.req->request.cas = 0;
+    }
+};
+
 #endif
@@ -16,8 +16,30 @@
  */
 #include "config.h"
 #include "binarymessagepipe.h"
+#include <algorithm>
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+
+/**
+ * The number of queued messages handed to the kernel in a single
+ * writev() call
+ */
+static const int MAX_IOV = 64;
+#endif
 
 void BinaryMessagePipe::step(short mask) {
+    if (sock.isConnecting()) {
+        try {
+            sock.finishConnect();
+        } catch (std::string &e) {
+            throw std::runtime_error(e);
+        }
+        if (sasl == NULL) {
+            callback->connected();
+        }
+    }
+
     if ((mask & EV_WRITE) == EV_WRITE) {
         drainBuffers();
     }
@@ -27,16 +49,86 @@ void BinaryMessagePipe::step(short mask) {
     }
 }
 
+#ifdef HAVE_SYS_UIO_H
+bool BinaryMessagePipe::drainBuffers() {
+    while (getSendable() > 0) {
+        // Send as many of the queued messages as we can in one go,
+        // starting with the rest of the message partially sent
+        struct iovec iov[MAX_IOV];
+        int cnt = 0;
+        int limit = static_cast<int>(std::min(getSendable(),
+                                              static_cast<size_t>(MAX_IOV)));
+        std::deque<BinaryMessage*>::iterator iter;
+        for (iter = queue.begin(); cnt < limit; ++iter, ++cnt) {
+            if (cnt == 0 && sendptr != NULL) {
+                iov[cnt].iov_base = sendptr;
+                iov[cnt].iov_len = sendlen;
+            } else {
+                iov[cnt].iov_base = (*iter)->data.rawBytes;
+                iov[cnt].iov_len = (*iter)->size;
+            }
+        }
+
+        ssize_t nw = writev(sock.getSocket(), iov, cnt);
+        if (nw == -1) {
+            switch (get_socket_errno()) {
+            case EINTR:
+                // retry
+                continue;
+            case EWOULDBLOCK:
+                // no more could be sent at this time...
+                return false;
+            default:
+                {
+                    std::stringstream err;
+                    err << "Failed to write to stream: " << strerror(get_socket_errno());
+                    throw std::runtime_error(err.str());
+                }
+            }
+        }
+
+        // Take the messages sent off the queue before telling the
+        // callback, since it may queue (or coalesce) more messages
+        std::vector<BinaryMessage*> sent;
+        for (int ii = 0; ii < cnt; ++ii) {
+            if (static_cast<size_t>(nw) >= iov[ii].iov_len) {
+                nw -= iov[ii].iov_len;
+                // The authentication is none of the callback's business
+                bool auth = authQueued > 0;
+                BinaryMessage *next = popMessage();
+                if (auth) {
+                    delete next;
+                } else {
+                    sent.push_back(next);
+                }
+                sendptr = NULL;
+            } else {
+                if (nw > 0) {
+                    sendptr = static_cast<uint8_t*>(iov[ii].iov_base) + nw;
+                    sendlen = iov[ii].iov_len - nw;
+                }
+                break;
+            }
+        }
+        for (std::vector<BinaryMessage*>::iterator m = sent.begin();
+             m != sent.end(); ++m) {
+            callback->messageSent(*m);
+            delete *m;
+        }
+    }
+    return queue.empty();
+}
+#else
 bool BinaryMessagePipe::drainBuffers() {
-    if (sendptr != NULL || !queue.empty()) {
+    if (sendptr != NULL || getSendable() > 0) {
         do {
             if (sendptr == NULL) {
-                if (!queue.empty()) {
+                if (getSendable() > 0) {
                     sendptr = queue.front()->data.req->bytes;
                     sendlen = (ssize_t)queue.front()->size;
                 } else {
                     // no more data to send!
-                    return true;
+                    return queue.empty();
                 }
             }
 
@@ -58,9 +150,11 @@ bool BinaryMessagePipe::drainBuffers() {
                     }
                 }
             } else if (nw == sendlen) {
-                BinaryMessage *next = queue.front();
-                queue.pop();
-                callback.messageSent(next);
+                bool auth = authQueued > 0;
+                BinaryMessage *next = popMessage();
+                if (!auth) {
+                    callback->messageSent(next);
+                }
                 delete next;
                 sendptr = NULL;
             } else {
@@ -72,6 +166,7 @@ bool BinaryMessagePipe::drainBuffers() {
     }
     return true;
 }
+#endif
 
 bool BinaryMessagePipe::readMessage() {
     do {
@@ -122,19 +217,73 @@ bool BinaryMessagePipe::readMessage() {
 }
 
 void BinaryMessagePipe::fillBuffers() {
-    while (readMessage()) {
-        callback.messageReceived(msg);
+    // The callback may plug the input while we're reading
+    while (doRead && readMessage()) {
+        if (sasl != NULL) {
+            continueAuthentication();
+        } else {
+            callback->messageReceived(msg);
+        }
         msg = NULL;
     }
 
     if (closed) {
-        callback.shutdown();
+        callback->shutdown();
     }
 }
 
+bool BinaryMessagePipe::coalesce(BinaryMessage *message) {
+    uint8_t opcode = message->data.req->request.opcode;
+    if ((opcode != PROTOCOL_BINARY_CMD_TAP_MUTATION &&
+         opcode != PROTOCOL_BINARY_CMD_TAP_DELETE &&
+         opcode != PROTOCOL_BINARY_CMD_SETQ &&
+         opcode != PROTOCOL_BINARY_CMD_DELETEQ) ||
+        message->isTapAckRequested()) {
+        coalesceIndex.clear();
+        return false;
+    }
+
+    uint64_t seq = popped + queue.size();
+    if (coalesceIndex.size() > 2 * queue.size() + 1024) {
+        // Forget about the messages already sent
+        std::map<std::string, uint64_t>::iterator iter = coalesceIndex.begin();
+        while (iter != coalesceIndex.end()) {
+            if (iter->second < popped) {
+                coalesceIndex.erase(iter++);
+            } else {
+                ++iter;
+            }
+        }
+    }
+
+    std::string key(reinterpret_cast<const char*>(&message->data.req->request.vbucket),
+                    sizeof(message->data.req->request.vbucket));
+    key.append(message->getKeyBytes(), message->getKeyLength());
+    std::pair<std::map<std::string, uint64_t>::iterator, bool> entry;
+    entry = coalesceIndex.insert(std::make_pair(key, seq));
+    if (entry.second) {
+        return false;
+    }
+
+    uint64_t older = entry.first->second;
+    // The message at the front may be partially sent already
+    if (older < popped + framed || (older == popped && sendptr != NULL)) {
+        entry.first->second = seq;
+        return false;
+    }
+
+    // The newer message takes the place of the older one, which is
+    // never moved across a barrier since those clear the index
+    BinaryMessage *replaced = queue[older - popped];
+    queue[older - popped] = message;
+    callback->messageCoalesced(replaced);
+    delete replaced;
+    return true;
+}
+
 void BinaryMessagePipe::updateEvent() {
     short new_flags = EV_PERSIST;
-    if (!queue.empty()) {
+    if (sock.isConnecting() || getSendable() > 0) {
         new_flags |= EV_WRITE;
     }
 
@@ -190,138 +339,228 @@ extern "C" {
 
     typedef int(*SASLFUNC)();
 }
-#endif
-
-void BinaryMessagePipe::authenticate(const std::string &authname,
-                                     const std::string &password) {
-#ifndef ENABLE_SASL
-    (void)authname;
-    (void)password;
-#else
-    if (password.length() > 127) {
-        throw std::runtime_error(std::string("Password too long"));
-    }
-
-    union {
-        sasl_secret_t secret;
-        char buffer[sizeof(sasl_secret_t) + 128];
-    } secret;
-    sasl_callback_t sasl_callbacks[4] = {
-        { SASL_CB_USER, (SASLFUNC)&get_username, (void*)authname.c_str() },
-        { SASL_CB_AUTHNAME, (SASLFUNC)&get_username, (void*)authname.c_str() },
-        { SASL_CB_PASS, (SASLFUNC)&get_password, (void*)&secret.secret },
-        { SASL_CB_LIST_END, NULL, NULL }
-    };
-
-    memset(secret.buffer, 0, sizeof(secret.buffer));
-    secret.secret.len = password.length();
-    memcpy(secret.secret.data, password.c_str(), password.length());
-
-    BinaryMessage *message = new SaslListMechsBinaryMessage;
-    queue.push(message);
-    if (!drainBuffers()) {
-        throw std::runtime_error(std::string("Failed to send auth data"));
-    }
 
-    if (!readMessage()) {
-        throw std::runtime_error(std::string("Failed to receive auth data"));
-    }
-
-    if (msg->data.res->response.opcode != PROTOCOL_BINARY_CMD_SASL_LIST_MECHS) {
-        throw std::runtime_error(std::string("Internal error, unexpected package received"));
-    }
+/**
+ * The client side of a SASL authentication, turning each response of
+ * the server into the next request
+ */
+class SaslClient {
+public:
+    SaslClient(const std::string &authname, const std::string &password) :
+        user(authname), conn(NULL)
+    {
+        if (password.length() > 127) {
+            throw std::runtime_error(std::string("Password too long"));
+        }
 
-    if (ntohs(msg->data.res->response.status) != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-        throw std::runtime_error(std::string("Failed to get sasl mechs"));
+        memset(secret.buffer, 0, sizeof(secret.buffer));
+        secret.secret.len = password.length();
+        memcpy(secret.secret.data, password.c_str(), password.length());
+
+        sasl_callback_t cbs[4] = {
+            { SASL_CB_USER, (SASLFUNC)&get_username, (void*)user.c_str() },
+            { SASL_CB_AUTHNAME, (SASLFUNC)&get_username, (void*)user.c_str() },
+            { SASL_CB_PASS, (SASLFUNC)&get_password, (void*)&secret.secret },
+            { SASL_CB_LIST_END, NULL, NULL }
+        };
+        memcpy(callbacks, cbs, sizeof(callbacks));
     }
 
-    std::string mechs((char*)msg->data.res->bytes + sizeof(msg->data.res->bytes),
-                      ntohl(msg->data.res->response.bodylen));
-    delete msg;
-    msg = NULL;
-
-    sasl_conn_t *conn;
-    int ret = sasl_client_new("memcached", sock.toString().c_str(),
-                              sock.getLocalAddress().c_str(),
-                              sock.getRemoteAddress().c_str(),
-                              sasl_callbacks, 0, &conn);
-    if (ret != SASL_OK) {
-        throw std::runtime_error("Failed to create sasl client");
+    ~SaslClient() {
+        if (conn != NULL) {
+            sasl_dispose(&conn);
+        }
     }
 
-    const char *data;
-    const char *chosenmech;
-    unsigned int len;
-    ret = sasl_client_start(conn, mechs.c_str(), NULL, &data, &len, &chosenmech);
-
-    if (ret != SASL_OK && ret != SASL_CONTINUE) {
-        sasl_dispose(&conn);
-        throw std::runtime_error(std::string("sasl_client_start failed"));
+    /**
+     * The first request of the authentication
+     */
+    BinaryMessage *start() {
+        return new SaslListMechsBinaryMessage;
     }
 
-    size_t clen = strlen(chosenmech);
-    message = new SaslAuthBinaryMessage(clen, chosenmech, len, data);
-    do {
-        queue.push(message);
-        if (!drainBuffers()) {
-            sasl_dispose(&conn);
-            throw std::runtime_error(std::string("Failed to send auth data"));
+    /**
+     * Answer a response from the server
+     * @return the next request, or NULL once authenticated
+     * @throw std::runtime_error if the authentication failed
+     */
+    BinaryMessage *step(BinaryMessage *response, Socket &sock) {
+        if (conn == NULL) {
+            return chooseMechanism(response, sock);
         }
 
-        if (!readMessage()) {
-            sasl_dispose(&conn);
-            throw std::runtime_error(std::string("Failed to receive auth data"));
-        }
-
-        if (msg->data.res->response.opcode != PROTOCOL_BINARY_CMD_SASL_STEP &&
-            msg->data.res->response.opcode != PROTOCOL_BINARY_CMD_SASL_AUTH) {
-            sasl_dispose(&conn);
+        if (response->data.res->response.opcode != PROTOCOL_BINARY_CMD_SASL_STEP &&
+            response->data.res->response.opcode != PROTOCOL_BINARY_CMD_SASL_AUTH) {
             std::stringstream ss;
             ss << "Internal error unexpected package received during SASL auth."
-               << " Expected: STEP or AUTH, got: " << msg->toString();
+               << " Expected: STEP or AUTH, got: " << response->toString();
             throw std::runtime_error(ss.str());
         }
 
-        uint16_t klen = ntohs(msg->data.res->response.keylen);
-        uint32_t blen = ntohl(msg->data.res->response.bodylen);
-        std::string bytes((char*)msg->data.res->bytes + sizeof(msg->data.res->bytes) +
-                          klen + msg->data.res->response.extlen,
-                          blen - klen - msg->data.res->response.extlen);
-
-        uint16_t stat = ntohs(msg->data.res->response.status);
-        delete msg;
-        msg = NULL;
+        uint16_t klen = ntohs(response->data.res->response.keylen);
+        uint32_t blen = ntohl(response->data.res->response.bodylen);
+        std::string bytes((char*)response->data.res->bytes +
+                          sizeof(response->data.res->bytes) +
+                          klen + response->data.res->response.extlen,
+                          blen - klen - response->data.res->response.extlen);
 
-        switch (stat) {
+        switch (ntohs(response->data.res->response.status)) {
         case PROTOCOL_BINARY_RESPONSE_SUCCESS:
-            sasl_dispose(&conn);
-            return;
+            return NULL;
         case PROTOCOL_BINARY_RESPONSE_AUTH_CONTINUE:
             break;
         case PROTOCOL_BINARY_RESPONSE_AUTH_ERROR:
             {
-                sasl_dispose(&conn);
                 std::stringstream ss;
                 ss << "Authentication failed: " << bytes;
                 throw std::runtime_error(ss.str());
             }
         default:
             {
-                sasl_dispose(&conn);
                 std::stringstream ss;
                 ss << "Internal error: " << bytes;
                 throw std::runtime_error(ss.str());
             }
         }
 
-        ret = sasl_client_step(conn, bytes.c_str(), bytes.length(), NULL, &data, &len);
+        const char *data;
+        unsigned int len;
+        int ret = sasl_client_step(conn, bytes.c_str(), bytes.length(), NULL,
+                                   &data, &len);
         if (ret != SASL_OK && ret != SASL_CONTINUE) {
-            sasl_dispose(&conn);
             throw std::runtime_error(std::string("sasl_client_step failed"));
         }
 
-        message = new SaslStepBinaryMessage(clen, chosenmech, len, data);
-    } while (true);
+        return new SaslStepBinaryMessage(mech.length(), mech.c_str(),
+                                         len, data);
+    }
+
+private:
+    SaslClient(const SaslClient &);
+    SaslClient &operator=(const SaslClient &);
+
+    BinaryMessage *chooseMechanism(BinaryMessage *response, Socket &sock) {
+        if (response->data.res->response.opcode != PROTOCOL_BINARY_CMD_SASL_LIST_MECHS) {
+            throw std::runtime_error(std::string("Internal error, unexpected package received"));
+        }
+
+        if (ntohs(response->data.res->response.status) != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+            throw std::runtime_error(std::string("Failed to get sasl mechs"));
+        }
+
+        std::string mechs((char*)response->data.res->bytes +
+                          sizeof(response->data.res->bytes),
+                          ntohl(response->data.res->response.bodylen));
+
+        int ret = sasl_client_new("memcached", sock.toString().c_str(),
+                                  sock.getLocalAddress().c_str(),
+                                  sock.getRemoteAddress().c_str(),
+                                  callbacks, 0, &conn);
+        if (ret != SASL_OK) {
+            conn = NULL;
+            throw std::runtime_error("Failed to create sasl client");
+        }
+
+        const char *data;
+        const char *chosenmech;
+        unsigned int len;
+        ret = sasl_client_start(conn, mechs.c_str(), NULL, &data, &len,
+                                &chosenmech);
+        if (ret != SASL_OK && ret != SASL_CONTINUE) {
+            throw std::runtime_error(std::string("sasl_client_start failed"));
+        }
+
+        mech.assign(chosenmech);
+        return new SaslAuthBinaryMessage(mech.length(), mech.c_str(),
+                                         len, data);
+    }
+
+    std::string user;
+    union {
+        sasl_secret_t secret;
+        char buffer[sizeof(sasl_secret_t) + 128];
+    } secret;
+    sasl_callback_t callbacks[4];
+    sasl_conn_t *conn;
+    std::string mech;
+};
+#endif
+
+BinaryMessagePipe::~BinaryMessagePipe() {
+    if (flags != 0 && !closed) {
+        event_del(&ev);
+    }
+    delete msg;
+    discardMessages();
+#ifdef ENABLE_SASL
+    delete sasl;
+#endif
+}
+
+void BinaryMessagePipe::authenticate(const std::string &authname,
+                                     const std::string &password) {
+#ifndef ENABLE_SASL
+    (void)authname;
+    (void)password;
+#else
+    SaslClient client(authname, password);
+    BinaryMessage *message = client.start();
+    do {
+        queue.push_front(message);
+        ++authQueued;
+        if (!drainBuffers()) {
+            throw std::runtime_error(std::string("Failed to send auth data"));
+        }
+
+        if (!readMessage()) {
+            throw std::runtime_error(std::string("Failed to receive auth data"));
+        }
+
+        message = client.step(msg, sock);
+        delete msg;
+        msg = NULL;
+    } while (message != NULL);
+#endif
+}
+
+void BinaryMessagePipe::startAuthentication(const std::string &authname,
+                                            const std::string &password) {
+#ifndef ENABLE_SASL
+    (void)authname;
+    (void)password;
+#else
+    assert(sasl == NULL);
+    sasl = new SaslClient(authname, password);
+    queueAuthMessage(sasl->start());
+#endif
+}
+
+void BinaryMessagePipe::queueAuthMessage(BinaryMessage *message) {
+    // Nothing else was sent since the authentication started, so there's
+    // no partially sent message at the front of the queue
+    assert(sendptr == NULL && authQueued == 0);
+    queue.push_front(message);
+    ++authQueued;
+    // The positions of the queued messages moved
+    coalesceIndex.clear();
+    updateEvent();
+}
+
+void BinaryMessagePipe::continueAuthentication() {
+#ifdef ENABLE_SASL
+    BinaryMessage *next = sasl->step(msg, sock);
+    delete msg;
+    msg = NULL;
+    if (next != NULL) {
+        queueAuthMessage(next);
+        return;
+    }
+
+    delete sasl;
+    sasl = NULL;
+    callback->connected();
+    // Let the messages held back go
+    updateEvent();
 #endif
 }
 
@@ -331,7 +570,7 @@ vbucket_state_t BinaryMessagePipe::getVBucketState(uint16_t bucket, int tmout) {
         sock.setTimeout(tmout);
     }
     BinaryMessage *message = new GetVBucketStateBinaryMessage(bucket);
-    queue.push(message);
+    queue.push_back(message);
     if (!drainBuffers()) {
         throw std::runtime_error(std::string("Failed to send vbucket get state"));
     }
@@ -369,12 +608,42 @@ vbucket_state_t BinaryMessagePipe::getVBucketState(uint16_t bucket, int tmout) {
     return state;
 }
 
+size_t BinaryMessagePipe::discardMessages()
+{
+    size_t ret = queue.size();
+    while (!queue.empty()) {
+        delete popMessage();
+    }
+    coalesceIndex.clear();
+    // A partially sent message was at the front of the queue
+    sendptr = NULL;
+    framed = 0;
+    return ret;
+}
+
+size_t BinaryMessagePipe::moveMessages(BinaryMessagePipe &to)
+{
+    // The other connection authenticates on its own
+    while (authQueued > 0) {
+        delete popMessage();
+    }
+    size_t ret = queue.size();
+    while (!queue.empty()) {
+        to.queue.push_back(popMessage());
+    }
+    coalesceIndex.clear();
+    // The other connection sends a partially sent message from scratch
+    sendptr = NULL;
+    framed = 0;
+    to.updateEvent();
+    return ret;
+}
+
 void BinaryMessagePipe::dumpMessages(std::ostream &out)
 {
     BinaryMessage *next;
     while (!queue.empty()) {
-        next = queue.front();
-        queue.pop();
+        next = popMessage();
         out << "  " << next->toString() << std::endl;
         delete next;
     }
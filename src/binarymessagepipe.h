@@ -23,7 +23,8 @@
 #include "sockstream.h"
 #include <memcached/vbucket.h>
 #include <string>
-#include <queue>
+#include <deque>
+#include <map>
 #include <event.h>
 
 #ifndef evutil_socket_t
@@ -35,11 +36,29 @@ public:
     virtual ~BinaryMessagePipeCallback() {}
     virtual void messageReceived(BinaryMessage *msg) = 0;
     virtual void messageSent(BinaryMessage *msg) { (void)msg; };
+    /**
+     * The message was replaced in the queue by a newer one for the same
+     * key, and won't be sent
+     */
+    virtual void messageCoalesced(BinaryMessage *msg) { (void)msg; };
     virtual void abort() = 0;
     virtual void shutdown() {};
+    /**
+     * The connection failed
+     * @return true if the callback replaces the connection, instead of
+     *         having everything aborted
+     */
+    virtual bool reconnect() { return false; }
+    /**
+     * The connection started without blocking (and the authentication
+     * started with startAuthentication()) completed
+     */
+    virtual void connected() {}
     void markcomplete();
 };
 
+class SaslClient;
+
 extern "C" {
     void event_handler(evutil_socket_t fd, short which, void *arg);
 }
@@ -48,25 +67,69 @@ class BinaryMessagePipe {
 public:
     BinaryMessagePipe(Socket &s, BinaryMessagePipeCallback &cb, struct event_base *b,
                       int tmout) :
-        sock(s), callback(cb), msg(NULL), avail(0), flags(0), base(b), timeout(tmout),
-        sendptr(NULL), sendlen(0), closed(false), doRead(true)
+        sock(s), callback(&cb), msg(NULL), avail(0), flags(0), base(b), timeout(tmout),
+        sendptr(NULL), sendlen(0), framed(0), closed(false), doRead(true),
+        coalescing(false), popped(0), sasl(NULL), authQueued(0)
     {
         updateEvent();
     }
 
-    ~BinaryMessagePipe() {
-    }
+    virtual ~BinaryMessagePipe();
 
     void abort() {
-        callback.abort();
+        callback->abort();
+        close();
+    }
+
+    /**
+     * Let the callback replace the failed connection
+     * @return false if it can't, and the pipe must be aborted
+     */
+    bool reconnect() {
+        if (!callback->reconnect()) {
+            return false;
+        }
+        close();
+        return true;
+    }
+
+    /**
+     * Close the connection without notifying the callback
+     */
+    void close() {
         closed = true;
         // we need to delete event before closing fd
         updateEvent();
         sock.close();
     }
 
+    /**
+     * Let another callback handle the events on this pipe, so that the
+     * connection may be reused
+     */
+    void setCallback(BinaryMessagePipeCallback &cb) {
+        callback = &cb;
+    }
+
     void authenticate(const std::string &authname, const std::string &password);
 
+    /**
+     * Authenticate without waiting for the server. The messages sent
+     * meanwhile are held back until the authentication succeeded, which
+     * is told to the callback with connected(). A failure is thrown
+     * from step().
+     */
+    void startAuthentication(const std::string &authname,
+                             const std::string &password);
+
+    /**
+     * Has the connection (and the authentication) completed? Only the
+     * connections started without blocking are ever in progress.
+     */
+    bool isConnected() const {
+        return !sock.isConnecting() && sasl == NULL;
+    }
+
     void plugInput(void) {
         doRead = false;
         updateEvent();
@@ -75,6 +138,10 @@ public:
     void unPlugInput(void) {
         doRead = true;
         updateEvent();
+        if (!closed && hasBufferedInput()) {
+            // The socket won't tell us about the messages already read
+            event_active(&ev, EV_READ, 0);
+        }
     }
 
     void step(short flags);
@@ -87,12 +154,30 @@ public:
      *        deleted by calling delete when the message is transferred
      */
     void sendMessage(BinaryMessage *message) {
-        queue.push(message);
+        if (coalescing && coalesce(message)) {
+            return;
+        }
+        queue.push_back(message);
         updateEvent();
     }
 
+    /**
+     * Let a TAP_MUTATION or TAP_DELETE replace the message for the same
+     * key (in the same vbucket) still waiting in the queue, instead of
+     * sending both of them. All other messages, and the messages
+     * requesting a TAP ack, are barriers nothing is moved across.
+     */
+    void setCoalescing(bool enable) {
+        coalescing = enable;
+        coalesceIndex.clear();
+    }
+
     void updateEvent();
 
+    std::string getPeerName() const {
+        return sock.toString();
+    }
+
     std::string toString() const {
         std::stringstream ss;
         ss << "BinaryMessagePipe from " << sock.toString()
@@ -106,27 +191,83 @@ public:
 
     void dumpMessages(std::ostream &out);
 
+    /**
+     * Delete all of the messages waiting to be sent
+     * @return the number of messages deleted
+     */
+    size_t discardMessages();
+
+    /**
+     * Move all of the messages waiting to be sent to the end of the
+     * queue of another pipe (replacing this connection)
+     * @return the number of messages moved
+     */
+    size_t moveMessages(BinaryMessagePipe &to);
+
 protected:
 
     /**
      * Read a message from the stream
      * @return true if a complete message is available in msg, false otherwise
      */
-    bool readMessage();
+    virtual bool readMessage();
 
     /**
      * Write as much as possible from the message queue to the socket
      * @return true if all messages in the queue are successfully sent, false otherwise
      */
-    bool drainBuffers();
+    virtual bool drainBuffers();
+
+    /**
+     * @return true if messages were read from the socket, but not
+     *         handed to the callback yet
+     */
+    virtual bool hasBufferedInput() const {
+        return false;
+    }
 
     /**
      * Try to read and dispatch as many messages from the input pipe
      */
     void fillBuffers();
 
+    /**
+     * Replace the queued message for the same key with message
+     * @return true if message took the place of an older one
+     */
+    bool coalesce(BinaryMessage *message);
+
+    /**
+     * Send the next message of the authentication ahead of everything
+     * else queued
+     */
+    void queueAuthMessage(BinaryMessage *message);
+
+    /**
+     * Answer the response in msg to the authentication in progress
+     */
+    void continueAuthentication();
+
+    /**
+     * The number of messages at the front of the queue which may be
+     * written to the socket now
+     */
+    size_t getSendable() const {
+        return sasl == NULL ? queue.size() : authQueued;
+    }
+
+    BinaryMessage *popMessage() {
+        BinaryMessage *next = queue.front();
+        queue.pop_front();
+        ++popped;
+        if (authQueued > 0) {
+            --authQueued;
+        }
+        return next;
+    }
+
     Socket &sock;
-    BinaryMessagePipeCallback &callback;
+    BinaryMessagePipeCallback *callback;
     BinaryMessage *msg;
     size_t bufsz;
     protocol_binary_request_header header;
@@ -136,12 +277,31 @@ protected:
     struct event ev;
     int timeout;
 
-    std::queue<BinaryMessage *> queue;
+    std::deque<BinaryMessage *> queue;
     uint8_t *sendptr;
     ssize_t sendlen;
+    /**
+     * The number of messages at the front of the queue written together
+     * (as a single frame by the RelayPipe), which can't be coalesced
+     */
+    size_t framed;
 
     bool closed;
     bool doRead;
+
+    bool coalescing;
+    /**
+     * The sequence number of the last message queued for each vbucket
+     * and key (the number of messages popped before it, plus its
+     * position in the queue)
+     */
+    std::map<std::string, uint64_t> coalesceIndex;
+    uint64_t popped;
+
+    /** The authentication in progress, or NULL */
+    SaslClient *sasl;
+    /** The messages of the authentication at the front of the queue */
+    size_t authQueued;
 };
 
 #endif
@@ -114,3 +114,156 @@ void parseBuckets(vector<uint16_t> &buckets, const char *str) throw (std::string
         throw err.str();
     }
 }
+
+void parseVBucketMap(map<uint16_t, string> &vbmap, istream &in) throw (std::string) {
+    string line;
+    int lineno = 0;
+
+    while (getline(in, line)) {
+        ++lineno;
+        size_t start = line.find_first_not_of(" \t\r\n");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+
+        size_t end = line.find_last_not_of(" \t\r\n");
+        size_t sep = line.find_last_of(" \t", end);
+        if (sep == string::npos || sep < start) {
+            stringstream err;
+            err << "Missing host:port in vbucket map at line " << lineno;
+            throw err.str();
+        }
+
+        string host = line.substr(sep + 1, end - sep);
+        vector<uint16_t> buckets;
+        try {
+            parseBuckets(buckets, line.substr(start, sep - start).c_str());
+        } catch (string &e) {
+            stringstream err;
+            err << "Invalid vbucket map at line " << lineno << ": " << e;
+            throw err.str();
+        }
+
+        vector<uint16_t>::iterator iter;
+        for (iter = buckets.begin(); iter != buckets.end(); ++iter) {
+            if (vbmap.find(*iter) != vbmap.end() && vbmap[*iter] != host) {
+                stringstream err;
+                err << "vbucket " << *iter << " is mapped to both "
+                    << vbmap[*iter] << " and " << host
+                    << " (line " << lineno << ")";
+                throw err.str();
+            }
+            vbmap[*iter] = host;
+        }
+    }
+}
+
+/**
+ * The tables for computing the (IEEE) CRC32 eight bytes at a time.
+ * table[0] is the classic byte at a time table, and table[k][b] is the
+ * CRC of b followed by k zero bytes.
+ */
+class Crc32Table {
+public:
+    Crc32Table() {
+        for (uint32_t ii = 0; ii < 256; ++ii) {
+            uint32_t crc = ii;
+            for (int jj = 0; jj < 8; ++jj) {
+                crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+            }
+            table[0][ii] = crc;
+        }
+        for (uint32_t ii = 0; ii < 256; ++ii) {
+            for (int k = 1; k < 8; ++k) {
+                table[k][ii] = (table[k - 1][ii] >> 8) ^
+                    table[0][table[k - 1][ii] & 0xff];
+            }
+        }
+    }
+
+    uint32_t crc32(const unsigned char *p, size_t n, uint32_t crc) const {
+        crc = ~crc;
+        while (n >= 8) {
+            uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+                                 (static_cast<uint32_t>(p[3]) << 24));
+            crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+                table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+                table[3][p[4]] ^ table[2][p[5]] ^
+                table[1][p[6]] ^ table[0][p[7]];
+            p += 8;
+            n -= 8;
+        }
+        while (n-- > 0) {
+            crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        }
+        return ~crc;
+    }
+
+private:
+    uint32_t table[8][256];
+};
+
+// Built before main(), so the worker threads never race for it
+static const Crc32Table crc32Table;
+
+uint32_t crc32(const void *data, size_t n, uint32_t crc) {
+    return crc32Table.crc32(reinterpret_cast<const unsigned char*>(data), n,
+                            crc);
+}
+
+uint16_t getVBucketByKey(const char *key, size_t nkey, size_t numVBuckets) {
+    uint32_t crc = crc32(key, nkey);
+    return static_cast<uint16_t>(((crc >> 16) & 0x7fff) & (numVBuckets - 1));
+}
+
+void parseBucketList(vector<BucketSpec> &list, istream &in) throw (std::string) {
+    string line;
+    int lineno = 0;
+
+    while (getline(in, line)) {
+        ++lineno;
+        size_t start = line.find_first_not_of(" \t\r\n");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+
+        size_t sep = line.find_first_of(" \t", start);
+        if (sep == string::npos) {
+            stringstream err;
+            err << "Missing vbuckets in bucket list at line " << lineno;
+            throw err.str();
+        }
+
+        BucketSpec spec;
+        spec.name = line.substr(start, sep - start);
+        size_t colon = spec.name.find(':');
+        if (colon != string::npos) {
+            spec.password = spec.name.substr(colon + 1);
+            spec.name.resize(colon);
+        }
+        if (spec.name.empty()) {
+            stringstream err;
+            err << "Missing bucket name in bucket list at line " << lineno;
+            throw err.str();
+        }
+
+        try {
+            parseBuckets(spec.vbuckets, line.substr(sep + 1).c_str());
+        } catch (string &e) {
+            stringstream err;
+            err << "Invalid bucket list at line " << lineno << ": " << e;
+            throw err.str();
+        }
+
+        vector<BucketSpec>::iterator iter;
+        for (iter = list.begin(); iter != list.end(); ++iter) {
+            if (iter->name == spec.name) {
+                stringstream err;
+                err << "Bucket " << spec.name << " is listed twice (line "
+                    << lineno << ")";
+                throw err.str();
+            }
+        }
+        list.push_back(spec);
+    }
+}
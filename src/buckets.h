@@ -19,8 +19,49 @@
 
 #include <vector>
 #include <string>
+#include <map>
+#include <istream>
 void parseBuckets(std::vector<uint16_t> &buckets,
                   const char *str) throw (std::string);
 
+/**
+ * Parse a vbucket map. Each line contains a list of buckets (in the
+ * same syntax as -b) followed by the host:port owning them. Empty lines
+ * and lines starting with # are ignored.
+ */
+void parseVBucketMap(std::map<uint16_t, std::string> &vbmap,
+                     std::istream &in) throw (std::string);
+
+/**
+ * Compute the (IEEE) CRC32 of n bytes. Pass the CRC of the previous
+ * bytes as crc to continue it.
+ */
+uint32_t crc32(const void *data, size_t n, uint32_t crc = 0);
+
+/**
+ * Get the vbucket a key belongs to in a cluster with numVBuckets
+ * vbuckets (a power of two), using the same CRC32 hash as the clients
+ */
+uint16_t getVBucketByKey(const char *key, size_t nkey, size_t numVBuckets);
+
+/**
+ * A data bucket, and the vbuckets to migrate from it
+ */
+class BucketSpec {
+public:
+    std::string name;
+    std::string password;
+    std::vector<uint16_t> vbuckets;
+};
+
+/**
+ * Parse a list of data buckets. Each line contains the name of the
+ * bucket (optionally followed by :password) and the vbuckets to
+ * migrate (in the same syntax as -b). Empty lines and lines starting
+ * with # are ignored.
+ */
+void parseBucketList(std::vector<BucketSpec> &list,
+                     std::istream &in) throw (std::string);
+
 #endif
 
@@ -0,0 +1,415 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "capture.h"
+#include "buckets.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+using namespace std;
+
+static const char SEGMENT_MAGIC[8] = { 'V', 'B', 'M', 'C', 'A', 'P', 0, 1 };
+static const char INDEX_MAGIC[8] = { 'V', 'B', 'M', 'C', 'I', 'D', 'X', 1 };
+static const size_t SEGMENT_HEADER_SIZE = 16;
+static const size_t RECORD_HEADER_SIZE = 16;
+static const size_t INDEX_ENTRY_SIZE = 16;
+static const size_t TRAILER_SIZE = 24;
+
+static void put32(char *p, uint32_t val) {
+    val = htonl(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void put64(char *p, uint64_t val) {
+    put32(p, static_cast<uint32_t>(val >> 32));
+    put32(p + 4, static_cast<uint32_t>(val));
+}
+
+static uint32_t get32(const char *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohl(val);
+}
+
+static uint64_t get64(const char *p) {
+    return (static_cast<uint64_t>(get32(p)) << 32) | get32(p + 4);
+}
+
+static string describe(const string &what, const string &name) {
+    return what + " " + name + ": " + strerror(errno);
+}
+
+string CaptureWriter::getSegmentName(const string &path, size_t n) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%06lu", static_cast<unsigned long>(n));
+    return path + suffix;
+}
+
+CaptureWriter::CaptureWriter(const string &p, size_t ss,
+                             size_t mb) throw (std::runtime_error) :
+    path(p), segmentSize(ss), maxBuffered(mb), closing(false),
+    closed(false), fd(-1), map(NULL), mapSize(0), offset(0), segment(0),
+    records(0), bytes(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+    if (pthread_create(&tid, NULL, threadMain, this) != 0) {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+        throw std::runtime_error("Failed to start the capture thread");
+    }
+}
+
+CaptureWriter::~CaptureWriter() {
+    close();
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+bool CaptureWriter::append(const char *message, size_t size, uint64_t time) {
+    if (time == 0) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        time = static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+    }
+
+    // The CRC is left to the writer thread
+    char header[RECORD_HEADER_SIZE];
+    put32(header, static_cast<uint32_t>(size));
+    put32(header + 4, 0);
+    put64(header + 8, time);
+
+    pthread_mutex_lock(&mutex);
+    buffer.insert(buffer.end(), header, header + sizeof(header));
+    buffer.insert(buffer.end(), message, message + size);
+    bool keepingUp = buffer.size() < maxBuffered;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+    return keepingUp;
+}
+
+bool CaptureWriter::hasCaughtUp() {
+    pthread_mutex_lock(&mutex);
+    bool caughtUp = buffer.size() < maxBuffered / 2;
+    pthread_mutex_unlock(&mutex);
+    return caughtUp;
+}
+
+bool CaptureWriter::close() {
+    if (!closed) {
+        pthread_mutex_lock(&mutex);
+        closing = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(tid, NULL);
+        closed = true;
+    }
+    return error.empty();
+}
+
+void *CaptureWriter::threadMain(void *arg) {
+    reinterpret_cast<CaptureWriter*>(arg)->run();
+    return NULL;
+}
+
+void CaptureWriter::run() {
+    vector<char> local;
+    for (;;) {
+        pthread_mutex_lock(&mutex);
+        while (buffer.empty() && !closing) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        if (buffer.empty()) {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        local.swap(buffer);
+        pthread_mutex_unlock(&mutex);
+
+        // Once writing failed the rest of the messages are dropped
+        if (error.empty()) {
+            try {
+                write(local);
+            } catch (string &e) {
+                error = e;
+            }
+        }
+        local.clear();
+    }
+
+    if (map != NULL) {
+        try {
+            closeSegment();
+        } catch (string &e) {
+            if (error.empty()) {
+                error = e;
+            }
+        }
+    }
+}
+
+void CaptureWriter::write(const vector<char> &buf) throw (string) {
+    size_t pos = 0;
+    while (pos < buf.size()) {
+        const char *header = &buf[pos];
+        size_t size = get32(header);
+        size_t needed = RECORD_HEADER_SIZE + size;
+        if (map == NULL || offset + needed > mapSize) {
+            if (map != NULL) {
+                closeSegment();
+            }
+            openSegment(needed);
+        }
+
+        char *rec = map + offset;
+        memcpy(rec, header, needed);
+        put32(rec + 4, crc32(rec + 8, needed - 8));
+
+        // The vbucket is at the same place in all of the messages
+        uint16_t vbucket;
+        memcpy(&vbucket, rec + RECORD_HEADER_SIZE + 6, sizeof(vbucket));
+        vbucket = ntohs(vbucket);
+        std::map<uint16_t, CaptureIndexEntry>::iterator iter;
+        iter = index.find(vbucket);
+        if (iter == index.end()) {
+            CaptureIndexEntry &entry = index[vbucket];
+            entry.vbucket = vbucket;
+            entry.first = static_cast<uint32_t>(offset);
+            iter = index.find(vbucket);
+        }
+        iter->second.last = static_cast<uint32_t>(offset);
+        ++iter->second.records;
+
+        offset += needed;
+        pos += needed;
+        ++records;
+        bytes += size;
+    }
+}
+
+void CaptureWriter::openSegment(size_t needed) throw (string) {
+    string name = getSegmentName(path, segment);
+    fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw describe("Failed to create", name);
+    }
+
+    mapSize = max(segmentSize, SEGMENT_HEADER_SIZE + needed);
+    if (ftruncate(fd, mapSize) == -1) {
+        string e = describe("Failed to resize", name);
+        ::close(fd);
+        throw e;
+    }
+    void *addr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (addr == MAP_FAILED) {
+        string e = describe("Failed to map", name);
+        ::close(fd);
+        throw e;
+    }
+    map = static_cast<char*>(addr);
+
+    memcpy(map, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    put32(map + 8, static_cast<uint32_t>(segment));
+    put32(map + 12, 0);
+    offset = SEGMENT_HEADER_SIZE;
+    index.clear();
+    ++segment;
+}
+
+void CaptureWriter::closeSegment() throw (string) {
+    munmap(map, mapSize);
+    map = NULL;
+
+    // Replace the unused part of the segment with the index
+    vector<char> tail(index.size() * INDEX_ENTRY_SIZE + TRAILER_SIZE, 0);
+    char *p = tail.empty() ? NULL : &tail[0];
+    std::map<uint16_t, CaptureIndexEntry>::const_iterator iter;
+    for (iter = index.begin(); iter != index.end(); ++iter) {
+        uint16_t vbucket = htons(iter->second.vbucket);
+        memcpy(p, &vbucket, sizeof(vbucket));
+        put32(p + 4, iter->second.first);
+        put32(p + 8, iter->second.last);
+        put32(p + 12, iter->second.records);
+        p += INDEX_ENTRY_SIZE;
+    }
+    put32(p, static_cast<uint32_t>(index.size()));
+    put32(p + 4, crc32(&tail[0], index.size() * INDEX_ENTRY_SIZE));
+    put64(p + 8, offset);
+    memcpy(p + 16, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+
+    string name = getSegmentName(path, segment - 1);
+    bool ok = ftruncate(fd, offset) == 0 &&
+        pwrite(fd, &tail[0], tail.size(), offset) ==
+        static_cast<ssize_t>(tail.size());
+    string e = ok ? "" : describe("Failed to write the index of", name);
+    ::close(fd);
+    fd = -1;
+    if (!ok) {
+        throw e;
+    }
+}
+
+CaptureReader::CaptureReader(const string &p) throw (string) :
+    path(p), segment(0), fd(-1), map(NULL), mapSize(0), offset(0), end(0)
+{
+    openSegment(0);
+}
+
+CaptureReader::~CaptureReader() {
+    closeSegment();
+}
+
+bool CaptureReader::openSegment(size_t n) throw (string) {
+    string name = CaptureWriter::getSegmentName(path, n);
+    fd = ::open(name.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT && n > 0) {
+            return false;
+        }
+        throw describe("Failed to open", name);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        string e = describe("Failed to stat", name);
+        ::close(fd);
+        fd = -1;
+        throw e;
+    }
+    mapSize = st.st_size;
+    if (mapSize < SEGMENT_HEADER_SIZE) {
+        ::close(fd);
+        fd = -1;
+        throw "Not a capture segment: " + name;
+    }
+    void *addr = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        string e = describe("Failed to map", name);
+        ::close(fd);
+        fd = -1;
+        throw e;
+    }
+    map = static_cast<const char*>(addr);
+    segment = n;
+    offset = SEGMENT_HEADER_SIZE;
+    end = mapSize;
+    index.clear();
+
+    if (memcmp(map, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+        closeSegment();
+        throw "Not a capture segment: " + name;
+    }
+
+    // A segment without the trailer is read until the first empty record
+    const char *trailer = map + mapSize - min(mapSize, TRAILER_SIZE);
+    if (mapSize >= SEGMENT_HEADER_SIZE + TRAILER_SIZE &&
+        memcmp(trailer + 16, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0) {
+        size_t entries = get32(trailer);
+        uint64_t indexOffset = get64(trailer + 8);
+        if (indexOffset < SEGMENT_HEADER_SIZE ||
+            indexOffset + entries * INDEX_ENTRY_SIZE + TRAILER_SIZE != mapSize ||
+            crc32(map + indexOffset, entries * INDEX_ENTRY_SIZE) != get32(trailer + 4)) {
+            closeSegment();
+            throw "Corrupt index in " + name;
+        }
+        end = indexOffset;
+        for (size_t ii = 0; ii < entries; ++ii) {
+            const char *p = map + indexOffset + ii * INDEX_ENTRY_SIZE;
+            CaptureIndexEntry entry;
+            memcpy(&entry.vbucket, p, sizeof(entry.vbucket));
+            entry.vbucket = ntohs(entry.vbucket);
+            entry.first = get32(p + 4);
+            entry.last = get32(p + 8);
+            entry.records = get32(p + 12);
+            index.push_back(entry);
+        }
+    }
+    return true;
+}
+
+void CaptureReader::closeSegment() {
+    if (map != NULL) {
+        munmap(const_cast<char*>(map), mapSize);
+        map = NULL;
+    }
+    if (fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool CaptureReader::hasRecord() const {
+    return map != NULL && offset + RECORD_HEADER_SIZE <= end &&
+        get32(map + offset) != 0;
+}
+
+bool CaptureReader::next(CaptureRecord &record) throw (string) {
+    for (;;) {
+        if (map == NULL) {
+            return false;
+        }
+        size_t size = 0;
+        if (offset + RECORD_HEADER_SIZE <= end) {
+            size = get32(map + offset);
+        }
+        if (size == 0) {
+            closeSegment();
+            if (!openSegment(segment + 1)) {
+                return false;
+            }
+            continue;
+        }
+
+        const char *rec = map + offset;
+        if (offset + RECORD_HEADER_SIZE + size > end ||
+            crc32(rec + 8, size + 8) != get32(rec + 4)) {
+            stringstream ss;
+            ss << "Corrupt record at offset " << offset << " in "
+               << CaptureWriter::getSegmentName(path, segment);
+            throw ss.str();
+        }
+        record.message = rec + RECORD_HEADER_SIZE;
+        record.size = size;
+        record.time = get64(rec + 8);
+        record.segment = segment;
+        record.offset = offset;
+        offset += RECORD_HEADER_SIZE + size;
+        return true;
+    }
+}
+
+void CaptureReader::seek(size_t off) throw (string) {
+    if (map == NULL || off < SEGMENT_HEADER_SIZE ||
+        off + RECORD_HEADER_SIZE > end) {
+        stringstream ss;
+        ss << "No record at offset " << off << " in "
+           << CaptureWriter::getSegmentName(path, segment);
+        throw ss.str();
+    }
+    offset = off;
+}
@@ -0,0 +1,241 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H 1
+
+#include "config.h"
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * The size of the segments of a capture file, unless a message doesn't
+ * fit in a segment of its own
+ */
+const size_t CAPTURE_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+/**
+ * A capture is a sequence of segment files named <path>.000000,
+ * <path>.000001 and so on. All of the numbers are in network byte
+ * order. Each segment starts with a 16 byte header:
+ *
+ *   "VBMCAP\0\1", the number of the segment (4 bytes), 4 bytes unused
+ *
+ * followed by the records. Each record holds one binary protocol
+ * message:
+ *
+ *   the length of the message (4 bytes)
+ *   the CRC32 of the time followed by the message (4 bytes)
+ *   the time the message was received, in microseconds (8 bytes)
+ *   the message
+ *
+ * A segment that was closed properly ends with the index of its
+ * vbuckets, one 16 byte entry per vbucket:
+ *
+ *   the vbucket (2 bytes), 2 bytes unused,
+ *   the offset of its first and last records (4 bytes each),
+ *   the number of records (4 bytes)
+ *
+ * and a 24 byte trailer:
+ *
+ *   the number of index entries (4 bytes), the CRC32 of the entries
+ *   (4 bytes), the offset of the index (8 bytes), "VBMCIDX\1"
+ *
+ * The records of a segment left behind by a crash are followed by
+ * zeros instead.
+ */
+class CaptureIndexEntry {
+public:
+    CaptureIndexEntry() : vbucket(0), first(0), last(0), records(0) { }
+
+    uint16_t vbucket;
+    uint32_t first;
+    uint32_t last;
+    uint32_t records;
+};
+
+/**
+ * Appends messages to a capture. The messages are copied to a buffer,
+ * and written to the memory mapped segments by a thread of its own, so
+ * the caller never waits for the disk. Once the thread falls more than
+ * maxBuffered bytes behind, the caller is told to hold back its input
+ * until the thread has caught up.
+ */
+class CaptureWriter {
+public:
+    /**
+     * Start the writer thread. The segments are created when needed.
+     * @throw std::runtime_error if the thread can't be started
+     */
+    CaptureWriter(const std::string &path,
+                  size_t segmentSize = CAPTURE_SEGMENT_SIZE,
+                  size_t maxBuffered = 16 * 1024 * 1024) throw (std::runtime_error);
+
+    /**
+     * Close the capture, if not done already
+     */
+    ~CaptureWriter();
+
+    /**
+     * Append a binary protocol message received at time (in
+     * microseconds, 0 for now) to the capture
+     * @return false if the thread is more than maxBuffered bytes
+     *         behind (the message is appended all the same)
+     */
+    bool append(const char *message, size_t size, uint64_t time = 0);
+
+    /**
+     * Has the thread written all but maxBuffered / 2 bytes of what
+     * was appended, after append() returned false?
+     */
+    bool hasCaughtUp();
+
+    /**
+     * Write everything appended so far, close the last segment and
+     * stop the thread
+     * @return false if writing failed (see getError())
+     */
+    bool close();
+
+    const std::string &getError() const {
+        return error;
+    }
+
+    uint64_t getRecords() const {
+        return records;
+    }
+
+    uint64_t getBytes() const {
+        return bytes;
+    }
+
+    size_t getSegments() const {
+        return segment;
+    }
+
+    /**
+     * Get the name of segment n of the capture at path
+     */
+    static std::string getSegmentName(const std::string &path, size_t n);
+
+private:
+    static void *threadMain(void *arg);
+    void run();
+    void write(const std::vector<char> &buffer) throw (std::string);
+    void openSegment(size_t needed) throw (std::string);
+    void closeSegment() throw (std::string);
+
+    std::string path;
+    size_t segmentSize;
+    size_t maxBuffered;
+
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    /** Signalled when there's something to write */
+    pthread_cond_t cond;
+    std::vector<char> buffer;
+    bool closing;
+    bool closed;
+
+    /** Only used by the writer thread until it is done */
+    std::string error;
+    int fd;
+    char *map;
+    size_t mapSize;
+    size_t offset;
+    size_t segment;
+    std::map<uint16_t, CaptureIndexEntry> index;
+    uint64_t records;
+    uint64_t bytes;
+};
+
+/**
+ * A message read from a capture. The message lives in the memory
+ * mapped segment, and is only valid until the reader moves on to the
+ * next segment.
+ */
+class CaptureRecord {
+public:
+    CaptureRecord() : message(NULL), size(0), time(0), segment(0),
+                      offset(0) { }
+
+    const char *message;
+    size_t size;
+    uint64_t time;
+    size_t segment;
+    size_t offset;
+};
+
+/**
+ * Reads the records of a capture in order, through mmap
+ */
+class CaptureReader {
+public:
+    /**
+     * @throw std::string if the first segment can't be opened
+     */
+    CaptureReader(const std::string &path) throw (std::string);
+    ~CaptureReader();
+
+    /**
+     * Get the next record
+     * @return false at the end of the capture
+     * @throw std::string if a segment is corrupt
+     */
+    bool next(CaptureRecord &record) throw (std::string);
+
+    /**
+     * Is there another record in the current segment? If not, next()
+     * moves on to the next segment, which invalidates the records
+     * returned so far.
+     */
+    bool hasRecord() const;
+
+    /**
+     * Get the index of the current segment (empty if the segment
+     * wasn't closed properly)
+     */
+    const std::vector<CaptureIndexEntry> &getIndex() const {
+        return index;
+    }
+
+    /**
+     * Jump to a record of the current segment (the offset of an
+     * index entry or of a record returned by next())
+     * @throw std::string if there's no record at offset
+     */
+    void seek(size_t offset) throw (std::string);
+
+private:
+    bool openSegment(size_t n) throw (std::string);
+    void closeSegment();
+
+    std::string path;
+    size_t segment;
+    int fd;
+    const char *map;
+    size_t mapSize;
+    size_t offset;
+    /** The end of the records of the segment */
+    size_t end;
+    std::vector<CaptureIndexEntry> index;
+};
+
+#endif
@@ -0,0 +1,399 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "daemon.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace std;
+
+class MigrationDaemon::Client {
+public:
+    Client(MigrationDaemon *d, int s) :
+        daemon(d), sock(s), eof(false), closed(false)
+    { }
+
+    MigrationDaemon *daemon;
+    int sock;
+    struct event ev;
+    std::string input;
+    std::string output;
+    /** The client is done sending jobs, but waits for the outcome */
+    bool eof;
+    bool closed;
+};
+
+MigrationDaemon::MigrationDaemon(const string &p, struct event_base *b,
+                                 WorkerPool *wp,
+                                 size_t window) throw (std::runtime_error) :
+    path(p), base(b), pool(wp), share(window), sock(-1),
+    reapScheduled(false), nextId(1)
+{
+    struct sockaddr_un addr;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        throw std::runtime_error(string("Failed to create socket: ") +
+                                 strerror(errno));
+    }
+
+    // Remove the socket left behind by a previous instance
+    unlink(path.c_str());
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) == -1 || listen(sock, 16) == -1) {
+        string msg = string("Failed to listen on ") + path + ": " +
+            strerror(errno);
+        ::close(sock);
+        throw std::runtime_error(msg);
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    event_set(&acceptEvent, sock, EV_READ | EV_PERSIST, acceptHandler, this);
+    event_base_set(base, &acceptEvent);
+    int event_add_rv = event_add(&acceptEvent, NULL);
+    assert(event_add_rv != -1);
+
+    evtimer_set(&reapEvent, reapHandler, this);
+    event_base_set(base, &reapEvent);
+}
+
+MigrationDaemon::~MigrationDaemon() {
+    if (reapScheduled) {
+        evtimer_del(&reapEvent);
+    }
+    event_del(&acceptEvent);
+    ::close(sock);
+    unlink(path.c_str());
+
+    while (!clients.empty()) {
+        closeClient(clients.front());
+    }
+}
+
+void MigrationDaemon::accept() {
+    int s;
+    while ((s = ::accept(sock, NULL, NULL)) != -1) {
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+        Client *client = new Client(this, s);
+        clients.push_back(client);
+        event_set(&client->ev, s, EV_READ | EV_PERSIST, clientHandler, client);
+        event_base_set(base, &client->ev);
+        int event_add_rv = event_add(&client->ev, NULL);
+        assert(event_add_rv != -1);
+    }
+}
+
+void MigrationDaemon::readClient(Client *client) {
+    char buffer[4096];
+    ssize_t nr;
+    while ((nr = read(client->sock, buffer, sizeof(buffer))) > 0) {
+        client->input.append(buffer, nr);
+    }
+    if (nr == 0) {
+        client->eof = true;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        client->closed = true;
+    }
+
+    size_t eol;
+    while ((eol = client->input.find('\n')) != string::npos) {
+        string line = client->input.substr(0, eol);
+        client->input.erase(0, eol + 1);
+        if (line.find_first_not_of(" \t\r") != string::npos) {
+            startJob(client, line);
+        }
+    }
+}
+
+void MigrationDaemon::writeClient(Client *client) {
+    while (!client->output.empty()) {
+        ssize_t nw = write(client->sock, client->output.data(),
+                           client->output.length());
+        if (nw == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                client->closed = true;
+            }
+            return;
+        }
+        client->output.erase(0, nw);
+    }
+}
+
+void MigrationDaemon::updateClient(Client *client) {
+    short flags = EV_PERSIST;
+    if (!client->eof) {
+        flags |= EV_READ;
+    }
+    if (!client->output.empty()) {
+        flags |= EV_WRITE;
+    }
+    event_del(&client->ev);
+    event_set(&client->ev, client->sock, flags, clientHandler, client);
+    event_base_set(base, &client->ev);
+    int event_add_rv = event_add(&client->ev, NULL);
+    assert(event_add_rv != -1);
+}
+
+bool MigrationDaemon::isFinished(Client *client) const {
+    if (client->closed) {
+        return true;
+    }
+    if (!client->eof || !client->output.empty()) {
+        return false;
+    }
+    map<Migration*, Job*>::const_iterator iter;
+    for (iter = jobs.begin(); iter != jobs.end(); ++iter) {
+        if (iter->second->client == client) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void MigrationDaemon::closeClient(Client *client) {
+    // The jobs keep running, but nobody is interested in the outcome
+    map<Migration*, Job*>::iterator iter;
+    for (iter = jobs.begin(); iter != jobs.end(); ++iter) {
+        if (iter->second->client == client) {
+            iter->second->client = NULL;
+        }
+    }
+    event_del(&client->ev);
+    ::close(client->sock);
+    clients.remove(client);
+    delete client;
+}
+
+void MigrationDaemon::send(Client *client, const string &line) {
+    if (client == NULL) {
+        return;
+    }
+    client->output.append(line);
+    client->output.append("\n");
+    updateClient(client);
+}
+
+void MigrationDaemon::startJob(Client *client, const string &line) {
+    Job *job = new Job(nextId++, client);
+    stringstream prefix;
+    prefix << job->id << " ";
+
+    MigrationSpec spec;
+    stringstream label;
+    label << "job " << job->id;
+    spec.label = label.str();
+
+    try {
+        stringstream ss(line);
+        vector<string> args;
+        string arg;
+        while (ss >> arg) {
+            args.push_back(arg);
+        }
+
+        for (size_t ii = 0; ii < args.size(); ++ii) {
+            if (args[ii].length() != 2 || args[ii][0] != '-') {
+                throw "Unexpected argument: " + args[ii];
+            }
+            int opt = args[ii][1];
+            const char *value = NULL;
+            if (strchr("hlbdmnRLcNEfszpixIXJUSOoyag", opt) != NULL) {
+                if (++ii == args.size()) {
+                    throw "Missing argument for " + args[ii - 1];
+                }
+                value = args[ii].c_str();
+            }
+
+            if (opt == 'a') {
+                // There is no terminal to read the password from
+                spec.auth = args[ii];
+                size_t colon = spec.auth.find(':');
+                if (colon != string::npos) {
+                    spec.passwd = spec.auth.substr(colon + 1);
+                    spec.auth.resize(colon);
+                }
+            } else if (!spec.parseOption(opt, value)) {
+                throw "Unknown option: " + args[ii];
+            }
+        }
+        spec.resolve();
+        job->migration = new Migration(spec);
+    } catch (string &e) {
+        stringstream ss;
+        ss << prefix.str() << "failed " << EX_USAGE << " " << e;
+        send(client, ss.str());
+        delete job;
+        return;
+    }
+
+    job->migration->setListener(this);
+    jobs[job->migration] = job;
+
+    string error;
+    int status = EX_OK;
+    try {
+        job->migration->start(base, pool, &share, &cache);
+    } catch (std::string &e) {
+        error = "Failed to connect to host: " + e;
+        status = EX_CONFIG;
+    } catch (std::exception &e) {
+        error = string("Failed to start worker threads: ") + e.what();
+        status = EX_OSERR;
+    }
+
+    if (status != EX_OK) {
+        stringstream ss;
+        ss << prefix.str() << "failed " << status << " " << error;
+        send(client, ss.str());
+        jobs.erase(job->migration);
+        delete job->migration;
+        delete job;
+        return;
+    }
+
+    send(client, prefix.str() + "started");
+}
+
+void MigrationDaemon::report(Migration &migration, const string &what) {
+    map<Migration*, Job*>::iterator iter = jobs.find(&migration);
+    if (iter != jobs.end()) {
+        stringstream ss;
+        ss << iter->second->id << " " << what;
+        send(iter->second->client, ss.str());
+    }
+}
+
+void MigrationDaemon::vbucketMoving(Migration &migration, uint16_t vbucket) {
+    stringstream ss;
+    ss << "moving " << vbucket;
+    report(migration, ss.str());
+}
+
+void MigrationDaemon::vbucketMoved(Migration &migration, uint16_t vbucket) {
+    stringstream ss;
+    ss << "moved " << vbucket;
+    report(migration, ss.str());
+}
+
+void MigrationDaemon::migrationDone(Migration &migration) {
+    // We're called from the callbacks of the pipes we're about to
+    // delete, so the job is cleaned up from the event loop
+    map<Migration*, Job*>::iterator iter = jobs.find(&migration);
+    if (iter != jobs.end()) {
+        iter->second->done = true;
+        scheduleReap(0);
+    }
+}
+
+void MigrationDaemon::scheduleReap(long usec) {
+    if (!reapScheduled) {
+        struct timeval tv = {0, usec};
+        int event_add_rv = evtimer_add(&reapEvent, &tv);
+        assert(event_add_rv != -1);
+        reapScheduled = true;
+    }
+}
+
+void MigrationDaemon::reap() {
+    bool busy = false;
+    map<Migration*, Job*>::iterator iter = jobs.begin();
+    while (iter != jobs.end()) {
+        Job *job = iter->second;
+        if (!job->done) {
+            ++iter;
+            continue;
+        }
+        if (!job->migration->isIdle()) {
+            // The workers are still busy with the messages of a failed job
+            busy = true;
+            ++iter;
+            continue;
+        }
+
+        int status = job->migration->finish(EX_OK);
+        stringstream ss;
+        ss << job->id << " done " << status << " ";
+        job->migration->getStats(ss);
+        send(job->client, ss.str());
+
+        delete job->migration;
+        delete job;
+        jobs.erase(iter++);
+    }
+
+    if (busy) {
+        scheduleReap(10000);
+    }
+
+    // Close the clients waiting for their last job
+    list<Client*>::iterator ci = clients.begin();
+    while (ci != clients.end()) {
+        Client *client = *ci++;
+        if (isFinished(client)) {
+            closeClient(client);
+        }
+    }
+}
+
+void MigrationDaemon::acceptHandler(evutil_socket_t fd, short which,
+                                    void *arg) {
+    (void)fd;
+    (void)which;
+    reinterpret_cast<MigrationDaemon*>(arg)->accept();
+}
+
+void MigrationDaemon::clientHandler(evutil_socket_t fd, short which,
+                                    void *arg) {
+    (void)fd;
+    Client *client = reinterpret_cast<Client*>(arg);
+    MigrationDaemon *daemon = client->daemon;
+    if (which & EV_READ) {
+        daemon->readClient(client);
+    }
+    if (which & EV_WRITE) {
+        daemon->writeClient(client);
+    }
+
+    if (daemon->isFinished(client)) {
+        daemon->closeClient(client);
+    } else {
+        daemon->updateClient(client);
+    }
+}
+
+void MigrationDaemon::reapHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    MigrationDaemon *daemon = reinterpret_cast<MigrationDaemon*>(arg);
+    daemon->reapScheduled = false;
+    daemon->reap();
+}
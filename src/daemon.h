@@ -0,0 +1,107 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef DAEMON_H
+#define DAEMON_H 1
+
+#include "config.h"
+#include "migration.h"
+#include <list>
+#include <map>
+#include <string>
+
+#ifndef evutil_socket_t
+#define evutil_socket_t int
+#endif
+
+/**
+ * The MigrationDaemon accepts migration jobs on a UNIX socket, and
+ * runs all of them on the same event loop.
+ *
+ * Each line sent by a client is a job, using the same options as the
+ * command line (except that -a takes name[:password]). The daemon
+ * answers with lines prefixed by the id of the job:
+ *
+ *   <id> started
+ *   <id> moving <vbucket>
+ *   <id> moved <vbucket>
+ *   <id> done <exit status> <statistics>
+ *   <id> failed <exit status> <reason>
+ *
+ * The connections to the destinations are kept when a job succeeds,
+ * and reused by the next job to the same server with the same
+ * credentials.
+ */
+class MigrationDaemon : public MigrationListener {
+public:
+    MigrationDaemon(const std::string &path, struct event_base *base,
+                    WorkerPool *pool,
+                    size_t window) throw (std::runtime_error);
+    ~MigrationDaemon();
+
+    void vbucketMoving(Migration &migration, uint16_t vbucket);
+    void vbucketMoved(Migration &migration, uint16_t vbucket);
+    void migrationDone(Migration &migration);
+
+private:
+    class Client;
+
+    class Job {
+    public:
+        Job(unsigned int i, Client *c) :
+            id(i), client(c), migration(NULL), done(false)
+        { }
+
+        unsigned int id;
+        Client *client;
+        Migration *migration;
+        bool done;
+    };
+
+    void accept();
+    void readClient(Client *client);
+    void writeClient(Client *client);
+    void closeClient(Client *client);
+    bool isFinished(Client *client) const;
+    void send(Client *client, const std::string &line);
+    void updateClient(Client *client);
+
+    void startJob(Client *client, const std::string &line);
+    void report(Migration &migration, const std::string &what);
+    void scheduleReap(long usec);
+    void reap();
+
+    static void acceptHandler(evutil_socket_t fd, short which, void *arg);
+    static void clientHandler(evutil_socket_t fd, short which, void *arg);
+    static void reapHandler(evutil_socket_t fd, short which, void *arg);
+
+    std::string path;
+    struct event_base *base;
+    WorkerPool *pool;
+    FairShare share;
+    ConnectionCache cache;
+
+    int sock;
+    struct event acceptEvent;
+    struct event reapEvent;
+    bool reapScheduled;
+
+    std::list<Client*> clients;
+    std::map<Migration*, Job*> jobs;
+    unsigned int nextId;
+};
+
+#endif
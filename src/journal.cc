@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "journal.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+void ProgressJournal::load() throw (string) {
+    entries.clear();
+    messages = bytes = 0;
+    ifstream in(path.c_str());
+    if (!in.is_open()) {
+        if (errno == ENOENT) {
+            previousMessages = previousBytes = 0;
+            return;
+        }
+        throw "Failed to open " + path + ": " + strerror(errno);
+    }
+
+    string line;
+    size_t lineno = 0;
+    bool named = false;
+    while (getline(in, line)) {
+        ++lineno;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+        stringstream ss(line);
+        if (!named) {
+            // The name may be empty, for a stream the source named
+            string keyword;
+            string name;
+            ss >> keyword >> name;
+            if (keyword != "stream") {
+                break;
+            }
+            if (name != stream) {
+                throw path + " is the journal of the stream \"" + name +
+                    "\", not of \"" + stream + "\"";
+            }
+            named = true;
+            continue;
+        }
+
+        unsigned long vbucket;
+        Entry entry;
+        string state;
+        string rest;
+        if (!(ss >> vbucket >> entry.messages >> entry.bytes >> state) ||
+            vbucket > 0xffff ||
+            (state != "backfilling" && state != "backfilled") ||
+            (ss >> rest)) {
+            stringstream error;
+            error << "Invalid line " << lineno << " in " << path
+                  << ": " << line;
+            throw error.str();
+        }
+        entry.backfilled = state == "backfilled";
+        entries[static_cast<uint16_t>(vbucket)] = entry;
+        messages += entry.messages;
+        bytes += entry.bytes;
+    }
+
+    if (!named && lineno > 0) {
+        throw "Missing the stream name in " + path;
+    }
+    previousMessages = messages;
+    previousBytes = bytes;
+}
+
+bool ProgressJournal::isBackfilled(uint16_t vbucket) const {
+    map<uint16_t, Entry>::const_iterator e = entries.find(vbucket);
+    return e != entries.end() && e->second.backfilled;
+}
+
+bool ProgressJournal::isBackfilled(const vector<uint16_t> &vbuckets) const {
+    for (size_t ii = 0; ii < vbuckets.size(); ++ii) {
+        if (!isBackfilled(vbuckets[ii])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void ProgressJournal::save() throw (string) {
+    // Replace the file in one go, so that we never leave half of it
+    // behind if we die while writing it
+    string tmp = path + ".tmp";
+    ofstream out(tmp.c_str(), ios::trunc);
+    out << "stream " << stream << endl;
+    map<uint16_t, Entry>::const_iterator e;
+    for (e = entries.begin(); e != entries.end(); ++e) {
+        out << e->first << " " << e->second.messages << " "
+            << e->second.bytes << " "
+            << (e->second.backfilled ? "backfilled" : "backfilling") << endl;
+    }
+    out.close();
+    if (out.fail() || rename(tmp.c_str(), path.c_str()) == -1) {
+        string error = "Failed to write " + path + ": " + strerror(errno);
+        remove(tmp.c_str());
+        throw error;
+    }
+    dirty = false;
+}
@@ -0,0 +1,139 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H 1
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Keeps the progress of each vbucket of a TAP stream, so that an
+ * interrupted migration of a registered TAP client can tell how much
+ * it doesn't have to receive again when it resumes from the checkpoint
+ * of the source, and doesn't ask for a backfill it already got.
+ *
+ * The journal is a text file naming the stream, with a line per
+ * vbucket:
+ *
+ *   stream <name>
+ *   <vbucket> <messages> <bytes> <backfilling|backfilled>
+ *
+ * The file is replaced at most once a second while the stream runs.
+ */
+class ProgressJournal {
+public:
+    ProgressJournal(const std::string &p, const std::string &s) :
+        path(p), stream(s), messages(0), bytes(0), previousMessages(0),
+        previousBytes(0), dirty(false), saved(0)
+    { }
+
+    /**
+     * Read the file left by a previous run. A missing file is an
+     * empty journal.
+     * @throw std::string if the file can't be read or parsed, or it
+     *        belongs to another stream
+     */
+    void load() throw (std::string);
+
+    /**
+     * Count a message received for vbucket
+     */
+    void received(uint16_t vbucket, size_t size) {
+        Entry &entry = entries[vbucket];
+        ++entry.messages;
+        entry.bytes += size;
+        ++messages;
+        bytes += size;
+        dirty = true;
+    }
+
+    /**
+     * The source is done backfilling vbucket
+     */
+    void backfilled(uint16_t vbucket) {
+        entries[vbucket].backfilled = true;
+        dirty = true;
+    }
+
+    bool isBackfilled(uint16_t vbucket) const;
+
+    /**
+     * Is the source done backfilling all of the vbuckets?
+     */
+    bool isBackfilled(const std::vector<uint16_t> &vbuckets) const;
+
+    /**
+     * Write the file if it changed, and if now is at least a second
+     * after the last time it was written
+     * @throw std::string if the file can't be written
+     */
+    void update(time_t now) throw (std::string) {
+        if (dirty && now != saved) {
+            save();
+            saved = now;
+        }
+    }
+
+    /**
+     * Write the file
+     * @throw std::string if the file can't be written
+     */
+    void save() throw (std::string);
+
+    /** The number of messages received, including by the previous runs */
+    uint64_t getMessages() const {
+        return messages;
+    }
+
+    uint64_t getBytes() const {
+        return bytes;
+    }
+
+    /** The number of bytes the previous runs received */
+    uint64_t getPreviousBytes() const {
+        return previousBytes;
+    }
+
+    uint64_t getPreviousMessages() const {
+        return previousMessages;
+    }
+
+private:
+    class Entry {
+    public:
+        Entry() : messages(0), bytes(0), backfilled(false) { }
+
+        uint64_t messages;
+        uint64_t bytes;
+        bool backfilled;
+    };
+
+    std::string path;
+    std::string stream;
+    std::map<uint16_t, Entry> entries;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t previousMessages;
+    uint64_t previousBytes;
+    bool dirty;
+    time_t saved;
+};
+
+#endif
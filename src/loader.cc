@@ -0,0 +1,282 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "loader.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+/** The most records, and bytes, to write at once */
+static const size_t MAX_BATCH_RECORDS = 64;
+static const size_t MAX_BATCH_BYTES = 256 * 1024;
+
+static uint64_t now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+CaptureLoader::CaptureLoader(const string &path,
+                             const vector<uint16_t> &vbuckets,
+                             struct event_base *b) throw (std::string) :
+    reader(path), wanted(0x10000, false), base(b), registered(false),
+    sock(-1), peer(-1), iovPos(0), speed(0), timerPending(false),
+    holding(false), firstTime(0), startTime(0), lag(0), maxLag(0),
+    totalLag(0), eof(false), done(false), records(0), bytes(0)
+{
+    for (size_t ii = 0; ii < vbuckets.size(); ++ii) {
+        wanted[vbuckets[ii]] = true;
+    }
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        throw string("Failed to create socket pair: ") + strerror(errno);
+    }
+    sock = fds[0];
+    peer = fds[1];
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+}
+
+CaptureLoader::~CaptureLoader() {
+    if (registered) {
+        event_del(&ev);
+    }
+    if (timerPending) {
+        evtimer_del(&timer);
+    }
+    if (sock != -1) {
+        ::close(sock);
+    }
+}
+
+void CaptureLoader::start() {
+    evtimer_set(&timer, timerHandler, this);
+    event_base_set(base, &timer);
+    updateEvent(EV_READ | EV_WRITE);
+}
+
+void CaptureLoader::updateEvent(short which) {
+    if (registered) {
+        event_del(&ev);
+    }
+    event_set(&ev, sock, which | EV_PERSIST, handler, this);
+    event_base_set(base, &ev);
+    int event_add_rv = event_add(&ev, NULL);
+    assert(event_add_rv != -1);
+    registered = true;
+}
+
+void CaptureLoader::handler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    reinterpret_cast<CaptureLoader*>(arg)->step(which);
+}
+
+void CaptureLoader::timerHandler(evutil_socket_t fd, short which,
+                                 void *arg) {
+    (void)fd;
+    (void)which;
+    CaptureLoader *loader = reinterpret_cast<CaptureLoader*>(arg);
+    loader->timerPending = false;
+    if (!loader->done) {
+        loader->updateEvent(EV_READ | EV_WRITE);
+    }
+}
+
+void CaptureLoader::step(short which) {
+    if (which & EV_READ) {
+        discard();
+    }
+    if (done || !(which & EV_WRITE)) {
+        return;
+    }
+
+    try {
+        while (true) {
+            if (iovPos == iovBase.size() && !fill()) {
+                if (eof) {
+                    // Everything is written. The acks still to come
+                    // are of no interest, and waiting for them would
+                    // keep the event loop running.
+                    shutdown(sock, SHUT_WR);
+                    finish();
+                }
+                return;
+            }
+            if (!drain()) {
+                return;
+            }
+        }
+    } catch (std::string &e) {
+        error = e;
+        finish();
+    }
+}
+
+bool CaptureLoader::fill() throw (std::string) {
+    iovBase.clear();
+    iovLen.clear();
+    iovDue.clear();
+    iovPos = 0;
+    if (eof) {
+        return false;
+    }
+
+    // The records must all be in the same segment, since moving on to
+    // the next one unmaps the current one
+    size_t batch = 0;
+    uint64_t now = speed > 0 ? now_usec() : 0;
+    CaptureRecord record;
+    while (iovBase.size() < MAX_BATCH_RECORDS && batch < MAX_BATCH_BYTES) {
+        if (holding) {
+            record = held;
+            holding = false;
+        } else {
+            if (!iovBase.empty() && !reader.hasRecord()) {
+                break;
+            }
+            if (!reader.next(record)) {
+                eof = true;
+                break;
+            }
+            uint16_t vbucket;
+            memcpy(&vbucket, record.message + 6, sizeof(vbucket));
+            if (record.size < 24 || !wanted[ntohs(vbucket)]) {
+                continue;
+            }
+        }
+
+        uint64_t due = 0;
+        if (speed > 0) {
+            due = getDue(record);
+            if (due > now) {
+                held = record;
+                holding = true;
+                if (iovBase.empty()) {
+                    wait(due, now);
+                }
+                break;
+            }
+        }
+        iovBase.push_back(const_cast<char*>(record.message));
+        iovLen.push_back(record.size);
+        iovDue.push_back(due);
+        batch += record.size;
+        ++records;
+        bytes += record.size;
+    }
+    return !iovBase.empty();
+}
+
+bool CaptureLoader::drain() {
+    struct iovec iov[MAX_BATCH_RECORDS];
+    size_t num = 0;
+    for (size_t ii = iovPos; ii < iovBase.size(); ++ii, ++num) {
+        iov[num].iov_base = iovBase[ii];
+        iov[num].iov_len = iovLen[ii];
+    }
+
+    // sendmsg is writev with flags, so that the migration closing its
+    // end doesn't kill us with SIGPIPE
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = num;
+    ssize_t nw;
+    while ((nw = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+        // retry
+    }
+    if (nw == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error = string("Failed to write the messages: ") + strerror(errno);
+            finish();
+        }
+        return false;
+    }
+
+    size_t left = nw;
+    uint64_t now = speed > 0 ? now_usec() : 0;
+    while (iovPos < iovBase.size() && left >= iovLen[iovPos]) {
+        left -= iovLen[iovPos];
+        if (speed > 0) {
+            lag = now > iovDue[iovPos] ? now - iovDue[iovPos] : 0;
+            maxLag = std::max(maxLag, lag);
+            totalLag += lag;
+        }
+        ++iovPos;
+    }
+    if (left > 0) {
+        iovBase[iovPos] += left;
+        iovLen[iovPos] -= left;
+    }
+    return true;
+}
+
+uint64_t CaptureLoader::getDue(const CaptureRecord &record) {
+    if (startTime == 0) {
+        // The schedule starts with the first record
+        startTime = now_usec();
+        firstTime = record.time;
+    }
+    uint64_t offset = record.time > firstTime ? record.time - firstTime : 0;
+    return startTime + static_cast<uint64_t>(offset / speed);
+}
+
+void CaptureLoader::wait(uint64_t due, uint64_t now) {
+    // Stop writing (but keep reading the acks) until the record is due
+    updateEvent(EV_READ);
+    struct timeval tv;
+    tv.tv_sec = (due - now) / 1000000;
+    tv.tv_usec = (due - now) % 1000000;
+    int event_add_rv = evtimer_add(&timer, &tv);
+    assert(event_add_rv != -1);
+    timerPending = true;
+}
+
+void CaptureLoader::discard() {
+    char buffer[4096];
+    ssize_t nr;
+    while ((nr = read(sock, buffer, sizeof(buffer))) > 0) {
+        // The acks aren't of any use to us
+    }
+    if (nr == 0 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        // The migration closed the stream
+        finish();
+    }
+}
+
+void CaptureLoader::finish() {
+    if (registered) {
+        event_del(&ev);
+        registered = false;
+    }
+    if (timerPending) {
+        evtimer_del(&timer);
+        timerPending = false;
+    }
+    done = true;
+}
@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef LOADER_H
+#define LOADER_H 1
+
+#include "config.h"
+#include "capture.h"
+#include <string>
+#include <vector>
+#include <event.h>
+
+#ifndef evutil_socket_t
+#define evutil_socket_t int
+#endif
+
+/**
+ * Plays a capture (see CaptureWriter) back as if it came from a TAP
+ * source. The messages of the selected vbuckets are written, straight
+ * from the memory mapped segments, into one end of a socket pair, and
+ * the migration reads them from the other end like from any other
+ * source. Everything the migration sends back (TAP acks) is discarded.
+ * The end of the capture is signalled by shutting down the socket.
+ *
+ * The records are written as fast as the migration takes them, unless
+ * a replay speed is set: the records are then written at the times
+ * they were captured (relative to the first one), divided by the
+ * speed, and the loader keeps track of how far behind that schedule
+ * it falls.
+ */
+class CaptureLoader {
+public:
+    /**
+     * Open the capture and the socket pair
+     * @throw std::string if the capture can't be opened
+     */
+    CaptureLoader(const std::string &path,
+                  const std::vector<uint16_t> &vbuckets,
+                  struct event_base *base) throw (std::string);
+
+    ~CaptureLoader();
+
+    /**
+     * Get the socket the migration reads the messages from. The
+     * caller takes over the socket.
+     */
+    int getSocket() const {
+        return peer;
+    }
+
+    /**
+     * Keep the timing of the capture, speeded up by speed (0 to write
+     * the records as fast as possible). Must be called before start().
+     */
+    void setSpeed(double s) {
+        speed = s;
+    }
+
+    /**
+     * Start writing the messages from the event loop
+     */
+    void start();
+
+    /**
+     * Has the whole capture been written, or did we give up?
+     */
+    bool isDone() const {
+        return done;
+    }
+
+    /**
+     * Get the reason we gave up, if we did
+     */
+    const std::string &getError() const {
+        return error;
+    }
+
+    uint64_t getRecords() const {
+        return records;
+    }
+
+    uint64_t getBytes() const {
+        return bytes;
+    }
+
+    /**
+     * Get how far behind schedule (in microseconds) the last record
+     * was written, and the most and the average of all of them
+     */
+    uint64_t getLag() const {
+        return lag;
+    }
+
+    uint64_t getMaxLag() const {
+        return maxLag;
+    }
+
+    uint64_t getAverageLag() const {
+        return records == 0 ? 0 : totalLag / records;
+    }
+
+private:
+    static void handler(evutil_socket_t fd, short which, void *arg);
+    static void timerHandler(evutil_socket_t fd, short which, void *arg);
+    void step(short which);
+    bool fill() throw (std::string);
+    bool drain();
+    void discard();
+    void finish();
+    void updateEvent(short which);
+    uint64_t getDue(const CaptureRecord &record);
+    void wait(uint64_t due, uint64_t now);
+
+    CaptureReader reader;
+    std::vector<bool> wanted;
+    struct event_base *base;
+    struct event ev;
+    bool registered;
+    int sock;
+    int peer;
+
+    /** The records to write, pointing into the current segment */
+    std::vector<char*> iovBase;
+    std::vector<size_t> iovLen;
+    /** When each of them is due, when keeping the timing */
+    std::vector<uint64_t> iovDue;
+    size_t iovPos;
+
+    double speed;
+    struct event timer;
+    bool timerPending;
+    /** The record read, but not due yet */
+    CaptureRecord held;
+    bool holding;
+    /** The time of the first record, and when it was written */
+    uint64_t firstTime;
+    uint64_t startTime;
+    uint64_t lag;
+    uint64_t maxLag;
+    uint64_t totalLag;
+    bool eof;
+    bool done;
+    std::string error;
+    uint64_t records;
+    uint64_t bytes;
+};
+
+#endif
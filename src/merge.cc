@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "merge.h"
+#include "binarymessage.h"
+
+using namespace std;
+
+size_t MergeScheduler::addSource() {
+    sources.push_back(Source());
+    return sources.size() - 1;
+}
+
+uint32_t MergeScheduler::enqueue(size_t source, size_t conn,
+                                 BinaryMessage *msg, bool ack) {
+    Source &src = sources[source];
+    uint32_t opaque = htonl(static_cast<uint32_t>(source << 24) |
+                            (src.nextOpaque++ & 0xffffff));
+    if (ack) {
+        src.opaques[opaque] = msg->data.req->request.opaque;
+    }
+    msg->data.req->request.opaque = opaque;
+
+    src.queue.push_back(make_pair(conn, msg));
+    ++src.backlog;
+    return opaque;
+}
+
+void MergeScheduler::schedule(vector<pair<size_t, BinaryMessage*> > &out) {
+    bool progress;
+    do {
+        progress = false;
+        for (size_t ii = 0; ii < sources.size(); ++ii) {
+            Source &src = sources[(nextSource + ii) % sources.size()];
+            if (src.queue.empty()) {
+                src.deficit = 0;
+                continue;
+            }
+            if (inPipe[src.queue.front().first] >= limit) {
+                continue;
+            }
+
+            src.deficit += quantum;
+            progress = true;
+            while (!src.queue.empty()) {
+                size_t conn = src.queue.front().first;
+                BinaryMessage *msg = src.queue.front().second;
+                if (msg->size > src.deficit || inPipe[conn] >= limit) {
+                    break;
+                }
+                src.deficit -= msg->size;
+                src.queue.pop_front();
+                ++inPipe[conn];
+                out.push_back(make_pair(conn, msg));
+            }
+        }
+        if (!sources.empty()) {
+            nextSource = (nextSource + 1) % sources.size();
+        }
+    } while (progress);
+}
+
+bool MergeScheduler::sent(const BinaryMessage &msg, size_t conn) {
+    // The NOOPs and the vbucket state requests are our own, and never
+    // went through the queues of the sources
+    uint8_t opcode = msg.data.req->request.opcode;
+    if (opcode == PROTOCOL_BINARY_CMD_NOOP ||
+        opcode == PROTOCOL_BINARY_CMD_GET_VBUCKET) {
+        return false;
+    }
+    size_t source = ntohl(msg.data.req->request.opaque) >> 24;
+    if (source >= sources.size()) {
+        return false;
+    }
+    --inPipe[conn];
+    --sources[source].backlog;
+    sources[source].bytes += msg.size;
+    return true;
+}
+
+bool MergeScheduler::route(BinaryMessage *msg, size_t &source) {
+    uint32_t opaque = msg->data.res->response.opaque;
+    source = ntohl(opaque) >> 24;
+    if (source >= sources.size()) {
+        return false;
+    }
+    Source &src = sources[source];
+    map<uint32_t, uint32_t>::iterator iter = src.opaques.find(opaque);
+    if (iter != src.opaques.end()) {
+        msg->data.res->response.opaque = iter->second;
+        src.opaques.erase(iter);
+    }
+    return true;
+}
+
+void MergeScheduler::dumpMessages(size_t source, ostream &out) const {
+    deque<pair<size_t, BinaryMessage*> >::const_iterator iter;
+    for (iter = sources[source].queue.begin();
+         iter != sources[source].queue.end(); ++iter) {
+        out << "  " << iter->second->toString() << endl;
+    }
+}
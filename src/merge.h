@@ -0,0 +1,146 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef MERGE_H
+#define MERGE_H 1
+
+#include "config.h"
+#include <deque>
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+class BinaryMessage;
+
+/**
+ * The number of bytes each source may send per round when merging
+ * several sources
+ */
+const size_t MERGE_QUANTUM = 16 * 1024;
+
+/**
+ * The source index is kept in the top byte of the opaque field, and
+ * must not collide with the opaque values used by our own messages
+ */
+const size_t MAX_SOURCES = 128;
+
+/**
+ * Merges the streams of several sources into the connections to the
+ * destinations, using deficit round robin over the bytes sent. At most
+ * limit messages are kept in flight on each connection, and the rest
+ * wait in the queue of their source.
+ *
+ * The opaque field of the messages is rewritten to carry the source
+ * index, so that the responses can be routed back. The opaques the
+ * destinations answer with are mapped back to the ones the source used
+ * for the messages waiting for an ack.
+ */
+class MergeScheduler {
+public:
+    MergeScheduler(size_t connections, size_t l, size_t q = MERGE_QUANTUM) :
+        inPipe(connections, 0), limit(l), quantum(q), nextSource(0)
+    { }
+
+    /**
+     * Add a source
+     * @return the index of the source
+     */
+    size_t addSource();
+
+    size_t getNumSources() const {
+        return sources.size();
+    }
+
+    /**
+     * Queue a message from one of the sources for the connection conn
+     * @param ack does the source wait for an ack of the message
+     * @return the opaque the destination answers the message with
+     */
+    uint32_t enqueue(size_t source, size_t conn, BinaryMessage *msg, bool ack);
+
+    /**
+     * Take the messages to send next from the sources, until the
+     * connections are full or all the sources are empty
+     * @param out gets the connection and the message to send to it, in
+     *            the order to send them
+     */
+    void schedule(std::vector<std::pair<size_t, BinaryMessage*> > &out);
+
+    /**
+     * A message left the connection conn, making room for another one
+     * @return false if it didn't come from the queue of a source
+     */
+    bool sent(const BinaryMessage &msg, size_t conn);
+
+    /**
+     * Find the source a response from a destination is for, and give
+     * it back the opaque the source sent the message with
+     * @return false if it isn't for any of the sources
+     */
+    bool route(BinaryMessage *msg, size_t &source);
+
+    /**
+     * Get the number of messages of a source queued or in flight
+     */
+    size_t getBacklog(size_t source) const {
+        return sources[source].backlog;
+    }
+
+    /**
+     * Get the number of bytes sent for a source
+     */
+    uint64_t getBytes(size_t source) const {
+        return sources[source].bytes;
+    }
+
+    /**
+     * Get the number of messages that may be in flight on all of the
+     * connections together
+     */
+    size_t getWindow() const {
+        return limit * inPipe.size();
+    }
+
+    /**
+     * Print the messages queued for a source
+     */
+    void dumpMessages(size_t source, std::ostream &out) const;
+
+private:
+    class Source {
+    public:
+        Source() : deficit(0), backlog(0), bytes(0), nextOpaque(0) { }
+
+        std::deque<std::pair<size_t, BinaryMessage*> > queue;
+        size_t deficit;
+        size_t backlog;
+        uint64_t bytes;
+        uint32_t nextOpaque;
+        /** The opaques of the source, by the ones used downstream */
+        std::map<uint32_t, uint32_t> opaques;
+    };
+
+    std::vector<Source> sources;
+    /** The messages in flight on each connection */
+    std::vector<size_t> inPipe;
+    size_t limit;
+    size_t quantum;
+    size_t nextSource;
+};
+
+#endif
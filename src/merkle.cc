@@ -0,0 +1,118 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "merkle.h"
+
+#include <cassert>
+
+using namespace std;
+
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME = 0x100000001b3ULL;
+
+/**
+ * The leaves are picked with a differently seeded hash than the items,
+ * and neither of them is related to the CRC32 picking the vbucket
+ */
+static const uint64_t LEAF_SEED = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t fnv(const void *data, size_t n, uint64_t h) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for (size_t ii = 0; ii < n; ++ii) {
+        h ^= p[ii];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint64_t fnvWord(uint32_t value, uint64_t h) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        h ^= (value >> shift) & 0xff;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+/**
+ * Spread the bits of a hash (the finalizer of SplitMix64)
+ */
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+MerkleTree::MerkleTree(size_t l) : leaves(l), nodes(2 * l, 0), items(0) {
+    assert(leaves > 0 && (leaves & (leaves - 1)) == 0);
+}
+
+uint64_t MerkleTree::hashItem(const char *key, size_t nkey,
+                              const char *value, size_t nvalue,
+                              uint32_t flags, uint32_t expiry,
+                              uint8_t datatype) {
+    // The lengths keep the key and the value apart
+    uint64_t h = fnvWord(static_cast<uint32_t>(nkey), FNV_OFFSET);
+    h = fnv(key, nkey, h);
+    h = fnvWord(static_cast<uint32_t>(nvalue), h);
+    h = fnv(value, nvalue, h);
+    h = fnvWord(flags, h);
+    h = fnvWord(expiry, h);
+    h = fnv(&datatype, 1, h);
+    return mix(h);
+}
+
+size_t MerkleTree::getLeaf(const char *key, size_t nkey) const {
+    return static_cast<size_t>(mix(fnv(key, nkey, FNV_OFFSET) ^ LEAF_SEED) &
+                               (leaves - 1));
+}
+
+void MerkleTree::add(const char *key, size_t nkey, uint64_t hash) {
+    nodes[leaves + getLeaf(key, nkey)] += hash;
+    ++items;
+}
+
+void MerkleTree::build() {
+    for (size_t ii = leaves - 1; ii > 0; --ii) {
+        nodes[ii] = mix(nodes[2 * ii] * FNV_PRIME + nodes[2 * ii + 1]);
+    }
+}
+
+size_t MerkleTree::diff(const MerkleTree &other,
+                        vector<size_t> &differing) const {
+    assert(leaves == other.leaves);
+    size_t compared = 0;
+    vector<size_t> stack(1, 1);
+    while (!stack.empty()) {
+        size_t node = stack.back();
+        stack.pop_back();
+        ++compared;
+        if (nodes[node] == other.nodes[node]) {
+            continue;
+        }
+        if (node >= leaves) {
+            differing.push_back(node - leaves);
+        } else {
+            // The left subtree first, to find the leaves in order
+            stack.push_back(2 * node + 1);
+            stack.push_back(2 * node);
+        }
+    }
+    return compared;
+}
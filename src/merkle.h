@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef MERKLE_H
+#define MERKLE_H 1
+
+#include "config.h"
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * The default number of leaves of the tree of a vbucket
+ */
+const size_t MERKLE_LEAVES = 1024;
+
+/**
+ * A Merkle tree over the items of a vbucket. The items are spread over
+ * the leaves by the hash of their key, and the hash of a leaf is the
+ * sum of the hashes of its items, so that it doesn't matter in which
+ * order they are added (a dump of the source and one of the destination
+ * send them in different orders). Every inner node hashes its two
+ * children, so two trees built from the same items have the same root,
+ * and the leaves that differ are found by descending only into the
+ * subtrees that differ.
+ *
+ * The nodes are kept in an array: the root is node 1, the children of
+ * node n are 2n and 2n + 1, and the leaves are the last half.
+ */
+class MerkleTree {
+public:
+    /**
+     * @param leaves the number of leaves (a power of two)
+     */
+    MerkleTree(size_t leaves = MERKLE_LEAVES);
+
+    /**
+     * Hash the key, the value and the metadata of an item (the CAS is
+     * left out, since the destination assigns its own)
+     */
+    static uint64_t hashItem(const char *key, size_t nkey,
+                             const char *value, size_t nvalue,
+                             uint32_t flags, uint32_t expiry,
+                             uint8_t datatype);
+
+    /**
+     * Get the leaf a key belongs to
+     */
+    size_t getLeaf(const char *key, size_t nkey) const;
+
+    /**
+     * Add an item hashed by hashItem() to the leaf of its key
+     */
+    void add(const char *key, size_t nkey, uint64_t hash);
+
+    /**
+     * Compute the inner nodes, once all of the items are added
+     */
+    void build();
+
+    uint64_t getRoot() const {
+        return nodes[1];
+    }
+
+    /**
+     * Compare with a tree of the same size (both built), top down
+     * @param leaves where to add the leaves that differ (in order)
+     * @return the number of nodes compared
+     */
+    size_t diff(const MerkleTree &other, std::vector<size_t> &leaves) const;
+
+    size_t getLeaves() const {
+        return leaves;
+    }
+
+    uint64_t getItems() const {
+        return items;
+    }
+
+private:
+    size_t leaves;
+    std::vector<uint64_t> nodes;
+    uint64_t items;
+};
+
+#endif
@@ -0,0 +1,3047 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "migration.h"
+
+#include <iostream>
+#include <sstream>
+#include <deque>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <memcached/vbucket.h>
+
+#include "acks.h"
+#include "buckets.h"
+#include "capture.h"
+#include "journal.h"
+#include "loader.h"
+#include "merge.h"
+#include "quiet.h"
+#include "relay.h"
+#include "snapshot.h"
+#include "validation.h"
+#include "window.h"
+
+#include "sockstream.h"
+#include "binarymessagepipe.h"
+#include "parallelstage.h"
+#include "transform.h"
+#include "workerpool.h"
+
+using namespace std;
+
+/**
+ * In quiet mode a NOOP is sent after this many messages, since the
+ * servers hold back the errors of the quiet commands until they get a
+ * command that isn't quiet
+ */
+const size_t FENCE_INTERVAL = 1024;
+
+/**
+ * The opaque of the NOOP sent on every connection once the sources
+ * are done in quiet mode, to wait for the destinations to process the
+ * last of the quiet commands
+ */
+const uint32_t FINAL_FENCE_OPAQUE = 0xffffffff;
+
+/**
+ * The opaque of the NOOPs trimming the retransmit window (-g)
+ */
+const uint32_t WINDOW_FENCE_OPAQUE = 0xfffffffe;
+
+/**
+ * A lost source is reconnected after RECONNECT_DELAY milliseconds,
+ * doubling the delay up to RECONNECT_MAX_DELAY after every failed
+ * attempt, and given up on after RECONNECT_ATTEMPTS attempts in a row
+ */
+const long RECONNECT_DELAY = 100;
+const long RECONNECT_MAX_DELAY = 10000;
+const size_t RECONNECT_ATTEMPTS = 10;
+
+/**
+ * A connection lasting this many seconds starts the backoff over
+ */
+const time_t RECONNECT_STABLE = 60;
+
+/**
+ * How often to check whether the destinations answered the acks for
+ * a lost source, in milliseconds
+ */
+const long RECONNECT_POLL = 10;
+
+/**
+ * How often to check whether the capture (-O) caught up, in
+ * milliseconds
+ */
+const long CAPTURE_POLL = 10;
+
+/**
+ * The UpstreamController keeps track of the number of messages pending
+ * on each of the downstream connections. A connection is congested
+ * once it has more than PENDING_SEND_HI_WAT messages queued, and stays
+ * congested until it drops below PENDING_SEND_LO_WAT.
+ *
+ * The connections are grouped per destination, and a destination is
+ * congested while all of its connections are congested. The upstream
+ * is plugged while any of the destinations is congested.
+ *
+ * In fan-out mode every destination receives all of the messages, and
+ * the destinations after the first are replicas. With the
+ * REPLICA_DROP policy the replicas don't throttle the source; a replica
+ * with more than dropLimit messages pending is disconnected instead.
+ *
+ * With multiple sources the streams are merged into the downstream
+ * connections by a MergeScheduler, keeping at most PENDING_SEND_HI_WAT
+ * messages queued in each connection. Each source is plugged on its
+ * own once its backlog exceeds its share of the window.
+ *
+ * When several migrations share the event loop, each of them may only
+ * have its FairShare of bytes queued towards the destination.
+ */
+class UpstreamController {
+public:
+    UpstreamController(size_t destinations = 1, size_t connections = 1) :
+        upstream(0), pendingSendCount(0),
+        pending(destinations * connections, 0),
+        congested(destinations * connections, false),
+        redialing(destinations * connections, false),
+        groupSize(connections), groupCongested(destinations, 0),
+        numCongested(0), closed(false), inputPlugged(false), aborting(false),
+        fanout(false), policy(REPLICA_STALL), dropLimit(0),
+        dropped(destinations, false), groupPending(destinations, 0),
+        maxGroupPending(destinations, 0), sent(destinations, 0),
+        sentBytes(destinations, 0), merging(false),
+        merger(destinations * connections, PENDING_SEND_HI_WAT),
+        openSources(0), share(NULL), pendingBytes(0), overShare(false),
+        filtered(0), coalesced(0), coalescedBytes(0), quiet(false),
+        fences(destinations * connections, FENCE_INTERVAL), fencing(false),
+        validating(false), draining(0), captureBehind(false), backfillLog(NULL),
+        backfillTime(0), migration(NULL), listener(NULL), done(false)
+    {
+        // Empty
+    }
+
+    bool isMerging() const {
+        return merging;
+    }
+
+    /**
+     * Queue a message from one of the sources for the downstream
+     * connection conn.
+     * @param ack does the source wait for an ack of the message (the
+     *            flag is gone once it is translated to a quiet command)
+     * @return the opaque the destination answers the message with
+     */
+    uint32_t enqueue(size_t source, size_t conn, BinaryMessage *msg, bool ack) {
+        uint32_t opaque = merger.enqueue(source, conn, msg, ack);
+        updateSourceFlow();
+        pump();
+        return opaque;
+    }
+
+    /**
+     * Move messages from the sources to the downstream connections
+     * until the connections are full or all the sources are empty.
+     */
+    void pump() {
+        std::vector<std::pair<size_t, BinaryMessage*> > ready;
+        merger.schedule(ready);
+        for (size_t ii = 0; ii < ready.size(); ++ii) {
+            downstream[ready[ii].first]->sendMessage(ready[ii].second);
+        }
+    }
+
+    void setFanout(ReplicaPolicy p, size_t limit) {
+        fanout = true;
+        policy = p;
+        dropLimit = limit;
+    }
+
+    bool isFanout() const {
+        return fanout;
+    }
+
+    bool isDropped(size_t group) const {
+        return dropped[group];
+    }
+
+    size_t getNumGroups() const {
+        return dropped.size();
+    }
+
+    /**
+     * Register that a message requesting a TAP ack was sent to all of
+     * the live destinations. The ack is passed on to the source once
+     * all of them have acked it.
+     */
+    void expectAck(BinaryMessage *msg) {
+        acks.expect(msg->data.req->request.opcode,
+                    msg->data.req->request.opaque, dropped);
+    }
+
+    void sendUpstreamMessage(BinaryMessage *msg, size_t conn = 0) {
+        if (merging) {
+            size_t source;
+            if (!merger.route(msg, source)) {
+                if (verbosity) {
+                    cerr << "Dropping response for unknown source: "
+                         << msg->toString() << endl;
+                }
+                delete msg;
+                return;
+            }
+            respond(source, msg);
+            return;
+        }
+
+        if (fanout) {
+            size_t group = conn / groupSize;
+            switch (acks.answer(msg->data.res->response.opaque, group,
+                                ntohs(msg->data.res->response.status))) {
+            case FanoutAcks::ACK_UNKNOWN:
+                // Everyone else got the same message, so only pass on
+                // the one from the first destination
+                if (group != 0) {
+                    delete msg;
+                    return;
+                }
+                break;
+            case FanoutAcks::ACK_HELD:
+                delete msg;
+                return;
+            case FanoutAcks::ACK_RELEASED:
+                break;
+            }
+        }
+        respond(0, msg);
+    }
+
+    /**
+     * Register that the source waits for an ack of a message. The acks
+     * are passed on to the source in the order of the calls, whatever
+     * order the destinations answer them in.
+     */
+    void awaitAck(size_t source, BinaryMessage *msg) {
+        sources[source].sequencer.expect(msg->data.req->request.opcode,
+                                         msg->data.req->request.opaque);
+    }
+
+    /**
+     * Count the ack the source waits for, if msg asks for one
+     */
+    void expectResponse(size_t source, BinaryMessage *msg) {
+        if (msg->isTapAckRequested()) {
+            ++sources[source].owed;
+        }
+    }
+
+    /**
+     * Get the number of acks the source still waits for on the
+     * current connection
+     */
+    size_t getOwedAcks(size_t source) const {
+        return sources[source].owed;
+    }
+
+    /**
+     * Send the responses of a source to another connection. Whatever
+     * was still due to the failed one is dropped with it.
+     */
+    void replaceUpstream(size_t source, BinaryMessagePipe *pipe) {
+        Source &src = sources[source];
+        src.pipe = pipe;
+        src.owed = 0;
+        src.sequencer.clear();
+        if (source == 0) {
+            upstream = pipe;
+        }
+        if (src.plugged || (!merging && source == 0 && inputPlugged)) {
+            pipe->plugInput();
+        }
+    }
+
+    /**
+     * Try to resume the stream of a source after its connection failed
+     * (or the source closed it)
+     */
+    bool resume(size_t source, bool eof) {
+        return !aborting && !sources[source].closed &&
+            migration->resume(source, eof);
+    }
+
+    /**
+     * Try to replace the failed connection conn to a destination
+     */
+    bool redial(size_t conn) {
+        return !aborting && !dropped[conn / groupSize] &&
+            migration->redial(conn);
+    }
+
+    /**
+     * Hold back the upstream while the connection conn is down. The
+     * messages for it wait in the queue of the failed pipe.
+     */
+    void suspendDownstream(size_t conn) {
+        if (redialing[conn]) {
+            return;
+        }
+        redialing[conn] = true;
+        if (throttles(conn / groupSize)) {
+            ++numCongested;
+        }
+        if (!merging && !inputPlugged && numCongested > 0) {
+            upstream->plugInput();
+            inputPlugged = true;
+        }
+    }
+
+    /**
+     * Hold back the sources while the capture (-O) is behind
+     */
+    void holdForCapture() {
+        if (captureBehind) {
+            return;
+        }
+        captureBehind = true;
+        if (merging) {
+            updateSourceFlow();
+        } else {
+            ++numCongested;
+            if (!inputPlugged) {
+                upstream->plugInput();
+                inputPlugged = true;
+            }
+        }
+        migration->waitForCapture();
+    }
+
+    /**
+     * The capture caught up, so let the sources go again
+     */
+    void releaseCapture() {
+        captureBehind = false;
+        if (merging) {
+            updateSourceFlow();
+        } else {
+            --numCongested;
+            if (inputPlugged && numCongested == 0 && !closed) {
+                upstream->unPlugInput();
+                inputPlugged = false;
+            }
+        }
+    }
+
+    /**
+     * Send the messages for the connection conn to another pipe
+     */
+    void replaceDownstream(size_t conn, BinaryMessagePipe *pipe) {
+        downstream[conn] = pipe;
+        if (!redialing[conn]) {
+            return;
+        }
+        redialing[conn] = false;
+        if (throttles(conn / groupSize)) {
+            --numCongested;
+        }
+        if (!merging && inputPlugged && numCongested == 0 && !closed) {
+            upstream->unPlugInput();
+            inputPlugged = false;
+        }
+    }
+
+    void incrementPendingDownstream(size_t conn = 0, size_t size = 0) {
+        if (!upstream) {
+            return;
+        }
+
+        size_t group = conn / groupSize;
+        if (dropped[group]) {
+            return;
+        }
+
+        if (group == 0) {
+            pendingBytes += size;
+            if (share != NULL && !overShare &&
+                pendingBytes > share->getShare()) {
+                overShare = true;
+                ++numCongested;
+            }
+        }
+
+        pendingSendCount++;
+        if (++groupPending[group] > maxGroupPending[group]) {
+            maxGroupPending[group] = groupPending[group];
+        }
+        if (++pending[conn] > PENDING_SEND_HI_WAT && !congested[conn]) {
+            congested[conn] = true;
+            if (++groupCongested[group] == groupSize && throttles(group)) {
+                ++numCongested;
+            }
+        }
+
+        if (group != 0 && policy == REPLICA_DROP &&
+            groupPending[group] > dropLimit) {
+            std::stringstream ss;
+            ss << groupPending[group] << " messages behind";
+            dropGroup(group, ss.str());
+            return;
+        }
+
+        if (!merging && !inputPlugged && numCongested > 0) {
+            upstream->plugInput();
+            inputPlugged = true;
+        }
+    }
+
+    /**
+     * Count the size of a message already counted by
+     * incrementPendingDownstream() before its size was known
+     */
+    void addPendingBytes(size_t conn, size_t size) {
+        if (!upstream || conn / groupSize != 0 || dropped[0]) {
+            return;
+        }
+
+        pendingBytes += size;
+        if (share != NULL && !overShare && pendingBytes > share->getShare()) {
+            overShare = true;
+            ++numCongested;
+            if (!merging && !inputPlugged) {
+                upstream->plugInput();
+                inputPlugged = true;
+            }
+        }
+    }
+
+    void decrementPendingDownstream(size_t conn = 0, size_t size = 0) {
+        if (!upstream) {
+            return;
+        }
+
+        size_t group = conn / groupSize;
+        if (dropped[group]) {
+            return;
+        }
+
+        if (group == 0) {
+            pendingBytes -= size;
+            if (overShare && pendingBytes < share->getShare() / 2) {
+                overShare = false;
+                --numCongested;
+            }
+        }
+
+        pendingSendCount--;
+        --groupPending[group];
+        if (--pending[conn] < PENDING_SEND_LO_WAT && congested[conn]) {
+            congested[conn] = false;
+            if (groupCongested[group]-- == groupSize && throttles(group)) {
+                --numCongested;
+            }
+        }
+
+        if (!merging && inputPlugged && numCongested == 0 && !closed) {
+            upstream->unPlugInput();
+            inputPlugged = false;
+        }
+        saveBackfilled();
+        checkDone();
+    }
+
+    void messageSent(BinaryMessage *msg, size_t conn) {
+        size_t group = conn / groupSize;
+        ++sent[group];
+        sentBytes[group] += msg->size;
+        release(msg, conn);
+    }
+
+    /**
+     * A message was replaced by a newer one for the same key while
+     * waiting to be sent
+     */
+    void messageCoalesced(BinaryMessage *msg, size_t conn) {
+        if (conn / groupSize == 0) {
+            ++coalesced;
+            coalescedBytes += msg->size;
+        }
+        release(msg, conn);
+    }
+
+    /**
+     * Release the resources held by a message leaving the downstream
+     * queue of the connection conn
+     */
+    void release(BinaryMessage *msg, size_t conn) {
+        decrementPendingDownstream(conn, msg->size);
+        if (merging && merger.sent(*msg, conn)) {
+            updateSourceFlow();
+            pump();
+        }
+    }
+
+    /**
+     * Plug the sources with more than their share of the window queued,
+     * and unplug those that have dropped to half of it
+     */
+    void updateSourceFlow() {
+        size_t sourceShare = merger.getWindow() /
+            std::max(openSources, static_cast<size_t>(1));
+        sourceShare = std::max(sourceShare,
+                               static_cast<size_t>(PENDING_SEND_LO_WAT));
+        for (size_t ii = 0; ii < sources.size(); ++ii) {
+            Source &src = sources[ii];
+            size_t backlog = merger.getBacklog(ii);
+            if (!src.plugged && !src.closed &&
+                (backlog > sourceShare || captureBehind)) {
+                src.pipe->plugInput();
+                src.plugged = true;
+            } else if (src.plugged && backlog < sourceShare / 2 &&
+                       !captureBehind) {
+                src.pipe->unPlugInput();
+                src.plugged = false;
+            }
+        }
+    }
+
+    void getSourceStats(std::ostream &out) {
+        for (size_t ii = 0; ii < sources.size(); ++ii) {
+            out << "Source " << sources[ii].pipe->getPeerName() << ": "
+                << merger.getBytes(ii) << " bytes sent" << endl;
+        }
+    }
+
+    /**
+     * Disconnect one of the replicas. The messages waiting to be sent
+     * to it are thrown away, and it no longer holds back any TAP acks.
+     */
+    void dropGroup(size_t group, const std::string &reason) {
+        if (dropped[group]) {
+            return;
+        }
+        dropped[group] = true;
+
+        cerr << "Dropping replica " << downstream[group * groupSize]->getPeerName()
+             << ": " << reason << endl;
+
+        for (size_t ii = group * groupSize; ii < (group + 1) * groupSize; ++ii) {
+            pendingSendCount -= pending[ii];
+            pending[ii] = 0;
+            congested[ii] = false;
+            downstream[ii]->discardMessages();
+            downstream[ii]->abort();
+        }
+        groupCongested[group] = 0;
+        groupPending[group] = 0;
+
+        vector<BinaryMessage*> released;
+        acks.drop(group, released);
+        for (size_t ii = 0; ii < released.size(); ++ii) {
+            respond(0, released[ii]);
+        }
+
+        if (inputPlugged && numCongested == 0 && !closed) {
+            upstream->unPlugInput();
+            inputPlugged = false;
+        }
+        checkDone();
+    }
+
+    /**
+     * Print how far each of the destinations are lagging behind
+     */
+    void getReplicaStats(std::ostream &out) {
+        uint64_t lead = *std::max_element(sent.begin(), sent.end());
+        for (size_t ii = 0; ii < dropped.size(); ++ii) {
+            out << (ii == 0 ? "Destination " : "Replica ")
+                << downstream[ii * groupSize]->getPeerName() << ": "
+                << sent[ii] << " messages (" << sentBytes[ii]
+                << " bytes) sent, " << lead - sent[ii]
+                << " behind the fastest, max backlog "
+                << maxGroupPending[ii];
+            if (dropped[ii]) {
+                out << " (dropped)";
+            }
+            out << endl;
+        }
+    }
+
+    void setDownstream(const vector<BinaryMessagePipe*> &_downstream) {
+        downstream = _downstream;
+    }
+
+    void abort() {
+        if (!aborting) {
+            cerr << "Downstream connection closed.. shutdown upstream" << endl;
+            aborting = true;
+            for (size_t ii = 0; ii < sources.size(); ++ii) {
+                sources[ii].pipe->abort();
+            }
+            // We may have been waiting for the final NOOPs
+            checkDone();
+        }
+    }
+
+    void close() {
+        if (share != NULL && !closed) {
+            // Let the others use our part of the window
+            share->leave();
+        }
+        if ((quiet || fencing) && !closed && !aborting) {
+            // The destinations may still be processing the quiet
+            // commands, and hold back their errors (or may still lose
+            // the messages in the retransmit windows)
+            for (size_t ii = 0; ii < downstream.size(); ++ii) {
+                if (!dropped[ii / groupSize] &&
+                    (!downstream[ii]->isClosed() || redialing[ii])) {
+                    BinaryMessage *noop = new NoopBinaryMessage(FINAL_FENCE_OPAQUE);
+                    incrementPendingDownstream(ii, noop->size);
+                    downstream[ii]->sendMessage(noop);
+                    ++draining;
+                }
+            }
+        }
+        closed = true;
+        checkDone();
+    }
+
+    void setListener(Migration *m, MigrationListener *l) {
+        migration = m;
+        listener = l;
+    }
+
+    void vbucketMoving(uint16_t vbucket) {
+        listener->vbucketMoving(*migration, vbucket);
+    }
+
+    void vbucketMoved(uint16_t vbucket) {
+        listener->vbucketMoved(*migration, vbucket);
+    }
+
+    bool isAborted() const {
+        return aborting;
+    }
+
+    void setFairShare(FairShare *s) {
+        share = s;
+        share->join();
+    }
+
+    /**
+     * Ack a message dropped by the transforms (filtered or expired) on
+     * behalf of the destinations, so that the source doesn't wait for it
+     */
+    void ackDropped(size_t source, BinaryMessage *msg) {
+        ++filtered;
+        ackMessage(source, msg);
+    }
+
+    /**
+     * Ack a message that isn't sent to the destinations, if the
+     * source asked for it. The ack still waits for the messages sent
+     * before it to be acked by the destinations.
+     */
+    void ackMessage(size_t source, BinaryMessage *msg) {
+        if (msg->isTapAckRequested()) {
+            awaitAck(source, msg);
+            respond(source, new ResponseBinaryMessage(msg->data.req->request.opcode,
+                                                      msg->data.req->request.opaque,
+                                                      PROTOCOL_BINARY_RESPONSE_SUCCESS));
+        }
+    }
+
+    uint64_t getSent() const {
+        return sent[0];
+    }
+
+    uint64_t getFiltered() const {
+        return filtered;
+    }
+
+    /**
+     * Send quiet commands to the destinations instead of TAP messages
+     */
+    void setQuiet() {
+        quiet = true;
+    }
+
+    bool isQuiet() const {
+        return quiet;
+    }
+
+    /**
+     * Called for every quiet command sent to the connection conn. A
+     * NOOP is sent after the commands for TAP messages requesting an
+     * ack (ackOpcode is the opcode of the TAP message), and the TAP ack
+     * is sent once the NOOP is answered. Otherwise a NOOP is sent
+     * every FENCE_INTERVAL commands, so that we see the errors.
+     */
+    void fence(size_t conn, uint8_t ackOpcode, uint32_t opaque) {
+        if (!fences.sent(conn, ackOpcode, opaque)) {
+            return;
+        }
+        BinaryMessage *noop = new NoopBinaryMessage(opaque);
+        incrementPendingDownstream(conn, noop->size);
+        downstream[conn]->sendMessage(noop);
+    }
+
+    /**
+     * Send a NOOP to the connection conn, to learn that the destination
+     * processed everything sent before it
+     */
+    void windowFence(size_t conn) {
+        BinaryMessage *noop = new NoopBinaryMessage(WINDOW_FENCE_OPAQUE);
+        incrementPendingDownstream(conn, noop->size);
+        downstream[conn]->sendMessage(noop);
+    }
+
+    /**
+     * Wait for the destinations to answer a NOOP once the sources are
+     * done, like in quiet mode, since the retransmit windows (-g) only
+     * cover the messages until then
+     */
+    void setFencing() {
+        fencing = true;
+    }
+
+    bool isFencing() const {
+        return fencing;
+    }
+
+    /**
+     * Ask the destinations for the state of every vbucket made active
+     * (-V), instead of validating them one by one after the migration
+     */
+    void setValidating() {
+        validating = true;
+    }
+
+    bool isValidating() const {
+        return validating;
+    }
+
+    /**
+     * Do we still need the responses of the destinations once the
+     * sources are done: the final NOOPs in quiet mode (or with -g), or
+     * the vbucket states (-V)
+     */
+    bool awaitsDestinations() const {
+        return quiet || fencing || validating;
+    }
+
+    /**
+     * Ask the destination behind the connection conn for the state of
+     * vbucket. The request follows the TAP_VBUCKET_SET making it
+     * active, so the answer tells whether the destination took it.
+     */
+    void requestState(size_t conn, uint16_t vbucket) {
+        BinaryMessage *req = validator.request(vbucket);
+        incrementPendingDownstream(conn, req->size);
+        downstream[conn]->sendMessage(req);
+    }
+
+    /**
+     * Handle the answer to a request sent by requestState()
+     */
+    void stateReceived(BinaryMessage *msg) {
+        validator.answered(*msg);
+        delete msg;
+        checkDone();
+    }
+
+    /**
+     * Look up the state of vbucket reported to requestState()
+     * @return false if it was never asked for (or never answered)
+     */
+    bool getState(uint16_t vbucket, vbucket_state_t &state,
+                  std::string &error) const {
+        return validator.getState(vbucket, state, error);
+    }
+
+    /**
+     * Handle the answer to a NOOP sent to the connection conn
+     * @return true if it was the last one, sent by close()
+     */
+    bool drained(uint32_t opaque, size_t conn) {
+        if (opaque != FINAL_FENCE_OPAQUE || draining == 0) {
+            return false;
+        }
+        // Nothing more to come from this destination (but the vbucket
+        // states requested after the NOOP, which checkDone() waits for)
+        if (!validating) {
+            downstream[conn]->plugInput();
+        }
+        --draining;
+        checkDone();
+        return true;
+    }
+
+    /**
+     * Handle a response from the destination in quiet mode: an error
+     * for one of the quiet commands, or the response to a NOOP
+     */
+    void quietResponse(BinaryMessage *msg, size_t conn) {
+        uint8_t opcode = msg->data.res->response.opcode;
+        uint16_t status = ntohs(msg->data.res->response.status);
+        uint32_t opaque = msg->data.res->response.opaque;
+        if (fences.failed(opcode, status) && verbosity) {
+            cerr << "Error from " << downstream[conn]->getPeerName()
+                 << ": " << msg->toString() << endl;
+        }
+        delete msg;
+
+        if (opcode == PROTOCOL_BINARY_CMD_NOOP && drained(opaque, conn)) {
+            return;
+        }
+
+        // Ack (or fail) the TAP message the NOOP was sent for
+        uint8_t ackOpcode = fences.answered(conn, opcode, opaque, status);
+        if (ackOpcode == 0) {
+            return;
+        }
+        sendUpstreamMessage(new ResponseBinaryMessage(ackOpcode, opaque,
+                                                      status), conn);
+    }
+
+    uint64_t getQuietErrors() const {
+        return fences.getErrors();
+    }
+
+    /**
+     * Record the vbuckets done backfilling in log. The destination has
+     * the data of the vbuckets as of when (the time the TAP streams
+     * were started).
+     */
+    void setBackfillLog(BackfillLog *log, uint64_t when) {
+        backfillLog = log;
+        backfillTime = when;
+    }
+
+    /**
+     * The source is done backfilling the vbucket. It is written to the
+     * log once everything received before is handed to the destinations.
+     */
+    void backfillClosed(uint16_t vbucket) {
+        if (backfillLog != NULL) {
+            backfilled.push_back(vbucket);
+            saveBackfilled();
+        }
+    }
+
+    void saveBackfilled() {
+        if (backfilled.empty() || pendingSendCount != 0) {
+            return;
+        }
+        try {
+            backfillLog->update(backfilled, backfillTime);
+        } catch (std::string &e) {
+            cerr << e << endl;
+        }
+        backfilled.clear();
+    }
+
+    uint64_t getCoalesced() const {
+        return coalesced;
+    }
+
+    uint64_t getCoalescedBytes() const {
+        return coalescedBytes;
+    }
+
+    uint64_t getSentBytes() const {
+        return sentBytes[0];
+    }
+
+    /**
+     * Mark a source as closed
+     * @return true if all of the sources are closed
+     */
+    bool closeSource(size_t source) {
+        if (!sources[source].closed) {
+            sources[source].closed = true;
+            --openSources;
+        }
+        if (openSources == 0) {
+            close();
+            return true;
+        }
+        // The others get a bigger share now
+        updateSourceFlow();
+        return false;
+    }
+
+    /**
+     * Add a source
+     * @return the index of the source
+     */
+    size_t addUpstream(BinaryMessagePipe *_upstream) {
+        sources.push_back(Source(_upstream));
+        merger.addSource();
+        upstream = sources[0].pipe;
+        merging = sources.size() > 1;
+        ++openSources;
+        return sources.size() - 1;
+    }
+
+    int getPendingSendCount() {
+        return pendingSendCount;
+    }
+
+    void dumpMessages(std::ostream &out) {
+        for (size_t ii = 0; ii < sources.size(); ++ii) {
+            sources[ii].pipe->dumpMessages(out);
+            merger.dumpMessages(ii, out);
+        }
+    }
+
+private:
+    class Source {
+    public:
+        Source(BinaryMessagePipe *p) :
+            pipe(p), plugged(false), closed(false), owed(0)
+        { }
+
+        BinaryMessagePipe *pipe;
+        /** Holds back the acks answered out of order */
+        AckSequencer sequencer;
+        bool plugged;
+        bool closed;
+        /** The acks the source waits for on the current connection */
+        size_t owed;
+    };
+
+    /**
+     * Send a response to a source. The TAP acks are held back until
+     * the messages the source sent before are acked too.
+     */
+    void respond(size_t source, BinaryMessage *msg) {
+        Source &src = sources[source];
+        if (!src.sequencer.answer(msg->data.res->response.opaque,
+                                  ntohs(msg->data.res->response.status))) {
+            deliver(src, msg);
+            return;
+        }
+        delete msg;
+        while ((msg = src.sequencer.next()) != NULL) {
+            deliver(src, msg);
+        }
+    }
+
+    void deliver(Source &src, BinaryMessage *msg) {
+        if (src.owed > 0) {
+            --src.owed;
+        }
+        src.pipe->sendMessage(msg);
+    }
+
+    /**
+     * Tell the listener once the sources are closed and everything
+     * is sent (or we gave up)
+     */
+    void checkDone() {
+        if (closed && !done &&
+            ((pendingSendCount == 0 && draining == 0 &&
+              validator.getAwaiting() == 0) || aborting)) {
+            done = true;
+            if (validating && !aborting) {
+                // Every vbucket state is in, and nothing else is
+                // expected from the destinations
+                for (size_t ii = 0; ii < downstream.size(); ++ii) {
+                    downstream[ii]->plugInput();
+                }
+            }
+            if (listener != NULL) {
+                listener->migrationDone(*migration);
+            }
+        }
+    }
+
+    /**
+     * Should the congestion of this destination throttle the source?
+     */
+    bool throttles(size_t group) const {
+        return group == 0 || policy == REPLICA_STALL;
+    }
+
+    BinaryMessagePipe *upstream;
+    vector<BinaryMessagePipe*> downstream;
+    int pendingSendCount;
+    vector<int> pending;
+    vector<bool> congested;
+    /** The connections waiting to be replaced by Migration::redial() */
+    vector<bool> redialing;
+    size_t groupSize;
+    vector<size_t> groupCongested;
+    size_t numCongested;
+    bool closed;
+    bool inputPlugged;
+    bool aborting;
+
+    bool fanout;
+    ReplicaPolicy policy;
+    size_t dropLimit;
+    vector<bool> dropped;
+    vector<size_t> groupPending;
+    vector<size_t> maxGroupPending;
+    vector<uint64_t> sent;
+    vector<uint64_t> sentBytes;
+    FanoutAcks acks;
+
+    bool merging;
+    vector<Source> sources;
+    MergeScheduler merger;
+    size_t openSources;
+
+    FairShare *share;
+    size_t pendingBytes;
+    bool overShare;
+    uint64_t filtered;
+    uint64_t coalesced;
+    uint64_t coalescedBytes;
+    bool quiet;
+    QuietFences fences;
+    bool fencing;
+    bool validating;
+    /** The vbucket states reported by the destinations (-V) */
+    StateValidator validator;
+    /** The connections yet to answer the final NOOP */
+    size_t draining;
+    /** The sources are held back until the capture catches up */
+    bool captureBehind;
+    BackfillLog *backfillLog;
+    uint64_t backfillTime;
+    /** The vbuckets done backfilling, but not written to the log yet */
+    std::vector<uint16_t> backfilled;
+
+    Migration *migration;
+    MigrationListener *listener;
+    bool done;
+};
+
+class DownstreamBinaryMessagePipeCallback : public BinaryMessagePipeCallback {
+public:
+    DownstreamBinaryMessagePipeCallback(UpstreamController *_upstream,
+                                        size_t _conn = 0, size_t _groupSize = 1,
+                                        ReplicaPolicy _policy = REPLICA_STALL) :
+        upstream(_upstream), conn(_conn), groupSize(_groupSize),
+        policy(_policy), aborting(false), moved(0), window(NULL),
+        replaying(0)
+    {
+        // Empty
+    }
+
+    void messageReceived(BinaryMessage *msg) {
+        if (window != NULL) {
+            window->answered(msg->data.res->response.opcode,
+                             msg->data.res->response.opaque);
+        }
+        if (msg->data.res->response.opcode == PROTOCOL_BINARY_CMD_GET_VBUCKET) {
+            upstream->stateReceived(msg);
+        } else if (upstream->isQuiet()) {
+            upstream->quietResponse(msg, conn);
+        } else if (msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_NOOP) {
+            // Ignore NOOP responses, except for the last one
+            upstream->drained(msg->data.res->response.opaque, conn);
+            delete msg;
+        } else {
+            if (verbosity > 1) {
+                std::cout << "Received message from downstream server: "
+                          << msg->toString() << std::endl;
+            }
+            upstream->sendUpstreamMessage(msg, conn);
+        }
+    }
+
+    void messageCoalesced(BinaryMessage *msg) {
+        upstream->messageCoalesced(msg, conn);
+    }
+
+    void messageSent(BinaryMessage *msg) {
+        if (window != NULL) {
+            window->sent(*msg);
+        }
+        if (replaying > 0) {
+            // Sent again after reconnecting, and counted the first time
+            --replaying;
+            return;
+        }
+        upstream->messageSent(msg, conn);
+        if (window != NULL && window->needsFence()) {
+            window->fenceQueued();
+            upstream->windowFence(conn);
+        }
+
+        uint8_t opcode = msg->data.req->request.opcode;
+        if (opcode == PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET) {
+            if (msg->size - sizeof(msg->data.vs->bytes) == sizeof(vbucket_state_t)) {
+                // test the state thing..
+                vbucket_state_t state;
+                memcpy(&state, msg->data.rawBytes + sizeof(msg->data.vs->bytes),
+                       sizeof(state));
+                state = static_cast<vbucket_state_t>(ntohl(state));
+                if (state == vbucket_state_pending) {
+                    upstream->vbucketMoving(msg->getVBucketId());
+                } else if (state == vbucket_state_active) {
+                    ++moved;
+                    upstream->vbucketMoved(msg->getVBucketId());
+                    // Every destination gets the takeover of its own
+                    // vbuckets (the replicas never do)
+                    if (upstream->isValidating()) {
+                        upstream->requestState(conn, msg->getVBucketId());
+                    }
+                } else if (!is_valid_vbucket_state_t(state)) {
+                    cerr << "Illegal vbucket state received: "
+                         << state << endl;
+                }
+            } else {
+                cerr << "Incorrect message size for TAP_VBUCKET_SET: " <<
+                    msg->size - sizeof(msg->data.vs->bytes) << endl;
+            }
+        }
+    }
+
+    void abort() {
+        if (!aborting) {
+            aborting = true;
+            if (dropReplica("connection failed")) {
+                return;
+            }
+            cerr << "An error occured on the downstream connection.." << endl;
+            markcomplete();
+            upstream->abort();
+        }
+    }
+
+    bool reconnect() {
+        return !aborting && upstream->redial(conn);
+    }
+
+    void shutdown() {
+        if (!aborting && upstream->redial(conn)) {
+            return;
+        }
+        aborting = true;
+        if (dropReplica("connection closed")) {
+            return;
+        }
+        markcomplete();
+        upstream->abort();
+    }
+
+    /**
+     * A failing replica is dropped rather than failing the entire
+     * migration if the policy permits it.
+     * @return true if the replica was dropped
+     */
+    bool dropReplica(const std::string &reason) {
+        size_t group = conn / groupSize;
+        if (group == 0 || !upstream->isFanout() || policy != REPLICA_DROP) {
+            return false;
+        }
+        upstream->dropGroup(group, reason);
+        return true;
+    }
+
+    size_t getMoved() const {
+        return moved;
+    }
+
+    /**
+     * Keep the messages sent in w, to send them again over a new
+     * connection if this one fails
+     */
+    void setWindow(RetransmitWindow *w) {
+        window = w;
+    }
+
+    /**
+     * The next count messages sent are the ones sent again after
+     * reconnecting, in addition to those of an earlier attempt that
+     * failed before they were sent (and are moved along)
+     */
+    void addReplaying(size_t count) {
+        replaying += count;
+    }
+
+private:
+    UpstreamController *upstream;
+    size_t conn;
+    size_t groupSize;
+    ReplicaPolicy policy;
+    bool aborting;
+    size_t moved;
+    RetransmitWindow *window;
+    size_t replaying;
+};
+
+/**
+ * The callback for the connections to the sources. The transforms are
+ * applied by the TransformingUpstreamCallback subclass, so that the
+ * per message code can be specialized for the transforms in use.
+ */
+class UpstreamBinaryMessagePipeCallback : public BinaryMessagePipeCallback,
+                                          public MessageProcessor,
+                                          public StageCallback {
+public:
+    UpstreamBinaryMessagePipeCallback(UpstreamController *_controller,
+                                      const vector<uint16_t> &_buckets) :
+        BinaryMessagePipeCallback(), controller(_controller),
+        buckets(_buckets), stage(NULL), copies(1), groupSize(1), source(0),
+        numVBuckets(0), rekeyed(false), quiet(false), capture(NULL), captureOnly(false),
+        exporter(NULL), journal(NULL), received(0), aborting(false)
+    {
+        // EMPTY
+    }
+
+    void messageSent(BinaryMessage *msg) {
+        if (verbosity > 1) {
+            std::cout << "Message from downstream sent upstream: "
+                      << msg->toString() << std::endl;
+        }
+    }
+
+    void messageProcessed(BinaryMessage *msg, bool keep) {
+        if (keep) {
+            send(msg, true);
+        } else {
+            decrementPending(msg, 0);
+            discard(msg);
+        }
+    }
+
+    void incrementPending(BinaryMessage *msg, size_t size) {
+        size_t conn = getConnection(msg);
+        for (size_t ii = 0; ii < copies; ++ii) {
+            controller->incrementPendingDownstream(conn + ii * groupSize,
+                                                   size);
+        }
+    }
+
+    void decrementPending(BinaryMessage *msg, size_t size) {
+        size_t conn = getConnection(msg);
+        for (size_t ii = 0; ii < copies; ++ii) {
+            controller->decrementPendingDownstream(conn + ii * groupSize,
+                                                   size);
+        }
+    }
+
+    size_t getConnection(BinaryMessage *msg) const {
+        // All messages for a vbucket use the same connection to
+        // preserve the ordering within the vbucket
+        return routes[msg->getVBucketId()];
+    }
+
+    /**
+     * Send a message to the destinations
+     * @param ack does the source wait for an ack of the message
+     * @return the opaque the destinations answer the message with
+     */
+    uint32_t forward(BinaryMessage *msg, bool ack) {
+        size_t conn = getConnection(msg);
+        if (controller->isMerging()) {
+            return controller->enqueue(source, conn, msg, ack);
+        }
+
+        uint32_t opaque = msg->data.req->request.opaque;
+        if (copies == 1) {
+            downstream[conn]->sendMessage(msg);
+            return opaque;
+        }
+
+        // Fan out to all of the destinations still alive
+        vector<size_t> live;
+        for (size_t ii = 0; ii < copies; ++ii) {
+            if (!controller->isDropped(ii)) {
+                live.push_back(conn + ii * groupSize);
+            }
+        }
+
+        if (msg->isTapAckRequested()) {
+            controller->expectAck(msg);
+        }
+
+        vector<BinaryMessage*> shares;
+        SharedBinaryMessage::share(msg, live.size(), shares);
+        for (size_t ii = 0; ii < live.size(); ++ii) {
+            downstream[live[ii]]->sendMessage(shares[ii]);
+        }
+        return opaque;
+    }
+
+    /**
+     * Send every message to all of the n destinations, each using
+     * groupSize connections
+     */
+    void setFanout(size_t n, size_t _groupSize) {
+        copies = n;
+        groupSize = _groupSize;
+    }
+
+    /**
+     * Set the downstream connections, and the index of the connection
+     * to use for each vbucket
+     */
+    void setDownstream(const vector<BinaryMessagePipe*> &_downstream,
+                       const vector<uint32_t> &_routes) {
+        downstream = _downstream;
+        routes = _routes;
+    }
+
+    void replaceDownstream(size_t conn, BinaryMessagePipe *pipe) {
+        downstream[conn] = pipe;
+    }
+
+    void setStage(ParallelStage *_stage) {
+        stage = _stage;
+    }
+
+    void setSource(size_t _source) {
+        source = _source;
+    }
+
+    /**
+     * Send the mutations and deletions as quiet SETQ and DELETEQ
+     * commands instead of TAP messages
+     */
+    void setQuiet(bool q) {
+        quiet = q;
+    }
+
+    /**
+     * Record every message from the source in the capture. With only
+     * set the messages aren't sent anywhere else.
+     */
+    void setCapture(CaptureWriter *c, bool only) {
+        capture = c;
+        captureOnly = only;
+    }
+
+    /**
+     * Write the items to the snapshots instead of sending them to the
+     * destinations
+     */
+    void setExport(SnapshotExporter *e) {
+        exporter = e;
+    }
+
+    /**
+     * Keep the progress of the vbuckets in the journal
+     */
+    void setJournal(ProgressJournal *j) {
+        journal = j;
+    }
+
+    /**
+     * Move the items to the vbucket of their key in a cluster with n
+     * vbuckets (or keep their vbucket if n is 0)
+     * @param rekey do the transforms rewrite the keys (-p)
+     */
+    void setResharding(size_t n, bool rekey) {
+        numVBuckets = n;
+        rekeyed = n != 0 && rekey;
+        resharder = ReshardTransform(n);
+    }
+
+    void completeMe() {
+        markcomplete();
+        controller->close();
+    }
+
+    void abort() {
+        if (!aborting) {
+            aborting = true;
+            vector<BinaryMessagePipe*>::iterator iter;
+            for (iter = downstream.begin(); iter != downstream.end(); ++iter) {
+                (*iter)->abort();
+            }
+            completeMe();
+        }
+    }
+
+    bool reconnect() {
+        return controller->resume(source, false);
+    }
+
+    /**
+     * Get the number of bytes received from the source, over all of
+     * the connections
+     */
+    uint64_t getReceived() const {
+        return received;
+    }
+
+    void shutdown() {
+        // The source may have closed the stream since it is going away
+        if (controller->resume(source, true)) {
+            return;
+        }
+        // The other sources still need the responses from downstream
+        if (!controller->closeSource(source)) {
+            return;
+        }
+        // In quiet mode (or with -g) we still wait for the responses
+        // to the final NOOPs, and with -V for the vbucket states
+        if (!controller->awaitsDestinations()) {
+            vector<BinaryMessagePipe*>::iterator iter;
+            for (iter = downstream.begin(); iter != downstream.end(); ++iter) {
+                (*iter)->plugInput();
+                (*iter)->updateEvent();
+            }
+        }
+        markcomplete();
+    }
+
+protected:
+    /**
+     * Check that we asked for the message
+     * @return false if the message was deleted
+     */
+    bool admit(BinaryMessage *msg) {
+        if (verbosity > 1) {
+            std::cout << "Received message from upstream server: "
+                      << msg->toString() << std::endl;
+        }
+
+        // Some messages are connection bound and not vbucket bound..
+        switch (msg->data.req->request.opcode) {
+        case PROTOCOL_BINARY_CMD_NOOP:
+            if (captureOnly) {
+                delete msg;
+                return false;
+            }
+            return true;
+        case PROTOCOL_BINARY_CMD_TAP_OPAQUE:
+            if (msg->getTapOpaqueCommand() == TAP_OPAQUE_CLOSE_BACKFILL) {
+                controller->backfillClosed(msg->getVBucketId());
+                if (journal != NULL) {
+                    journal->backfilled(msg->getVBucketId());
+                }
+            }
+            controller->expectResponse(source, msg);
+            return record(msg);
+        default:
+            ;
+        }
+        if (!std::binary_search(buckets.begin(), buckets.end(),
+                                msg->getVBucketId())) {
+            std::cerr << "Internal server error!!" << std::endl
+                      << "Received a message for a bucket I didn't request:"
+                      << msg->toString()
+                      << std::endl;
+            delete msg;
+            return false;
+        }
+
+        controller->expectResponse(source, msg);
+        received += msg->size;
+        if (journal != NULL) {
+            journal->received(msg->getVBucketId(), msg->size);
+            try {
+                journal->update(time(NULL));
+            } catch (std::string &e) {
+                cerr << e << endl;
+            }
+        }
+
+        // The messages are captured the way the source sent them
+        if (!record(msg)) {
+            return false;
+        }
+
+        if (numVBuckets != 0 &&
+            resharder.handles(msg->data.req->request.opcode)) {
+            resharder.apply(msg);
+        }
+        return true;
+    }
+
+    /**
+     * Move a message to the vbucket of its key once the transforms
+     * rewrote it (-n with -p), before it is routed. A message from the
+     * stage is counted on the connection of the vbucket it was
+     * submitted with, so the count follows it. (The stage keeps the
+     * messages of a key in order, since they all had the same vbucket.)
+     */
+    void rehash(BinaryMessage *msg, bool staged) {
+        if (!rekeyed || !resharder.handles(msg->data.req->request.opcode)) {
+            return;
+        }
+        size_t from = getConnection(msg);
+        resharder.apply(msg);
+        size_t to = getConnection(msg);
+        if (staged && to != from) {
+            for (size_t ii = 0; ii < copies; ++ii) {
+                controller->incrementPendingDownstream(to + ii * groupSize, 0);
+                controller->decrementPendingDownstream(from + ii * groupSize, 0);
+            }
+        }
+    }
+
+    /**
+     * Append the message to the capture file, if there is one
+     * @return false if the message was deleted since there are no
+     *         destinations to send it to
+     */
+    bool record(BinaryMessage *msg) {
+        if (capture == NULL) {
+            return true;
+        }
+        if (!capture->append(msg->data.rawBytes, msg->size)) {
+            controller->holdForCapture();
+        }
+        if (!captureOnly) {
+            return true;
+        }
+        controller->ackMessage(source, msg);
+        delete msg;
+        return false;
+    }
+
+    /**
+     * Hand the message to the stage, if there is one
+     * @return false if the message must be processed right away
+     */
+    bool submit(BinaryMessage *msg) {
+        if (stage == NULL) {
+            return false;
+        }
+        // The size is counted once the stage is done with the message
+        incrementPending(msg, 0);
+        stage->submit(msg);
+        return true;
+    }
+
+    /**
+     * Count the size of a message, and send it to the destinations.
+     * The message itself is already counted if it went through the
+     * stage (its size may have changed there).
+     */
+    void send(BinaryMessage *msg, bool staged) {
+        rehash(msg, staged);
+        if (exporter != NULL) {
+            snapshot(msg, staged);
+            return;
+        }
+
+        uint8_t ackOpcode = 0;
+        bool ack = msg->isTapAckRequested();
+        if (ack) {
+            controller->awaitAck(source, msg);
+        }
+        if (quiet) {
+            if (ack) {
+                ackOpcode = msg->data.req->request.opcode;
+                if (copies > 1) {
+                    controller->expectAck(msg);
+                }
+            }
+            translateQuiet(msg);
+        }
+
+        size_t conn = getConnection(msg);
+        if (staged) {
+            controller->addPendingBytes(conn, msg->size);
+        } else {
+            incrementPending(msg, msg->size);
+        }
+        // The NOOPs carry the opaque the destinations know the message by
+        uint32_t opaque = forward(msg, ack);
+
+        if (quiet) {
+            for (size_t ii = 0; ii < copies; ++ii) {
+                if (!controller->isDropped(ii)) {
+                    controller->fence(conn + ii * groupSize, ackOpcode, opaque);
+                }
+            }
+        }
+    }
+
+    /**
+     * Write an item to the snapshot of its vbucket. The other messages
+     * of the dump are of no use to the snapshots.
+     */
+    void snapshot(BinaryMessage *msg, bool staged) {
+        if (staged) {
+            decrementPending(msg, 0);
+        }
+        if (msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
+            uint64_t cas = 0;
+            const unsigned char *bytes =
+                reinterpret_cast<const unsigned char*>(&msg->data.req->request.cas);
+            for (size_t ii = 0; ii < sizeof(cas); ++ii) {
+                cas = (cas << 8) | bytes[ii];
+            }
+            exporter->add(msg->getVBucketId(), msg->getKeyBytes(),
+                          msg->getKeyLength(), msg->getValueBytes(),
+                          static_cast<uint32_t>(msg->getValueLength()),
+                          ntohl(msg->data.mutation->message.body.item.flags),
+                          ntohl(msg->data.mutation->message.body.item.expiration),
+                          cas, msg->data.req->request.datatype);
+        }
+        controller->ackMessage(source, msg);
+        delete msg;
+    }
+
+    /**
+     * Get rid of a message dropped by the transforms. The messages
+     * before it have already been handed to the downstream pipes, so
+     * its ack is queued behind theirs.
+     */
+    void discard(BinaryMessage *msg) {
+        controller->ackDropped(source, msg);
+        delete msg;
+    }
+
+private:
+    vector<BinaryMessagePipe*> downstream;
+    vector<uint32_t> routes;
+    UpstreamController *controller;
+    vector<uint16_t> buckets;
+    ParallelStage *stage;
+    size_t copies;
+    size_t groupSize;
+    size_t source;
+    size_t numVBuckets;
+    bool rekeyed;
+    ReshardTransform resharder;
+    bool quiet;
+    CaptureWriter *capture;
+    bool captureOnly;
+    SnapshotExporter *exporter;
+    ProgressJournal *journal;
+    uint64_t received;
+    bool aborting;
+};
+
+/**
+ * Applies the transforms T (a TransformPipeline or NoTransform) to the
+ * messages from the source. With NoTransform the messages are
+ * forwarded as they are.
+ */
+template <class T>
+class TransformingUpstreamCallback : public UpstreamBinaryMessagePipeCallback {
+public:
+    TransformingUpstreamCallback(UpstreamController *_controller,
+                                 const vector<uint16_t> &_buckets,
+                                 T &t) :
+        UpstreamBinaryMessagePipeCallback(_controller, _buckets),
+        transforms(t)
+    {
+        // EMPTY
+    }
+
+    void messageReceived(BinaryMessage *msg) {
+        if (!admit(msg) || submit(msg)) {
+            return;
+        }
+        if (transforms.apply(msg)) {
+            send(msg, false);
+        } else {
+            discard(msg);
+        }
+    }
+
+    /**
+     * Called on the worker threads when a stage is in use
+     */
+    bool process(BinaryMessage *msg) {
+        return transforms.apply(msg);
+    }
+
+private:
+    T &transforms;
+};
+
+
+static MigrationListener defaultListener;
+static NoTransform noTransform;
+
+/**
+ * The timer connecting to a lost source (or destination) again
+ */
+class Migration::Reconnection {
+public:
+    Reconnection(Migration *m, size_t i, bool d) :
+        migration(m), index(i), destination(d), attempts(0),
+        connected(time(NULL)), scheduled(false)
+    { }
+
+    Migration *migration;
+    /** The source, or the connection to a destination */
+    size_t index;
+    bool destination;
+    struct event ev;
+    /** The attempts since the connection was last stable */
+    size_t attempts;
+    time_t connected;
+    bool scheduled;
+};
+
+void MigrationListener::vbucketMoving(Migration &migration, uint16_t vbucket) {
+    (void)migration;
+    cout << "Starting to move bucket " << vbucket << endl;
+    cout.flush();
+}
+
+void MigrationListener::vbucketMoved(Migration &migration, uint16_t vbucket) {
+    (void)migration;
+    cout << "Bucket " << vbucket << " moved to the next server" << endl;
+    cout.flush();
+}
+
+/**
+ * The callback of an idle connection in the cache
+ */
+class ConnectionCache::Connection : public BinaryMessagePipeCallback {
+public:
+    Connection(BinaryMessagePipe *p, Socket *s) :
+        pipe(p), sock(s), dead(false)
+    { }
+
+    ~Connection() {
+        delete pipe;
+        delete sock;
+    }
+
+    void messageReceived(BinaryMessage *msg) {
+        // Late responses from the previous migration
+        delete msg;
+    }
+
+    void abort() {
+        dead = true;
+    }
+
+    void shutdown() {
+        dead = true;
+    }
+
+    BinaryMessagePipe *pipe;
+    Socket *sock;
+    bool dead;
+};
+
+static string cacheKey(const string &host, const string &auth,
+                       const string &passwd) {
+    string key(host);
+    key.append(1, '\0');
+    key.append(auth);
+    key.append(1, '\0');
+    key.append(passwd);
+    return key;
+}
+
+ConnectionCache::~ConnectionCache() {
+    multimap<string, Connection*>::iterator iter;
+    for (iter = idle.begin(); iter != idle.end(); ++iter) {
+        iter->second->pipe->close();
+        delete iter->second;
+    }
+}
+
+bool ConnectionCache::acquire(const string &host, const string &auth,
+                              const string &passwd, BinaryMessagePipe *&pipe,
+                              Socket *&sock) {
+    purge();
+    multimap<string, Connection*>::iterator iter;
+    iter = idle.find(cacheKey(host, auth, passwd));
+    if (iter == idle.end()) {
+        return false;
+    }
+
+    Connection *conn = iter->second;
+    idle.erase(iter);
+    pipe = conn->pipe;
+    sock = conn->sock;
+    conn->pipe = NULL;
+    conn->sock = NULL;
+    delete conn;
+    return true;
+}
+
+void ConnectionCache::release(const string &host, const string &auth,
+                              const string &passwd, BinaryMessagePipe *pipe,
+                              Socket *sock) {
+    purge();
+    Connection *conn = new Connection(pipe, sock);
+    pipe->setCallback(*conn);
+    // Keep reading so that we notice if the server closes it
+    pipe->unPlugInput();
+    idle.insert(make_pair(cacheKey(host, auth, passwd), conn));
+}
+
+void ConnectionCache::purge() {
+    multimap<string, Connection*>::iterator iter = idle.begin();
+    while (iter != idle.end()) {
+        if (iter->second->dead) {
+            iter->second->pipe->close();
+            delete iter->second;
+            idle.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+bool MigrationSpec::parseOption(int opt, const char *arg) throw (std::string) {
+    switch (opt) {
+    case 'R':
+        replicas.push_back(arg);
+        break;
+    case 'L':
+        if (strcmp(arg, "stall") == 0) {
+            policy = REPLICA_STALL;
+        } else if (strncmp(arg, "drop", 4) == 0 &&
+                   (arg[4] == '\0' || arg[4] == ':')) {
+            policy = REPLICA_DROP;
+            if (arg[4] == ':') {
+                dropLimit = atoi(arg + 5);
+            }
+        } else {
+            throw string("Unknown replica policy: ") + arg;
+        }
+        break;
+    case 'm':
+        vbmapFile.assign(arg);
+        break;
+    case 'n':
+        numVBuckets = strtoul(arg, NULL, 10);
+        // The hash only has 15 bits
+        if (numVBuckets == 0 || numVBuckets > 0x8000 ||
+            (numVBuckets & (numVBuckets - 1)) != 0) {
+            throw string("The number of vbuckets must be a power of two"
+                         " between 1 and 32768: ") + arg;
+        }
+        break;
+    case 'c':
+        connections = atoi(arg);
+        if (connections == 0) {
+            throw string("The number of connections must be at least 1");
+        }
+        break;
+    case 'E':
+        hasExpiry = true;
+        expiry = strtoul(arg, NULL, 10);
+        break;
+    case 'f':
+        hasFlags = true;
+        flags = strtoul(arg, NULL, 10);
+        break;
+    case 's':
+        dropExpired = true;
+        expirySkew = strtoul(arg, NULL, 10);
+        break;
+    case 'z':
+        compress = true;
+        compressThreshold = strtoul(arg, NULL, 10);
+        break;
+    case 'i':
+        includePrefixes.push_back(arg);
+        break;
+    case 'x':
+        excludePrefixes.push_back(arg);
+        break;
+    case 'I':
+        includePatterns.push_back(arg);
+        break;
+    case 'X':
+        excludePatterns.push_back(arg);
+        break;
+    case 'p':
+        {
+            const char *colon = strchr(arg, ':');
+            if (colon == NULL || colon == arg) {
+                throw string("Invalid key prefix rewrite (use from:to): ") +
+                    arg;
+            }
+            keyPrefixes.push_back(make_pair(string(arg, colon - arg),
+                                            string(colon + 1)));
+        }
+        break;
+    case 'A':
+        tapAck = true;
+        break;
+    case 'd':
+        destinations.push_back(arg);
+        break;
+    case 'h':
+    case 'l':
+        // The -b options before the first -h belong to it
+        if (!hosts.empty()) {
+            sourceBuckets.resize(hosts.size() + 1);
+        }
+        hosts.push_back(arg);
+        loads.push_back(opt == 'l');
+        break;
+    case 'b':
+        parseBuckets(sourceBuckets.back(), arg);
+        break;
+    case 't':
+        takeover = true;
+        break;
+    case 'C':
+        coalesce = true;
+        break;
+    case 'q':
+        quiet = true;
+        break;
+    case 'J':
+        backfillLog.assign(arg);
+        break;
+    case 'U':
+        backfillMargin = strtoul(arg, NULL, 10);
+        break;
+    case 'O':
+        capturePath.assign(arg);
+        break;
+    case 'o':
+        exportDir.assign(arg);
+        break;
+    case 'S':
+        journalPath.assign(arg);
+        break;
+    case 'G':
+        relay = true;
+        break;
+    case 'g':
+        retransmitWindow = strtoul(arg, NULL, 10);
+        if (retransmitWindow == 0) {
+            throw string("Invalid retransmit window: ") + arg;
+        }
+        break;
+    case 'y':
+        replaySpeed = strtod(arg, NULL);
+        if (replaySpeed <= 0) {
+            throw string("Invalid replay speed: ") + arg;
+        }
+        break;
+    case 'N':
+        name.assign(arg);
+        break;
+    case 'F':
+        flush = true;
+        break;
+    case 'V':
+        validate = true;
+        break;
+    case 'r':
+        registeredTapClient = true;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+void MigrationSpec::resolve() throw (std::string) {
+    if (vbmapFile.empty()) {
+        return;
+    }
+    if (!destinations.empty()) {
+        throw string("-d can't be combined with a vbucket map");
+    }
+
+    map<uint16_t, string> vbmap;
+    ifstream in(vbmapFile.c_str());
+    if (!in.good()) {
+        throw "Failed to open vbucket map: " + vbmapFile;
+    }
+    parseVBucketMap(vbmap, in);
+
+    // When re-sharding the map is the one of the new cluster, and the
+    // vbuckets to read are given with -b
+    vector<uint16_t> all;
+    for (size_t ii = 0; ii < numVBuckets; ++ii) {
+        all.push_back(static_cast<uint16_t>(ii));
+    }
+
+    vector<uint16_t> &buckets = numVBuckets != 0 ? all : sourceBuckets[0];
+    if (buckets.empty()) {
+        map<uint16_t, string>::iterator iter;
+        for (iter = vbmap.begin(); iter != vbmap.end(); ++iter) {
+            buckets.push_back(iter->first);
+        }
+    }
+
+    vector<uint16_t>::iterator iter;
+    for (iter = buckets.begin(); iter != buckets.end(); ++iter) {
+        if (vbmap.find(*iter) == vbmap.end()) {
+            stringstream ss;
+            ss << "vbucket " << *iter << " is not in the vbucket map";
+            throw ss.str();
+        }
+        vector<string>::iterator d;
+        d = std::find(destinations.begin(), destinations.end(), vbmap[*iter]);
+        vbdest[*iter] = d - destinations.begin();
+        if (d == destinations.end()) {
+            destinations.push_back(vbmap[*iter]);
+        }
+    }
+}
+
+Migration::Migration(const MigrationSpec &s) throw (std::string) :
+    spec(s), routes(0x10000, 0), base(NULL), started(false), cache(NULL),
+    listener(&defaultListener), controller(NULL), transforms(NULL),
+    expired(NULL), compressor(NULL), backfill(s.backfillLog), capture(NULL),
+    exporter(NULL), journal(NULL), resumedBytes(0), resumes(0),
+    resumeFailed(false), redialed(0), replayed(0), replayedBytes(0),
+    relayed(NULL), captureScheduled(false)
+{
+    if (spec.hosts.empty()) {
+        throw string("You need to specify the host to migrate data from");
+    }
+
+    if (spec.hosts.size() > MAX_SOURCES) {
+        throw string("Too many hosts to migrate from");
+    }
+
+    // The specs built without parseOption only have servers
+    spec.loads.resize(spec.hosts.size(), false);
+
+    for (size_t ii = 0; ii < spec.sourceBuckets.size(); ++ii) {
+        vector<uint16_t> &b = spec.sourceBuckets[ii];
+        sort(b.begin(), b.end());
+        b.erase(unique(b.begin(), b.end()), b.end());
+        buckets.insert(buckets.end(), b.begin(), b.end());
+    }
+
+    if (spec.hosts.size() > 1) {
+        if (spec.destinations.size() > 1 || !spec.replicas.empty()) {
+            throw string("Multiple hosts can't be combined with -m or -R");
+        }
+        for (size_t ii = 0; ii < spec.hosts.size(); ++ii) {
+            if (spec.sourceBuckets.size() <= ii ||
+                spec.sourceBuckets[ii].empty()) {
+                throw "Please specify the buckets to migrate from " +
+                    spec.hosts[ii] + " by using -b";
+            }
+        }
+        vector<uint16_t> all(buckets);
+        sort(all.begin(), all.end());
+        vector<uint16_t>::iterator dup;
+        dup = std::adjacent_find(all.begin(), all.end());
+        if (dup != all.end()) {
+            stringstream ss;
+            ss << "vbucket " << *dup << " is specified for more than one host";
+            throw ss.str();
+        }
+    }
+
+    if (!spec.exportDir.empty()) {
+        // A snapshot is taken of everything the source has now
+        if (!spec.destinations.empty() || !spec.vbmapFile.empty() ||
+            !spec.replicas.empty() || !spec.backfillLog.empty() ||
+            find(spec.loads.begin(), spec.loads.end(),
+                 true) != spec.loads.end()) {
+            throw string("Exporting can't be combined with -d, -m, -R, -J"
+                         " or -l");
+        }
+    }
+
+    if (spec.relay && spec.destinations.empty()) {
+        throw string("Relaying (-G) needs a destination");
+    }
+
+    if (spec.destinations.empty()) {
+        if (spec.capturePath.empty() && spec.exportDir.empty()) {
+            throw string("Can't perform bucket migration without a destination host");
+        }
+        // The vbuckets can't be handed over to a capture file
+        if (spec.takeover || spec.flush) {
+            throw string("Capturing or exporting without a destination"
+                         " can't be combined with -t or -F");
+        }
+    }
+
+    if (!spec.replicas.empty()) {
+        if (spec.destinations.size() != 1) {
+            throw string("Replicas can't be combined with a vbucket map");
+        }
+        if (spec.takeover) {
+            throw string("Replicas can't be used in takeover mode");
+        }
+        if (spec.replicas.size() >= 32) {
+            throw string("Too many replicas");
+        }
+    }
+
+    if (buckets.empty()) {
+        throw string("Please specify the buckets to migrate by using -b");
+    }
+
+    sort(buckets.begin(), buckets.end());
+    buckets.erase(unique(buckets.begin(), buckets.end()), buckets.end());
+
+    // The vbucket states can't be set with the quiet commands
+    if (spec.quiet && spec.takeover) {
+        throw string("Quiet mode can't be combined with takeover");
+    }
+
+    // A capture has no vbuckets to hand over, and no notion of time
+    // to backfill from
+    bool loading = find(spec.loads.begin(), spec.loads.end(),
+                        true) != spec.loads.end();
+    if (loading && (spec.takeover || !spec.backfillLog.empty())) {
+        throw string("Loading a capture can't be combined with -t or -J");
+    }
+    if (spec.replaySpeed > 0 && !loading) {
+        throw string("Only the captures loaded with -l can be replayed");
+    }
+
+    if (!spec.backfillLog.empty()) {
+        backfill.load();
+    }
+
+    if (spec.relay) {
+        relayed = new RelayStats;
+    }
+
+    if (!spec.journalPath.empty()) {
+        journal = new ProgressJournal(spec.journalPath, spec.name);
+        try {
+            journal->load();
+        } catch (string &e) {
+            delete journal;
+            journal = NULL;
+            throw;
+        }
+    }
+
+    // When re-sharding the messages are routed by their new vbucket
+    vector<uint16_t> targets;
+    if (spec.numVBuckets != 0) {
+        if (spec.takeover) {
+            throw string("Re-sharding can't be combined with takeover");
+        }
+        for (size_t ii = 0; ii < spec.numVBuckets; ++ii) {
+            targets.push_back(static_cast<uint16_t>(ii));
+        }
+    } else {
+        targets = buckets;
+    }
+
+    // Each destination use a range of connections, and the vbuckets
+    // are spread over the connections to their destination
+    expected.resize(spec.destinations.size(), 0);
+    for (vector<uint16_t>::iterator iter = targets.begin();
+         iter != targets.end() && !spec.destinations.empty(); ++iter) {
+        size_t dest = 0;
+        map<uint16_t, size_t>::const_iterator d = spec.vbdest.find(*iter);
+        if (d != spec.vbdest.end()) {
+            dest = d->second;
+        }
+        routes[*iter] = dest * spec.connections + (*iter % spec.connections);
+        ++expected[dest];
+    }
+
+    // The routes only cover the first destination in fan-out mode
+    destinations = spec.destinations;
+    destinations.insert(destinations.end(), spec.replicas.begin(),
+                        spec.replicas.end());
+
+    // The expired items are dropped before we spend any time on them,
+    // and the filters go next, since they look at the original keys
+    transforms = new TransformPipeline;
+    if (spec.numVBuckets != 0 || spec.quiet) {
+        transforms->add(new VBucketStateFilter);
+    }
+    if (spec.dropExpired) {
+        expired = new ExpiredItemTransform(spec.expirySkew);
+        transforms->add(expired);
+    }
+    if (!spec.includePrefixes.empty() || !spec.excludePrefixes.empty() ||
+        !spec.includePatterns.empty() || !spec.excludePatterns.empty()) {
+        try {
+            transforms->add(new KeyFilterTransform(spec.includePrefixes,
+                                                   spec.excludePrefixes,
+                                                   spec.includePatterns,
+                                                   spec.excludePatterns));
+        } catch (string &e) {
+            delete transforms;
+            throw;
+        }
+    }
+    for (size_t ii = 0; ii < spec.keyPrefixes.size(); ++ii) {
+        transforms->add(new KeyPrefixTransform(spec.keyPrefixes[ii].first,
+                                               spec.keyPrefixes[ii].second));
+    }
+    if (spec.hasExpiry) {
+        transforms->add(new ExpiryTransform(spec.expiry));
+    }
+    if (spec.hasFlags) {
+        transforms->add(new FlagsTransform(spec.flags));
+    }
+    // The values are compressed once everything else is done
+    if (spec.compress) {
+        try {
+            compressor = new CompressTransform(spec.compressThreshold);
+        } catch (string &e) {
+            delete transforms;
+            throw;
+        }
+        transforms->add(compressor);
+    }
+}
+
+void Migration::start(struct event_base *b, WorkerPool *pool,
+                      FairShare *share,
+                      ConnectionCache *c) throw (std::string, std::runtime_error)
+{
+    base = b;
+    cache = c;
+    size_t connections = spec.connections;
+    // The statistics of the first destination are kept (empty) when
+    // there are none, since we only capture the messages
+    controller = new UpstreamController(max(destinations.size(),
+                                            static_cast<size_t>(1)),
+                                        connections);
+    controller->setListener(this, listener);
+    if (!spec.capturePath.empty()) {
+        capture = new CaptureWriter(spec.capturePath);
+        evtimer_set(&captureEvent, captureHandler, this);
+        event_base_set(base, &captureEvent);
+    }
+    if (spec.quiet) {
+        controller->setQuiet();
+    }
+    if (spec.retransmitWindow > 0) {
+        controller->setFencing();
+    }
+    if (spec.takeover && spec.validate) {
+        controller->setValidating();
+    }
+    if (!spec.exportDir.empty()) {
+        exporter = new SnapshotExporter(spec.exportDir);
+        if (!exporter->getError().empty()) {
+            throw exporter->getError();
+        }
+        // Every vbucket gets a snapshot, even an empty one
+        if (spec.numVBuckets != 0) {
+            for (size_t ii = 0; ii < spec.numVBuckets; ++ii) {
+                exporter->open(static_cast<uint16_t>(ii));
+            }
+        } else {
+            for (size_t ii = 0; ii < buckets.size(); ++ii) {
+                exporter->open(buckets[ii]);
+            }
+        }
+    }
+
+    for (size_t ii = 0; ii < spec.hosts.size(); ++ii) {
+        UpstreamBinaryMessagePipeCallback *cb;
+        if (transforms->empty()) {
+            cb = new TransformingUpstreamCallback<NoTransform>(
+                controller, spec.sourceBuckets[ii], noTransform);
+        } else {
+            cb = new TransformingUpstreamCallback<TransformPipeline>(
+                controller, spec.sourceBuckets[ii], *transforms);
+        }
+        cb->setResharding(spec.numVBuckets, !spec.keyPrefixes.empty());
+        cb->setQuiet(spec.quiet);
+        cb->setCapture(capture, destinations.empty() && exporter == NULL);
+        cb->setExport(exporter);
+        cb->setJournal(journal);
+        upstream.push_back(cb);
+    }
+
+    for (size_t ii = 0; ii < destinations.size() * connections; ++ii) {
+        downstream.push_back(new DownstreamBinaryMessagePipeCallback(controller,
+                                                                     ii,
+                                                                     connections,
+                                                                     spec.policy));
+    }
+
+    if (!spec.replicas.empty()) {
+        controller->setFanout(spec.policy, spec.dropLimit);
+        upstream[0]->setFanout(destinations.size(), connections);
+    }
+
+    // The sources share the worker pool, but each has its own stage to
+    // keep the ordering within the stream. Without any transforms
+    // there's nothing for the workers to do.
+    if (pool != NULL && !transforms->empty()) {
+        for (size_t ii = 0; ii < upstream.size(); ++ii) {
+            stages.push_back(new ParallelStage("rewrite", *pool,
+                                               *upstream[ii], *upstream[ii],
+                                               base));
+            upstream[ii]->setStage(stages.back());
+        }
+    }
+
+    for (size_t ii = 0; ii < destinations.size() * connections; ++ii) {
+        // The flush only needs to be sent on one of the connections
+        // to each destination
+        Socket *sock = NULL;
+        BinaryMessagePipe *pipe = NULL;
+        // The connections to the relay receivers aren't cached, since
+        // they can't be used by the migrations without -G
+        if (spec.relay || cache == NULL ||
+            !cache->acquire(destinations[ii / connections], spec.auth,
+                            spec.passwd, pipe, sock)) {
+            pipe = getServer(destinations[ii / connections], *downstream[ii],
+                             sock, spec.relay);
+        } else {
+            pipe->setCallback(*downstream[ii]);
+        }
+        pipe->setCoalescing(spec.coalesce);
+        downstreamPipes.push_back(pipe);
+        downstreamSockets.push_back(sock);
+        if (spec.retransmitWindow > 0) {
+            windows.push_back(new RetransmitWindow(spec.retransmitWindow,
+                                                   FENCE_INTERVAL));
+            downstream[ii]->setWindow(windows.back());
+            Reconnection *r = new Reconnection(this, ii, true);
+            evtimer_set(&r->ev, reconnectHandler, r);
+            event_base_set(base, &r->ev);
+            redials.push_back(r);
+        }
+        if (spec.flush && (ii % connections) == 0) {
+            pipe->sendMessage(new FlushBinaryMessage);
+        }
+    }
+    for (size_t ii = 0; ii < spec.hosts.size(); ++ii) {
+        Socket *sock = NULL;
+        if (spec.loads[ii]) {
+            upstreamPipes.push_back(getLoader(ii, sock));
+            reconnections.push_back(NULL);
+        } else {
+            loaders.push_back(NULL);
+            upstreamPipes.push_back(getServer(spec.hosts[ii], *upstream[ii],
+                                              sock));
+            Reconnection *r = new Reconnection(this, ii, false);
+            evtimer_set(&r->ev, reconnectHandler, r);
+            event_base_set(base, &r->ev);
+            reconnections.push_back(r);
+        }
+        upstreamSockets.push_back(sock);
+    }
+
+    controller->setDownstream(downstreamPipes);
+    uint64_t now = time(NULL);
+    if (!spec.backfillLog.empty()) {
+        controller->setBackfillLog(&backfill, now);
+    }
+    // The source picks up where the earlier runs left the checkpoint
+    bool resuming = journal != NULL && spec.registeredTapClient &&
+        !spec.name.empty() && journal->getPreviousBytes() > 0;
+    if (resuming) {
+        resumedBytes = journal->getPreviousBytes();
+        if (verbosity) {
+            cout << "Resuming stream " << spec.name << " after "
+                 << journal->getPreviousMessages() << " messages ("
+                 << resumedBytes << " bytes) received by earlier runs"
+                 << endl;
+        }
+    }
+    for (size_t ii = 0; ii < spec.hosts.size(); ++ii) {
+        BinaryMessagePipe *upstreamPipe = upstreamPipes[ii];
+        upstream[ii]->setDownstream(downstreamPipes, routes);
+        upstream[ii]->setSource(controller->addUpstream(upstreamPipe));
+        if (loaders[ii] != NULL) {
+            loaders[ii]->setSpeed(spec.replaySpeed);
+            loaders[ii]->start();
+            continue;
+        }
+
+        // Only ask for the changes made since the last run (with some
+        // margin for the clocks of the servers)
+        uint64_t since = backfill.getSince(spec.sourceBuckets[ii]);
+        if (since != 0 && resuming &&
+            journal->isBackfilled(spec.sourceBuckets[ii])) {
+            // An earlier run got through the backfill, and the
+            // checkpoint has everything after it
+            since = 0;
+            if (verbosity) {
+                cout << "Not backfilling from " << spec.hosts[ii]
+                     << " again, resuming from its checkpoint" << endl;
+            }
+        }
+        if (since != 0) {
+            since = since > spec.backfillMargin ? since - spec.backfillMargin : 1;
+            if (verbosity) {
+                cout << "Backfilling from " << spec.hosts[ii] << " since "
+                     << since << " (" << now - since << " seconds ago)"
+                     << endl;
+            }
+        }
+        requestStream(ii, since);
+    }
+
+    if (share != NULL) {
+        controller->setFairShare(share);
+    }
+
+    if (spec.flush) {
+        for (size_t ii = 0; ii < destinations.size(); ++ii) {
+            controller->incrementPendingDownstream(ii * connections);
+        }
+    }
+    started = true;
+}
+
+int Migration::finish(int status) {
+    size_t connections = spec.connections;
+
+    if (verbosity) {
+        for (size_t ii = 0; ii < stages.size(); ++ii) {
+            stages[ii]->getStats(cout);
+        }
+        if (controller->isFanout()) {
+            controller->getReplicaStats(cout);
+        }
+        if (controller->isMerging()) {
+            controller->getSourceStats(cout);
+        }
+        if (compressor != NULL) {
+            compressor->getStats(cout);
+        }
+        if (spec.relay) {
+            RelayStats stats(*relayed);
+            for (size_t ii = 0; ii < downstreamPipes.size(); ++ii) {
+                stats.add(static_cast<RelayPipe*>(downstreamPipes[ii])->getSent());
+            }
+            cout << "Relayed " << stats.messages << " messages ("
+                 << stats.bytes << " bytes) in " << stats.frames
+                 << " frames (" << stats.wireBytes << " bytes)" << endl;
+        }
+        if (spec.coalesce) {
+            cout << "Coalesced " << controller->getCoalesced()
+                 << " messages (" << controller->getCoalescedBytes()
+                 << " bytes)" << endl;
+        }
+    }
+    if (expired != NULL && expired->getDropped() > 0) {
+        expired->getStats(cout, verbosity > 0);
+    }
+
+    // Only the connection owning a vbucket sees its TAP_VBUCKET_SET
+    size_t moved = 0;
+    for (size_t ii = 0; ii < spec.destinations.size(); ++ii) {
+        size_t destMoved = 0;
+        for (size_t jj = 0; jj < connections; ++jj) {
+            destMoved += downstream[ii * connections + jj]->getMoved();
+        }
+        if (spec.takeover && spec.destinations.size() > 1 &&
+            destMoved != expected[ii]) {
+            cerr << "Did not move enough vbuckets to " << destinations[ii]
+                 << ": " << destMoved << "/" << expected[ii] << endl;
+        }
+        moved += destMoved;
+    }
+
+    if (spec.takeover && moved != buckets.size()) {
+        cerr << "Did not move enough vbuckets in takeover: "
+             << moved << "/" << buckets.size() << endl;
+        status = status == 0 ? EX_SOFTWARE : status;
+    }
+
+    if (capture != NULL) {
+        if (!capture->close()) {
+            cerr << "Failed to capture the messages: " << capture->getError()
+                 << endl;
+            status = status == 0 ? EX_IOERR : status;
+        } else if (verbosity) {
+            cout << "Captured " << capture->getRecords() << " messages ("
+                 << capture->getBytes() << " bytes) in "
+                 << capture->getSegments() << " segments" << endl;
+        }
+    }
+
+    if (exporter != NULL) {
+        if (!exporter->close()) {
+            cerr << "Failed to export the vbuckets: " << exporter->getError()
+                 << endl;
+            status = status == 0 ? EX_IOERR : status;
+        } else if (verbosity) {
+            cout << "Exported " << exporter->getItems() << " items of "
+                 << exporter->getVBuckets() << " vbuckets to "
+                 << spec.exportDir << " (" << exporter->getRuns()
+                 << " runs spilled to disk)" << endl;
+        }
+    }
+
+    for (size_t ii = 0; ii < loaders.size(); ++ii) {
+        CaptureLoader *loader = loaders[ii];
+        if (loader == NULL) {
+            continue;
+        }
+        if (!loader->getError().empty()) {
+            cerr << "Failed to load " << spec.hosts[ii] << ": "
+                 << loader->getError() << endl;
+            status = status == 0 ? EX_IOERR : status;
+        } else if (verbosity) {
+            cout << "Loaded " << loader->getRecords() << " messages ("
+                 << loader->getBytes() << " bytes) from " << spec.hosts[ii]
+                 << endl;
+        }
+        if (spec.replaySpeed > 0) {
+            cout << "Replay of " << spec.hosts[ii] << " at "
+                 << spec.replaySpeed << "x fell behind schedule by "
+                 << loader->getMaxLag() / 1000 << " ms at most ("
+                 << loader->getAverageLag() / 1000 << " ms on average, "
+                 << loader->getLag() / 1000 << " ms at the end)" << endl;
+        }
+    }
+
+    if (resumes > 0 || resumedBytes > 0) {
+        cout << "Resumed stream " << spec.name << " (" << resumes
+             << " reconnections), without receiving " << resumedBytes
+             << " bytes again" << endl;
+    }
+    if (redialed > 0) {
+        cout << "Reconnected to the destinations " << redialed
+             << " times, sending " << replayed << " messages ("
+             << replayedBytes << " bytes) again" << endl;
+    }
+    if (resumeFailed) {
+        status = status == 0 ? EX_IOERR : status;
+    }
+    if (journal != NULL) {
+        try {
+            journal->save();
+        } catch (std::string &e) {
+            cerr << e << endl;
+            status = status == 0 ? EX_IOERR : status;
+        }
+    }
+
+    if (controller->getQuietErrors() > 0) {
+        cerr << controller->getQuietErrors()
+             << " messages failed on the destination" << endl;
+        status = status == 0 ? EX_SOFTWARE : status;
+    }
+
+    if (controller->getPendingSendCount() != 0) {
+        cerr << "Had " << controller->getPendingSendCount()
+             << " pending messages at exit." << endl;
+        controller->dumpMessages(cerr);
+        status = status == 0 ? EX_SOFTWARE : status;
+    }
+
+    // Validate all takeovers..
+    if (status == 0 && spec.takeover && spec.validate) {
+        if (verbosity) {
+            cout << "Validate bucket states" << std::endl;
+        }
+
+        unsigned int numSuccess = 0;
+        vector<uint16_t>::iterator iter;
+        for (iter = buckets.begin(); iter != buckets.end(); ++iter) {
+            BinaryMessagePipe *downstreamPipe;
+            downstreamPipe = downstreamPipes[routes[*iter]];
+
+            // The vbuckets were asked for as soon as they were made
+            // active, and only the ones never answered are asked here
+            vbucket_state_t state = vbucket_state_dead;
+            std::string msg;
+            bool known = controller->getState(*iter, state, msg);
+            if (!known && downstreamPipe->isClosed()) {
+                cerr << "\t" << *iter
+                     << " Failed to verify, pipe to "
+                     << downstreamPipe->toString() << " is closed!" << endl;
+                continue ;
+            }
+
+            try {
+                if (!known) {
+                    state = downstreamPipe->getVBucketState(*iter,
+                                                            timeout * 1000);
+                }
+                if (!msg.empty()) {
+                    // The destination failed the request
+                } else if (state != vbucket_state_active) {
+                    cerr << "Incorrect state for " << *iter
+                         << " at "
+                         << downstreamPipe->toString() << ": " << state << endl;
+                } else {
+                    ++numSuccess;
+                    if (verbosity) {
+                        cout << "\t" << *iter << " ok" << endl;
+                    }
+                }
+            } catch (std::string &e) {
+                msg = e;
+            } catch (std::exception &e) {
+                msg = e.what();
+            } catch (...) {
+                msg.assign("Unhandled exception");
+            }
+
+            if (msg.length()) {
+                cerr << "\t" << *iter << " Failed to verify: "
+                     << msg.c_str() << endl;
+            }
+        }
+
+        if (numSuccess != buckets.size() && status == 0) {
+            cerr << "Expected to move " << buckets.size()
+                 << " buckets, but moved " << numSuccess << std::endl;
+            status = EX_SOFTWARE;
+        }
+    }
+
+    // Loading the captures is done once all of them are sent, and a
+    // dump once the source sent everything
+    bool loading = find(spec.loads.begin(), spec.loads.end(),
+                        false) == spec.loads.end();
+    if (status == 0 && !spec.takeover && !loading && exporter == NULL) {
+        // It is only the takeover processes that should exit, so getting
+        // here would be some sort of a failure..
+        status = EX_SOFTWARE;
+    }
+
+    return status;
+}
+
+bool Migration::isIdle() const {
+    for (size_t ii = 0; ii < stages.size(); ++ii) {
+        if (!stages[ii]->isIdle()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Migration::~Migration() {
+    release();
+    delete transforms;
+    delete capture;
+    delete exporter;
+    delete journal;
+    delete relayed;
+}
+
+void Migration::release() {
+    bool reuse = started && cache != NULL && !controller->isAborted() &&
+        controller->getPendingSendCount() == 0 && !spec.relay;
+
+    for (size_t ii = 0; ii < upstreamPipes.size(); ++ii) {
+        upstreamPipes[ii]->close();
+        delete upstreamPipes[ii];
+        delete upstreamSockets[ii];
+    }
+    for (size_t ii = 0; ii < downstreamPipes.size(); ++ii) {
+        BinaryMessagePipe *pipe = downstreamPipes[ii];
+        size_t group = ii / spec.connections;
+        if (reuse && !pipe->isClosed() && !controller->isDropped(group)) {
+            cache->release(destinations[group], spec.auth, spec.passwd,
+                           pipe, downstreamSockets[ii]);
+        } else {
+            pipe->close();
+            delete pipe;
+            delete downstreamSockets[ii];
+        }
+    }
+    for (size_t ii = 0; ii < loaders.size(); ++ii) {
+        delete loaders[ii];
+    }
+    loaders.clear();
+    for (size_t ii = 0; ii < reconnections.size(); ++ii) {
+        if (reconnections[ii] != NULL && reconnections[ii]->scheduled) {
+            evtimer_del(&reconnections[ii]->ev);
+        }
+        delete reconnections[ii];
+    }
+    reconnections.clear();
+    if (captureScheduled) {
+        evtimer_del(&captureEvent);
+        captureScheduled = false;
+    }
+    for (size_t ii = 0; ii < redials.size(); ++ii) {
+        if (redials[ii]->scheduled) {
+            evtimer_del(&redials[ii]->ev);
+        }
+        delete redials[ii];
+        delete windows[ii];
+    }
+    redials.clear();
+    windows.clear();
+    upstreamPipes.clear();
+    upstreamSockets.clear();
+    downstreamPipes.clear();
+    downstreamSockets.clear();
+
+    for (size_t ii = 0; ii < stages.size(); ++ii) {
+        delete stages[ii];
+    }
+    stages.clear();
+    for (size_t ii = 0; ii < upstream.size(); ++ii) {
+        delete upstream[ii];
+    }
+    upstream.clear();
+    for (size_t ii = 0; ii < downstream.size(); ++ii) {
+        delete downstream[ii];
+    }
+    downstream.clear();
+    delete controller;
+    controller = NULL;
+}
+
+void Migration::getStats(std::ostream &out) const {
+    size_t moved = 0;
+    for (size_t ii = 0; ii < downstream.size(); ++ii) {
+        moved += downstream[ii]->getMoved();
+    }
+    out << controller->getSent() << " messages (" << controller->getSentBytes()
+        << " bytes) sent, ";
+    if (controller->getFiltered() > 0) {
+        out << controller->getFiltered() << " filtered, ";
+    }
+    if (expired != NULL && expired->getDropped() > 0) {
+        out << expired->getDropped() << " expired, ";
+    }
+    if (controller->getCoalesced() > 0) {
+        out << controller->getCoalesced() << " coalesced, ";
+    }
+    if (controller->getQuietErrors() > 0) {
+        out << controller->getQuietErrors() << " failed, ";
+    }
+    if (capture != NULL) {
+        out << capture->getRecords() << " captured, ";
+    }
+    if (exporter != NULL) {
+        out << exporter->getItems() << " exported, ";
+    }
+    if (resumes > 0) {
+        out << resumes << " resumed (" << resumedBytes << " bytes saved), ";
+    }
+    if (redialed > 0) {
+        out << replayed << " resent, ";
+    }
+    uint64_t loaded = 0;
+    for (size_t ii = 0; ii < loaders.size(); ++ii) {
+        if (loaders[ii] != NULL) {
+            loaded += loaders[ii]->getRecords();
+        }
+    }
+    if (loaded > 0) {
+        out << loaded << " loaded, ";
+    }
+    out << moved << "/" << buckets.size() << " vbuckets moved";
+}
+
+void Migration::requestStream(size_t source, uint64_t since) {
+    BinaryMessagePipe *pipe = upstreamPipes[source];
+    pipe->sendMessage(new TapRequestBinaryMessage(spec.name,
+                                                  spec.sourceBuckets[source],
+                                                  spec.takeover,
+                                                  spec.tapAck,
+                                                  spec.registeredTapClient,
+                                                  since,
+                                                  exporter != NULL));
+    pipe->updateEvent();
+}
+
+bool Migration::resume(size_t source, bool eof) {
+    // Only a registered client has a checkpoint to resume from, and the
+    // source closes a takeover or a dump once it is done
+    if (!spec.registeredTapClient || spec.name.empty() ||
+        reconnections[source] == NULL || exporter != NULL ||
+        (eof && spec.takeover)) {
+        return false;
+    }
+
+    Reconnection *r = reconnections[source];
+    if (r->scheduled) {
+        return true;
+    }
+    // An attempt that failed to connect has nothing to resume, and
+    // doesn't end the backoff
+    bool lost = upstreamPipes[source]->isConnected();
+    if (lost && time(NULL) - r->connected >= RECONNECT_STABLE) {
+        r->attempts = 0;
+    }
+    if (r->attempts == RECONNECT_ATTEMPTS) {
+        cerr << "Giving up on " << spec.hosts[source] << " after "
+             << RECONNECT_ATTEMPTS << " attempts to resume" << endl;
+        resumeFailed = true;
+        return false;
+    }
+
+    if (lost) {
+        // Starting over would receive all of it again
+        resumedBytes += upstream[source]->getReceived();
+        ++resumes;
+    }
+    long delay = min(RECONNECT_DELAY << r->attempts, RECONNECT_MAX_DELAY);
+    cerr << "Lost the connection to " << spec.hosts[source]
+         << ", resuming stream " << spec.name << " in " << delay << " ms"
+         << endl;
+    ++r->attempts;
+    scheduleReconnect(r, delay);
+    return true;
+}
+
+void Migration::scheduleReconnect(Reconnection *r, long delay) {
+    struct timeval tv = {delay / 1000, (delay % 1000) * 1000};
+    int event_add_rv = evtimer_add(&r->ev, &tv);
+    assert(event_add_rv != -1);
+    r->scheduled = true;
+}
+
+void Migration::reconnect(size_t source) {
+    Reconnection *r = reconnections[source];
+    r->scheduled = false;
+    if (controller->isAborted()) {
+        return;
+    }
+
+    // The acks for the old connection must not reach the new one
+    if (controller->getOwedAcks(source) > 0) {
+        scheduleReconnect(r, RECONNECT_POLL);
+        return;
+    }
+
+    Socket *sock = NULL;
+    BinaryMessagePipe *pipe = NULL;
+    try {
+        pipe = getServer(spec.hosts[source], *upstream[source], sock);
+    } catch (std::string &e) {
+        cerr << "Failed to reconnect to " << spec.hosts[source] << ": "
+             << e << endl;
+        if (r->attempts == RECONNECT_ATTEMPTS) {
+            cerr << "Giving up on " << spec.hosts[source] << " after "
+                 << RECONNECT_ATTEMPTS << " attempts to resume" << endl;
+            resumeFailed = true;
+            upstream[source]->abort();
+            return;
+        }
+        long delay = min(RECONNECT_DELAY << r->attempts, RECONNECT_MAX_DELAY);
+        ++r->attempts;
+        scheduleReconnect(r, delay);
+        return;
+    }
+
+    // The failed pipe is closed, and no longer in the event loop
+    delete upstreamPipes[source];
+    delete upstreamSockets[source];
+    upstreamPipes[source] = pipe;
+    upstreamSockets[source] = sock;
+    controller->replaceUpstream(source, pipe);
+    r->connected = time(NULL);
+    if (verbosity) {
+        cout << "Resuming stream " << spec.name << " from the checkpoint of "
+             << spec.hosts[source] << endl;
+    }
+    requestStream(source, 0);
+}
+
+bool Migration::redial(size_t conn) {
+    if (redials.empty()) {
+        return false;
+    }
+
+    Reconnection *r = redials[conn];
+    if (r->scheduled) {
+        return true;
+    }
+    const string &host = destinations[conn / spec.connections];
+    if (!windows[conn]->isComplete()) {
+        cerr << "Lost the connection to " << host << " with more than "
+             << spec.retransmitWindow << " bytes unacknowledged" << endl;
+        return false;
+    }
+    // A connection that never came up doesn't end the backoff
+    if (downstreamPipes[conn]->isConnected() &&
+        time(NULL) - r->connected >= RECONNECT_STABLE) {
+        r->attempts = 0;
+    }
+    if (r->attempts == RECONNECT_ATTEMPTS) {
+        cerr << "Giving up on " << host << " after " << RECONNECT_ATTEMPTS
+             << " attempts to reconnect" << endl;
+        resumeFailed = true;
+        return false;
+    }
+
+    long delay = min(RECONNECT_DELAY << r->attempts, RECONNECT_MAX_DELAY);
+    cerr << "Lost the connection to " << host << ", reconnecting in "
+         << delay << " ms" << endl;
+    if (downstreamPipes[conn]->isConnected()) {
+        // Only the connections lost count, not the attempts that
+        // failed to connect
+        ++redialed;
+    }
+    ++r->attempts;
+    controller->suspendDownstream(conn);
+    scheduleReconnect(r, delay);
+    return true;
+}
+
+void Migration::replaceDestination(size_t conn) {
+    Reconnection *r = redials[conn];
+    r->scheduled = false;
+    if (controller->isAborted()) {
+        return;
+    }
+
+    const string &host = destinations[conn / spec.connections];
+    Socket *sock = NULL;
+    BinaryMessagePipe *pipe = NULL;
+    try {
+        pipe = getServer(host, *downstream[conn], sock, spec.relay);
+    } catch (std::string &e) {
+        cerr << "Failed to reconnect to " << host << ": " << e << endl;
+        if (r->attempts == RECONNECT_ATTEMPTS) {
+            cerr << "Giving up on " << host << " after "
+                 << RECONNECT_ATTEMPTS << " attempts to reconnect" << endl;
+            resumeFailed = true;
+            downstream[conn]->abort();
+            return;
+        }
+        long delay = min(RECONNECT_DELAY << r->attempts, RECONNECT_MAX_DELAY);
+        ++r->attempts;
+        scheduleReconnect(r, delay);
+        return;
+    }
+
+    // Whatever the destination may have lost goes ahead of the
+    // messages that never made it to the failed connection. The new
+    // connection holds them until it is up, and if it fails first they
+    // are moved along to the next one.
+    vector<BinaryMessage*> replay;
+    windows[conn]->replay(replay);
+    uint64_t bytes = 0;
+    for (size_t ii = 0; ii < replay.size(); ++ii) {
+        bytes += replay[ii]->size;
+        pipe->sendMessage(replay[ii]);
+    }
+    downstream[conn]->addReplaying(replay.size());
+    downstreamPipes[conn]->moveMessages(*pipe);
+    pipe->setCoalescing(spec.coalesce);
+
+    // The failed pipe is closed, and no longer in the event loop
+    if (spec.relay) {
+        relayed->add(static_cast<RelayPipe*>(downstreamPipes[conn])->getSent());
+    }
+    delete downstreamPipes[conn];
+    delete downstreamSockets[conn];
+    downstreamPipes[conn] = pipe;
+    downstreamSockets[conn] = sock;
+    controller->replaceDownstream(conn, pipe);
+    for (size_t ii = 0; ii < upstream.size(); ++ii) {
+        upstream[ii]->replaceDownstream(conn, pipe);
+    }
+    r->connected = time(NULL);
+    replayed += replay.size();
+    replayedBytes += bytes;
+    if (verbosity) {
+        cout << "Reconnecting to " << host << ", sending " << replay.size()
+             << " messages (" << bytes << " bytes) again" << endl;
+    }
+}
+
+void Migration::reconnectHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    Reconnection *r = reinterpret_cast<Reconnection*>(arg);
+    if (r->destination) {
+        r->migration->replaceDestination(r->index);
+    } else {
+        r->migration->reconnect(r->index);
+    }
+}
+
+void Migration::waitForCapture() {
+    if (captureScheduled) {
+        return;
+    }
+    struct timeval tv = {0, CAPTURE_POLL * 1000};
+    int event_add_rv = evtimer_add(&captureEvent, &tv);
+    assert(event_add_rv != -1);
+    captureScheduled = true;
+}
+
+void Migration::captureHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    Migration *m = reinterpret_cast<Migration*>(arg);
+    m->captureScheduled = false;
+    if (m->capture->hasCaughtUp()) {
+        m->controller->releaseCapture();
+    } else {
+        m->waitForCapture();
+    }
+}
+
+BinaryMessagePipe *Migration::getLoader(size_t source,
+                                        Socket *&sock) throw (std::string)
+{
+    if (verbosity) {
+        cout << "Loading " << spec.hosts[source] << endl;
+    }
+    CaptureLoader *loader = new CaptureLoader(spec.hosts[source],
+                                              spec.sourceBuckets[source],
+                                              base);
+    loaders.push_back(loader);
+    sock = new Socket(loader->getSocket());
+    sock->setNonBlocking();
+    BinaryMessagePipe *ret = new BinaryMessagePipe(*sock, *upstream[source],
+                                                   base, timeout);
+    ret->updateEvent();
+    return ret;
+}
+
+BinaryMessagePipe *Migration::getServer(const string &host,
+                                        BinaryMessagePipeCallback &cb,
+                                        Socket *&sock,
+                                        bool relay) throw (std::string)
+{
+    BinaryMessagePipe* ret(NULL);
+    std::string msg;
+    sock = NULL;
+    try {
+        sock = new Socket(host);
+        if (verbosity) {
+            cout << "Connecting to " << *sock << endl;
+        }
+        // The event loop is shared with the other connections (and
+        // migrations), so the connection completes in the background
+        sock->connect(false);
+        sock->setKeepalive(true);
+        if (relay) {
+            // The receiver authenticates with the destination
+            ret = new RelayPipe(*sock, cb, base, timeout);
+        } else {
+            ret = new BinaryMessagePipe(*sock, cb, base, timeout);
+        }
+        if (spec.auth.length() > 0 && !relay) {
+            if (verbosity) {
+                cout << "Authenticating towards: " << *sock << endl;
+            }
+            ret->startAuthentication(spec.auth, spec.passwd);
+        }
+        ret->updateEvent();
+
+    } catch (std::string &e) {
+        msg = e;
+    } catch (std::exception &e) {
+        msg = e.what();
+    } catch (...) {
+        msg.assign("Unhandled exception");
+    }
+
+    if (msg.length() > 0) {
+        delete ret;
+        delete sock;
+        sock = NULL;
+        throw msg;
+    }
+
+    assert(ret);
+    return ret;
+}
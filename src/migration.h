@@ -0,0 +1,483 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef MIGRATION_H
+#define MIGRATION_H 1
+
+#include "config.h"
+#include <algorithm>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <event.h>
+
+#include "backfill.h"
+
+#ifndef evutil_socket_t
+#define evutil_socket_t int
+#endif
+
+#ifndef EX_SOFTWARE
+#define EX_SOFTWARE 70
+#endif
+
+extern uint8_t verbosity;
+extern unsigned int timeout;
+
+const int PENDING_SEND_LO_WAT = 128;
+const int PENDING_SEND_HI_WAT = 512;
+
+class BinaryMessage;
+class BinaryMessagePipe;
+class BinaryMessagePipeCallback;
+class Socket;
+class ParallelStage;
+class TransformPipeline;
+class ExpiredItemTransform;
+class CompressTransform;
+class CaptureWriter;
+class CaptureLoader;
+class SnapshotExporter;
+class ProgressJournal;
+class RetransmitWindow;
+class RelayStats;
+class WorkerPool;
+class UpstreamController;
+class UpstreamBinaryMessagePipeCallback;
+class DownstreamBinaryMessagePipeCallback;
+class Migration;
+
+/**
+ * What to do with a replica that can't keep up in fan-out mode
+ */
+enum ReplicaPolicy {
+    /** Throttle the source to the speed of the slowest replica */
+    REPLICA_STALL,
+    /** Disconnect replicas falling too far behind */
+    REPLICA_DROP
+};
+
+/**
+ * Divides a window of bytes in flight evenly between the migrations
+ * running on the same event loop, so that a bucket with more (or
+ * bigger) items can't starve the others.
+ */
+class FairShare {
+public:
+    FairShare(size_t w) : window(w), active(0) { }
+
+    void join() {
+        ++active;
+    }
+
+    void leave() {
+        --active;
+    }
+
+    /**
+     * Get the number of bytes each of the migrations may have in flight
+     */
+    size_t getShare() const {
+        size_t share = window / std::max(active, static_cast<size_t>(1));
+        return std::max(share, static_cast<size_t>(64 * 1024));
+    }
+
+private:
+    size_t window;
+    size_t active;
+};
+
+/**
+ * Receives the progress of a migration. The default implementation
+ * prints the vbucket state changes to stdout.
+ */
+class MigrationListener {
+public:
+    virtual ~MigrationListener() {}
+    virtual void vbucketMoving(Migration &migration, uint16_t vbucket);
+    virtual void vbucketMoved(Migration &migration, uint16_t vbucket);
+
+    /**
+     * Called once the migration has nothing more to send, or has
+     * failed. The migration may not be released from this callback.
+     */
+    virtual void migrationDone(Migration &migration) {
+        (void)migration;
+    }
+};
+
+/**
+ * Keeps idle, authenticated connections to the destinations so that
+ * the next migration to the same server doesn't have to connect and
+ * authenticate again. A cached connection closed by the server is
+ * dropped from the cache.
+ */
+class ConnectionCache {
+public:
+    ~ConnectionCache();
+
+    /**
+     * Get an idle connection to host authenticated as auth
+     * @return false if there is no such connection
+     */
+    bool acquire(const std::string &host, const std::string &auth,
+                 const std::string &passwd, BinaryMessagePipe *&pipe,
+                 Socket *&sock);
+
+    /**
+     * Hand an idle connection over to the cache
+     */
+    void release(const std::string &host, const std::string &auth,
+                 const std::string &passwd, BinaryMessagePipe *pipe,
+                 Socket *sock);
+
+    size_t size() {
+        purge();
+        return idle.size();
+    }
+
+private:
+    class Connection;
+
+    /**
+     * Delete the connections closed by the servers
+     */
+    void purge();
+
+    std::multimap<std::string, Connection*> idle;
+};
+
+/**
+ * Everything needed to run a single migration: where the vbuckets
+ * come from, where they go and how they are moved.
+ */
+class MigrationSpec {
+public:
+    MigrationSpec() :
+        sourceBuckets(1), numVBuckets(0), policy(REPLICA_STALL),
+        dropLimit(8 * PENDING_SEND_HI_WAT),
+        connections(1), takeover(false), tapAck(false),
+        registeredTapClient(false), flush(false), validate(false),
+        coalesce(false), quiet(false),
+        hasExpiry(false), hasFlags(false), expiry(0), flags(0),
+        dropExpired(false), expirySkew(0), compress(false),
+        compressThreshold(0), backfillMargin(300), replaySpeed(0),
+        retransmitWindow(0), relay(false)
+    { }
+
+    /**
+     * Apply one of the options describing a migration (-h, -l, -b, -d, -m,
+     * -n, -R, -L, -c, -A, -t, -C, -q, -N, -F, -V, -E, -f, -s, -z, -p,
+     * -i, -x, -I, -X, -J, -U, -S, -O, -o, -y, -g, -G and -r)
+     * @return false if opt isn't one of them
+     * @throw std::string if the argument is invalid
+     */
+    bool parseOption(int opt, const char *arg) throw (std::string);
+
+    /**
+     * Load the vbucket map given with -m, and pick the destination of
+     * each vbucket (of the new cluster when re-sharding)
+     * @throw std::string if the map is invalid or doesn't cover all
+     *                    of the vbuckets
+     */
+    void resolve() throw (std::string);
+
+    /** The name used in the messages about this migration */
+    std::string label;
+    /**
+     * The sources and the vbuckets to migrate from each of them. The
+     * sources flagged in loads are capture files to load (see -O)
+     * instead of servers.
+     */
+    std::vector<std::string> hosts;
+    std::vector<bool> loads;
+    std::vector<std::vector<uint16_t> > sourceBuckets;
+    /** The destinations, and the index of the destination per vbucket */
+    std::vector<std::string> destinations;
+    std::map<uint16_t, size_t> vbdest;
+    std::string vbmapFile;
+    /**
+     * The number of vbuckets of the destination cluster when re-sharding
+     * (the messages are moved to the vbucket of their key), or 0
+     */
+    size_t numVBuckets;
+    std::vector<std::string> replicas;
+    ReplicaPolicy policy;
+    size_t dropLimit;
+    size_t connections;
+    bool takeover;
+    bool tapAck;
+    bool registeredTapClient;
+    bool flush;
+    bool validate;
+    /** Replace the queued messages for a key with newer ones */
+    bool coalesce;
+    /** Send quiet SETQ/DELETEQ commands instead of the TAP messages */
+    bool quiet;
+    std::string name;
+    std::string auth;
+    std::string passwd;
+    bool hasExpiry;
+    bool hasFlags;
+    uint32_t expiry;
+    uint32_t flags;
+    /** Drop the items expired more than expirySkew seconds ago */
+    bool dropExpired;
+    uint32_t expirySkew;
+    /** Snappy compress the values of at least compressThreshold bytes */
+    bool compress;
+    size_t compressThreshold;
+    /**
+     * The file recording since when the destination has the data of
+     * each vbucket, and how far back to backfill before that
+     */
+    std::string backfillLog;
+    uint32_t backfillMargin;
+    /**
+     * Record the messages from the sources in this capture file, in
+     * addition to sending them to the destinations (if there are any)
+     */
+    std::string capturePath;
+    /**
+     * Load the captures with their original timing, speeded up by
+     * this factor (0 to load them as fast as possible)
+     */
+    double replaySpeed;
+    /**
+     * Dump the vbuckets to sorted, indexed snapshots in this directory
+     * instead of sending them to destinations
+     */
+    std::string exportDir;
+    /**
+     * The file keeping the progress of each vbucket, which tells how
+     * much a resumed stream didn't have to receive again
+     */
+    std::string journalPath;
+    /**
+     * The bytes kept per connection to a destination to send again
+     * after reconnecting, or 0 to fail when a destination is lost
+     */
+    size_t retransmitWindow;
+    /**
+     * The destinations are relay receivers (see -W), getting the
+     * messages in compressed batches
+     */
+    bool relay;
+    /** The key prefixes to replace, and their replacements */
+    std::vector<std::pair<std::string, std::string> > keyPrefixes;
+    /** The keys to migrate (by prefix or regular expression) */
+    std::vector<std::string> includePrefixes;
+    std::vector<std::string> includePatterns;
+    /** The keys not to migrate */
+    std::vector<std::string> excludePrefixes;
+    std::vector<std::string> excludePatterns;
+};
+
+/**
+ * A Migration owns the connections and the state of the TAP streams
+ * moving one set of vbuckets. Several migrations may share the same
+ * event loop (and worker pool).
+ */
+class Migration {
+public:
+    /**
+     * Validate the spec, and set up the transforms
+     * @throw std::string describing the problem with the spec
+     */
+    Migration(const MigrationSpec &spec) throw (std::string);
+
+    ~Migration();
+
+    /**
+     * Connect to all of the servers and start the TAP streams. The
+     * destinations are taken from the cache if possible. The
+     * connections complete in the event loop, where a failure to
+     * connect fails the migration like a lost connection.
+     * @throw std::string if we failed to start connecting to one of
+     *                    the servers
+     * @throw std::runtime_error if we failed to set up the worker stages
+     */
+    void start(struct event_base *base, WorkerPool *pool,
+               FairShare *share,
+               ConnectionCache *cache = NULL) throw (std::string,
+                                                     std::runtime_error);
+
+    /**
+     * Set the listener receiving the progress. Must be called before
+     * start().
+     */
+    void setListener(MigrationListener *l) {
+        listener = l;
+    }
+
+    /**
+     * Is the migration done with the workers, so that it can be
+     * released?
+     */
+    bool isIdle() const;
+
+    /**
+     * Close all of the connections and release the resources used by
+     * the migration. The connections to the destinations are handed
+     * to the cache if the migration succeeded. The event loop must not
+     * be dispatching events for the migration when this is called.
+     */
+    void release();
+
+    /**
+     * Check the outcome of the migration once the event loop is done
+     * with it.
+     * @param status the exit status so far
+     * @return the exit status of the migration
+     */
+    int finish(int status);
+
+    /**
+     * Print the number of messages and bytes sent
+     */
+    void getStats(std::ostream &out) const;
+
+    const std::string &getLabel() const {
+        return spec.label;
+    }
+
+    const std::vector<uint16_t> &getBuckets() const {
+        return buckets;
+    }
+
+    /**
+     * The connection to a source failed, or the source closed the
+     * stream (eof). The named stream of a registered TAP client (-r)
+     * is resumed from the checkpoint kept by the source, by connecting
+     * again after a backoff.
+     * @return false if the stream can't be resumed
+     */
+    bool resume(size_t source, bool eof);
+
+    /**
+     * The connection conn to a destination failed. With a retransmit
+     * window (-g) it is replaced after a backoff, and the messages the
+     * destination may not have processed are sent again.
+     * @return false if the connection can't be replaced
+     */
+    bool redial(size_t conn);
+
+    /**
+     * The capture (-O) fell behind and the sources are held back.
+     * Check every now and then whether it caught up.
+     */
+    void waitForCapture();
+
+private:
+    class Reconnection;
+
+    /**
+     * Connect to the source again, once the destinations answered the
+     * acks for the messages from the failed connection
+     */
+    void reconnect(size_t source);
+
+    /**
+     * Connect to the destination of conn again, and send it the
+     * retransmit window followed by the messages still queued
+     */
+    void replaceDestination(size_t conn);
+
+    /**
+     * Wait for delay milliseconds before trying to reconnect
+     */
+    void scheduleReconnect(Reconnection *r, long delay);
+
+    /**
+     * Ask the source for the TAP stream of its vbuckets
+     */
+    void requestStream(size_t source, uint64_t since);
+
+    static void reconnectHandler(evutil_socket_t fd, short which, void *arg);
+    static void captureHandler(evutil_socket_t fd, short which, void *arg);
+
+    /**
+     * Connect to (and authenticate with) a server, or connect to a
+     * relay receiver if relay is set. Nothing is waited for: the
+     * messages sent to the pipe are held until the connection is up,
+     * and a failure to connect fails the pipe like a lost connection.
+     * @throw std::string if the connection can't even be started
+     */
+    BinaryMessagePipe *getServer(const std::string &host,
+                                 BinaryMessagePipeCallback &cb,
+                                 Socket *&sock,
+                                 bool relay = false) throw (std::string);
+    /**
+     * Open the capture file of a source, and the pipe reading its
+     * messages
+     * @throw std::string if the capture can't be opened
+     */
+    BinaryMessagePipe *getLoader(size_t source,
+                                 Socket *&sock) throw (std::string);
+
+    MigrationSpec spec;
+    std::vector<uint16_t> buckets;
+    std::vector<uint32_t> routes;
+    std::vector<size_t> expected;
+    std::vector<std::string> destinations;
+
+    struct event_base *base;
+    bool started;
+    ConnectionCache *cache;
+    MigrationListener *listener;
+    UpstreamController *controller;
+    TransformPipeline *transforms;
+    /** Owned by the transforms, kept for the statistics */
+    ExpiredItemTransform *expired;
+    CompressTransform *compressor;
+    BackfillLog backfill;
+    CaptureWriter *capture;
+    SnapshotExporter *exporter;
+    ProgressJournal *journal;
+    /** The pending reconnection of each source (NULL for the loaders) */
+    std::vector<Reconnection*> reconnections;
+    /** The bytes received on the connections replaced by resuming */
+    uint64_t resumedBytes;
+    size_t resumes;
+    /** We gave up reconnecting to one of the servers */
+    bool resumeFailed;
+    /**
+     * The retransmit window and the pending reconnection of each
+     * connection to the destinations (empty without -g)
+     */
+    std::vector<RetransmitWindow*> windows;
+    std::vector<Reconnection*> redials;
+    size_t redialed;
+    uint64_t replayed;
+    uint64_t replayedBytes;
+    /** Sent over the relay connections replaced by redial() */
+    RelayStats *relayed;
+    /** The loader of each source (NULL for the servers) */
+    std::vector<CaptureLoader*> loaders;
+    std::vector<UpstreamBinaryMessagePipeCallback*> upstream;
+    std::vector<DownstreamBinaryMessagePipeCallback*> downstream;
+    std::vector<BinaryMessagePipe*> upstreamPipes;
+    std::vector<BinaryMessagePipe*> downstreamPipes;
+    std::vector<Socket*> upstreamSockets;
+    std::vector<Socket*> downstreamSockets;
+    std::vector<ParallelStage*> stages;
+    struct event captureEvent;
+    bool captureScheduled;
+};
+
+#endif
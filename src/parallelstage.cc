@@ -0,0 +1,240 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "parallelstage.h"
+
+#include <set>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+static uint64_t now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+ParallelStage::ParallelStage(const std::string &nm, WorkerPool &p,
+                             MessageProcessor &proc, StageCallback &cb,
+                             struct event_base *b,
+                             size_t batchsz) throw (std::runtime_error) :
+    name(nm), pool(p), processor(proc), callback(cb), base(b),
+    batchSize(batchsz), flushScheduled(false), notifyActive(false),
+    notified(false), queueDepth(0), maxQueueDepth(0), processed(0),
+    dropped(0), batches(0), totalLatency(0), maxLatency(0)
+{
+    if (pipe(notify) == -1) {
+        throw std::runtime_error("Failed to create notification pipe");
+    }
+    fcntl(notify[0], F_SETFL, fcntl(notify[0], F_GETFL) | O_NONBLOCK);
+    pthread_mutex_init(&mutex, NULL);
+
+    evtimer_set(&flushEvent, flushHandler, this);
+    event_base_set(base, &flushEvent);
+}
+
+ParallelStage::~ParallelStage() {
+    if (flushScheduled) {
+        evtimer_del(&flushEvent);
+    }
+    if (notifyActive) {
+        event_del(&notifyEvent);
+    }
+    ::close(notify[0]);
+    ::close(notify[1]);
+    pthread_mutex_destroy(&mutex);
+}
+
+bool ParallelStage::isBarrier(BinaryMessage *msg) const {
+    switch (msg->data.req->request.opcode) {
+    case PROTOCOL_BINARY_CMD_NOOP:
+    case PROTOCOL_BINARY_CMD_TAP_OPAQUE:
+        return true;
+    default:
+        return msg->isTapAckRequested();
+    }
+}
+
+void ParallelStage::submit(BinaryMessage *msg) {
+    if (++queueDepth > maxQueueDepth) {
+        maxQueueDepth = queueDepth;
+    }
+
+    if (isBarrier(msg)) {
+        // Everything before the barrier must be in flight first
+        flush();
+        Batch *batch = new Batch(this, msg->getVBucketId(), true);
+        batch->start = now_usec();
+        batch->messages.push_back(msg);
+        dispatch(batch);
+        return;
+    }
+
+    uint16_t vbucket = msg->getVBucketId();
+    std::map<uint16_t, Batch*>::iterator iter = open.find(vbucket);
+    Batch *batch;
+    if (iter == open.end()) {
+        batch = new Batch(this, vbucket, false);
+        batch->start = now_usec();
+        open[vbucket] = batch;
+    } else {
+        batch = iter->second;
+    }
+
+    batch->messages.push_back(msg);
+    if (batch->messages.size() >= batchSize) {
+        open.erase(vbucket);
+        dispatch(batch);
+    } else {
+        scheduleFlush();
+    }
+}
+
+void ParallelStage::flush() {
+    std::map<uint16_t, Batch*>::iterator iter;
+    for (iter = open.begin(); iter != open.end(); ++iter) {
+        dispatch(iter->second);
+    }
+    open.clear();
+}
+
+void ParallelStage::scheduleFlush() {
+    // Let the event loop finish the current read before the partial
+    // batches are sent to the workers
+    if (!flushScheduled) {
+        struct timeval tv = {0, 0};
+        int event_add_rv = evtimer_add(&flushEvent, &tv);
+        assert(event_add_rv != -1);
+        flushScheduled = true;
+    }
+}
+
+void ParallelStage::dispatch(Batch *batch) {
+    inflight.push_back(batch);
+    ++batches;
+    if (!notifyActive) {
+        event_set(&notifyEvent, notify[0], EV_READ | EV_PERSIST,
+                  notifyHandler, this);
+        event_base_set(base, &notifyEvent);
+        int event_add_rv = event_add(&notifyEvent, NULL);
+        assert(event_add_rv != -1);
+        notifyActive = true;
+    }
+    pool.schedule(batch);
+}
+
+void ParallelStage::Batch::run() {
+    keep.resize(messages.size());
+    for (size_t ii = 0; ii < messages.size(); ++ii) {
+        keep[ii] = stage->processor.process(messages[ii]);
+    }
+    stage->batchCompleted(this);
+}
+
+void ParallelStage::batchCompleted(Batch *batch) {
+    pthread_mutex_lock(&mutex);
+    batch->done = true;
+    if (!notified) {
+        notified = true;
+        char c = 0;
+        ssize_t nw;
+        do {
+            nw = write(notify[1], &c, 1);
+        } while (nw == -1 && errno == EINTR);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void ParallelStage::complete() {
+    std::vector<Batch*> ready;
+    std::set<uint16_t> blocked;
+
+    pthread_mutex_lock(&mutex);
+    notified = false;
+    std::list<Batch*>::iterator iter = inflight.begin();
+    bool pending = false;
+    while (iter != inflight.end()) {
+        Batch *batch = *iter;
+        if (batch->barrier) {
+            if (pending || !batch->done) {
+                break;
+            }
+        } else if (!batch->done || blocked.count(batch->vbucket) != 0) {
+            blocked.insert(batch->vbucket);
+            pending = true;
+            ++iter;
+            continue;
+        }
+
+        ready.push_back(batch);
+        iter = inflight.erase(iter);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    uint64_t now = now_usec();
+    std::vector<Batch*>::iterator bi;
+    for (bi = ready.begin(); bi != ready.end(); ++bi) {
+        Batch *batch = *bi;
+        uint64_t latency = now - batch->start;
+        totalLatency += latency;
+        if (latency > maxLatency) {
+            maxLatency = latency;
+        }
+
+        for (size_t ii = 0; ii < batch->messages.size(); ++ii) {
+            --queueDepth;
+            ++processed;
+            if (!batch->keep[ii]) {
+                ++dropped;
+            }
+            callback.messageProcessed(batch->messages[ii], batch->keep[ii]);
+        }
+        delete batch;
+    }
+
+    if (inflight.empty() && notifyActive) {
+        // Don't keep the event loop alive when there is nothing to wait for
+        event_del(&notifyEvent);
+        notifyActive = false;
+    }
+}
+
+void ParallelStage::getStats(std::ostream &out) const {
+    uint64_t released = batches - inflight.size();
+    out << "Stage " << name << ": " << processed << " messages processed, "
+        << dropped << " dropped, " << queueDepth << " queued (max "
+        << maxQueueDepth << "), latency avg "
+        << (released ? totalLatency / released : 0) << "us max "
+        << maxLatency << "us" << std::endl;
+}
+
+void ParallelStage::flushHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    ParallelStage *stage = reinterpret_cast<ParallelStage*>(arg);
+    stage->flushScheduled = false;
+    stage->flush();
+}
+
+void ParallelStage::notifyHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)which;
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+        // drain
+    }
+    reinterpret_cast<ParallelStage*>(arg)->complete();
+}
@@ -0,0 +1,158 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef PARALLELSTAGE_H
+#define PARALLELSTAGE_H 1
+
+#include "config.h"
+#include "binarymessage.h"
+#include "workerpool.h"
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <event.h>
+
+#ifndef evutil_socket_t
+#define evutil_socket_t int
+#endif
+
+/**
+ * The per message work done by a ParallelStage. process() is called
+ * on the worker threads, so it may not touch any state owned by the
+ * event loop.
+ */
+class MessageProcessor {
+public:
+    virtual ~MessageProcessor() {}
+
+    /**
+     * Process a message
+     * @return false if the message should be dropped
+     */
+    virtual bool process(BinaryMessage *msg) = 0;
+};
+
+/**
+ * Receives the messages in order once they have been processed
+ */
+class StageCallback {
+public:
+    virtual ~StageCallback() {}
+    virtual void messageProcessed(BinaryMessage *msg, bool keep) = 0;
+};
+
+/**
+ * A ParallelStage runs a MessageProcessor over the message stream by
+ * handing batches of messages to a WorkerPool. The messages are handed
+ * back to the callback on the event loop thread in the same order as
+ * they were submitted within each vbucket.
+ *
+ * Messages requesting a TAP ack, and messages that aren't bound to a
+ * vbucket, act as barriers: they are released only after everything
+ * submitted before them, and nothing submitted after them is released
+ * before them.
+ */
+class ParallelStage {
+public:
+    ParallelStage(const std::string &nm, WorkerPool &p, MessageProcessor &proc,
+                  StageCallback &cb, struct event_base *b,
+                  size_t batchsz = 64) throw (std::runtime_error);
+    ~ParallelStage();
+
+    /**
+     * Hand a message to the stage. The stage takes over the ownership
+     * of the message until it is passed to the callback.
+     */
+    void submit(BinaryMessage *msg);
+
+    /**
+     * Send all partially filled batches to the worker pool
+     */
+    void flush();
+
+    /**
+     * Called from the event loop when the workers have completed
+     * batches.
+     */
+    void complete();
+
+    /**
+     * Get the number of messages currently in the stage
+     */
+    size_t getQueueDepth() const { return queueDepth; }
+
+    /**
+     * Is the stage done with all of the messages submitted to it?
+     */
+    bool isIdle() const { return open.empty() && inflight.empty(); }
+
+    void getStats(std::ostream &out) const;
+
+private:
+    class Batch : public Task {
+    public:
+        Batch(ParallelStage *s, uint16_t vb, bool b) :
+            stage(s), vbucket(vb), barrier(b), done(false), start(0)
+        { }
+
+        void run();
+
+        ParallelStage *stage;
+        uint16_t vbucket;
+        bool barrier;
+        bool done;
+        uint64_t start;
+        std::vector<BinaryMessage*> messages;
+        std::vector<bool> keep;
+    };
+
+    bool isBarrier(BinaryMessage *msg) const;
+    void dispatch(Batch *batch);
+    void batchCompleted(Batch *batch);
+    void scheduleFlush();
+
+    static void flushHandler(evutil_socket_t fd, short which, void *arg);
+    static void notifyHandler(evutil_socket_t fd, short which, void *arg);
+
+    std::string name;
+    WorkerPool &pool;
+    MessageProcessor &processor;
+    StageCallback &callback;
+    struct event_base *base;
+    size_t batchSize;
+
+    std::map<uint16_t, Batch*> open;
+    std::list<Batch*> inflight;
+    struct event flushEvent;
+    bool flushScheduled;
+
+    int notify[2];
+    struct event notifyEvent;
+    bool notifyActive;
+    bool notified;
+    pthread_mutex_t mutex;
+
+    size_t queueDepth;
+    size_t maxQueueDepth;
+    uint64_t processed;
+    uint64_t dropped;
+    uint64_t batches;
+    uint64_t totalLatency;
+    uint64_t maxLatency;
+};
+
+#endif
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "quiet.h"
+#include "binarymessage.h"
+
+#include <cstring>
+
+using namespace std;
+
+void translateQuiet(BinaryMessage *msg) {
+    protocol_binary_request_header *req = msg->data.req;
+    uint8_t opcode;
+    uint8_t extlen;
+    switch (req->request.opcode) {
+    case PROTOCOL_BINARY_CMD_TAP_MUTATION:
+        opcode = PROTOCOL_BINARY_CMD_SETQ;
+        extlen = sizeof(protocol_binary_request_set) - sizeof(*req);
+        break;
+    case PROTOCOL_BINARY_CMD_TAP_DELETE:
+        opcode = PROTOCOL_BINARY_CMD_DELETEQ;
+        extlen = 0;
+        break;
+    case PROTOCOL_BINARY_CMD_TAP_FLUSH:
+        opcode = PROTOCOL_BINARY_CMD_FLUSHQ;
+        extlen = 0;
+        break;
+    default:
+        return;
+    }
+
+    // The TAP header and the engine specific data are dropped, while
+    // the item flags and expiry time (the last extras of a mutation)
+    // become the extras of the SETQ
+    char *body = msg->data.rawBytes + sizeof(*req);
+    size_t keyOffset = msg->getKeyOffset() - sizeof(*req);
+    memmove(body, body + req->request.extlen - extlen, extlen);
+    memmove(body + extlen, body + keyOffset,
+            msg->size - sizeof(*req) - keyOffset);
+
+    msg->size -= keyOffset - extlen;
+    req->request.opcode = opcode;
+    req->request.extlen = extlen;
+    req->request.bodylen = htonl(static_cast<uint32_t>(msg->size - sizeof(*req)));
+    req->request.cas = 0;
+}
+
+bool QuietFences::sent(size_t conn, uint8_t ackOpcode, uint32_t opaque) {
+    if (ackOpcode == 0 && ++sinceFence[conn] < fenceInterval) {
+        return false;
+    }
+    sinceFence[conn] = 0;
+    if (ackOpcode != 0) {
+        fences[conn][opaque] = ackOpcode;
+    }
+    return true;
+}
+
+bool QuietFences::failed(uint8_t opcode, uint16_t &status) {
+    if (opcode == PROTOCOL_BINARY_CMD_NOOP ||
+        status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        return false;
+    }
+    if ((opcode == PROTOCOL_BINARY_CMD_DELETEQ ||
+         opcode == PROTOCOL_BINARY_CMD_DELETE) &&
+        status == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT) {
+        status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        return false;
+    }
+    ++errors;
+    return true;
+}
+
+uint8_t QuietFences::answered(size_t conn, uint8_t opcode, uint32_t opaque,
+                              uint16_t status) {
+    map<uint32_t, uint8_t>::iterator iter = fences[conn].find(opaque);
+    if (iter == fences[conn].end() ||
+        (opcode != PROTOCOL_BINARY_CMD_NOOP &&
+         status == PROTOCOL_BINARY_RESPONSE_SUCCESS)) {
+        return 0;
+    }
+    uint8_t ackOpcode = iter->second;
+    fences[conn].erase(iter);
+    return ackOpcode;
+}
@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef QUIET_H
+#define QUIET_H 1
+
+#include "config.h"
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+class BinaryMessage;
+
+/**
+ * Turn a TAP_MUTATION, TAP_DELETE or TAP_FLUSH into the equivalent
+ * quiet command (SETQ, DELETEQ or FLUSHQ). The message is rewritten in
+ * place, since the quiet commands are never bigger.
+ */
+void translateQuiet(BinaryMessage *msg);
+
+/**
+ * Keeps track of the NOOPs fencing the quiet commands (-q) sent to
+ * each connection. The destinations only answer a quiet command if it
+ * fails, and hold back the errors until they get a command that isn't
+ * quiet.
+ *
+ * A NOOP follows the command for a TAP message requesting an ack, and
+ * the TAP ack is due once the NOOP is answered (or the command fails).
+ * Otherwise a NOOP is sent every interval commands, so that the errors
+ * are seen.
+ */
+class QuietFences {
+public:
+    QuietFences(size_t connections, size_t interval) :
+        sinceFence(connections, 0), fences(connections),
+        fenceInterval(interval), errors(0)
+    { }
+
+    /**
+     * A quiet command was sent to the connection conn
+     * @param ackOpcode the opcode of the TAP message if it requested an
+     *                  ack, or 0
+     * @param opaque the opaque of the command
+     * @return true if a NOOP with the same opaque must follow it
+     */
+    bool sent(size_t conn, uint8_t ackOpcode, uint32_t opaque);
+
+    /**
+     * Check the status of a response from a destination. Deleting an
+     * item the destination doesn't have is fine, and the status is
+     * changed to success.
+     * @return true if it reports a failed command (which is counted)
+     */
+    bool failed(uint8_t opcode, uint16_t &status);
+
+    /**
+     * Handle a response from the connection conn: the answer to a NOOP,
+     * or the error for a quiet command
+     * @return the opcode of the TAP message to ack (or fail) with the
+     *         opaque and status of the response, or 0 if none is due
+     */
+    uint8_t answered(size_t conn, uint8_t opcode, uint32_t opaque,
+                     uint16_t status);
+
+    uint64_t getErrors() const {
+        return errors;
+    }
+
+private:
+    /** The commands sent since the last NOOP on each connection */
+    std::vector<size_t> sinceFence;
+    /** The TAP acks waiting for a NOOP response on each connection */
+    std::vector<std::map<uint32_t, uint8_t> > fences;
+    size_t fenceInterval;
+    uint64_t errors;
+};
+
+#endif
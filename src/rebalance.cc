@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "rebalance.h"
+
+#include <sstream>
+
+using namespace std;
+
+RebalancePlan::RebalancePlan(const map<uint16_t, string> &current,
+                             const map<uint16_t, string> &target,
+                             size_t nl, size_t cl) throw (std::string) :
+    nodeLimit(nl), clusterLimit(cl), running(0), total(0)
+{
+    if (nodeLimit == 0) {
+        throw string("The number of moves per server must be at least 1");
+    }
+
+    map<uint16_t, string>::const_iterator iter;
+    for (iter = current.begin(); iter != current.end(); ++iter) {
+        if (target.find(iter->first) == target.end()) {
+            stringstream ss;
+            ss << "vbucket " << iter->first << " is not in the target map";
+            throw ss.str();
+        }
+    }
+
+    for (iter = target.begin(); iter != target.end(); ++iter) {
+        map<uint16_t, string>::const_iterator owner;
+        owner = current.find(iter->first);
+        if (owner == current.end()) {
+            stringstream ss;
+            ss << "vbucket " << iter->first << " is not in the current map";
+            throw ss.str();
+        }
+        if (owner->second == iter->second) {
+            continue;
+        }
+
+        RebalanceMove move;
+        move.vbucket = iter->first;
+        move.source = owner->second;
+        move.destination = iter->second;
+        pending.push_back(move);
+        ++nodes[move.source].outLeft;
+        ++nodes[move.destination].inLeft;
+    }
+    total = pending.size();
+}
+
+bool RebalancePlan::next(RebalanceMove &move) {
+    if (clusterLimit != 0 && running >= clusterLimit) {
+        return false;
+    }
+
+    list<RebalanceMove>::iterator best = pending.end();
+    size_t bestLeft = 0;
+    size_t bestLoad = 0;
+    list<RebalanceMove>::iterator iter;
+    for (iter = pending.begin(); iter != pending.end(); ++iter) {
+        Node &source = nodes[iter->source];
+        Node &destination = nodes[iter->destination];
+        if (source.out >= nodeLimit || destination.in >= nodeLimit) {
+            continue;
+        }
+
+        // Keep the servers with the longest queues busy, and spread
+        // the rest over the servers doing the least
+        size_t left = source.outLeft + destination.inLeft;
+        size_t load = source.in + source.out + destination.in +
+            destination.out;
+        if (best == pending.end() || left > bestLeft ||
+            (left == bestLeft && load < bestLoad)) {
+            best = iter;
+            bestLeft = left;
+            bestLoad = load;
+        }
+    }
+
+    if (best == pending.end()) {
+        return false;
+    }
+
+    move = *best;
+    pending.erase(best);
+    Node &source = nodes[move.source];
+    Node &destination = nodes[move.destination];
+    --source.outLeft;
+    ++source.out;
+    --destination.inLeft;
+    ++destination.in;
+    ++running;
+    return true;
+}
+
+void RebalancePlan::completed(const RebalanceMove &move) {
+    --nodes[move.source].out;
+    --nodes[move.destination].in;
+    --running;
+}
+
+void RebalancePlan::getStats(ostream &out) const {
+    map<string, Node>::const_iterator n;
+    for (n = nodes.begin(); n != nodes.end(); ++n) {
+        out << "  " << n->first << ": " << n->second.inLeft << " in, "
+            << n->second.outLeft << " out" << endl;
+    }
+}
@@ -0,0 +1,117 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef REBALANCE_H
+#define REBALANCE_H 1
+
+#include <list>
+#include <map>
+#include <ostream>
+#include <string>
+
+/**
+ * A vbucket moving from the server owning it to its new owner
+ */
+class RebalanceMove {
+public:
+    RebalanceMove() : vbucket(0) { }
+
+    uint16_t vbucket;
+    std::string source;
+    std::string destination;
+};
+
+/**
+ * The moves needed to go from one vbucket map to another, and the
+ * order to run them in.
+ *
+ * Every server may have at most nodeLimit vbuckets moving into it, and
+ * nodeLimit vbuckets moving out of it, at the same time. At most
+ * clusterLimit moves (0 for no limit) run at the same time in total.
+ * Within the limits the moves of the servers with the most moves left
+ * go first, since the server with the longest queue decides how long
+ * the rebalance takes.
+ */
+class RebalancePlan {
+public:
+    /**
+     * Compute the moves
+     * @throw std::string if the maps don't contain the same vbuckets
+     *                    or a limit is invalid
+     */
+    RebalancePlan(const std::map<uint16_t, std::string> &current,
+                  const std::map<uint16_t, std::string> &target,
+                  size_t nodeLimit, size_t clusterLimit) throw (std::string);
+
+    /**
+     * Pick the next move to start
+     * @return false if all of the moves allowed by the limits are
+     *         already running
+     */
+    bool next(RebalanceMove &move);
+
+    /**
+     * A move started by next() is done (or failed)
+     */
+    void completed(const RebalanceMove &move);
+
+    /**
+     * Forget about the moves not started yet
+     */
+    void cancel() {
+        pending.clear();
+    }
+
+    bool isDone() const {
+        return pending.empty() && running == 0;
+    }
+
+    size_t size() const {
+        return total;
+    }
+
+    size_t getRunning() const {
+        return running;
+    }
+
+    /**
+     * Print the number of vbuckets left to move into and out of each
+     * server
+     */
+    void getStats(std::ostream &out) const;
+
+private:
+    class Node {
+    public:
+        Node() : in(0), out(0), inLeft(0), outLeft(0) { }
+
+        /** The number of moves running */
+        size_t in;
+        size_t out;
+        /** The number of moves not started yet */
+        size_t inLeft;
+        size_t outLeft;
+    };
+
+    std::list<RebalanceMove> pending;
+    std::map<std::string, Node> nodes;
+    size_t nodeLimit;
+    size_t clusterLimit;
+    size_t running;
+    size_t total;
+};
+
+#endif
@@ -0,0 +1,184 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "rebalancer.h"
+
+#include <iostream>
+#include <sstream>
+#include <cassert>
+
+using namespace std;
+
+Rebalancer::Rebalancer(RebalancePlan &p, const MigrationSpec &s,
+                       struct event_base *b, WorkerPool *wp,
+                       size_t window) :
+    plan(p), spec(s), base(b), pool(wp), share(window),
+    reapScheduled(false), completed(0), status(EX_OK)
+{
+    evtimer_set(&reapEvent, reapHandler, this);
+    event_base_set(base, &reapEvent);
+}
+
+Rebalancer::~Rebalancer() {
+    if (reapScheduled) {
+        evtimer_del(&reapEvent);
+    }
+    map<Migration*, Move>::iterator iter;
+    for (iter = moves.begin(); iter != moves.end(); ++iter) {
+        delete iter->first;
+    }
+}
+
+void Rebalancer::start() {
+    schedule();
+    checkDone();
+}
+
+void Rebalancer::checkDone() {
+    // The idle connections in the cache would keep the loop running
+    if (plan.isDone()) {
+        event_base_loopexit(base, NULL);
+    }
+}
+
+void Rebalancer::schedule() {
+    RebalanceMove move;
+    while (plan.next(move)) {
+        MigrationSpec ms(spec);
+        stringstream label;
+        label << "vbucket " << move.vbucket;
+        ms.label = label.str();
+        ms.hosts.push_back(move.source);
+        ms.sourceBuckets[0].push_back(move.vbucket);
+        ms.destinations.push_back(move.destination);
+        ms.takeover = true;
+        if (!ms.name.empty()) {
+            // The moves from the same server run at the same time
+            stringstream name;
+            name << ms.name << "_" << move.vbucket;
+            ms.name = name.str();
+        }
+
+        if (verbosity) {
+            cout << "Moving vbucket " << move.vbucket << " from "
+                 << move.source << " to " << move.destination << endl;
+        }
+
+        Migration *migration = NULL;
+        try {
+            migration = new Migration(ms);
+            migration->setListener(this);
+            moves[migration].move = move;
+            migration->start(base, pool, &share, &cache);
+        } catch (std::string &e) {
+            cerr << "Failed to move vbucket " << move.vbucket << " from "
+                 << move.source << " to " << move.destination << ": "
+                 << e << endl;
+            failed(EX_CONFIG);
+        } catch (std::exception &e) {
+            cerr << "Failed to start worker threads: " << e.what() << endl;
+            failed(EX_OSERR);
+        }
+
+        if (status != EX_OK) {
+            if (migration != NULL) {
+                moves.erase(migration);
+                delete migration;
+            }
+            plan.completed(move);
+            return;
+        }
+    }
+}
+
+void Rebalancer::failed(int st) {
+    if (status == EX_OK) {
+        status = st;
+        plan.cancel();
+    }
+}
+
+void Rebalancer::migrationDone(Migration &migration) {
+    // We're called from the callbacks of the pipes we're about to
+    // delete, so the move is cleaned up from the event loop
+    map<Migration*, Move>::iterator iter = moves.find(&migration);
+    if (iter != moves.end()) {
+        iter->second.done = true;
+        scheduleReap(0);
+    }
+}
+
+void Rebalancer::scheduleReap(long usec) {
+    if (!reapScheduled) {
+        struct timeval tv = {0, usec};
+        int event_add_rv = evtimer_add(&reapEvent, &tv);
+        assert(event_add_rv != -1);
+        reapScheduled = true;
+    }
+}
+
+void Rebalancer::reap() {
+    bool busy = false;
+    map<Migration*, Move>::iterator iter = moves.begin();
+    while (iter != moves.end()) {
+        Migration *migration = iter->first;
+        Move &m = iter->second;
+        if (!m.done) {
+            ++iter;
+            continue;
+        }
+        if (!migration->isIdle()) {
+            busy = true;
+            ++iter;
+            continue;
+        }
+
+        int st = migration->finish(EX_OK);
+        ++completed;
+        if (st == EX_OK) {
+            cout << "Moved vbucket " << m.move.vbucket << " from "
+                 << m.move.source << " to " << m.move.destination
+                 << " (" << completed << "/" << plan.size() << ")" << endl;
+        } else {
+            cerr << "Failed to move vbucket " << m.move.vbucket << " from "
+                 << m.move.source << " to " << m.move.destination
+                 << ", exit status " << st << endl;
+            failed(st);
+        }
+
+        plan.completed(m.move);
+        delete migration;
+        moves.erase(iter++);
+    }
+
+    if (busy) {
+        scheduleReap(10000);
+    }
+
+    if (status == EX_OK) {
+        schedule();
+    }
+    checkDone();
+}
+
+void Rebalancer::reapHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    Rebalancer *rebalancer = reinterpret_cast<Rebalancer*>(arg);
+    rebalancer->reapScheduled = false;
+    rebalancer->reap();
+}
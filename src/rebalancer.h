@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef REBALANCER_H
+#define REBALANCER_H 1
+
+#include "config.h"
+#include "migration.h"
+#include "rebalance.h"
+#include <map>
+
+#ifndef evutil_socket_t
+#define evutil_socket_t int
+#endif
+
+/**
+ * The Rebalancer runs the moves of a RebalancePlan on an event loop.
+ * Every move is a takeover of a single vbucket, described by the
+ * template spec (with the source, vbucket and destination filled in).
+ * No more moves are started once one of them fails.
+ */
+class Rebalancer : public MigrationListener {
+public:
+    Rebalancer(RebalancePlan &plan, const MigrationSpec &spec,
+               struct event_base *base, WorkerPool *pool,
+               size_t window);
+    ~Rebalancer();
+
+    /**
+     * Start the first moves. The event loop is stopped once all of the
+     * moves are done.
+     */
+    void start();
+
+    /**
+     * Get the exit status of the first move that failed
+     */
+    int getStatus() const {
+        return status;
+    }
+
+    void migrationDone(Migration &migration);
+
+private:
+    void schedule();
+    void checkDone();
+    void failed(int st);
+    void scheduleReap(long usec);
+    void reap();
+
+    static void reapHandler(evutil_socket_t fd, short which, void *arg);
+
+    RebalancePlan &plan;
+    MigrationSpec spec;
+    struct event_base *base;
+    WorkerPool *pool;
+    FairShare share;
+    ConnectionCache cache;
+
+    struct event reapEvent;
+    bool reapScheduled;
+
+    class Move {
+    public:
+        Move() : done(false) { }
+
+        RebalanceMove move;
+        bool done;
+    };
+
+    std::map<Migration*, Move> moves;
+    size_t completed;
+    int status;
+};
+
+#endif
@@ -0,0 +1,528 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "relay.h"
+#include "migration.h"
+
+#include <iostream>
+#include <sstream>
+#include <cassert>
+#include <cstring>
+#ifdef HAVE_SNAPPY_C_H
+#include <snappy-c.h>
+#endif
+
+using namespace std;
+
+static const uint8_t RELAY_MAGIC = 0xd7;
+static const uint8_t RELAY_SNAPPY = 0x01;
+static const size_t RELAY_HEADER = 16;
+
+/**
+ * The messages are packed into frames of up to this many bytes (a
+ * bigger message gets a frame of its own)
+ */
+static const size_t RELAY_FRAME_BYTES = 256 * 1024;
+
+/**
+ * The largest frame accepted from the other end
+ */
+static const size_t RELAY_MAX_FRAME = 64 * 1024 * 1024;
+
+static void putWord(char *dst, uint32_t value) {
+    value = htonl(value);
+    memcpy(dst, &value, sizeof(value));
+}
+
+static uint32_t getWord(const char *src) {
+    uint32_t value;
+    memcpy(&value, src, sizeof(value));
+    return ntohl(value);
+}
+
+void RelayPipe::buildFrame() {
+    batch.clear();
+    size_t count = 0;
+    std::deque<BinaryMessage*>::iterator iter;
+    for (iter = queue.begin(); iter != queue.end(); ++iter, ++count) {
+        if (count > 0 && batch.length() + (*iter)->size > RELAY_FRAME_BYTES) {
+            break;
+        }
+        batch.append((*iter)->data.rawBytes, (*iter)->size);
+    }
+    framed = count;
+
+    uint8_t frameFlags = 0;
+    frame.resize(RELAY_HEADER);
+#ifdef HAVE_SNAPPY_C_H
+    size_t clen = snappy_max_compressed_length(batch.length());
+    frame.resize(RELAY_HEADER + clen);
+    if (snappy_compress(batch.data(), batch.length(), &frame[RELAY_HEADER],
+                        &clen) == SNAPPY_OK && clen < batch.length()) {
+        frameFlags = RELAY_SNAPPY;
+        frame.resize(RELAY_HEADER + clen);
+    }
+#endif
+    if (frameFlags == 0) {
+        frame.resize(RELAY_HEADER);
+        frame.append(batch);
+    }
+
+    frame[0] = static_cast<char>(RELAY_MAGIC);
+    frame[1] = static_cast<char>(frameFlags);
+    frame[2] = frame[3] = 0;
+    putWord(&frame[4], static_cast<uint32_t>(count));
+    putWord(&frame[8], static_cast<uint32_t>(batch.length()));
+    putWord(&frame[12], static_cast<uint32_t>(frame.length() - RELAY_HEADER));
+
+    sendptr = reinterpret_cast<uint8_t*>(&frame[0]);
+    sendlen = static_cast<ssize_t>(frame.length());
+}
+
+bool RelayPipe::drainBuffers() {
+    do {
+        if (sendptr == NULL) {
+            if (queue.empty()) {
+                return true;
+            }
+            buildFrame();
+        }
+
+        ssize_t nw = send(sock.getSocket(), (const char*)sendptr, sendlen, 0);
+        if (nw == -1) {
+            switch (get_socket_errno()) {
+            case EINTR:
+                continue;
+            case EWOULDBLOCK:
+                return false;
+            default:
+                {
+                    std::stringstream err;
+                    err << "Failed to write to stream: "
+                        << strerror(get_socket_errno());
+                    throw std::runtime_error(err.str());
+                }
+            }
+        }
+
+        sendptr += nw;
+        sendlen -= nw;
+        if (sendlen > 0) {
+            continue;
+        }
+
+        // Take the messages of the frame off the queue before telling
+        // the callback, since it may queue more messages
+        sendptr = NULL;
+        ++sent.frames;
+        sent.messages += framed;
+        sent.bytes += batch.length();
+        sent.wireBytes += frame.length();
+        std::vector<BinaryMessage*> done;
+        for (; framed > 0; --framed) {
+            done.push_back(popMessage());
+        }
+        for (std::vector<BinaryMessage*>::iterator m = done.begin();
+             m != done.end(); ++m) {
+            callback->messageSent(*m);
+            delete *m;
+        }
+    } while (true);
+}
+
+void RelayPipe::unpackFrame() {
+    uint8_t frameFlags = static_cast<uint8_t>(input[1]);
+    size_t raw = getWord(&input[8]);
+    size_t length = getWord(&input[12]);
+    const char *payload = &input[RELAY_HEADER];
+
+    if (frameFlags & RELAY_SNAPPY) {
+#ifdef HAVE_SNAPPY_C_H
+        size_t ulen;
+        if (snappy_uncompressed_length(payload, length, &ulen) != SNAPPY_OK ||
+            ulen != raw) {
+            throw std::runtime_error("Corrupt relay frame");
+        }
+        unpacked.resize(raw);
+        if (snappy_uncompress(payload, length, &unpacked[0],
+                              &ulen) != SNAPPY_OK) {
+            throw std::runtime_error("Corrupt relay frame");
+        }
+#else
+        throw std::runtime_error("Not built with Snappy support");
+#endif
+    } else {
+        if (length != raw) {
+            throw std::runtime_error("Corrupt relay frame");
+        }
+        unpacked.assign(payload, length);
+    }
+    unpackedOffset = 0;
+
+    ++received.frames;
+    received.bytes += raw;
+    received.wireBytes += RELAY_HEADER + length;
+}
+
+bool RelayPipe::readMessage() {
+    do {
+        if (unpackedOffset < unpacked.length()) {
+            size_t left = unpacked.length() - unpackedOffset;
+            const char *next = unpacked.data() + unpackedOffset;
+            protocol_binary_request_header h;
+            if (left < sizeof(h.bytes)) {
+                throw std::runtime_error("Corrupt relay frame");
+            }
+            memcpy(h.bytes, next, sizeof(h.bytes));
+            size_t size = sizeof(h.bytes) + ntohl(h.request.bodylen);
+            if (size > left) {
+                throw std::runtime_error("Corrupt relay frame");
+            }
+            msg = new BinaryMessage(h);
+            memcpy(msg->data.rawBytes, next, size);
+            unpackedOffset += size;
+            ++received.messages;
+            return true;
+        }
+
+        // Read the header of the next frame, and then its payload
+        size_t want = RELAY_HEADER;
+        if (inputFill >= RELAY_HEADER) {
+            want += getWord(&input[12]);
+        }
+        if (input.size() < want) {
+            input.resize(want);
+        }
+
+        ssize_t nr = recv(sock.getSocket(), &input[inputFill],
+                          want - inputFill, 0);
+        if (nr == -1) {
+            switch (get_socket_errno()) {
+            case EINTR:
+                continue;
+            case EWOULDBLOCK:
+                return false;
+            default:
+                {
+                    std::stringstream err;
+                    err << "Failed to read from stream: "
+                        << strerror(get_socket_errno());
+                    throw std::runtime_error(err.str());
+                }
+            }
+        } else if (nr == 0) {
+            closed = true;
+            return false;
+        }
+
+        inputFill += nr;
+        if (inputFill < RELAY_HEADER) {
+            continue;
+        }
+        if (inputFill == RELAY_HEADER &&
+            (static_cast<uint8_t>(input[0]) != RELAY_MAGIC ||
+             getWord(&input[8]) > RELAY_MAX_FRAME ||
+             getWord(&input[12]) > RELAY_MAX_FRAME)) {
+            throw std::runtime_error("Invalid relay frame detected on the wire");
+        }
+        if (inputFill == RELAY_HEADER + getWord(&input[12])) {
+            unpackFrame();
+            inputFill = 0;
+        }
+    } while (true);
+}
+
+/**
+ * The two ends of a relay connection
+ */
+class RelayReceiver::Bridge {
+public:
+    Bridge(RelayReceiver *r, const std::string &p) :
+        receiver(r), peer(p), relaySock(NULL), destSock(NULL), relay(NULL),
+        dest(NULL), relayCallback(NULL), destCallback(NULL), pending(0),
+        plugged(false), eof(false), closed(false)
+    { }
+
+    ~Bridge();
+
+    RelayReceiver *receiver;
+    std::string peer;
+    Socket *relaySock;
+    Socket *destSock;
+    RelayPipe *relay;
+    BinaryMessagePipe *dest;
+    RelayCallback *relayCallback;
+    DestinationCallback *destCallback;
+    /** The messages queued for the destination */
+    size_t pending;
+    bool plugged;
+    /** The sender is done, and the bridge closes once pending drops to 0 */
+    bool eof;
+    bool closed;
+};
+
+/**
+ * Pass the messages from the sender on to the destination, holding
+ * back the sender while the destination can't keep up
+ */
+class RelayReceiver::RelayCallback : public BinaryMessagePipeCallback {
+public:
+    RelayCallback(Bridge *b) : bridge(b) { }
+
+    void messageReceived(BinaryMessage *msg) {
+        bridge->dest->sendMessage(msg);
+        if (++bridge->pending > static_cast<size_t>(PENDING_SEND_HI_WAT) &&
+            !bridge->plugged) {
+            bridge->relay->plugInput();
+            bridge->plugged = true;
+        }
+    }
+
+    void abort() {
+        bridge->receiver->close(bridge, "connection failed");
+    }
+
+    void shutdown() {
+        bridge->eof = true;
+        if (bridge->pending == 0) {
+            bridge->receiver->close(bridge, "done");
+        }
+    }
+
+private:
+    Bridge *bridge;
+};
+
+/**
+ * Relay the responses of the destination back to the sender
+ */
+class RelayReceiver::DestinationCallback : public BinaryMessagePipeCallback {
+public:
+    DestinationCallback(Bridge *b) : bridge(b) { }
+
+    void messageReceived(BinaryMessage *msg) {
+        bridge->relay->sendMessage(msg);
+    }
+
+    void connected() {
+        // The sender was held back until the destination was up
+        bridge->relay->unPlugInput();
+        bridge->plugged = false;
+    }
+
+    void messageSent(BinaryMessage *msg) {
+        (void)msg;
+        if (--bridge->pending < static_cast<size_t>(PENDING_SEND_LO_WAT) &&
+            bridge->plugged) {
+            bridge->relay->unPlugInput();
+            bridge->plugged = false;
+        }
+        if (bridge->eof && bridge->pending == 0) {
+            bridge->receiver->close(bridge, "done");
+        }
+    }
+
+    void abort() {
+        bridge->receiver->close(bridge, "destination failed");
+    }
+
+    void shutdown() {
+        bridge->receiver->close(bridge, "destination closed the connection");
+    }
+
+private:
+    Bridge *bridge;
+};
+
+RelayReceiver::Bridge::~Bridge() {
+    delete relay;
+    delete dest;
+    delete relaySock;
+    delete destSock;
+    delete relayCallback;
+    delete destCallback;
+}
+
+RelayReceiver::RelayReceiver(in_port_t port, const string &d,
+                             const string &a, const string &p,
+                             struct event_base *b) throw (std::runtime_error) :
+    destination(d), auth(a), passwd(p), base(b), listener(NULL),
+    reapScheduled(false)
+{
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) {
+        throw std::runtime_error(string("Failed to create socket: ") +
+                                 strerror(get_socket_errno()));
+    }
+    listener = new Socket(sock);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    int flag = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char*>(&flag), sizeof(flag));
+    if (bind(sock, reinterpret_cast<struct sockaddr*>(&addr),
+             sizeof(addr)) == SOCKET_ERROR || listen(sock, 16) == SOCKET_ERROR) {
+        stringstream ss;
+        ss << "Failed to listen on port " << port << ": "
+           << strerror(get_socket_errno());
+        delete listener;
+        throw std::runtime_error(ss.str());
+    }
+    listener->setNonBlocking();
+
+    event_set(&acceptEvent, sock, EV_READ | EV_PERSIST, acceptHandler, this);
+    event_base_set(base, &acceptEvent);
+    int event_add_rv = event_add(&acceptEvent, NULL);
+    assert(event_add_rv != -1);
+
+    evtimer_set(&reapEvent, reapHandler, this);
+    event_base_set(base, &reapEvent);
+}
+
+RelayReceiver::~RelayReceiver() {
+    if (reapScheduled) {
+        evtimer_del(&reapEvent);
+    }
+    event_del(&acceptEvent);
+    delete listener;
+
+    while (!bridges.empty()) {
+        Bridge *bridge = bridges.front();
+        bridges.pop_front();
+        if (!bridge->closed) {
+            bridge->relay->close();
+            bridge->dest->close();
+        }
+        delete bridge;
+    }
+}
+
+void RelayReceiver::accept() {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    SOCKET s;
+    while ((s = ::accept(listener->getSocket(),
+                         reinterpret_cast<struct sockaddr*>(&addr),
+                         &len)) != INVALID_SOCKET) {
+        stringstream peer;
+        peer << inet_ntoa(addr.sin_addr) << ":" << ntohs(addr.sin_port);
+        len = sizeof(addr);
+
+        Bridge *bridge = new Bridge(this, peer.str());
+        bridge->relaySock = new Socket(s);
+        bridge->relayCallback = new RelayCallback(bridge);
+        bridge->destCallback = new DestinationCallback(bridge);
+
+        // The destination is connected to (and authenticated with) in
+        // the background, and nothing is read from the sender before
+        // it is up
+        string error;
+        try {
+            bridge->destSock = new Socket(destination);
+            bridge->destSock->connect(false);
+            bridge->destSock->setKeepalive(true);
+            bridge->dest = new BinaryMessagePipe(*bridge->destSock,
+                                                 *bridge->destCallback,
+                                                 base, timeout);
+            if (!auth.empty()) {
+                bridge->dest->startAuthentication(auth, passwd);
+            }
+            bridge->relaySock->setNonBlocking();
+        } catch (std::string &e) {
+            error = e;
+        } catch (std::exception &e) {
+            error = e.what();
+        }
+        if (!error.empty()) {
+            cerr << "Failed to connect " << peer.str() << " to "
+                 << destination << ": " << error << endl;
+            if (bridge->dest != NULL) {
+                bridge->dest->close();
+            }
+            delete bridge;
+            continue;
+        }
+
+        bridge->relay = new RelayPipe(*bridge->relaySock,
+                                      *bridge->relayCallback, base, timeout);
+        bridge->relay->plugInput();
+        bridge->plugged = true;
+        bridges.push_back(bridge);
+        if (verbosity) {
+            cout << "Relaying " << peer.str() << " to " << destination
+                 << endl;
+        }
+    }
+}
+
+void RelayReceiver::close(Bridge *bridge, const string &reason) {
+    if (bridge->closed) {
+        return;
+    }
+    bridge->closed = true;
+    bridge->relay->close();
+    bridge->dest->close();
+
+    const RelayStats &stats = bridge->relay->getReceived();
+    if (verbosity) {
+        cout << "Relay from " << bridge->peer << " closed (" << reason
+             << "): " << stats.messages << " messages (" << stats.bytes
+             << " bytes) received in " << stats.frames << " frames ("
+             << stats.wireBytes << " bytes)" << endl;
+    } else if (reason != "done") {
+        cerr << "Relay from " << bridge->peer << " closed: " << reason
+             << endl;
+    }
+
+    if (!reapScheduled) {
+        struct timeval tv = {0, 0};
+        int event_add_rv = evtimer_add(&reapEvent, &tv);
+        assert(event_add_rv != -1);
+        reapScheduled = true;
+    }
+}
+
+void RelayReceiver::reap() {
+    std::list<Bridge*>::iterator iter = bridges.begin();
+    while (iter != bridges.end()) {
+        if ((*iter)->closed) {
+            delete *iter;
+            bridges.erase(iter++);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+void RelayReceiver::acceptHandler(evutil_socket_t fd, short which,
+                                  void *arg) {
+    (void)fd;
+    (void)which;
+    reinterpret_cast<RelayReceiver*>(arg)->accept();
+}
+
+void RelayReceiver::reapHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    RelayReceiver *receiver = reinterpret_cast<RelayReceiver*>(arg);
+    receiver->reapScheduled = false;
+    receiver->reap();
+}
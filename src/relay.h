@@ -0,0 +1,144 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef RELAY_H
+#define RELAY_H 1
+
+#include "config.h"
+#include "binarymessagepipe.h"
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * The messages and bytes carried over relay connections
+ */
+class RelayStats {
+public:
+    RelayStats() : frames(0), messages(0), bytes(0), wireBytes(0) { }
+
+    void add(const RelayStats &other) {
+        frames += other.frames;
+        messages += other.messages;
+        bytes += other.bytes;
+        wireBytes += other.wireBytes;
+    }
+
+    uint64_t frames;
+    uint64_t messages;
+    /** The size of the messages */
+    uint64_t bytes;
+    /** The size of the frames carrying them */
+    uint64_t wireBytes;
+};
+
+/**
+ * A BinaryMessagePipe between two migrators (see -G and -W), batching
+ * the queued messages into Snappy compressed frames. Every frame starts
+ * with a 16 byte header: the magic byte, the flags, two unused bytes,
+ * the number of messages, their length and the length of the payload
+ * (in network byte order). Nothing is held back to fill a frame, so
+ * the frames grow as the messages queue up behind a slow link.
+ */
+class RelayPipe : public BinaryMessagePipe {
+public:
+    RelayPipe(Socket &s, BinaryMessagePipeCallback &cb, struct event_base *b,
+              int tmout) :
+        BinaryMessagePipe(s, cb, b, tmout), inputFill(0), unpackedOffset(0)
+    { }
+
+    const RelayStats &getSent() const {
+        return sent;
+    }
+
+    const RelayStats &getReceived() const {
+        return received;
+    }
+
+protected:
+    bool readMessage();
+    bool drainBuffers();
+    bool hasBufferedInput() const {
+        return unpackedOffset < unpacked.length();
+    }
+
+private:
+    /**
+     * Pack the messages at the front of the queue into the next frame
+     */
+    void buildFrame();
+
+    /**
+     * Unpack the frame read into input
+     * @throw std::runtime_error if the frame is corrupt
+     */
+    void unpackFrame();
+
+    std::string batch;
+    std::string frame;
+    std::vector<char> input;
+    size_t inputFill;
+    std::string unpacked;
+    size_t unpackedOffset;
+    RelayStats sent;
+    RelayStats received;
+};
+
+/**
+ * The receiving end of a relay (-W): every connection accepted from a
+ * sending migrator is bridged to a connection of its own to the
+ * destination, which gets the messages unpacked, and whose responses
+ * are relayed back.
+ */
+class RelayReceiver {
+public:
+    RelayReceiver(in_port_t port, const std::string &destination,
+                  const std::string &auth, const std::string &passwd,
+                  struct event_base *base) throw (std::runtime_error);
+    ~RelayReceiver();
+
+private:
+    class Bridge;
+    class RelayCallback;
+    class DestinationCallback;
+
+    void accept();
+
+    /**
+     * Close both ends of the bridge. It is deleted from the event loop,
+     * since we may be called from the callbacks of its pipes.
+     */
+    void close(Bridge *bridge, const std::string &reason);
+
+    void reap();
+
+    static void acceptHandler(evutil_socket_t fd, short which, void *arg);
+    static void reapHandler(evutil_socket_t fd, short which, void *arg);
+
+    std::string destination;
+    std::string auth;
+    std::string passwd;
+    struct event_base *base;
+    Socket *listener;
+    struct event acceptEvent;
+    struct event reapEvent;
+    bool reapScheduled;
+    std::list<Bridge*> bridges;
+};
+
+#endif
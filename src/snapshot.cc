@@ -0,0 +1,673 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "snapshot.h"
+#include "buckets.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <queue>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[8] = { 'V', 'B', 'M', 'S', 'N', 'P', 0, 1 };
+static const char INDEX_MAGIC[8] = { 'V', 'B', 'M', 'S', 'I', 'D', 'X', 1 };
+static const size_t HEADER_SIZE = 16;
+static const size_t ITEM_HEADER_SIZE = 24;
+static const size_t TRAILER_SIZE = 56;
+static const uint64_t BLOOM_BITS_PER_KEY = 10;
+static const uint32_t BLOOM_HASHES = 7;
+
+static void put16(char *p, uint16_t val) {
+    val = htons(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void put32(char *p, uint32_t val) {
+    val = htonl(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void put64(char *p, uint64_t val) {
+    put32(p, static_cast<uint32_t>(val >> 32));
+    put32(p + 4, static_cast<uint32_t>(val));
+}
+
+static uint16_t get16(const char *p) {
+    uint16_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohs(val);
+}
+
+static uint32_t get32(const char *p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return ntohl(val);
+}
+
+static uint64_t get64(const char *p) {
+    return (static_cast<uint64_t>(get32(p)) << 32) | get32(p + 4);
+}
+
+static string describe(const string &what, const string &name) {
+    return what + " " + name + ": " + strerror(errno);
+}
+
+static size_t itemSize(const char *item) {
+    return ITEM_HEADER_SIZE + get16(item) + get32(item + 12);
+}
+
+static int compareKeys(const char *a, size_t alen, const char *b, size_t blen) {
+    int cmp = memcmp(a, b, min(alen, blen));
+    if (cmp != 0) {
+        return cmp;
+    }
+    return alen < blen ? -1 : (alen > blen ? 1 : 0);
+}
+
+/**
+ * Compare the keys of two items
+ */
+static int compareItems(const char *a, const char *b) {
+    return compareKeys(a + ITEM_HEADER_SIZE, get16(a),
+                       b + ITEM_HEADER_SIZE, get16(b));
+}
+
+/**
+ * The Bloom filter uses double hashing: hash i is h1 + i * h2
+ */
+static void bloomHash(const char *key, size_t len, uint32_t &h1, uint32_t &h2) {
+    h1 = crc32(key, len);
+    // FNV-1a
+    h2 = 2166136261U;
+    for (size_t ii = 0; ii < len; ++ii) {
+        h2 = (h2 ^ static_cast<unsigned char>(key[ii])) * 16777619U;
+    }
+    h2 |= 1;
+}
+
+/**
+ * Writes the items, sorted and without duplicates, to the snapshot
+ * file. The file is written under a temporary name, and only renamed
+ * once complete.
+ */
+class SnapshotWriter::Output {
+public:
+    Output(const string &p, uint16_t vb, uint64_t expected) throw (string) :
+        path(p), tmpPath(p + ".tmp"), vbucket(vb), fp(NULL), offset(0),
+        blockStart(0), indexEntries(0), items(0),
+        bloomBits(max(static_cast<uint64_t>(64),
+                      expected * BLOOM_BITS_PER_KEY)),
+        bloom((bloomBits + 7) / 8, 0)
+    {
+        bloomBits = bloom.size() * 8;
+        fp = fopen(tmpPath.c_str(), "wb");
+        if (fp == NULL) {
+            throw describe("Failed to create", tmpPath);
+        }
+        char header[HEADER_SIZE];
+        memset(header, 0, sizeof(header));
+        memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        put16(header + 8, vbucket);
+        write(header, sizeof(header));
+    }
+
+    ~Output() {
+        if (fp != NULL) {
+            fclose(fp);
+            remove(tmpPath.c_str());
+        }
+    }
+
+    void add(const char *item) throw (string) {
+        uint16_t keylen = get16(item);
+        const char *key = item + ITEM_HEADER_SIZE;
+        if (items == 0 || offset - blockStart >= SNAPSHOT_BLOCK_SIZE) {
+            blockStart = offset;
+            char buf[8];
+            put16(buf, keylen);
+            index.insert(index.end(), buf, buf + 2);
+            index.insert(index.end(), key, key + keylen);
+            put64(buf, offset);
+            index.insert(index.end(), buf, buf + 8);
+            ++indexEntries;
+        }
+
+        uint32_t h1, h2;
+        bloomHash(key, keylen, h1, h2);
+        for (uint32_t ii = 0; ii < BLOOM_HASHES; ++ii) {
+            uint64_t bit = (h1 + static_cast<uint64_t>(ii) * h2) % bloomBits;
+            bloom[bit / 8] |= static_cast<unsigned char>(1 << (bit % 8));
+        }
+
+        write(item, itemSize(item));
+        ++items;
+    }
+
+    void close() throw (string) {
+        uint64_t indexOffset = offset;
+        uint64_t bloomOffset = offset + index.size();
+        uint32_t crc = 0;
+        if (!index.empty()) {
+            write(&index[0], index.size());
+            crc = crc32(&index[0], index.size());
+        }
+        write(reinterpret_cast<const char*>(&bloom[0]), bloom.size());
+        crc = crc32(&bloom[0], bloom.size(), crc);
+
+        char trailer[TRAILER_SIZE];
+        memset(trailer, 0, sizeof(trailer));
+        put64(trailer, items);
+        put64(trailer + 8, indexOffset);
+        put64(trailer + 16, bloomOffset);
+        put32(trailer + 24, indexEntries);
+        put32(trailer + 28, static_cast<uint32_t>(bloom.size()));
+        put32(trailer + 32, BLOOM_HASHES);
+        put32(trailer + 36, crc);
+        put16(trailer + 40, vbucket);
+        memcpy(trailer + 48, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        write(trailer, sizeof(trailer));
+
+        if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+            throw describe("Failed to write", tmpPath);
+        }
+        fclose(fp);
+        fp = NULL;
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            string e = describe("Failed to rename", tmpPath);
+            remove(tmpPath.c_str());
+            throw e;
+        }
+    }
+
+    uint64_t getItems() const {
+        return items;
+    }
+
+private:
+    void write(const char *data, size_t size) throw (string) {
+        if (fwrite(data, 1, size, fp) != size) {
+            throw describe("Failed to write", tmpPath);
+        }
+        offset += size;
+    }
+
+    string path;
+    string tmpPath;
+    uint16_t vbucket;
+    FILE *fp;
+    uint64_t offset;
+    uint64_t blockStart;
+    vector<char> index;
+    uint32_t indexEntries;
+    uint64_t items;
+    uint64_t bloomBits;
+    vector<unsigned char> bloom;
+};
+
+/**
+ * Orders the items kept in memory by key
+ */
+class ItemLess {
+public:
+    ItemLess(const char *b) : base(b) { }
+
+    bool operator()(size_t a, size_t b) const {
+        return compareItems(base + a, base + b) < 0;
+    }
+
+private:
+    const char *base;
+};
+
+/**
+ * Reads the items of a run in order
+ */
+class RunReader {
+public:
+    RunReader(const string &n, size_t r) throw (string) :
+        name(n), run(r), fp(fopen(n.c_str(), "rb"))
+    {
+        if (fp == NULL) {
+            throw describe("Failed to open", name);
+        }
+    }
+
+    ~RunReader() {
+        fclose(fp);
+    }
+
+    bool next() throw (string) {
+        item.resize(ITEM_HEADER_SIZE);
+        size_t nr = fread(&item[0], 1, ITEM_HEADER_SIZE, fp);
+        if (nr == 0 && feof(fp)) {
+            return false;
+        }
+        if (nr != ITEM_HEADER_SIZE) {
+            throw "Truncated run " + name;
+        }
+        size_t rest = itemSize(&item[0]) - ITEM_HEADER_SIZE;
+        item.resize(ITEM_HEADER_SIZE + rest);
+        if (rest > 0 && fread(&item[ITEM_HEADER_SIZE], 1, rest, fp) != rest) {
+            throw "Truncated run " + name;
+        }
+        return true;
+    }
+
+    string name;
+    /** The runs written later win over the earlier ones */
+    size_t run;
+    FILE *fp;
+    vector<char> item;
+};
+
+/**
+ * Orders the heap of runs by their current item, and the latest run
+ * first for the same key
+ */
+class RunGreater {
+public:
+    bool operator()(const RunReader *a, const RunReader *b) const {
+        int cmp = compareItems(&a->item[0], &b->item[0]);
+        if (cmp != 0) {
+            return cmp > 0;
+        }
+        return a->run < b->run;
+    }
+};
+
+SnapshotWriter::SnapshotWriter(const string &p, uint16_t vb) :
+    path(p), vbucket(vb), added(0), items(0)
+{
+    // Empty
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    for (size_t ii = 0; ii < runs.size(); ++ii) {
+        remove(runs[ii].c_str());
+    }
+}
+
+void SnapshotWriter::add(const char *key, uint16_t keylen, const char *value,
+                         uint32_t valuelen, uint32_t flags, uint32_t expiry,
+                         uint64_t cas, uint8_t datatype) {
+    char header[ITEM_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    put16(header, keylen);
+    header[2] = static_cast<char>(datatype);
+    put32(header + 4, flags);
+    put32(header + 8, expiry);
+    put32(header + 12, valuelen);
+    put64(header + 16, cas);
+
+    offsets.push_back(arena.size());
+    arena.insert(arena.end(), header, header + sizeof(header));
+    arena.insert(arena.end(), key, key + keylen);
+    arena.insert(arena.end(), value, value + valuelen);
+    ++added;
+}
+
+void SnapshotWriter::sort(vector<size_t> &order) const {
+    order = offsets;
+    // Stable, so that the last of the items with the same key wins
+    if (!arena.empty()) {
+        std::stable_sort(order.begin(), order.end(), ItemLess(&arena[0]));
+    }
+}
+
+string SnapshotWriter::getRunName(size_t n) const {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".run%lu", static_cast<unsigned long>(n));
+    return path + suffix;
+}
+
+void SnapshotWriter::spill() throw (string) {
+    if (offsets.empty()) {
+        return;
+    }
+    vector<size_t> order;
+    sort(order);
+
+    string name = getRunName(runs.size());
+    FILE *fp = fopen(name.c_str(), "wb");
+    if (fp == NULL) {
+        throw describe("Failed to create", name);
+    }
+    runs.push_back(name);
+    for (size_t ii = 0; ii < order.size(); ++ii) {
+        const char *item = &arena[order[ii]];
+        if (ii + 1 < order.size() &&
+            compareItems(item, &arena[order[ii + 1]]) == 0) {
+            continue;
+        }
+        size_t size = itemSize(item);
+        if (fwrite(item, 1, size, fp) != size) {
+            fclose(fp);
+            throw describe("Failed to write", name);
+        }
+    }
+    if (fclose(fp) != 0) {
+        throw describe("Failed to write", name);
+    }
+
+    // Give the memory back
+    vector<char>().swap(arena);
+    vector<size_t>().swap(offsets);
+}
+
+void SnapshotWriter::merge(Output &out) throw (string) {
+    vector<RunReader*> readers;
+    priority_queue<RunReader*, vector<RunReader*>, RunGreater> heap;
+    try {
+        for (size_t ii = 0; ii < runs.size(); ++ii) {
+            readers.push_back(new RunReader(runs[ii], ii));
+            if (readers.back()->next()) {
+                heap.push(readers.back());
+            }
+        }
+
+        vector<char> last;
+        while (!heap.empty()) {
+            RunReader *top = heap.top();
+            heap.pop();
+            out.add(&top->item[0]);
+            last = top->item;
+            if (top->next()) {
+                heap.push(top);
+            }
+            // Skip the older versions of the item
+            while (!heap.empty() &&
+                   compareItems(&heap.top()->item[0], &last[0]) == 0) {
+                RunReader *older = heap.top();
+                heap.pop();
+                if (older->next()) {
+                    heap.push(older);
+                }
+            }
+        }
+    } catch (string &) {
+        for (size_t ii = 0; ii < readers.size(); ++ii) {
+            delete readers[ii];
+        }
+        throw;
+    }
+    for (size_t ii = 0; ii < readers.size(); ++ii) {
+        delete readers[ii];
+    }
+}
+
+void SnapshotWriter::close() throw (string) {
+    if (runs.empty()) {
+        // Everything fits in memory
+        vector<size_t> order;
+        sort(order);
+        Output out(path, vbucket, order.size());
+        for (size_t ii = 0; ii < order.size(); ++ii) {
+            const char *item = &arena[order[ii]];
+            if (ii + 1 < order.size() &&
+                compareItems(item, &arena[order[ii + 1]]) == 0) {
+                continue;
+            }
+            out.add(item);
+        }
+        out.close();
+        items = out.getItems();
+    } else {
+        spill();
+        Output out(path, vbucket, added);
+        merge(out);
+        out.close();
+        items = out.getItems();
+    }
+
+    for (size_t ii = 0; ii < runs.size(); ++ii) {
+        remove(runs[ii].c_str());
+    }
+    runs.clear();
+    vector<char>().swap(arena);
+    vector<size_t>().swap(offsets);
+}
+
+SnapshotExporter::SnapshotExporter(const string &d, size_t m) :
+    dir(d), memory(m), buffered(0), closed(false), items(0), runs(0)
+{
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        error = describe("Failed to create", dir);
+    }
+}
+
+SnapshotExporter::~SnapshotExporter() {
+    map<uint16_t, SnapshotWriter*>::iterator iter;
+    for (iter = writers.begin(); iter != writers.end(); ++iter) {
+        delete iter->second;
+    }
+}
+
+string SnapshotExporter::getSnapshotName(const string &dir, uint16_t vbucket) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%u.snap", static_cast<unsigned int>(vbucket));
+    return dir + name;
+}
+
+SnapshotWriter *SnapshotExporter::getWriter(uint16_t vbucket) {
+    SnapshotWriter *&writer = writers[vbucket];
+    if (writer == NULL) {
+        writer = new SnapshotWriter(getSnapshotName(dir, vbucket), vbucket);
+    }
+    return writer;
+}
+
+void SnapshotExporter::open(uint16_t vbucket) {
+    getWriter(vbucket);
+}
+
+void SnapshotExporter::add(uint16_t vbucket, const char *key, uint16_t keylen,
+                           const char *value, uint32_t valuelen,
+                           uint32_t flags, uint32_t expiry, uint64_t cas,
+                           uint8_t datatype) {
+    if (!error.empty() || closed) {
+        return;
+    }
+
+    SnapshotWriter *writer = getWriter(vbucket);
+    writer->add(key, keylen, value, valuelen, flags, expiry, cas, datatype);
+    buffered += ITEM_HEADER_SIZE + keylen + valuelen;
+
+    // Spill the vbuckets using the most memory first
+    while (buffered > memory) {
+        SnapshotWriter *largest = NULL;
+        map<uint16_t, SnapshotWriter*>::iterator iter;
+        for (iter = writers.begin(); iter != writers.end(); ++iter) {
+            if (largest == NULL ||
+                iter->second->getBuffered() > largest->getBuffered()) {
+                largest = iter->second;
+            }
+        }
+        buffered -= largest->getBuffered();
+        try {
+            largest->spill();
+            ++runs;
+        } catch (string &e) {
+            error = e;
+            return;
+        }
+    }
+}
+
+bool SnapshotExporter::close() {
+    if (closed) {
+        return error.empty();
+    }
+    closed = true;
+    map<uint16_t, SnapshotWriter*>::iterator iter;
+    for (iter = writers.begin(); iter != writers.end() && error.empty();
+         ++iter) {
+        try {
+            iter->second->close();
+            items += iter->second->getItems();
+        } catch (string &e) {
+            error = e;
+        }
+    }
+    buffered = 0;
+    return error.empty();
+}
+
+SnapshotReader::SnapshotReader(const string &p) throw (string) :
+    path(p), fd(-1), map(NULL), mapSize(0), items(0), vbucket(0),
+    indexOffset(0), bloom(NULL), bloomBits(0), bloomHashes(0)
+{
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw describe("Failed to open", path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        string e = describe("Failed to stat", path);
+        ::close(fd);
+        throw e;
+    }
+    mapSize = st.st_size;
+    if (mapSize < HEADER_SIZE + TRAILER_SIZE) {
+        ::close(fd);
+        throw "Not a snapshot: " + path;
+    }
+    void *addr = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        string e = describe("Failed to map", path);
+        ::close(fd);
+        throw e;
+    }
+    map = static_cast<const char*>(addr);
+
+    const char *trailer = map + mapSize - TRAILER_SIZE;
+    if (memcmp(map, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        memcmp(trailer + 48, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+        munmap(const_cast<char*>(map), mapSize);
+        ::close(fd);
+        throw "Not a snapshot: " + path;
+    }
+
+    items = get64(trailer);
+    indexOffset = get64(trailer + 8);
+    uint64_t bloomOffset = get64(trailer + 16);
+    uint32_t entries = get32(trailer + 24);
+    uint32_t bloomBytes = get32(trailer + 28);
+    bloomHashes = get32(trailer + 32);
+    vbucket = get16(trailer + 40);
+
+    bool valid = indexOffset >= HEADER_SIZE && bloomOffset >= indexOffset &&
+        bloomBytes > 0 && bloomOffset + bloomBytes + TRAILER_SIZE == mapSize &&
+        crc32(map + indexOffset, mapSize - TRAILER_SIZE - indexOffset) ==
+        get32(trailer + 36);
+
+    // The index is checked by the CRC, but not its contents
+    const char *ptr = map + indexOffset;
+    const char *end = map + bloomOffset;
+    for (uint32_t ii = 0; valid && ii < entries; ++ii) {
+        if (ptr + 2 > end || ptr + 2 + get16(ptr) + 8 > end) {
+            valid = false;
+            break;
+        }
+        uint16_t keylen = get16(ptr);
+        uint64_t offset = get64(ptr + 2 + keylen);
+        if (offset < HEADER_SIZE || offset >= indexOffset) {
+            valid = false;
+            break;
+        }
+        blocks.push_back(make_pair(string(ptr + 2, keylen), offset));
+        ptr += 2 + keylen + 8;
+    }
+    if (!valid || ptr != end) {
+        munmap(const_cast<char*>(map), mapSize);
+        ::close(fd);
+        throw "Corrupt snapshot index in " + path;
+    }
+
+    bloom = reinterpret_cast<const unsigned char*>(map + bloomOffset);
+    bloomBits = static_cast<uint64_t>(bloomBytes) * 8;
+}
+
+SnapshotReader::~SnapshotReader() {
+    munmap(const_cast<char*>(map), mapSize);
+    ::close(fd);
+}
+
+bool SnapshotReader::mayContain(const string &key) const {
+    uint32_t h1, h2;
+    bloomHash(key.data(), key.length(), h1, h2);
+    for (uint32_t ii = 0; ii < bloomHashes; ++ii) {
+        uint64_t bit = (h1 + static_cast<uint64_t>(ii) * h2) % bloomBits;
+        if ((bloom[bit / 8] & (1 << (bit % 8))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Orders the blocks by their first key
+ */
+static bool keyBeforeBlock(const string &key,
+                           const pair<string, uint64_t> &block) {
+    return key < block.first;
+}
+
+bool SnapshotReader::get(const string &key, SnapshotItem &item) const {
+    if (blocks.empty() || !mayContain(key)) {
+        return false;
+    }
+
+    // The key can only be in the last block starting at or before it
+    vector<pair<string, uint64_t> >::const_iterator block;
+    block = upper_bound(blocks.begin(), blocks.end(), key, keyBeforeBlock);
+    if (block == blocks.begin()) {
+        return false;
+    }
+    const char *p = map + (block - 1)->second;
+    const char *end = map + (block == blocks.end() ? indexOffset : block->second);
+
+    while (p + ITEM_HEADER_SIZE <= end) {
+        uint16_t keylen = get16(p);
+        size_t size = itemSize(p);
+        if (p + size > end) {
+            break;
+        }
+        int cmp = compareKeys(p + ITEM_HEADER_SIZE, keylen,
+                              key.data(), key.length());
+        if (cmp == 0) {
+            item.key.assign(p + ITEM_HEADER_SIZE, keylen);
+            item.value.assign(p + ITEM_HEADER_SIZE + keylen, get32(p + 12));
+            item.datatype = static_cast<uint8_t>(p[2]);
+            item.flags = get32(p + 4);
+            item.expiry = get32(p + 8);
+            item.cas = get64(p + 16);
+            return true;
+        }
+        if (cmp > 0) {
+            break;
+        }
+        p += size;
+    }
+    return false;
+}
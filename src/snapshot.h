@@ -0,0 +1,257 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H 1
+
+#include "config.h"
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+ * The items of a vbucket are written to the snapshot in blocks of
+ * about this many bytes, each of them listed in the index
+ */
+const size_t SNAPSHOT_BLOCK_SIZE = 4096;
+
+/**
+ * The memory used for sorting the items of all of the vbuckets of an
+ * export before they are spilled to disk
+ */
+const size_t SNAPSHOT_MEMORY = 64 * 1024 * 1024;
+
+/**
+ * A snapshot holds the items of one vbucket sorted by key. All of the
+ * numbers are in network byte order. The file starts with a 16 byte
+ * header:
+ *
+ *   "VBMSNP\0\1", the vbucket (2 bytes), 6 bytes unused
+ *
+ * followed by the items, each of them made of:
+ *
+ *   the length of the key (2 bytes), the datatype (1 byte), 1 byte
+ *   unused, the flags (4 bytes), the expiry time (4 bytes), the
+ *   length of the value (4 bytes), the CAS (8 bytes), the key and the
+ *   value
+ *
+ * The items are grouped in blocks starting every SNAPSHOT_BLOCK_SIZE
+ * bytes or so. The items are followed by the index, with an entry per
+ * block:
+ *
+ *   the length of the first key of the block (2 bytes), the key, and
+ *   the offset of the block (8 bytes)
+ *
+ * then by a Bloom filter of the keys (10 bits per key), and a 56 byte
+ * trailer:
+ *
+ *   the number of items (8 bytes), the offset of the index (8 bytes),
+ *   the offset of the Bloom filter (8 bytes), the number of index
+ *   entries (4 bytes), the size of the Bloom filter (4 bytes), the
+ *   number of hashes of the Bloom filter (4 bytes), the CRC32 of the
+ *   index and the Bloom filter (4 bytes), the vbucket (2 bytes), 6
+ *   bytes unused, "VBMSIDX\1"
+ */
+class SnapshotItem {
+public:
+    SnapshotItem() : flags(0), expiry(0), cas(0), datatype(0) { }
+
+    std::string key;
+    std::string value;
+    uint32_t flags;
+    uint32_t expiry;
+    uint64_t cas;
+    uint8_t datatype;
+};
+
+/**
+ * Writes the snapshot of a vbucket. The items are kept in memory until
+ * they're spilled to disk as a sorted run, and the runs are merged
+ * into the snapshot when it is closed. When a key is added more than
+ * once, the last one wins.
+ */
+class SnapshotWriter {
+public:
+    SnapshotWriter(const std::string &path, uint16_t vbucket);
+
+    /**
+     * Remove the runs left behind, if any
+     */
+    ~SnapshotWriter();
+
+    void add(const char *key, uint16_t keylen, const char *value,
+             uint32_t valuelen, uint32_t flags, uint32_t expiry,
+             uint64_t cas, uint8_t datatype);
+
+    /**
+     * Get the number of bytes of items kept in memory
+     */
+    size_t getBuffered() const {
+        return arena.size();
+    }
+
+    /**
+     * Write the items kept in memory to a sorted run
+     * @throw std::string if the run can't be written
+     */
+    void spill() throw (std::string);
+
+    /**
+     * Merge the runs into the snapshot
+     * @throw std::string if the snapshot can't be written
+     */
+    void close() throw (std::string);
+
+    /**
+     * Get the number of items in the snapshot (once closed)
+     */
+    uint64_t getItems() const {
+        return items;
+    }
+
+    size_t getRuns() const {
+        return runs.size();
+    }
+
+private:
+    class Output;
+
+    void sort(std::vector<size_t> &order) const;
+    std::string getRunName(size_t n) const;
+    void merge(Output &out) throw (std::string);
+
+    std::string path;
+    uint16_t vbucket;
+    /** The items in memory, and where each of them starts */
+    std::vector<char> arena;
+    std::vector<size_t> offsets;
+    std::vector<std::string> runs;
+    /** The number of items added (including the duplicates) */
+    uint64_t added;
+    uint64_t items;
+};
+
+/**
+ * Exports the items of many vbuckets to a directory, one snapshot per
+ * vbucket, keeping the memory used by all of them under a limit by
+ * spilling the largest ones to disk. The first error is kept, and the
+ * items added after it are ignored.
+ */
+class SnapshotExporter {
+public:
+    SnapshotExporter(const std::string &dir, size_t memory = SNAPSHOT_MEMORY);
+    ~SnapshotExporter();
+
+    /**
+     * Make sure vbucket gets a snapshot, even if it has no items
+     */
+    void open(uint16_t vbucket);
+
+    void add(uint16_t vbucket, const char *key, uint16_t keylen,
+             const char *value, uint32_t valuelen, uint32_t flags,
+             uint32_t expiry, uint64_t cas, uint8_t datatype);
+
+    /**
+     * Write the snapshots of all of the vbuckets
+     * @return false if something went wrong (see getError())
+     */
+    bool close();
+
+    const std::string &getError() const {
+        return error;
+    }
+
+    uint64_t getItems() const {
+        return items;
+    }
+
+    size_t getVBuckets() const {
+        return writers.size();
+    }
+
+    size_t getRuns() const {
+        return runs;
+    }
+
+    /**
+     * Get the name of the snapshot of vbucket in dir
+     */
+    static std::string getSnapshotName(const std::string &dir,
+                                       uint16_t vbucket);
+
+private:
+    SnapshotWriter *getWriter(uint16_t vbucket);
+
+    std::string dir;
+    size_t memory;
+    size_t buffered;
+    std::map<uint16_t, SnapshotWriter*> writers;
+    std::string error;
+    bool closed;
+    uint64_t items;
+    size_t runs;
+};
+
+/**
+ * Looks up keys in a snapshot through mmap: the Bloom filter rules out
+ * most of the keys that aren't there, and the index leads to the only
+ * block that may hold the key.
+ */
+class SnapshotReader {
+public:
+    /**
+     * @throw std::string if the file isn't a valid snapshot
+     */
+    SnapshotReader(const std::string &path) throw (std::string);
+    ~SnapshotReader();
+
+    /**
+     * Look up key
+     * @return false if the snapshot doesn't have it
+     */
+    bool get(const std::string &key, SnapshotItem &item) const;
+
+    /**
+     * May the snapshot have key? (false if it certainly doesn't)
+     */
+    bool mayContain(const std::string &key) const;
+
+    uint64_t getItems() const {
+        return items;
+    }
+
+    uint16_t getVBucket() const {
+        return vbucket;
+    }
+
+private:
+    std::string path;
+    int fd;
+    const char *map;
+    size_t mapSize;
+    uint64_t items;
+    uint16_t vbucket;
+    uint64_t indexOffset;
+    /** The first key and the offset of every block */
+    std::vector<std::pair<std::string, uint64_t> > blocks;
+    const unsigned char *bloom;
+    uint64_t bloomBits;
+    uint32_t bloomHashes;
+};
+
+#endif
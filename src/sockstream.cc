@@ -145,7 +145,7 @@ void Socket::resolve(void) throw (string)
     }
 }
 
-void Socket::connect(void) throw (string)
+void Socket::connect(bool blocking) throw (string)
 {
     if (sock != INVALID_SOCKET) {
         throw "Can't call connect() with an open Socket. Call close()!!";
@@ -160,7 +160,15 @@ void Socket::connect(void) throw (string)
             continue;
         }
 
+        if (!blocking) {
+            setNonBlocking();
+        }
+
         if (::connect(sock, next->ai_addr, next->ai_addrlen) == SOCKET_ERROR) {
+            if (!blocking && (get_socket_errno() == EINPROGRESS ||
+                              get_socket_errno() == EWOULDBLOCK)) {
+                break;
+            }
             closesocket(sock);
             sock = INVALID_SOCKET;
             continue;
@@ -174,6 +182,28 @@ void Socket::connect(void) throw (string)
         msg << "Failed to connect to [" << host << ":" << port << "]";
         throw msg.str();
     }
+
+    // Even a connection completed right away is left to
+    // finishConnect(), so that there's a single place to learn about it
+    connecting = !blocking;
+}
+
+void Socket::finishConnect(void) throw (string)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR,
+                   reinterpret_cast<char*>(&error), &len) == SOCKET_ERROR) {
+        error = get_socket_errno();
+    }
+
+    if (error != 0) {
+        stringstream msg;
+        msg << "Failed to connect to [" << host << ":" << port << "]: "
+            << strerror(error);
+        throw msg.str();
+    }
+    connecting = false;
 }
 
 void Socket::close(void) {
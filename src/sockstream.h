@@ -29,14 +29,15 @@ class isockstream;
 class Socket {
 
 public:
-    Socket(SOCKET s) : sock(s), host(""), port(0),
-                       in(NULL), out(NULL), ai(NULL)
+    Socket(SOCKET s) : sock(s), host(""), port(""),
+                       in(NULL), out(NULL), ai(NULL), connecting(false)
     {
         // @todo use getpeername to lookup the peers name
     }
 
     Socket(const std::string &h) : sock(INVALID_SOCKET), host(h), port("11211"),
-                                   in(NULL), out(NULL), ai(NULL) {
+                                   in(NULL), out(NULL), ai(NULL),
+                                   connecting(false) {
         ssize_t s = host.find(":");
         if (s != -1) {
             port = host.substr(s + 1);
@@ -46,7 +47,8 @@ public:
 
     Socket(const std::string &h, in_port_t p) : sock(INVALID_SOCKET),
                                                 host(h), port(), in(NULL),
-                                                out(NULL), ai(NULL) {
+                                                out(NULL), ai(NULL),
+                                                connecting(false) {
         std::stringstream ss;
         ss << p;
         port.assign(ss.str());
@@ -78,7 +80,25 @@ public:
     void setKeepalive(bool enable) throw (std::string);
 
     void resolve(void) throw (std::string);
-    void connect(void) throw (std::string);
+    /**
+     * Connect to the first address of the host accepting the connection.
+     * Without blocking, the socket is made non-blocking and the
+     * connection to the first address completes in the background
+     * (see finishConnect()).
+     */
+    void connect(bool blocking = true) throw (std::string);
+
+    /**
+     * Complete a connection started without blocking, once the socket
+     * is ready
+     * @throw std::string if the connection failed
+     */
+    void finishConnect(void) throw (std::string);
+
+    /**
+     * Was the connection started without blocking, and never completed?
+     */
+    bool isConnecting() const { return connecting; }
     void close(void);
 
     SOCKET getSocket() const { return sock; }
@@ -92,6 +112,7 @@ protected:
     isockstream *in;
     osockstream *out;
     struct addrinfo *ai;
+    bool connecting;
 };
 
 #endif
@@ -0,0 +1,399 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "transform.h"
+#include "buckets.h"
+
+#include <algorithm>
+#include <ctime>
+#ifdef HAVE_SNAPPY_C_H
+#include <snappy-c.h>
+#endif
+
+using namespace std;
+
+/**
+ * Smaller expiry times are relative to the time the item was stored
+ */
+static const uint32_t MAX_RELATIVE_EXPIRY = 60 * 60 * 24 * 30;
+
+ExpiredItemTransform::ExpiredItemTransform(uint32_t s) : skew(s) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+ExpiredItemTransform::~ExpiredItemTransform() {
+    pthread_mutex_destroy(&mutex);
+}
+
+bool ExpiredItemTransform::apply(BinaryMessage *msg) {
+    uint32_t expiry = ntohl(msg->data.mutation->message.body.item.expiration);
+    if (expiry <= MAX_RELATIVE_EXPIRY ||
+        static_cast<time_t>(expiry) + skew >= time(NULL)) {
+        return true;
+    }
+
+    pthread_mutex_lock(&mutex);
+    Dropped &d = dropped[msg->getVBucketId()];
+    ++d.items;
+    d.bytes += msg->size;
+    pthread_mutex_unlock(&mutex);
+    return false;
+}
+
+uint64_t ExpiredItemTransform::getDropped() const {
+    uint64_t items = 0;
+    pthread_mutex_lock(&mutex);
+    map<uint16_t, Dropped>::const_iterator iter;
+    for (iter = dropped.begin(); iter != dropped.end(); ++iter) {
+        items += iter->second.items;
+    }
+    pthread_mutex_unlock(&mutex);
+    return items;
+}
+
+void ExpiredItemTransform::getStats(ostream &out, bool perVBucket) const {
+    Dropped total;
+    pthread_mutex_lock(&mutex);
+    map<uint16_t, Dropped>::const_iterator iter;
+    for (iter = dropped.begin(); iter != dropped.end(); ++iter) {
+        total.items += iter->second.items;
+        total.bytes += iter->second.bytes;
+    }
+    out << "Dropped " << total.items << " expired items (" << total.bytes
+        << " bytes)" << endl;
+    if (perVBucket) {
+        for (iter = dropped.begin(); iter != dropped.end(); ++iter) {
+            out << "  vbucket " << iter->first << ": " << iter->second.items
+                << " items (" << iter->second.bytes << " bytes)" << endl;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * The datatype of Snappy compressed values
+ * (PROTOCOL_BINARY_DATATYPE_COMPRESSED in newer versions of memcached)
+ */
+static const uint8_t DATATYPE_SNAPPY = 0x02;
+
+/**
+ * Compression is turned off for a vbucket if the last SAMPLE_SIZE
+ * values didn't shrink by at least 1/MIN_SAVINGS, and sampled again
+ * after RETRY_AFTER values
+ */
+static const size_t SAMPLE_SIZE = 64;
+static const size_t MIN_SAVINGS = 8;
+static const size_t RETRY_AFTER = 4096;
+
+CompressTransform::CompressTransform(size_t t) throw (std::string) :
+    threshold(t)
+{
+#ifndef HAVE_SNAPPY_C_H
+    throw string("Not built with Snappy support");
+#endif
+    if (pthread_key_create(&key, NULL) != 0) {
+        throw string("Failed to create the compression statistics key");
+    }
+    pthread_mutex_init(&mutex, NULL);
+}
+
+CompressTransform::~CompressTransform() {
+    // The shards are owned by us and not by the threads, so there is no
+    // destructor for the key
+    pthread_key_delete(key);
+    for (size_t ii = 0; ii < shards.size(); ++ii) {
+        delete shards[ii];
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+CompressTransform::Shard &CompressTransform::getShard() {
+    Shard *shard = static_cast<Shard*>(pthread_getspecific(key));
+    if (shard == NULL) {
+        shard = new Shard;
+        pthread_mutex_lock(&mutex);
+        shards.push_back(shard);
+        pthread_mutex_unlock(&mutex);
+        pthread_setspecific(key, shard);
+    }
+    return *shard;
+}
+
+bool CompressTransform::apply(BinaryMessage *msg) {
+#ifdef HAVE_SNAPPY_C_H
+    size_t length = msg->getValueLength();
+    if (length < threshold ||
+        msg->data.req->request.datatype != PROTOCOL_BINARY_RAW_BYTES) {
+        return true;
+    }
+
+    // Nobody else updates our shard, so the lock is uncontended unless
+    // the statistics are being collected at the same time
+    Shard &shard = getShard();
+    pthread_mutex_lock(&shard.mutex);
+    VBucket &vb = shard.vbuckets[msg->getVBucketId()];
+    if (vb.skip > 0) {
+        --vb.skip;
+        pthread_mutex_unlock(&shard.mutex);
+        return true;
+    }
+    pthread_mutex_unlock(&shard.mutex);
+
+    // Compress straight into the new message
+    size_t offset = msg->getValueBytes() - msg->data.rawBytes;
+    size_t clen = snappy_max_compressed_length(length);
+    char *bytes = new char[offset + clen];
+    if (snappy_compress(msg->getValueBytes(), length, bytes + offset,
+                        &clen) != SNAPPY_OK) {
+        clen = length;
+    }
+
+    pthread_mutex_lock(&shard.mutex);
+    sample(shard, vb, length, clen);
+    pthread_mutex_unlock(&shard.mutex);
+
+    if (clen >= length) {
+        delete []bytes;
+        return true;
+    }
+    memcpy(bytes, msg->data.rawBytes, offset);
+    msg->replaceValue(bytes, offset + clen);
+    msg->data.req->request.datatype = DATATYPE_SNAPPY;
+#else
+    (void)msg;
+#endif
+    return true;
+}
+
+void CompressTransform::sample(Shard &shard, VBucket &vb, size_t length,
+                               size_t clen) {
+    if (clen < length) {
+        ++shard.compressed;
+        shard.bytesIn += length;
+        shard.bytesOut += clen;
+    }
+
+    vb.bytesIn += length;
+    vb.bytesOut += std::min(clen, length);
+    if (++vb.samples == SAMPLE_SIZE) {
+        if (vb.bytesIn - vb.bytesOut < vb.bytesIn / MIN_SAVINGS) {
+            vb.skip = RETRY_AFTER;
+            ++shard.turnedOff;
+        }
+        vb.samples = 0;
+        vb.bytesIn = vb.bytesOut = 0;
+    }
+}
+
+void CompressTransform::getStats(ostream &out) const {
+    uint64_t compressed = 0, bytesIn = 0, bytesOut = 0, turnedOff = 0;
+    pthread_mutex_lock(&mutex);
+    for (size_t ii = 0; ii < shards.size(); ++ii) {
+        Shard *shard = shards[ii];
+        pthread_mutex_lock(&shard->mutex);
+        compressed += shard->compressed;
+        bytesIn += shard->bytesIn;
+        bytesOut += shard->bytesOut;
+        turnedOff += shard->turnedOff;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    out << "Compressed " << compressed << " values (" << bytesIn
+        << " bytes to " << bytesOut << " bytes), turned compression off "
+        << turnedOff << " times" << endl;
+}
+
+bool KeyPrefixTransform::apply(BinaryMessage *msg) {
+    uint16_t keylen = msg->getKeyLength();
+    if (keylen < from.length() ||
+        memcmp(msg->getKeyBytes(), from.data(), from.length()) != 0) {
+        return true;
+    }
+
+    if (keylen - from.length() + to.length() > 0xffff) {
+        // It wouldn't fit in the message, so leave it alone
+        return true;
+    }
+
+    msg->setKeyPrefix(static_cast<uint16_t>(from.length()), to.data(),
+                      static_cast<uint16_t>(to.length()));
+    return true;
+}
+
+bool ReshardTransform::apply(BinaryMessage *msg) {
+    msg->data.req->request.vbucket =
+        htons(getVBucketByKey(msg->getKeyBytes(), msg->getKeyLength(),
+                              numVBuckets));
+    return true;
+}
+
+TransformPipeline::~TransformPipeline() {
+    vector<Transform*>::iterator iter;
+    for (iter = transforms.begin(); iter != transforms.end(); ++iter) {
+        delete *iter;
+    }
+}
+
+void TransformPipeline::add(Transform *transform) {
+    transforms.push_back(transform);
+    for (int opcode = 0; opcode < 256; ++opcode) {
+        if (transform->handles(static_cast<uint8_t>(opcode))) {
+            table[opcode].push_back(transform);
+        }
+    }
+}
+
+void PrefixSet::add(const string &prefix) {
+    size_t node = 0;
+    for (size_t ii = 0; ii < prefix.length(); ++ii) {
+        unsigned char c = static_cast<unsigned char>(prefix[ii]);
+        vector<pair<unsigned char, size_t> > &children = nodes[node].children;
+        vector<pair<unsigned char, size_t> >::iterator iter;
+        iter = lower_bound(children.begin(), children.end(),
+                           make_pair(c, static_cast<size_t>(0)));
+        if (iter != children.end() && iter->first == c) {
+            node = iter->second;
+        } else {
+            size_t child = nodes.size();
+            children.insert(iter, make_pair(c, child));
+            nodes.push_back(Node());
+            node = child;
+        }
+    }
+    nodes[node].terminal = true;
+}
+
+bool PrefixSet::matches(const char *key, size_t nkey) const {
+    const Node *node = &nodes[0];
+    for (size_t ii = 0; !node->terminal; ++ii) {
+        if (ii == nkey) {
+            return false;
+        }
+        unsigned char c = static_cast<unsigned char>(key[ii]);
+        const vector<pair<unsigned char, size_t> > &children = node->children;
+        size_t jj = 0;
+        while (jj < children.size() && children[jj].first < c) {
+            ++jj;
+        }
+        if (jj == children.size() || children[jj].first != c) {
+            return false;
+        }
+        node = &nodes[children[jj].second];
+    }
+    return true;
+}
+
+#ifdef HAVE_REGEX_H
+static void compile(vector<regex_t*> &compiled,
+                    const vector<string> &patterns) throw (std::string) {
+    vector<string>::const_iterator iter;
+    for (iter = patterns.begin(); iter != patterns.end(); ++iter) {
+        regex_t *re = new regex_t;
+        int rc = regcomp(re, iter->c_str(), REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char buffer[256];
+            regerror(rc, re, buffer, sizeof(buffer));
+            delete re;
+            throw "Invalid regular expression \"" + *iter + "\": " + buffer;
+        }
+        compiled.push_back(re);
+    }
+}
+
+static void release(vector<regex_t*> &compiled) {
+    vector<regex_t*>::iterator iter;
+    for (iter = compiled.begin(); iter != compiled.end(); ++iter) {
+        regfree(*iter);
+        delete *iter;
+    }
+    compiled.clear();
+}
+
+bool KeyFilterTransform::matches(const vector<regex_t*> &patterns,
+                                 const string &key) {
+    vector<regex_t*>::const_iterator iter;
+    for (iter = patterns.begin(); iter != patterns.end(); ++iter) {
+        if (regexec(*iter, key.c_str(), 0, NULL, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+KeyFilterTransform::KeyFilterTransform(const vector<string> &includePrefixes,
+                                       const vector<string> &excludePrefixes,
+                                       const vector<string> &inc,
+                                       const vector<string> &exc) throw (std::string) :
+    hasInclude(!includePrefixes.empty() || !inc.empty())
+{
+    for (size_t ii = 0; ii < includePrefixes.size(); ++ii) {
+        include.add(includePrefixes[ii]);
+    }
+    for (size_t ii = 0; ii < excludePrefixes.size(); ++ii) {
+        exclude.add(excludePrefixes[ii]);
+    }
+
+#ifdef HAVE_REGEX_H
+    try {
+        compile(includePatterns, inc);
+        compile(excludePatterns, exc);
+    } catch (string &e) {
+        release(includePatterns);
+        release(excludePatterns);
+        throw;
+    }
+#else
+    if (!inc.empty() || !exc.empty()) {
+        throw string("Not built with regular expression support");
+    }
+#endif
+}
+
+KeyFilterTransform::~KeyFilterTransform() {
+#ifdef HAVE_REGEX_H
+    release(includePatterns);
+    release(excludePatterns);
+#endif
+}
+
+bool KeyFilterTransform::apply(BinaryMessage *msg) {
+    const char *key = msg->getKeyBytes();
+    size_t nkey = msg->getKeyLength();
+    if (exclude.matches(key, nkey)) {
+        return false;
+    }
+    bool included = !hasInclude || include.matches(key, nkey);
+
+#ifdef HAVE_REGEX_H
+    if (included && excludePatterns.empty()) {
+        return true;
+    }
+    if (!included && includePatterns.empty()) {
+        return false;
+    }
+
+    // The regular expressions need a copy of the key to terminate it
+    string k(key, nkey);
+    if (!included) {
+        included = matches(includePatterns, k);
+    }
+    return included && !matches(excludePatterns, k);
+#else
+    return included;
+#endif
+}
@@ -0,0 +1,395 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef TRANSFORM_H
+#define TRANSFORM_H 1
+
+#include "config.h"
+#include "binarymessage.h"
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#ifdef HAVE_REGEX_H
+#include <regex.h>
+#endif
+
+/**
+ * A step of a TransformPipeline, modifying (or dropping) the messages
+ * on their way to the destination. apply() is only called for the
+ * opcodes the transform handles, and may be called on several worker
+ * threads at the same time.
+ */
+class Transform {
+public:
+    virtual ~Transform() {}
+
+    /**
+     * Should apply() be called for messages with this opcode?
+     */
+    virtual bool handles(uint8_t opcode) const = 0;
+
+    /**
+     * Transform a message
+     * @return false if the message should be dropped
+     */
+    virtual bool apply(BinaryMessage *msg) = 0;
+};
+
+/**
+ * Reset the expiry time of the items
+ */
+class ExpiryTransform : public Transform {
+public:
+    ExpiryTransform(uint32_t e) : expiry(htonl(e)) { }
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION;
+    }
+
+    bool apply(BinaryMessage *msg) {
+        msg->data.mutation->message.body.item.expiration = expiry;
+        return true;
+    }
+
+private:
+    uint32_t expiry;
+};
+
+/**
+ * Reset the flags of the items
+ */
+class FlagsTransform : public Transform {
+public:
+    FlagsTransform(uint32_t f) : flags(htonl(f)) { }
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION;
+    }
+
+    bool apply(BinaryMessage *msg) {
+        msg->data.mutation->message.body.item.flags = flags;
+        return true;
+    }
+
+private:
+    uint32_t flags;
+};
+
+/**
+ * Drop the messages about the state of the vbuckets of the source,
+ * which mean nothing to a cluster with a different number of vbuckets
+ * (and a TAP_OPAQUE starting a vbucket stream would reset the vbucket
+ * with the same id on the destination).
+ */
+class VBucketStateFilter : public Transform {
+public:
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_OPAQUE ||
+            opcode == PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET;
+    }
+
+    bool apply(BinaryMessage *msg) {
+        (void)msg;
+        return false;
+    }
+};
+
+/**
+ * Drop the items that have already expired. Only the absolute expiry
+ * times are checked (relative ones can't have passed yet), and an item
+ * must have expired more than skew seconds ago to be dropped, to allow
+ * for the difference between the clocks of the source and us.
+ */
+class ExpiredItemTransform : public Transform {
+public:
+    ExpiredItemTransform(uint32_t skew);
+    ~ExpiredItemTransform();
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION;
+    }
+
+    bool apply(BinaryMessage *msg);
+
+    /**
+     * Get the number of items dropped
+     */
+    uint64_t getDropped() const;
+
+    /**
+     * Print the number of items and bytes dropped, in total and for
+     * each vbucket if perVBucket is set
+     */
+    void getStats(std::ostream &out, bool perVBucket) const;
+
+private:
+    class Dropped {
+    public:
+        Dropped() : items(0), bytes(0) { }
+
+        uint64_t items;
+        uint64_t bytes;
+    };
+
+    uint32_t skew;
+    /** The counters are updated from the worker threads */
+    mutable pthread_mutex_t mutex;
+    std::map<uint16_t, Dropped> dropped;
+};
+
+/**
+ * Compress the values of the items with Snappy before they are sent.
+ * The compression ratio is sampled for each vbucket, and compression
+ * is turned off for a while for the vbuckets where it doesn't pay.
+ *
+ * Each thread applying the transform samples into a shard of its own,
+ * so the worker threads don't serialize on a shared lock.
+ */
+class CompressTransform : public Transform {
+public:
+    /**
+     * Compress the values of at least threshold bytes
+     * @throw std::string if we're not built with Snappy support
+     */
+    CompressTransform(size_t threshold) throw (std::string);
+    ~CompressTransform();
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION;
+    }
+
+    bool apply(BinaryMessage *msg);
+
+    /**
+     * Print the number of values compressed and the bytes saved
+     */
+    void getStats(std::ostream &out) const;
+
+private:
+    class VBucket {
+    public:
+        VBucket() : samples(0), bytesIn(0), bytesOut(0), skip(0) { }
+
+        size_t samples;
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+        /** The number of values to send uncompressed before sampling again */
+        size_t skip;
+    };
+
+    /**
+     * The sampling state and the counters of a single thread. Only the
+     * owning thread updates it, and its lock is only contended while
+     * the statistics are collected.
+     */
+    class Shard {
+    public:
+        Shard() : compressed(0), bytesIn(0), bytesOut(0), turnedOff(0) {
+            pthread_mutex_init(&mutex, NULL);
+        }
+
+        ~Shard() {
+            pthread_mutex_destroy(&mutex);
+        }
+
+        pthread_mutex_t mutex;
+        std::map<uint16_t, VBucket> vbuckets;
+        uint64_t compressed;
+        uint64_t bytesIn;
+        uint64_t bytesOut;
+        uint64_t turnedOff;
+    };
+
+    /**
+     * Get the shard of the calling thread, creating it on first use
+     */
+    Shard &getShard();
+
+    /**
+     * Sample the outcome of compressing a value of vbucket
+     */
+    void sample(Shard &shard, VBucket &vb, size_t length, size_t compressed);
+
+    size_t threshold;
+    pthread_key_t key;
+    /** Protects the list of shards */
+    mutable pthread_mutex_t mutex;
+    std::vector<Shard*> shards;
+};
+
+/**
+ * Replace a prefix of the keys of the mutations and deletions
+ */
+class KeyPrefixTransform : public Transform {
+public:
+    KeyPrefixTransform(const std::string &f, const std::string &t) :
+        from(f), to(t)
+    { }
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION ||
+            opcode == PROTOCOL_BINARY_CMD_TAP_DELETE;
+    }
+
+    bool apply(BinaryMessage *msg);
+
+private:
+    std::string from;
+    std::string to;
+};
+
+/**
+ * Move the mutations and deletions to the vbucket of their key in a
+ * cluster with numVBuckets vbuckets (-n). It goes after the transforms
+ * rewriting the keys, so that the rewritten key picks the vbucket.
+ */
+class ReshardTransform : public Transform {
+public:
+    explicit ReshardTransform(size_t n = 0) : numVBuckets(n) { }
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION ||
+            opcode == PROTOCOL_BINARY_CMD_TAP_DELETE;
+    }
+
+    bool apply(BinaryMessage *msg);
+
+private:
+    size_t numVBuckets;
+};
+
+/**
+ * A set of key prefixes stored in a trie, so that a key is matched
+ * against all of them in a single pass over the key.
+ */
+class PrefixSet {
+public:
+    PrefixSet() : nodes(1) { }
+
+    void add(const std::string &prefix);
+
+    bool empty() const {
+        return nodes.size() == 1 && !nodes[0].terminal;
+    }
+
+    /**
+     * Does the key start with one of the prefixes?
+     */
+    bool matches(const char *key, size_t nkey) const;
+
+private:
+    class Node {
+    public:
+        Node() : terminal(false) { }
+
+        /** The children sorted by their byte */
+        std::vector<std::pair<unsigned char, size_t> > children;
+        bool terminal;
+    };
+
+    std::vector<Node> nodes;
+};
+
+/**
+ * Drop the mutations and deletions of the keys we don't want. If there
+ * are include filters a key must match one of them, and a key matching
+ * an exclude filter is always dropped.
+ */
+class KeyFilterTransform : public Transform {
+public:
+    /**
+     * @throw std::string if a regular expression is invalid
+     */
+    KeyFilterTransform(const std::vector<std::string> &includePrefixes,
+                       const std::vector<std::string> &excludePrefixes,
+                       const std::vector<std::string> &includePatterns,
+                       const std::vector<std::string> &excludePatterns) throw (std::string);
+    ~KeyFilterTransform();
+
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION ||
+            opcode == PROTOCOL_BINARY_CMD_TAP_DELETE;
+    }
+
+    bool apply(BinaryMessage *msg);
+
+private:
+    PrefixSet include;
+    PrefixSet exclude;
+    bool hasInclude;
+#ifdef HAVE_REGEX_H
+    static bool matches(const std::vector<regex_t*> &patterns,
+                        const std::string &key);
+
+    std::vector<regex_t*> includePatterns;
+    std::vector<regex_t*> excludePatterns;
+#endif
+};
+
+/**
+ * An ordered list of transforms. Each opcode has its own list of the
+ * transforms handling it, so applying the pipeline to a message only
+ * touches the transforms interested in it.
+ */
+class TransformPipeline {
+public:
+    ~TransformPipeline();
+
+    /**
+     * Add a transform to the end of the pipeline. The pipeline takes
+     * over the ownership of the transform.
+     */
+    void add(Transform *transform);
+
+    bool empty() const {
+        return transforms.empty();
+    }
+
+    /**
+     * Apply all of the transforms handling the opcode of the message
+     * @return false if the message should be dropped
+     */
+    bool apply(BinaryMessage *msg) {
+        const std::vector<Transform*> &steps = table[msg->data.req->request.opcode];
+        for (size_t ii = 0; ii < steps.size(); ++ii) {
+            if (!steps[ii]->apply(msg)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    std::vector<Transform*> transforms;
+    std::vector<Transform*> table[256];
+};
+
+/**
+ * Used in place of a TransformPipeline when there is nothing to
+ * transform, so that the messages are forwarded without looking at
+ * them.
+ */
+class NoTransform {
+public:
+    bool apply(BinaryMessage *msg) {
+        (void)msg;
+        return true;
+    }
+};
+
+#endif
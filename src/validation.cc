@@ -0,0 +1,65 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "validation.h"
+#include "binarymessage.h"
+
+#include <cstring>
+#include <sstream>
+
+using namespace std;
+
+BinaryMessage *StateValidator::request(uint16_t vbucket) {
+    ++awaiting;
+    // The vbucket is the opaque, since the response doesn't carry it
+    return new GetVBucketStateBinaryMessage(vbucket, htonl(vbucket));
+}
+
+void StateValidator::answered(const BinaryMessage &msg) {
+    uint16_t vbucket = static_cast<uint16_t>(ntohl(msg.data.res->response.opaque));
+    uint16_t status = ntohs(msg.data.res->response.status);
+    if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        stringstream ss;
+        ss << "Failed to get vbucket state: " << status;
+        errors[vbucket] = ss.str();
+    } else if (msg.size < sizeof(msg.data.vg->bytes)) {
+        errors[vbucket] = "Invalid vbucket state response";
+    } else {
+        vbucket_state_t state;
+        memcpy(&state, &msg.data.vg->message.body.state, sizeof(state));
+        states[vbucket] = static_cast<vbucket_state_t>(ntohl(state));
+        errors.erase(vbucket);
+    }
+    if (awaiting > 0) {
+        --awaiting;
+    }
+}
+
+bool StateValidator::getState(uint16_t vbucket, vbucket_state_t &state,
+                              string &error) const {
+    map<uint16_t, string>::const_iterator err;
+    if ((err = errors.find(vbucket)) != errors.end()) {
+        error = err->second;
+        return true;
+    }
+    map<uint16_t, vbucket_state_t>::const_iterator iter;
+    if ((iter = states.find(vbucket)) == states.end()) {
+        return false;
+    }
+    state = iter->second;
+    return true;
+}
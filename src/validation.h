@@ -0,0 +1,70 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef VALIDATION_H
+#define VALIDATION_H 1
+
+#include "config.h"
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <memcached/vbucket.h>
+
+class BinaryMessage;
+
+/**
+ * Collects the states the destinations report for the vbuckets made
+ * active (-V). The request for the state of a vbucket follows the
+ * TAP_VBUCKET_SET making it active, so the answer tells whether the
+ * destination took it.
+ */
+class StateValidator {
+public:
+    StateValidator() : awaiting(0) { }
+
+    /**
+     * Create the request for the state of vbucket
+     */
+    BinaryMessage *request(uint16_t vbucket);
+
+    /**
+     * Handle the answer to a request() (the message is left to the
+     * caller)
+     */
+    void answered(const BinaryMessage &msg);
+
+    /**
+     * Look up the state of vbucket reported by the destination
+     * @param error set instead of the state if the request failed
+     * @return false if it was never asked for (or never answered)
+     */
+    bool getState(uint16_t vbucket, vbucket_state_t &state,
+                  std::string &error) const;
+
+    /**
+     * Get the number of requests yet to be answered
+     */
+    size_t getAwaiting() const {
+        return awaiting;
+    }
+
+private:
+    size_t awaiting;
+    std::map<uint16_t, vbucket_state_t> states;
+    std::map<uint16_t, std::string> errors;
+};
+
+#endif
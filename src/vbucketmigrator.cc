@@ -26,26 +26,44 @@
 #include <event.h>
 #include <pthread.h>
 #include <algorithm>
+#include <fstream>
 #include <memcached/vbucket.h>
 
 #include "sockstream.h"
 #include "binarymessagepipe.h"
 #include "buckets.h"
-
-#ifndef EX_SOFTWARE
-#define EX_SOFTWARE 70
+#include "migration.h"
+#include "rebalance.h"
+#include "rebalancer.h"
+#include "relay.h"
+#include "snapshot.h"
+#include "verify.h"
+#include "workerpool.h"
+#ifdef HAVE_SYS_UN_H
+#include "daemon.h"
 #endif
 
 using namespace std;
 
-static uint8_t verbosity(0);
-static unsigned int timeout = 0;
+uint8_t verbosity(0);
+unsigned int timeout = 0;
 static int exit_code = EX_OK;
 static struct event timerev;
 static bool evtimer_active(false);
 
 static size_t packets(0);
 
+/**
+ * A daemon can't exit because one of its connections timed out
+ */
+static bool daemonMode(false);
+
+/**
+ * The number of bytes the buckets may have in flight towards the
+ * destinations when migrating several buckets
+ */
+static const size_t FAIR_SHARE_WINDOW = 8 * 1024 * 1024;
+
 static void usage(std::string binary) {
     ssize_t idx = binary.find_last_of("/\\");
     if (idx != -1) {
@@ -54,12 +72,38 @@ static void usage(std::string binary) {
 
     cerr << "Usage: " << binary
          << " -h host:port -b # -d desthost:destport" << endl
-         << "\t-h host:port Connect to host:port" << endl
+         << "\t-h host:port Connect to host:port (may be repeated)" << endl
          << "\t-A           Use TAP acks" << endl
          << "\t-t           Move buckets from a server to another server"<< endl
-         << "\t-b #         Operate on bucket number #" << endl
+         << "\t-b #         Operate on bucket number # (on the previous -h)" << endl
+         << "\t-B file      Migrate the data buckets listed in file" << endl
+         << "\t-D path      Run migration jobs submitted over a UNIX socket" << endl
+         << "\t-P file      Rebalance from the vbucket map in file (with -Q)" << endl
+         << "\t-Q file      Rebalance to the vbucket map in file (with -P)" << endl
+         << "\t-k num       Move at most num vbuckets into/out of a server" << endl
+         << "\t-K num       Move at most num vbuckets at the same time" << endl
          << "\t-a auth      Try to authenticate <auth>" << endl
          << "\t-d host:port Send all vbuckets to this server" << endl
+         << "\t-m file      Send the vbuckets to the servers listed in file" << endl
+         << "\t-n num       Re-shard the keys into a cluster with num vbuckets" << endl
+         << "\t-R host:port Also send all vbuckets to this replica" << endl
+         << "\t-L policy    What to do with lagging replicas (stall|drop[:num])" << endl
+         << "\t-c num       Use num connections to the destination" << endl
+         << "\t-g bytes     Resend up to bytes after reconnecting to a destination" << endl
+         << "\t-G           Send to relay receivers (-W) in compressed batches" << endl
+         << "\t-W port      Relay the batches received on port to the destination" << endl
+         << "\t-w num       Use num worker threads to process the messages" << endl
+         << "\t-C           Coalesce the queued updates of the same key" << endl
+         << "\t-q           Send quiet SETQ/DELETEQ instead of TAP messages" << endl
+         << "\t-J file      Only backfill the changes since the time in file" << endl
+         << "\t-U seconds   Backfill seconds more than needed with -J (300)" << endl
+         << "\t-S file      Keep the progress of the vbuckets in file" << endl
+         << "\t-O file      Record the messages from the source in file" << endl
+         << "\t-l file      Load the messages recorded in file (may be repeated)" << endl
+         << "\t-y speed     Replay -l with the recorded timing, speeded up" << endl
+         << "\t-o dir       Export sorted snapshots of the vbuckets to dir" << endl
+         << "\t-j file      Look up the keys given as arguments in a snapshot" << endl
+         << "\t-M leaves    Verify the destination against the source, and repair it" << endl
          << "\t-v           Increase verbosity" << endl
          << "\t-F           Flush all data on the destination" << endl
          << "\t-N name      Use a tap stream named \"name\"" << endl
@@ -68,6 +112,13 @@ static void usage(std::string binary) {
          << "\t-V           Validate bucket takeover" << endl
          << "\t-E expiry    Reset the expiry of all items to 'expiry'." << endl
          << "\t-f flag      Reset the flag of all items to 'flag'." << endl
+         << "\t-s skew      Drop the items expired more than skew seconds ago" << endl
+         << "\t-z size      Compress the values of at least size bytes" << endl
+         << "\t-p from:to   Replace the key prefix 'from' with 'to'" << endl
+         << "\t-i prefix    Only migrate the keys starting with prefix" << endl
+         << "\t-x prefix    Don't migrate the keys starting with prefix" << endl
+         << "\t-I regex     Only migrate the keys matching regex" << endl
+         << "\t-X regex     Don't migrate the keys matching regex" << endl
          << "\t-r           Connect to the master as a registered TAP client" << endl;
     exit(EX_USAGE);
 }
@@ -79,257 +130,6 @@ void BinaryMessagePipeCallback::markcomplete() {
     }
 }
 
-const int PENDING_SEND_LO_WAT = 128;
-const int PENDING_SEND_HI_WAT = 512;
-
-class UpstreamController {
-public:
-    UpstreamController() :
-        upstream(0), pendingSendCount(0),
-        closed(false), inputPlugged(false), aborting(false)
-    {
-        // Empty
-    }
-
-    void sendUpstreamMessage(BinaryMessage *msg) {
-        upstream->sendMessage(msg);
-    }
-    void incrementPendingDownstream() {
-        if (!upstream) {
-            return;
-        }
-
-        pendingSendCount++;
-        if (!inputPlugged && pendingSendCount > PENDING_SEND_HI_WAT) {
-            upstream->plugInput();
-            inputPlugged = true;
-        }
-    }
-    void decrementPendingDownstream() {
-        if (!upstream) {
-            return;
-        }
-
-        pendingSendCount--;
-        if (inputPlugged && pendingSendCount < PENDING_SEND_LO_WAT && !closed) {
-            upstream->unPlugInput();
-            inputPlugged = false;
-        }
-    }
-
-    void abort() {
-        if (!aborting) {
-            cerr << "Downstream connection closed.. shutdown upstream" << endl;
-            aborting = true;
-            upstream->abort();
-        }
-    }
-
-    void close() {
-        closed = true;
-    }
-
-    void setUpstream(BinaryMessagePipe *_upstream) {
-        upstream = _upstream;
-    }
-
-    int getPendingSendCount() {
-        return pendingSendCount;
-    }
-
-    void dumpMessages(std::ostream &out) {
-        upstream->dumpMessages(out);
-    }
-
-private:
-    BinaryMessagePipe *upstream;
-    int pendingSendCount;
-    bool closed;
-    bool inputPlugged;
-    bool aborting;
-};
-
-class DownstreamBinaryMessagePipeCallback : public BinaryMessagePipeCallback {
-public:
-    DownstreamBinaryMessagePipeCallback(UpstreamController *_upstream) :
-        upstream(_upstream), aborting(false), moved(0)
-    {
-        // Empty
-    }
-
-    void messageReceived(BinaryMessage *msg) {
-        if (msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_NOOP) {
-            // Ignore NOOP responses
-            delete msg;
-        } else {
-            upstream->sendUpstreamMessage(msg);
-            if (verbosity > 1) {
-                std::cout << "Received message from downstream server: "
-                          << msg->toString() << std::endl;
-            }
-        }
-    }
-
-    void messageSent(BinaryMessage *msg) {
-        upstream->decrementPendingDownstream();
-
-        uint8_t opcode = msg->data.req->request.opcode;
-        if (opcode == PROTOCOL_BINARY_CMD_TAP_VBUCKET_SET) {
-            if (msg->size - sizeof(msg->data.vs->bytes) == sizeof(vbucket_state_t)) {
-                // test the state thing..
-                vbucket_state_t state;
-                memcpy(&state, msg->data.rawBytes + sizeof(msg->data.vs->bytes),
-                       sizeof(state));
-                state = static_cast<vbucket_state_t>(ntohl(state));
-                if (state == vbucket_state_pending) {
-                    cout << "Starting to move bucket "
-                         << msg->getVBucketId()
-                         << endl;
-                    cout.flush();
-                } else if (state == vbucket_state_active) {
-                    ++moved;
-                    cout << "Bucket "
-                         << msg->getVBucketId()
-                         << " moved to the next server" << endl;
-                    cout.flush();
-                } else if (!is_valid_vbucket_state_t(state)) {
-                    cerr << "Illegal vbucket state received: "
-                         << state << endl;
-                }
-            } else {
-                cerr << "Incorrect message size for TAP_VBUCKET_SET: " <<
-                    msg->size - sizeof(msg->data.vs->bytes) << endl;
-            }
-        }
-    }
-
-    void abort() {
-        if (!aborting) {
-            aborting = true;
-            cerr << "An error occured on the downstream connection.." << endl;
-            markcomplete();
-            upstream->abort();
-        }
-    }
-
-    void shutdown() {
-        aborting = true;
-        markcomplete();
-        upstream->abort();
-    }
-
-    size_t getMoved() const {
-        return moved;
-    }
-
-private:
-    UpstreamController *upstream;
-    bool aborting;
-    size_t moved;
-};
-
-class UpstreamBinaryMessagePipeCallback : public BinaryMessagePipeCallback {
-public:
-    UpstreamBinaryMessagePipeCallback(UpstreamController *_controller,
-                                      const vector<uint16_t> &_buckets) :
-        BinaryMessagePipeCallback(), controller(_controller),
-        buckets(_buckets), aborting(false),
-        hasExpiry(false), hasFlags(false), expiry(0), flags(0)
-    {
-        // EMPTY
-    }
-
-    void messageSent(BinaryMessage *msg) {
-        if (verbosity > 1) {
-            std::cout << "Message from downstream sent upstream: "
-                      << msg->toString() << std::endl;
-        }
-    }
-
-
-    void messageReceived(BinaryMessage *msg) {
-        if (verbosity > 1) {
-            std::cout << "Received message from upstream server: "
-                      << msg->toString() << std::endl;
-        }
-
-        // Some messages are connection bound and not vbucket bound..
-        bool allow;
-        switch (msg->data.req->request.opcode) {
-        case PROTOCOL_BINARY_CMD_NOOP:
-        case PROTOCOL_BINARY_CMD_TAP_OPAQUE:
-            allow = true;
-            break;
-        default:
-            allow = false;
-        }
-        if (!allow && !std::binary_search(buckets.begin(), buckets.end(),
-                                msg->getVBucketId())) {
-            std::cerr << "Internal server error!!" << std::endl
-                      << "Received a message for a bucket I didn't request:"
-                      << msg->toString()
-                      << std::endl;
-            delete msg;
-        } else {
-            controller->incrementPendingDownstream();
-            fixMessage(msg);
-            downstream->sendMessage(msg);
-        }
-    }
-
-    void fixMessage(BinaryMessage *msg) {
-        if (hasExpiry) {
-            msg->setExpiry(expiry);
-        }
-        if (hasFlags) {
-            msg->setFlags(flags);
-        }
-    }
-
-    void resetExpiry(uint32_t e) {
-        hasExpiry = true;
-        expiry = e;
-    }
-
-    void resetFlags(uint32_t f) {
-        hasFlags = true;
-        flags = f;
-    }
-
-    void setDownstream(BinaryMessagePipe *_downstream) {
-        downstream = _downstream;
-    }
-
-    void completeMe() {
-        markcomplete();
-        controller->close();
-    }
-
-    void abort() {
-        if (!aborting) {
-            aborting = true;
-            downstream->abort();
-            completeMe();
-        }
-    }
-
-    void shutdown() {
-        downstream->plugInput();
-        downstream->updateEvent();
-        completeMe();
-    }
-
-private:
-    BinaryMessagePipe *downstream;
-    UpstreamController *controller;
-    vector<uint16_t> buckets;
-    bool aborting;
-    bool hasExpiry;
-    bool hasFlags;
-    uint32_t expiry;
-    uint32_t flags;
-};
-
 extern "C" {
     void event_handler(evutil_socket_t fd, short which, void *arg) {
         (void)fd;
@@ -338,7 +138,14 @@ extern "C" {
 
         if (which == EV_TIMEOUT) {
             std::cerr << "Timed out on " << pipe->toString() << std::endl;
-            exit(EXIT_FAILURE);
+            if (pipe->reconnect()) {
+                return;
+            }
+            if (!daemonMode) {
+                exit(EXIT_FAILURE);
+            }
+            pipe->abort();
+            return;
         }
 
         ++packets;
@@ -347,8 +154,12 @@ extern "C" {
             pipe->step(which);
         } catch (std::exception& e) {
             cerr << e.what() << std::endl;
-            pipe->abort();
-            exit_code = EX_IOERR;
+            if (!pipe->reconnect()) {
+                // A server that was never reached is a configuration
+                // problem, not a lost connection
+                exit_code = pipe->isConnected() ? EX_IOERR : EX_CONFIG;
+                pipe->abort();
+            }
         }
         pipe->updateEvent();
     }
@@ -384,55 +195,6 @@ extern "C" {
     }
 }
 
-static BinaryMessagePipe *getServer(const string &destination,
-                                    BinaryMessagePipeCallback &cb,
-                                    struct event_base *b,
-                                    const std::string &auth,
-                                    const std::string &passwd,
-                                    bool flush)
-{
-    BinaryMessagePipe* ret(NULL);
-    std::string msg;
-    try {
-        string host(destination);
-        Socket *sock = new Socket(host);
-        if (verbosity) {
-            cout << "Connecting to " << *sock << endl;
-        }
-        sock->connect();
-        sock->setKeepalive(true);
-        ret = new BinaryMessagePipe(*sock, cb, b, timeout);
-        if (auth.length() > 0) {
-            if (verbosity) {
-                cout << "Authenticating towards: " << *sock << endl;
-            }
-            ret->authenticate(auth, passwd);
-            if (verbosity) {
-                cout << "Authenticated towards: " << *sock << endl;
-            }
-        }
-        sock->setNonBlocking();
-        if (flush) {
-            ret->sendMessage(new FlushBinaryMessage);
-        }
-        ret->updateEvent();
-
-    } catch (std::string &e) {
-        msg = e;
-    } catch (std::exception &e) {
-        msg = e.what();
-    } catch (...) {
-        msg.assign("Unhandled exception");
-    }
-
-    if (msg.length() > 0) {
-        throw msg;
-    }
-
-    assert(ret);
-    return ret;
-}
-
 #ifndef HAVE_GETPASS
 static char *getpass(const char *prompt)
 {
@@ -494,63 +256,263 @@ static void stdin_check(struct event_base *evbase) {
 
 }
 
+/**
+ * Run the migrations submitted over the UNIX socket at path until
+ * we're killed
+ */
+static int runDaemon(const string &path, size_t workers) {
+#ifdef HAVE_SYS_UN_H
+#ifdef ENABLE_SASL
+    if (sasl_client_init(NULL) != SASL_OK) {
+        fprintf(stderr, "Failed to initialize sasl library!\n");
+        return EX_OSERR;
+    }
+#endif
+
+    try {
+        initialize_sockets();
+    } catch (std::exception& e) {
+        cerr << "Failed to initialize sockets: " << e.what() << std::endl;
+        return EX_IOERR;
+    }
+
+    struct event_base *evbase = event_init();
+    if (evbase == NULL) {
+        cerr << "Failed to initialize libevent" << endl;
+        return EX_IOERR;
+    }
+
+    WorkerPool *pool = NULL;
+    if (workers > 0) {
+        try {
+            pool = new WorkerPool(workers);
+        } catch (std::exception &e) {
+            cerr << "Failed to start worker threads: " << e.what() << endl;
+            return EX_OSERR;
+        }
+    }
+
+    daemonMode = true;
+    try {
+        MigrationDaemon daemon(path, evbase, pool, FAIR_SHARE_WINDOW);
+        event_base_loop(evbase, 0);
+    } catch (std::exception &e) {
+        cerr << e.what() << endl;
+        return EX_OSERR;
+    }
+    return EX_OK;
+#else
+    (void)path;
+    (void)workers;
+    cerr << "Not built with UNIX socket support" << endl;
+    return EX_USAGE;
+#endif
+}
+
+/**
+ * Relay the batches received from the migrators connecting to port
+ * (with -G) to the destination, until we're killed
+ */
+static int runRelay(in_port_t port, const MigrationSpec &spec) {
+    struct event_base *evbase = event_init();
+    if (evbase == NULL) {
+        cerr << "Failed to initialize libevent" << endl;
+        return EX_IOERR;
+    }
+
+    daemonMode = true;
+    try {
+        RelayReceiver receiver(port, spec.destinations[0], spec.auth,
+                               spec.passwd, evbase);
+        event_base_loop(evbase, 0);
+    } catch (std::exception &e) {
+        cerr << e.what() << endl;
+        return EX_OSERR;
+    }
+    return EX_OK;
+}
+
+/**
+ * Compare the vbuckets of the destination with the source using Merkle
+ * trees of the given number of leaves, and repair the differences
+ */
+static int runVerify(const MigrationSpec &spec, size_t leaves) {
+    struct event_base *evbase = event_init();
+    if (evbase == NULL) {
+        cerr << "Failed to initialize libevent" << endl;
+        return EX_IOERR;
+    }
+
+    MerkleVerifier verifier(spec, leaves, evbase);
+    try {
+        verifier.start();
+    } catch (std::string &e) {
+        cerr << "Failed to connect to host: " << e.c_str() << endl;
+        return EX_CONFIG;
+    }
+    event_base_loop(evbase, 0);
+    return verifier.finish();
+}
+
+/**
+ * Load a vbucket map
+ */
+static bool loadVBucketMap(map<uint16_t, string> &vbmap, const string &file) {
+    ifstream in(file.c_str());
+    if (!in.good()) {
+        cerr << "Failed to open vbucket map: " << file << endl;
+        return false;
+    }
+    try {
+        parseVBucketMap(vbmap, in);
+    } catch (string &e) {
+        cerr << file << ": " << e.c_str() << endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Print the keys found in a snapshot the way memcached answers a get
+ */
+static int lookupSnapshot(const string &file, char **keys, int nkeys) {
+    int status = EX_OK;
+    try {
+        SnapshotReader reader(file);
+        for (int ii = 0; ii < nkeys; ++ii) {
+            SnapshotItem item;
+            if (!reader.get(keys[ii], item)) {
+                status = EX_DATAERR;
+                continue;
+            }
+            cout << "VALUE " << item.key << " " << item.flags << " "
+                 << item.value.length() << " " << item.cas << "\r\n";
+            cout.write(item.value.data(), item.value.length());
+            cout << "\r\n";
+        }
+        cout << "END\r\n";
+        if (verbosity) {
+            cerr << file << ": " << reader.getItems() << " items of vbucket "
+                 << reader.getVBucket() << endl;
+        }
+    } catch (string &e) {
+        cerr << e.c_str() << endl;
+        return EX_NOINPUT;
+    }
+    return status;
+}
+
+/**
+ * Move the vbuckets from the servers in the current map to the servers
+ * in the target map
+ */
+static int runRebalance(const MigrationSpec &spec, RebalancePlan &plan,
+                        size_t workers, bool erlang) {
+    if (plan.size() == 0) {
+        cout << "Nothing to move" << endl;
+        return EX_OK;
+    }
+    if (verbosity) {
+        cout << "Moving " << plan.size() << " vbuckets:" << endl;
+        plan.getStats(cout);
+    }
+
+    struct event_base *evbase = event_init();
+    if (evbase == NULL) {
+        cerr << "Failed to initialize libevent" << endl;
+        return EX_IOERR;
+    }
+
+    if (erlang) {
+        stdin_check(evbase);
+    }
+
+    WorkerPool *pool = NULL;
+    if (workers > 0) {
+        try {
+            pool = new WorkerPool(workers);
+        } catch (std::exception &e) {
+            cerr << "Failed to start worker threads: " << e.what() << endl;
+            return EX_OSERR;
+        }
+    }
+
+    Rebalancer rebalancer(plan, spec, evbase, pool, FAIR_SHARE_WINDOW);
+    rebalancer.start();
+    event_base_loop(evbase, 0);
+
+    if (pool != NULL) {
+        pool->shutdown();
+    }
+
+    if (exit_code != EX_OK) {
+        return exit_code;
+    }
+    return rebalancer.getStatus();
+}
+
 int main(int argc, char **argv)
 {
     int cmd;
-    vector<uint16_t> buckets;
-    string host;
-    string destination;
-    bool takeover = false;
-    bool tapAck = false;
+    MigrationSpec spec;
     bool erlang = false;
-    string auth;
-    string passwd;
-    string name;
-    bool validate = false;
-    bool flush = false;
-    bool registeredTapClient = false;
-    string expiryResetValue;
-    string flagResetValue;
-
-    while ((cmd = getopt(argc, argv, "N:Aa:h:b:d:tvFT:e?VE:rf:")) != EOF) {
+    size_t workers = 0;
+    string bucketListFile;
+    string daemonSocket;
+    string currentMapFile;
+    string targetMapFile;
+    size_t nodeLimit = 1;
+    size_t clusterLimit = 0;
+    string snapshotFile;
+    int relayPort = 0;
+    size_t verifyLeaves = 0;
+
+    while ((cmd = getopt(argc, argv, "N:Aa:h:b:d:tvFT:e?VE:rf:c:w:m:R:L:B:D:P:Q:k:K:p:i:x:I:X:s:Cz:n:qJ:U:S:O:l:y:o:j:g:GW:M:")) != EOF) {
         switch (cmd) {
-        case 'E':
-            expiryResetValue.assign(optarg);
+        case 'P':
+            currentMapFile.assign(optarg);
             break;
-        case 'f':
-            flagResetValue.assign(optarg);
+        case 'Q':
+            targetMapFile.assign(optarg);
             break;
-        case 'A':
-            tapAck = true;
+        case 'k':
+            nodeLimit = atoi(optarg);
             break;
-        case 'a':
-            auth.assign(optarg);
+        case 'K':
+            clusterLimit = atoi(optarg);
             break;
-        case 'd':
-            destination.assign(optarg);
+        case 'D':
+            daemonSocket.assign(optarg);
             break;
-        case 'h':
-            host.assign(optarg);
+        case 'W':
+            relayPort = atoi(optarg);
+            if (relayPort <= 0 || relayPort > 65535) {
+                cerr << "Invalid relay port: " << optarg << endl;
+                return EX_USAGE;
+            }
             break;
-        case 'b':
-            try {
-                parseBuckets(buckets, optarg);
-            } catch (string& e) {
-                cerr << e.c_str() << endl;
+        case 'j':
+            snapshotFile.assign(optarg);
+            break;
+        case 'M':
+            verifyLeaves = atoi(optarg);
+            if (verifyLeaves == 0 || (verifyLeaves & (verifyLeaves - 1)) != 0) {
+                cerr << "The number of leaves must be a power of two: "
+                     << optarg << endl;
                 return EX_USAGE;
             }
             break;
-        case 't':
-            takeover = true;
+        case 'B':
+            bucketListFile.assign(optarg);
             break;
-        case 'v':
-            ++verbosity;
+        case 'w':
+            workers = atoi(optarg);
             break;
-        case 'N':
-            name.assign(optarg);
+        case 'a':
+            spec.auth.assign(optarg);
             break;
-        case 'F':
-            flush = true;
+        case 'v':
+            ++verbosity;
             break;
         case 'T':
             timeout = atoi(optarg);
@@ -558,44 +520,146 @@ int main(int argc, char **argv)
         case 'e':
             erlang = true;
             break;
-        case 'V':
-            validate = true;
-            break;
-        case 'r':
-            registeredTapClient = true;
+        case '?':
+            usage(argv[0]);
             break;
-        case '?': /* FALLTHROUGH */
         default:
-            usage(argv[0]);
+            try {
+                if (!spec.parseOption(cmd, optarg)) {
+                    usage(argv[0]);
+                }
+            } catch (string& e) {
+                cerr << e.c_str() << endl;
+                return EX_USAGE;
+            }
+        }
+    }
+
+    if (!snapshotFile.empty()) {
+        if (optind == argc) {
+            cerr << "Please specify the keys to look up in " << snapshotFile
+                 << endl;
+            return EX_USAGE;
         }
+        return lookupSnapshot(snapshotFile, argv + optind, argc - optind);
+    }
+
+    if (!daemonSocket.empty()) {
+        return runDaemon(daemonSocket, workers);
+    }
+
+    if (relayPort != 0 &&
+        (spec.destinations.size() != 1 || !spec.hosts.empty() ||
+         !spec.vbmapFile.empty() || !currentMapFile.empty() ||
+         !targetMapFile.empty() || !bucketListFile.empty())) {
+        cerr << "-W needs a single destination (-d), and can't be combined"
+             << " with -h, -l, -m, -P, -Q or -B" << endl;
+        return EX_USAGE;
     }
 
-    if (!auth.empty()) {
+    if (verifyLeaves != 0 &&
+        (spec.hosts.size() != 1 || spec.loads[0] ||
+         spec.sourceBuckets[0].empty() || spec.destinations.size() != 1 ||
+         !spec.vbmapFile.empty() || spec.relay || !currentMapFile.empty() ||
+         !targetMapFile.empty() || !bucketListFile.empty())) {
+        cerr << "-M needs a single source (-h) with its vbuckets (-b) and a"
+             << " single destination (-d), and can't be combined with -l, -m,"
+             << " -G, -P, -Q or -B" << endl;
+        return EX_USAGE;
+    }
+
+    RebalancePlan *plan = NULL;
+    if (!currentMapFile.empty() || !targetMapFile.empty()) {
+        if (currentMapFile.empty() || targetMapFile.empty()) {
+            cerr << "Please specify both the current (-P) and the target (-Q)"
+                 << " vbucket map" << endl;
+            return EX_USAGE;
+        }
+        if (!spec.hosts.empty() || !spec.sourceBuckets[0].empty() ||
+            !spec.destinations.empty() || !spec.vbmapFile.empty() ||
+            !spec.replicas.empty() || spec.flush || !bucketListFile.empty() ||
+            spec.numVBuckets != 0 || spec.quiet || !spec.capturePath.empty() ||
+            !spec.exportDir.empty()) {
+            cerr << "-P and -Q can't be combined with -h, -l, -b, -d, -m, -R, -F,"
+                 << " -n, -q, -O, -o or -B" << endl;
+            return EX_USAGE;
+        }
+
+        map<uint16_t, string> current;
+        map<uint16_t, string> target;
+        if (!loadVBucketMap(current, currentMapFile) ||
+            !loadVBucketMap(target, targetMapFile)) {
+            return EX_USAGE;
+        }
+        try {
+            plan = new RebalancePlan(current, target, nodeLimit, clusterLimit);
+        } catch (string &e) {
+            cerr << e.c_str() << endl;
+            return EX_USAGE;
+        }
+    }
+
+    vector<BucketSpec> bucketList;
+    if (!bucketListFile.empty()) {
+        if (spec.hosts.size() > 1 || !spec.sourceBuckets[0].empty()) {
+            cerr << "-B can't be combined with multiple -h or -b" << endl;
+            return EX_USAGE;
+        }
+        ifstream in(bucketListFile.c_str());
+        if (!in.good()) {
+            cerr << "Failed to open bucket list: " << bucketListFile << endl;
+            return EX_USAGE;
+        }
+        try {
+            parseBucketList(bucketList, in);
+        } catch (string &e) {
+            cerr << e.c_str() << endl;
+            return EX_USAGE;
+        }
+        if (bucketList.empty()) {
+            cerr << "No buckets in " << bucketListFile << endl;
+            return EX_USAGE;
+        }
+    }
+
+    // The data buckets are selected by authenticating as the bucket
+    bool needAuth = !spec.auth.empty();
+    for (size_t ii = 0; ii < bucketList.size(); ++ii) {
+        if (bucketList[ii].name != "default" ||
+            !bucketList[ii].password.empty()) {
+            needAuth = true;
+        }
+    }
+
+    if (needAuth) {
 #ifdef ENABLE_SASL
         if (sasl_client_init(NULL) != SASL_OK) {
             fprintf(stderr, "Failed to initialize sasl library!\n");
             return EX_OSERR;
         }
+#else
+        fprintf(stderr, "Not built with SASL support\n");
+        return EX_USAGE;
+#endif
+    }
+
+    if (!spec.auth.empty()) {
         if (isatty(fileno(stdin))) {
             char *pw = getpass("Enter password: ");
             if (pw == NULL) {
                 return EXIT_FAILURE;
             }
-            passwd.assign(pw);
+            spec.passwd.assign(pw);
         } else {
             char buffer[1024];
             if (fgets(buffer, sizeof(buffer), stdin) == NULL) {
                 cout << "Missing password" << endl;
                 return EXIT_FAILURE;
             }
-            passwd.assign(buffer);
-            ssize_t p = passwd.find_first_of("\r\n");
-            passwd.resize(p);
+            spec.passwd.assign(buffer);
+            ssize_t p = spec.passwd.find_first_of("\r\n");
+            spec.passwd.resize(p);
         }
-#else
-        fprintf(stderr, "Not built with SASL support\n");
-        return EX_USAGE;
-#endif
     }
 
     try {
@@ -605,23 +669,65 @@ int main(int argc, char **argv)
         return EX_IOERR;
     }
 
-    if (host.length() == 0) {
-        cerr << "You need to specify the host to migrate data from"
-             << endl;
-        return EX_USAGE;
+    if (relayPort != 0) {
+        return runRelay(static_cast<in_port_t>(relayPort), spec);
     }
 
-    if (destination.empty()) {
-        cerr << "Can't perform bucket migration without a destination host" << endl;
-        return EX_USAGE;
+    if (verifyLeaves != 0) {
+        return runVerify(spec, verifyLeaves);
     }
 
-    if (buckets.empty()) {
-        cerr << "Please specify the buckets to migrate by using -b" << endl;
-        return EX_USAGE;
+    if (plan != NULL) {
+        return runRebalance(spec, *plan, workers, erlang);
+    }
+
+    // One migration per data bucket, or just the one described by
+    // the options
+    vector<MigrationSpec> specs;
+    if (bucketList.empty()) {
+        spec.label = "default";
+        specs.push_back(spec);
+    } else {
+        vector<BucketSpec>::iterator iter;
+        for (iter = bucketList.begin(); iter != bucketList.end(); ++iter) {
+            MigrationSpec bucket(spec);
+            bucket.label = iter->name;
+            bucket.sourceBuckets[0] = iter->vbuckets;
+            if (!spec.capturePath.empty()) {
+                bucket.capturePath = spec.capturePath + "." + iter->name;
+            }
+            if (!spec.journalPath.empty()) {
+                bucket.journalPath = spec.journalPath + "." + iter->name;
+            }
+            if (!spec.exportDir.empty()) {
+                bucket.exportDir = spec.exportDir + "." + iter->name;
+            }
+            if (!spec.hosts.empty() && spec.loads[0]) {
+                bucket.hosts[0] = spec.hosts[0] + "." + iter->name;
+            }
+            if (!iter->password.empty() || iter->name != "default") {
+                bucket.auth = iter->name;
+                bucket.passwd = iter->password;
+            }
+            specs.push_back(bucket);
+        }
+    }
+
+    vector<Migration*> migrations;
+    for (vector<MigrationSpec>::iterator iter = specs.begin();
+         iter != specs.end(); ++iter) {
+        try {
+            iter->resolve();
+            migrations.push_back(new Migration(*iter));
+        } catch (string &e) {
+            if (specs.size() > 1) {
+                cerr << "Bucket " << iter->label << ": ";
+            }
+            cerr << e.c_str() << endl;
+            return EX_USAGE;
+        }
     }
 
-    sort(buckets.begin(), buckets.end());
     struct event_base *evbase = event_init();
     if (evbase == NULL) {
         cerr << "Failed to initialize libevent" << endl;
@@ -632,114 +738,51 @@ int main(int argc, char **argv)
         stdin_check(evbase);
     }
 
-    UpstreamController controller;
-    UpstreamBinaryMessagePipeCallback upstream(&controller, buckets);
-    DownstreamBinaryMessagePipeCallback downstream(&controller);
-    BinaryMessagePipe *downstreamPipe;
-    BinaryMessagePipe *upstreamPipe;
-
-    if (expiryResetValue.length() != 0) {
-        uint32_t expiry = strtoul(expiryResetValue.c_str(), NULL, 10);
-        upstream.resetExpiry(expiry);
-    }
-
-    if (flagResetValue.length() != 0) {
-        uint32_t flags = strtoul(flagResetValue.c_str(), NULL, 10);
-        upstream.resetFlags(flags);
-    }
-
-    try {
-        downstreamPipe = getServer(destination, downstream, evbase,
-                                   auth, passwd, flush);
-        upstreamPipe = getServer(host, upstream, evbase,
-                                 auth, passwd, false);
-    } catch (std::string &e) {
-        cerr << "Failed to connect to host: " << e.c_str() << endl;
-        return EX_CONFIG;
+    WorkerPool *pool = NULL;
+    if (workers > 0) {
+        try {
+            pool = new WorkerPool(workers);
+        } catch (std::exception &e) {
+            cerr << "Failed to start worker threads: " << e.what() << endl;
+            return EX_OSERR;
+        }
     }
 
-    upstreamPipe->sendMessage(new TapRequestBinaryMessage(name, buckets, takeover,
-                                                          tapAck, registeredTapClient));
-    upstreamPipe->updateEvent();
-    upstream.setDownstream(downstreamPipe);
-    controller.setUpstream(upstreamPipe);
-
-    if (flush) {
-        controller.incrementPendingDownstream();
+    // The buckets share the bandwidth to the destination
+    FairShare share(FAIR_SHARE_WINDOW);
+    for (size_t ii = 0; ii < migrations.size(); ++ii) {
+        try {
+            migrations[ii]->start(evbase, pool,
+                                  migrations.size() > 1 ? &share : NULL);
+        } catch (std::string &e) {
+            cerr << "Failed to connect to host: " << e.c_str() << endl;
+            return EX_CONFIG;
+        } catch (std::exception &e) {
+            cerr << "Failed to start worker threads: " << e.what() << endl;
+            return EX_OSERR;
+        }
     }
 
     event_base_loop(evbase, 0);
 
-    if (takeover && downstream.getMoved() != buckets.size()) {
-        cerr << "Did not move enough vbuckets in takeover: "
-             << downstream.getMoved() << "/" << buckets.size() << endl;
-        exit_code = exit_code == 0 ? EX_SOFTWARE : exit_code;
+    if (pool != NULL) {
+        pool->shutdown();
     }
 
-    if (controller.getPendingSendCount() != 0) {
-        cerr << "Had " << controller.getPendingSendCount()
-             << " pending messages at exit." << endl;
-        controller.dumpMessages(cerr);
-        exit_code = exit_code == 0 ? EX_SOFTWARE : exit_code;
+    if (migrations.size() == 1) {
+        return migrations[0]->finish(exit_code);
     }
 
-    // Validate all takeovers..
-    if (exit_code == 0 && takeover && validate) {
-        if (verbosity) {
-            cout << "Validate bucket states" << std::endl;
+    int status = exit_code;
+    for (size_t ii = 0; ii < migrations.size(); ++ii) {
+        int bucketStatus = migrations[ii]->finish(EX_OK);
+        cout << "Bucket " << migrations[ii]->getLabel() << ": ";
+        migrations[ii]->getStats(cout);
+        cout << ", exit status " << bucketStatus << endl;
+        if (status == EX_OK) {
+            status = bucketStatus;
         }
-
-        unsigned int numSuccess = 0;
-        vector<uint16_t>::iterator iter;
-        for (iter = buckets.begin(); iter != buckets.end(); ++iter) {
-
-            if (downstreamPipe->isClosed()) {
-                cerr << "\t" << *iter
-                     << " Failed to verify, pipe to "
-                     << downstreamPipe->toString() << " is closed!" << endl;
-                continue ;
-            }
-
-            std::string msg;
-            try {
-                vbucket_state_t state = downstreamPipe->getVBucketState(*iter,
-                                                                        timeout * 1000);
-                if (state == vbucket_state_active) {
-                    ++numSuccess;
-                }
-                if (state != vbucket_state_active) {
-                    cerr << "Incorrect state for " << *iter
-                         << " at "
-                         << downstreamPipe->toString() << ": " << state << endl;
-                } else if (verbosity) {
-                    cout << "\t" << *iter << " ok" << endl;
-                }
-            } catch (std::string &e) {
-                msg = e;
-            } catch (std::exception &e) {
-                msg = e.what();
-            } catch (...) {
-                msg.assign("Unhandled exception");
-            }
-
-            if (msg.length()) {
-                cerr << "\t" << *iter << " Failed to verify: "
-                     << msg.c_str() << endl;
-            }
-        }
-
-        if (numSuccess != buckets.size() && exit_code == 0) {
-            cerr << "Expected to move " << buckets.size()
-                 << " buckets, but moved " << numSuccess << std::endl;
-            exit_code = EX_SOFTWARE;
-        }
-    }
-
-    if (exit_code == 0 && !takeover) {
-        // It is only the takeover processes that should exit, so getting
-        // here would be some sort of a failure..
-        exit_code = EX_SOFTWARE;
     }
 
-    return exit_code;
+    return status;
 }
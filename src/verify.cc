@@ -0,0 +1,446 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "verify.h"
+#include "binarymessagepipe.h"
+#include "quiet.h"
+
+#include <iostream>
+#include <sstream>
+#include <cassert>
+
+using namespace std;
+
+/**
+ * Connect (and authenticate) to a server, with cb handling the messages
+ * @throw std::string if we failed to connect
+ */
+static BinaryMessagePipe *connectTo(const string &host,
+                                    const MigrationSpec &spec,
+                                    BinaryMessagePipeCallback &cb,
+                                    struct event_base *base,
+                                    Socket *&sock) throw (std::string) {
+    BinaryMessagePipe *ret = NULL;
+    string msg;
+    sock = NULL;
+    try {
+        sock = new Socket(host);
+        if (verbosity) {
+            cout << "Connecting to " << *sock << endl;
+        }
+        sock->connect();
+        sock->setKeepalive(true);
+        ret = new BinaryMessagePipe(*sock, cb, base, timeout);
+        if (!spec.auth.empty()) {
+            ret->authenticate(spec.auth, spec.passwd);
+        }
+        sock->setNonBlocking();
+        ret->updateEvent();
+    } catch (std::string &e) {
+        msg = e;
+    } catch (std::exception &e) {
+        msg = e.what();
+    }
+
+    if (!msg.empty()) {
+        if (ret != NULL) {
+            ret->close();
+        }
+        delete ret;
+        delete sock;
+        sock = NULL;
+        throw msg;
+    }
+    return ret;
+}
+
+/**
+ * The TAP dump of the source or of the destination
+ */
+class MerkleVerifier::Dump : public BinaryMessagePipeCallback {
+public:
+    Dump(MerkleVerifier *v, const string &h, bool s) :
+        verifier(v), host(h), source(s), sock(NULL), pipe(NULL), eof(false)
+    { }
+
+    ~Dump() {
+        if (pipe != NULL) {
+            pipe->close();
+        }
+        delete pipe;
+        delete sock;
+    }
+
+    void messageReceived(BinaryMessage *msg) {
+        verifier->received(this, msg);
+    }
+
+    void abort() {
+        verifier->fail("Lost the connection to " + host, EX_IOERR);
+    }
+
+    void shutdown() {
+        eof = true;
+        verifier->scheduleStep();
+    }
+
+    MerkleVerifier *verifier;
+    string host;
+    bool source;
+    Socket *sock;
+    BinaryMessagePipe *pipe;
+    /** The server is done sending the dump */
+    bool eof;
+};
+
+/**
+ * The responses of the destination to the repairs
+ */
+class MerkleVerifier::Repair : public BinaryMessagePipeCallback {
+public:
+    Repair(MerkleVerifier *v) : verifier(v) { }
+
+    void messageReceived(BinaryMessage *msg) {
+        verifier->repaired(msg);
+    }
+
+    void abort() {
+        verifier->fail("Lost the connection to " +
+                       verifier->spec.destinations[0], EX_IOERR);
+    }
+
+    void shutdown() {
+        verifier->fail(verifier->spec.destinations[0] +
+                       " closed the connection", EX_IOERR);
+    }
+
+private:
+    MerkleVerifier *verifier;
+};
+
+MerkleVerifier::MerkleVerifier(const MigrationSpec &s, size_t l,
+                               struct event_base *b) :
+    spec(s), leaves(l), base(b), stepScheduled(false), phase(COMPARING),
+    status(EX_OK), source(NULL), destination(NULL), repairSock(NULL),
+    repairPipe(NULL), repairCallback(NULL), differingLeaves(0), compared(0),
+    repairs(0), deletes(0), repairErrors(0)
+{
+    const vector<uint16_t> &buckets = spec.sourceBuckets[0];
+    for (size_t ii = 0; ii < buckets.size(); ++ii) {
+        sourceTrees.insert(make_pair(buckets[ii], MerkleTree(leaves)));
+        destinationTrees.insert(make_pair(buckets[ii], MerkleTree(leaves)));
+    }
+
+    evtimer_set(&stepEvent, stepHandler, this);
+    event_base_set(base, &stepEvent);
+}
+
+MerkleVerifier::~MerkleVerifier() {
+    if (stepScheduled) {
+        evtimer_del(&stepEvent);
+    }
+    close();
+}
+
+void MerkleVerifier::start() throw (std::string) {
+    source = dump(spec.hosts[0], true, spec.sourceBuckets[0]);
+    destination = dump(spec.destinations[0], false, spec.sourceBuckets[0]);
+}
+
+MerkleVerifier::Dump *MerkleVerifier::dump(const string &host, bool src,
+                                           const vector<uint16_t> &vbuckets)
+    throw (std::string)
+{
+    Dump *d = new Dump(this, host, src);
+    try {
+        d->pipe = connectTo(host, spec, *d, base, d->sock);
+    } catch (std::string &) {
+        delete d;
+        throw;
+    }
+    d->pipe->sendMessage(new TapRequestBinaryMessage(spec.name, vbuckets,
+                                                     false, false, false,
+                                                     0, true));
+    d->pipe->updateEvent();
+    return d;
+}
+
+void MerkleVerifier::received(Dump *d, BinaryMessage *msg) {
+    if (msg->isTapAckRequested()) {
+        d->pipe->sendMessage(new ResponseBinaryMessage(msg->data.req->request.opcode,
+                                                       msg->data.req->request.opaque,
+                                                       PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    }
+    if (msg->data.req->request.magic != PROTOCOL_BINARY_REQ ||
+        msg->data.req->request.opcode != PROTOCOL_BINARY_CMD_TAP_MUTATION ||
+        phase == DONE) {
+        delete msg;
+        return;
+    }
+
+    uint16_t vbucket = msg->getVBucketId();
+    map<uint16_t, MerkleTree>::iterator tree = sourceTrees.find(vbucket);
+    if (tree == sourceTrees.end()) {
+        delete msg;
+        return;
+    }
+
+    const char *key = msg->getKeyBytes();
+    uint16_t nkey = msg->getKeyLength();
+    uint64_t hash = MerkleTree::hashItem(key, nkey, msg->getValueBytes(),
+                                         msg->getValueLength(),
+                                         ntohl(msg->data.mutation->message.body.item.flags),
+                                         ntohl(msg->data.mutation->message.body.item.expiration),
+                                         msg->data.req->request.datatype);
+    if (phase == COMPARING) {
+        if (!d->source) {
+            tree = destinationTrees.find(vbucket);
+        }
+        tree->second.add(key, nkey, hash);
+        delete msg;
+        return;
+    }
+
+    // Only the items of the leaves that differ are kept this time
+    map<uint16_t, vector<bool> >::iterator diff = differing.find(vbucket);
+    if (diff == differing.end() || !diff->second[tree->second.getLeaf(key, nkey)]) {
+        delete msg;
+        return;
+    }
+
+    ItemKey item(vbucket, string(key, nkey));
+    if (d->source) {
+        pair<uint64_t, BinaryMessage*> &entry = sourceItems[item];
+        delete entry.second;
+        entry.first = hash;
+        entry.second = msg;
+    } else {
+        destinationItems[item] = hash;
+        delete msg;
+    }
+}
+
+void MerkleVerifier::repaired(BinaryMessage *msg) {
+    uint8_t opcode = msg->data.res->response.opcode;
+    uint16_t st = ntohs(msg->data.res->response.status);
+    if (opcode == PROTOCOL_BINARY_CMD_NOOP) {
+        // The quiet commands before it are done
+        phase = DONE;
+        scheduleStep();
+    } else if (st != PROTOCOL_BINARY_RESPONSE_SUCCESS &&
+               !(opcode == PROTOCOL_BINARY_CMD_DELETEQ &&
+                 st == PROTOCOL_BINARY_RESPONSE_KEY_ENOENT)) {
+        if (verbosity) {
+            cerr << "Repair failed on the destination with status "
+                 << st << endl;
+        }
+        ++repairErrors;
+    }
+    delete msg;
+}
+
+void MerkleVerifier::fail(const string &error, int exitStatus) {
+    if (phase == DONE) {
+        return;
+    }
+    cerr << error << endl;
+    status = exitStatus;
+    phase = DONE;
+    scheduleStep();
+}
+
+void MerkleVerifier::scheduleStep() {
+    if (!stepScheduled) {
+        struct timeval tv = {0, 0};
+        int event_add_rv = evtimer_add(&stepEvent, &tv);
+        assert(event_add_rv != -1);
+        stepScheduled = true;
+    }
+}
+
+void MerkleVerifier::step() {
+    if (phase == DONE) {
+        close();
+        return;
+    }
+    if (phase == REPAIRING || !source->eof || !destination->eof) {
+        return;
+    }
+
+    delete source;
+    delete destination;
+    source = destination = NULL;
+
+    if (phase == COMPARING) {
+        compare();
+        if (differing.empty()) {
+            phase = DONE;
+            return;
+        }
+
+        vector<uint16_t> vbuckets;
+        map<uint16_t, vector<bool> >::iterator iter;
+        for (iter = differing.begin(); iter != differing.end(); ++iter) {
+            vbuckets.push_back(iter->first);
+        }
+        phase = COLLECTING;
+        try {
+            source = dump(spec.hosts[0], true, vbuckets);
+            destination = dump(spec.destinations[0], false, vbuckets);
+        } catch (std::string &e) {
+            fail("Failed to connect to host: " + e, EX_CONFIG);
+        }
+    } else {
+        phase = REPAIRING;
+        try {
+            repair();
+        } catch (std::string &e) {
+            fail("Failed to connect to host: " + e, EX_CONFIG);
+        }
+    }
+}
+
+void MerkleVerifier::compare() {
+    map<uint16_t, MerkleTree>::iterator iter;
+    for (iter = sourceTrees.begin(); iter != sourceTrees.end(); ++iter) {
+        MerkleTree &src = iter->second;
+        MerkleTree &dst = destinationTrees.find(iter->first)->second;
+        src.build();
+        dst.build();
+
+        vector<size_t> diff;
+        compared += src.diff(dst, diff);
+        if (!diff.empty()) {
+            vector<bool> &marks = differing[iter->first];
+            marks.resize(leaves);
+            for (size_t ii = 0; ii < diff.size(); ++ii) {
+                marks[diff[ii]] = true;
+            }
+            differingLeaves += diff.size();
+        }
+        if (verbosity) {
+            cout << "vbucket " << iter->first << ": " << src.getItems()
+                 << " items on the source, " << dst.getItems()
+                 << " on the destination, " << diff.size() << " of "
+                 << leaves << " leaves differ" << endl;
+        }
+    }
+}
+
+void MerkleVerifier::repair() throw (std::string) {
+    repairCallback = new Repair(this);
+    repairPipe = connectTo(spec.destinations[0], spec, *repairCallback, base,
+                           repairSock);
+
+    // The quiet commands work on active vbuckets, and only the
+    // failures are answered
+    map<ItemKey, pair<uint64_t, BinaryMessage*> >::iterator iter;
+    for (iter = sourceItems.begin(); iter != sourceItems.end(); ++iter) {
+        BinaryMessage *msg = iter->second.second;
+        map<ItemKey, uint64_t>::iterator dst = destinationItems.find(iter->first);
+        if (dst != destinationItems.end()) {
+            bool same = dst->second == iter->second.first;
+            destinationItems.erase(dst);
+            if (same) {
+                delete msg;
+                continue;
+            }
+        }
+        translateQuiet(msg);
+        repairPipe->sendMessage(msg);
+        ++repairs;
+    }
+    sourceItems.clear();
+
+    // Whatever is left is gone from the source
+    map<ItemKey, uint64_t>::iterator dst;
+    for (dst = destinationItems.begin(); dst != destinationItems.end(); ++dst) {
+        const string &key = dst->first.second;
+        repairPipe->sendMessage(new DeleteQuietBinaryMessage(dst->first.first,
+                                                             key.data(),
+                                                             static_cast<uint16_t>(key.length())));
+        ++deletes;
+    }
+    destinationItems.clear();
+
+    if (repairs + deletes == 0) {
+        // The leaves changed between the two dumps
+        phase = DONE;
+        scheduleStep();
+        return;
+    }
+    repairPipe->sendMessage(new NoopBinaryMessage(htonl(0xbadcafe)));
+    repairPipe->updateEvent();
+}
+
+void MerkleVerifier::close() {
+    delete source;
+    delete destination;
+    source = destination = NULL;
+    if (repairPipe != NULL) {
+        repairPipe->close();
+    }
+    delete repairPipe;
+    delete repairSock;
+    delete repairCallback;
+    repairPipe = NULL;
+    repairSock = NULL;
+    repairCallback = NULL;
+
+    map<ItemKey, pair<uint64_t, BinaryMessage*> >::iterator iter;
+    for (iter = sourceItems.begin(); iter != sourceItems.end(); ++iter) {
+        delete iter->second.second;
+    }
+    sourceItems.clear();
+}
+
+int MerkleVerifier::finish() {
+    if (status != EX_OK) {
+        return status;
+    }
+    if (phase != DONE) {
+        cerr << "Verification did not complete" << endl;
+        return EX_SOFTWARE;
+    }
+
+    uint64_t sourceCount = 0;
+    uint64_t destinationCount = 0;
+    map<uint16_t, MerkleTree>::iterator iter;
+    for (iter = sourceTrees.begin(); iter != sourceTrees.end(); ++iter) {
+        sourceCount += iter->second.getItems();
+        destinationCount += destinationTrees.find(iter->first)->second.getItems();
+    }
+    cout << "Verified " << sourceTrees.size() << " vbuckets: "
+         << sourceCount << " items on the source, " << destinationCount
+         << " on the destination, " << differingLeaves << " leaves differ ("
+         << compared << " nodes compared), " << repairs << " repaired, "
+         << deletes << " deleted" << endl;
+
+    if (repairErrors > 0) {
+        cerr << repairErrors << " repairs failed on the destination" << endl;
+        return EX_SOFTWARE;
+    }
+    return EX_OK;
+}
+
+void MerkleVerifier::stepHandler(evutil_socket_t fd, short which, void *arg) {
+    (void)fd;
+    (void)which;
+    MerkleVerifier *verifier = reinterpret_cast<MerkleVerifier*>(arg);
+    verifier->stepScheduled = false;
+    verifier->step();
+}
@@ -0,0 +1,138 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef VERIFY_H
+#define VERIFY_H 1
+
+#include "config.h"
+#include "merkle.h"
+#include "migration.h"
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <event.h>
+
+class BinaryMessage;
+class BinaryMessagePipe;
+class Socket;
+
+/**
+ * Verifies the vbuckets of the destination against the source (see
+ * -M), and repairs the destination where they differ. Both of them are
+ * dumped in parallel into a Merkle tree per vbucket, and the trees are
+ * compared top down. The vbuckets with differing leaves are dumped
+ * again, keeping only the items of those leaves this time, and the
+ * items missing on the destination or differing from the source are
+ * sent to it (with SETQ), while the ones it shouldn't have are deleted
+ * (with DELETEQ).
+ */
+class MerkleVerifier {
+public:
+    /**
+     * @param spec the source (hosts[0]), its vbuckets and the destination
+     * @param leaves the number of leaves of the trees (a power of two)
+     */
+    MerkleVerifier(const MigrationSpec &spec, size_t leaves,
+                   struct event_base *base);
+    ~MerkleVerifier();
+
+    /**
+     * Start dumping the source and the destination. The verification
+     * is done once the event loop runs out of events.
+     * @throw std::string if we failed to connect to one of them
+     */
+    void start() throw (std::string);
+
+    /**
+     * Report the outcome
+     * @return the exit status
+     */
+    int finish();
+
+private:
+    class Dump;
+    class Repair;
+
+    enum Phase {
+        /** Dumping everything into the trees */
+        COMPARING,
+        /** Dumping the items of the differing leaves */
+        COLLECTING,
+        /** Sending the repairs to the destination */
+        REPAIRING,
+        DONE
+    };
+
+    typedef std::pair<uint16_t, std::string> ItemKey;
+
+    /**
+     * Dump the vbuckets from a server
+     */
+    Dump *dump(const std::string &host, bool source,
+               const std::vector<uint16_t> &vbuckets) throw (std::string);
+
+    void received(Dump *d, BinaryMessage *msg);
+    void repaired(BinaryMessage *msg);
+
+    /**
+     * Give up on the verification
+     */
+    void fail(const std::string &error, int exitStatus);
+
+    /**
+     * Move on to the next phase from the event loop, since we may be
+     * called from the callbacks of the pipes we're about to delete
+     */
+    void scheduleStep();
+    void step();
+    void compare();
+    void repair() throw (std::string);
+    void close();
+
+    static void stepHandler(evutil_socket_t fd, short which, void *arg);
+
+    MigrationSpec spec;
+    size_t leaves;
+    struct event_base *base;
+    struct event stepEvent;
+    bool stepScheduled;
+    Phase phase;
+    int status;
+
+    Dump *source;
+    Dump *destination;
+    Socket *repairSock;
+    BinaryMessagePipe *repairPipe;
+    Repair *repairCallback;
+
+    std::map<uint16_t, MerkleTree> sourceTrees;
+    std::map<uint16_t, MerkleTree> destinationTrees;
+    /** The leaves to repair, per vbucket */
+    std::map<uint16_t, std::vector<bool> > differing;
+    /** The items of the differing leaves, and their hashes */
+    std::map<ItemKey, std::pair<uint64_t, BinaryMessage*> > sourceItems;
+    std::map<ItemKey, uint64_t> destinationItems;
+
+    size_t differingLeaves;
+    size_t compared;
+    uint64_t repairs;
+    uint64_t deletes;
+    uint64_t repairErrors;
+};
+
+#endif
@@ -0,0 +1,106 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "window.h"
+#include "binarymessage.h"
+
+using namespace std;
+
+void RetransmitWindow::sent(const BinaryMessage &msg) {
+    bool noop = msg.data.req->request.magic == PROTOCOL_BINARY_REQ &&
+        msg.data.req->request.opcode == PROTOCOL_BINARY_CMD_NOOP;
+
+    entries.push_back(Entry());
+    Entry &entry = entries.back();
+    entry.bytes.assign(msg.data.rawBytes, msg.size);
+    entry.before = fencesSent;
+    entry.answered = false;
+    bytes += msg.size;
+
+    if (noop) {
+        ++fencesSent;
+        sinceFence = 0;
+        sinceFenceBytes = 0;
+        fenceWaiting = false;
+    } else {
+        ++sinceFence;
+        sinceFenceBytes += msg.size;
+    }
+
+    if (bytes > limit) {
+        // Everything up to here is covered by the next NOOP
+        entries.clear();
+        bytes = 0;
+        overflowed = true;
+        validAfter = fencesSent;
+    }
+}
+
+void RetransmitWindow::answered(uint8_t opcode, uint32_t opaque) {
+    if (opcode == PROTOCOL_BINARY_CMD_NOOP) {
+        ++fencesAnswered;
+        if (overflowed && fencesAnswered > validAfter) {
+            overflowed = false;
+        }
+        trim();
+        return;
+    }
+
+    deque<Entry>::iterator iter;
+    for (iter = entries.begin(); iter != entries.end(); ++iter) {
+        const protocol_binary_request_header *req =
+            reinterpret_cast<const protocol_binary_request_header*>(iter->bytes.data());
+        if (!iter->answered && req->request.opcode == opcode &&
+            req->request.opaque == opaque) {
+            iter->answered = true;
+            break;
+        }
+    }
+    trim();
+}
+
+void RetransmitWindow::trim() {
+    while (!entries.empty() &&
+           (entries.front().before < fencesAnswered ||
+            entries.front().answered)) {
+        bytes -= entries.front().bytes.size();
+        entries.pop_front();
+    }
+}
+
+void RetransmitWindow::replay(vector<BinaryMessage*> &messages) {
+    deque<Entry>::iterator iter;
+    for (iter = entries.begin(); iter != entries.end(); ++iter) {
+        if (iter->answered) {
+            continue;
+        }
+        const protocol_binary_request_header *req =
+            reinterpret_cast<const protocol_binary_request_header*>(iter->bytes.data());
+        BinaryMessage *msg = new BinaryMessage(*req);
+        memcpy(msg->data.rawBytes, iter->bytes.data(), iter->bytes.size());
+        messages.push_back(msg);
+    }
+
+    // The NOOPs of the new connection are counted from scratch
+    entries.clear();
+    bytes = 0;
+    fencesSent = fencesAnswered = 0;
+    overflowed = false;
+    validAfter = 0;
+    sinceFence = sinceFenceBytes = 0;
+    fenceWaiting = false;
+}
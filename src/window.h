@@ -0,0 +1,123 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef WINDOW_H
+#define WINDOW_H 1
+
+#include "config.h"
+#include <deque>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class BinaryMessage;
+
+/**
+ * Keeps a copy of the messages sent to a destination until the
+ * destination has certainly processed them, so that they can be sent
+ * again over a new connection if the connection fails.
+ *
+ * The destination processes the messages of a connection in order, so
+ * the answer to a NOOP means it processed everything sent before the
+ * NOOP. A message answered by the destination (an ack, or an error) is
+ * processed as well. The window is bounded: once it holds more than
+ * limit bytes it is emptied, and it can't be replayed until the
+ * answer to a NOOP sent after that covers the messages thrown away.
+ */
+class RetransmitWindow {
+public:
+    RetransmitWindow(size_t l, size_t interval) :
+        limit(l), fenceInterval(interval), bytes(0), fencesSent(0),
+        fencesAnswered(0), overflowed(false), validAfter(0),
+        sinceFence(0), sinceFenceBytes(0), fenceWaiting(false)
+    { }
+
+    /**
+     * Keep a copy of a message written to the connection
+     */
+    void sent(const BinaryMessage &msg);
+
+    /**
+     * The destination answered a request
+     */
+    void answered(uint8_t opcode, uint32_t opaque);
+
+    /**
+     * Should a NOOP be sent to trim the window? True once many messages
+     * (or a quarter of the limit) were sent since the last NOOP, unless
+     * one is already on its way.
+     */
+    bool needsFence() const {
+        return !fenceWaiting &&
+            (sinceFence >= fenceInterval || sinceFenceBytes >= limit / 4);
+    }
+
+    /**
+     * A NOOP was queued for the connection
+     */
+    void fenceQueued() {
+        fenceWaiting = true;
+    }
+
+    /**
+     * Does the window hold every message the destination may not have
+     * processed?
+     */
+    bool isComplete() const {
+        return !overflowed;
+    }
+
+    /**
+     * Get copies of the messages the destination may not have
+     * processed, in the order they were sent, and start over for a
+     * new connection
+     */
+    void replay(std::vector<BinaryMessage*> &messages);
+
+    size_t getBytes() const {
+        return bytes;
+    }
+
+    size_t getMessages() const {
+        return entries.size();
+    }
+
+private:
+    class Entry {
+    public:
+        std::string bytes;
+        /** The number of NOOPs sent before this message */
+        uint64_t before;
+        bool answered;
+    };
+
+    void trim();
+
+    size_t limit;
+    size_t fenceInterval;
+    std::deque<Entry> entries;
+    size_t bytes;
+    uint64_t fencesSent;
+    uint64_t fencesAnswered;
+    /** Messages were thrown away since the NOOP validAfter */
+    bool overflowed;
+    uint64_t validAfter;
+    size_t sinceFence;
+    size_t sinceFenceBytes;
+    bool fenceWaiting;
+};
+
+#endif
@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "workerpool.h"
+
+#include <string>
+#include <cstring>
+
+WorkerPool::WorkerPool(size_t nthreads) throw (std::runtime_error) :
+    sleeping(0), nextWorker(0), stopping(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    for (size_t ii = 0; ii < nthreads; ++ii) {
+        workers.push_back(new Worker);
+    }
+
+    // The argument vector must be complete before any thread starts
+    args.resize(nthreads);
+    for (size_t ii = 0; ii < nthreads; ++ii) {
+        args[ii].pool = this;
+        args[ii].id = ii;
+        int error = pthread_create(&workers[ii]->tid, NULL, workerMain,
+                                   &args[ii]);
+        if (error != 0) {
+            std::vector<Worker*> unused(workers.begin() + ii, workers.end());
+            workers.resize(ii);
+            shutdown();
+            unused.insert(unused.end(), workers.begin(), workers.end());
+            for (size_t jj = 0; jj < unused.size(); ++jj) {
+                delete unused[jj];
+            }
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+            std::string message = "Failed to create worker thread: ";
+            message.append(std::strerror(error));
+            throw std::runtime_error(message);
+        }
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    shutdown();
+    std::vector<Worker*>::iterator iter;
+    for (iter = workers.begin(); iter != workers.end(); ++iter) {
+        delete *iter;
+    }
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+void WorkerPool::schedule(Task *task) {
+    Worker *w = workers[nextWorker];
+    nextWorker = (nextWorker + 1) % workers.size();
+
+    pthread_mutex_lock(&w->mutex);
+    w->tasks.push_back(task);
+    pthread_mutex_unlock(&w->mutex);
+
+    // A worker looks through the queues with the mutex held before it
+    // goes to sleep, so it either found the task or is asleep by now
+    pthread_mutex_lock(&mutex);
+    if (sleeping > 0) {
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+void WorkerPool::shutdown() {
+    pthread_mutex_lock(&mutex);
+    if (stopping) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    stopping = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    std::vector<Worker*>::iterator iter;
+    for (iter = workers.begin(); iter != workers.end(); ++iter) {
+        pthread_mutex_lock(&(*iter)->mutex);
+        (*iter)->stopping = true;
+        pthread_mutex_unlock(&(*iter)->mutex);
+    }
+    for (iter = workers.begin(); iter != workers.end(); ++iter) {
+        pthread_join((*iter)->tid, NULL);
+    }
+}
+
+void *WorkerPool::workerMain(void *arg) {
+    WorkerArg *wa = static_cast<WorkerArg*>(arg);
+    wa->pool->run(wa->id);
+    return NULL;
+}
+
+void WorkerPool::run(size_t id) {
+    do {
+        Task *task = nextTask(id);
+        if (task == NULL && (task = waitForTask(id)) == NULL) {
+            return;
+        }
+        task->run();
+    } while (true);
+}
+
+Task *WorkerPool::waitForTask(size_t id) {
+    Task *task = NULL;
+    pthread_mutex_lock(&mutex);
+    while (!stopping && (task = nextTask(id)) == NULL) {
+        ++sleeping;
+        pthread_cond_wait(&cond, &mutex);
+        --sleeping;
+    }
+    pthread_mutex_unlock(&mutex);
+    return task;
+}
+
+Task *WorkerPool::nextTask(size_t id) {
+    Task *task = NULL;
+    Worker *self = workers[id];
+
+    pthread_mutex_lock(&self->mutex);
+    if (self->stopping) {
+        pthread_mutex_unlock(&self->mutex);
+        return NULL;
+    }
+    if (!self->tasks.empty()) {
+        task = self->tasks.front();
+        self->tasks.pop_front();
+    }
+    pthread_mutex_unlock(&self->mutex);
+
+    // Steal from the back of the other queues, starting with our
+    // neighbour so that the thieves spread out.
+    for (size_t ii = 1; task == NULL && ii < workers.size(); ++ii) {
+        Worker *victim = workers[(id + ii) % workers.size()];
+        pthread_mutex_lock(&victim->mutex);
+        if (!victim->tasks.empty()) {
+            task = victim->tasks.back();
+            victim->tasks.pop_back();
+        }
+        pthread_mutex_unlock(&victim->mutex);
+    }
+
+    return task;
+}
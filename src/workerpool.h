@@ -0,0 +1,108 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H 1
+
+#include "config.h"
+#include <deque>
+#include <vector>
+#include <stdexcept>
+#include <pthread.h>
+
+/**
+ * A unit of work to run on one of the threads in the WorkerPool
+ */
+class Task {
+public:
+    virtual ~Task() {}
+    virtual void run() = 0;
+};
+
+/**
+ * A fixed size pool of worker threads. Each worker has its own queue
+ * of tasks, and a worker running out of work steals tasks from the
+ * other workers before going to sleep. The queues have a lock each,
+ * and the lock of the pool is only taken to go to sleep and to wake a
+ * sleeping worker up.
+ *
+ * The pool don't take ownership of the tasks, so the task must
+ * release itself (or notify its owner) when run() completes.
+ */
+class WorkerPool {
+public:
+    WorkerPool(size_t nthreads) throw (std::runtime_error);
+    ~WorkerPool();
+
+    /**
+     * Schedule a task to be run on one of the worker threads
+     */
+    void schedule(Task *task);
+
+    /**
+     * Stop all of the worker threads. Tasks not yet started are
+     * silently dropped.
+     */
+    void shutdown();
+
+    size_t getNumThreads() const { return workers.size(); }
+
+private:
+    class Worker {
+    public:
+        Worker() : tid(), stopping(false) {
+            pthread_mutex_init(&mutex, NULL);
+        }
+
+        ~Worker() {
+            pthread_mutex_destroy(&mutex);
+        }
+
+        pthread_t tid;
+        pthread_mutex_t mutex;
+        std::deque<Task*> tasks;
+        bool stopping;
+    };
+
+    struct WorkerArg {
+        WorkerPool *pool;
+        size_t id;
+    };
+
+    static void *workerMain(void *arg);
+    void run(size_t id);
+    /**
+     * Take a task from our own queue, or steal one from the others
+     * @return NULL if there is none, or the pool is stopping
+     */
+    Task *nextTask(size_t id);
+    /**
+     * Sleep until there is a task to take
+     * @return NULL if the pool is stopping
+     */
+    Task *waitForTask(size_t id);
+
+    std::vector<Worker*> workers;
+    std::vector<WorkerArg> args;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /** The workers waiting in waitForTask() */
+    size_t sleeping;
+    size_t nextWorker;
+    bool stopping;
+};
+
+#endif
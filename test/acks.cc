@@ -0,0 +1,166 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "acks.h"
+#include "binarymessage.h"
+#include <cassert>
+#include <vector>
+
+using namespace std;
+
+static void checkNext(AckSequencer &acks, uint32_t opaque,
+                      uint16_t status = PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+    BinaryMessage *msg = acks.next();
+    assert(msg != NULL);
+    assert(msg->data.res->response.magic == PROTOCOL_BINARY_RES);
+    assert(msg->data.res->response.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION);
+    assert(msg->data.res->response.opaque == opaque);
+    assert(ntohs(msg->data.res->response.status) == status);
+    delete msg;
+}
+
+static void testOrder() {
+    AckSequencer acks;
+    for (uint32_t ii = 1; ii <= 4; ++ii) {
+        acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, ii);
+    }
+    assert(acks.next() == NULL);
+
+    // The later acks wait for the first one
+    assert(acks.answer(3, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    assert(acks.answer(2, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    assert(acks.next() == NULL);
+    assert(acks.getPending() == 4);
+
+    assert(acks.answer(1, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    checkNext(acks, 1);
+    checkNext(acks, 2);
+    checkNext(acks, 3);
+    assert(acks.next() == NULL);
+    assert(acks.getPending() == 1);
+
+    // An error is passed on in order as well
+    assert(acks.answer(4, PROTOCOL_BINARY_RESPONSE_EINVAL));
+    checkNext(acks, 4, PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(acks.getPending() == 0);
+}
+
+static void testUnknown() {
+    AckSequencer acks;
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 1);
+    assert(!acks.answer(2, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    assert(acks.answer(1, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    // Answered once only
+    assert(!acks.answer(1, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    checkNext(acks, 1);
+}
+
+static void testSameOpaque() {
+    AckSequencer acks;
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 7);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 8);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 7);
+
+    // The oldest one is answered first
+    assert(acks.answer(7, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    checkNext(acks, 7);
+    assert(acks.answer(7, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    assert(acks.next() == NULL);
+    assert(acks.answer(8, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    checkNext(acks, 8);
+    checkNext(acks, 7);
+}
+
+static void testClear() {
+    AckSequencer acks;
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 1);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 2);
+    acks.clear();
+    assert(acks.getPending() == 0);
+    assert(!acks.answer(1, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 3);
+    assert(acks.answer(3, PROTOCOL_BINARY_RESPONSE_SUCCESS));
+    checkNext(acks, 3);
+}
+
+static void testFanout() {
+    FanoutAcks acks;
+    vector<bool> dropped(3, false);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 1, dropped);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 2, dropped);
+    assert(acks.answer(3, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_UNKNOWN);
+
+    // The source is answered once all of the groups acked
+    assert(acks.answer(1, 2, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_HELD);
+    assert(acks.answer(1, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_HELD);
+    assert(acks.answer(1, 1, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_RELEASED);
+
+    // A failure is passed on right away, and only once
+    assert(acks.answer(2, 1, PROTOCOL_BINARY_RESPONSE_EINVAL) ==
+           FanoutAcks::ACK_RELEASED);
+    assert(acks.answer(2, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_HELD);
+    assert(acks.answer(2, 2, PROTOCOL_BINARY_RESPONSE_EINVAL) ==
+           FanoutAcks::ACK_HELD);
+    assert(acks.getPending() == 0);
+    assert(acks.answer(2, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_UNKNOWN);
+}
+
+static void testFanoutDrop() {
+    FanoutAcks acks;
+    vector<bool> dropped(3, false);
+    dropped[2] = true;
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 1, dropped);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 2, dropped);
+    acks.expect(PROTOCOL_BINARY_CMD_TAP_MUTATION, 3, dropped);
+
+    // The group dropped before is never waited for
+    assert(acks.answer(1, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_HELD);
+    assert(acks.answer(2, 0, PROTOCOL_BINARY_RESPONSE_EINVAL) ==
+           FanoutAcks::ACK_RELEASED);
+
+    // Dropping the other replica completes the acked message, but the
+    // failed one was answered already
+    vector<BinaryMessage*> released;
+    acks.drop(1, released);
+    assert(released.size() == 1);
+    assert(released[0]->data.res->response.opaque == 1);
+    assert(ntohs(released[0]->data.res->response.status) ==
+           PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    delete released[0];
+    assert(acks.getPending() == 1);
+    assert(acks.answer(3, 0, PROTOCOL_BINARY_RESPONSE_SUCCESS) ==
+           FanoutAcks::ACK_RELEASED);
+}
+
+int main(void) {
+    testOrder();
+    testUnknown();
+    testSameOpaque();
+    testClear();
+    testFanout();
+    testFanoutDrop();
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "backfill.h"
+#include "testutil.h"
+#include <iostream>
+#include <fstream>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static void testMissingFile() {
+    string path = tempPath("backfill_test");
+    BackfillLog log(path);
+    try {
+        log.load();
+    } catch (string &e) {
+        cerr << e << endl;
+        abort();
+    }
+
+    vector<uint16_t> vbuckets;
+    vbuckets.push_back(1);
+    assert(log.getSince(vbuckets) == 0);
+}
+
+static void testUpdate() {
+    string path = tempPath("backfill_test");
+    BackfillLog log(path);
+    vector<uint16_t> vbuckets;
+    vbuckets.push_back(1);
+    vbuckets.push_back(2);
+    log.update(vbuckets, 1000);
+    vbuckets.resize(1);
+    log.update(vbuckets, 2000);
+
+    // Another log for the same file sees both of the updates
+    BackfillLog other(path);
+    other.load();
+    assert(other.getSince(vbuckets) == 2000);
+    vbuckets.push_back(2);
+    assert(other.getSince(vbuckets) == 1000);
+
+    // A full backfill is needed if one of the vbuckets is unknown
+    vbuckets.push_back(3);
+    assert(other.getSince(vbuckets) == 0);
+
+    // The updates of the others aren't lost
+    vbuckets.assign(1, 3);
+    log.update(vbuckets, 3000);
+    other.update(vbuckets, 4000);
+    log.load();
+    vbuckets.push_back(1);
+    assert(log.getSince(vbuckets) == 2000);
+    remove(path.c_str());
+}
+
+static void testInvalidFile() {
+    string path = tempPath("backfill_test");
+    {
+        ofstream out(path.c_str());
+        out << "# vbucket time" << endl
+            << "1 1000" << endl
+            << "2 soon" << endl;
+    }
+
+    BackfillLog log(path);
+    try {
+        log.load();
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+    remove(path.c_str());
+}
+
+int main(void) {
+    testMissingFile();
+    testUpdate();
+    testInvalidFile();
+
+    return 0;
+}
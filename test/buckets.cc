@@ -19,6 +19,8 @@
 #include <iostream>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <sstream>
 
 using namespace std;
 
@@ -133,6 +135,110 @@ static void testIllegalSyntax() {
     }
 }
 
+static void testVBucketMap() {
+    map<uint16_t, string> vbmap;
+    stringstream ss;
+    ss << "# comment" << endl
+       << "[0, 3] host1:11210" << endl
+       << endl
+       << "  4,6 host2:11210  " << endl
+       << "5\thost1:11210" << endl;
+
+    try {
+        parseVBucketMap(vbmap, ss);
+    } catch (string& e) {
+        cerr << e.c_str() << std::endl;
+        abort();
+    }
+    assert(vbmap.size() == 7);
+    assert(vbmap[0] == "host1:11210");
+    assert(vbmap[3] == "host1:11210");
+    assert(vbmap[4] == "host2:11210");
+    assert(vbmap[5] == "host1:11210");
+    assert(vbmap[6] == "host2:11210");
+}
+
+static void testIllegalVBucketMap() {
+    map<uint16_t, string> vbmap;
+
+    try {
+        stringstream ss("host1:11210\n");
+        parseVBucketMap(vbmap, ss);
+        abort();
+    } catch (string& e) {
+        /* Success! */
+    }
+
+    try {
+        stringstream ss("1,a host1:11210\n");
+        parseVBucketMap(vbmap, ss);
+        abort();
+    } catch (string& e) {
+        /* Success! */
+    }
+
+    try {
+        stringstream ss("1 host1:11210\n1 host2:11210\n");
+        parseVBucketMap(vbmap, ss);
+        abort();
+    } catch (string& e) {
+        /* Success! */
+    }
+}
+
+static void testBucketList() {
+    vector<BucketSpec> list;
+    stringstream ss;
+    ss << "# name[:password] vbuckets" << endl
+       << "default [0, 3]" << endl
+       << endl
+       << "  sales:secret 4,6  " << endl;
+
+    try {
+        parseBucketList(list, ss);
+    } catch (string& e) {
+        cerr << e.c_str() << std::endl;
+        abort();
+    }
+    assert(list.size() == 2);
+    assert(list[0].name == "default");
+    assert(list[0].password.empty());
+    assert(list[0].vbuckets.size() == 4);
+    assert(list[1].name == "sales");
+    assert(list[1].password == "secret");
+    assert(list[1].vbuckets.size() == 2);
+    assert(list[1].vbuckets[1] == 6);
+
+    try {
+        stringstream ss2("default\n");
+        parseBucketList(list, ss2);
+        abort();
+    } catch (string& e) {
+        /* Success! */
+    }
+
+    try {
+        list.clear();
+        stringstream ss2("default 1\ndefault 2\n");
+        parseBucketList(list, ss2);
+        abort();
+    } catch (string& e) {
+        /* Success! */
+    }
+}
+
+static void testVBucketByKey() {
+    assert(getVBucketByKey("", 0, 1024) == 0);
+    assert(getVBucketByKey("hello", 5, 1024) == 528);
+    assert(getVBucketByKey("hello", 5, 64) == 16);
+    assert(getVBucketByKey("a", 1, 1024) == 183);
+    assert(getVBucketByKey("user:1234", 9, 1024) == 176);
+    // Long enough for the eight bytes at a time loop
+    const char *key = "0123456789abcdefghijklmnopqrstuvwxyz";
+    assert(getVBucketByKey(key, strlen(key), 1024) == 437);
+    assert(getVBucketByKey(key, strlen(key), 64) == 53);
+    assert(getVBucketByKey(key, strlen(key), 1) == 0);
+}
 
 int main(int argc, char **argv) {
     (void)argc;
@@ -142,6 +248,10 @@ int main(int argc, char **argv) {
     testMultipleBuckets();
     testBucketRange();
     testIllegalSyntax();
+    testVBucketMap();
+    testIllegalVBucketMap();
+    testBucketList();
+    testVBucketByKey();
 
     return 0;
 }
@@ -0,0 +1,192 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "capture.h"
+#include "testutil.h"
+#include <iostream>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static void removeCapture(const string &path) {
+    for (size_t ii = 0;
+         remove(CaptureWriter::getSegmentName(path, ii).c_str()) == 0; ++ii) {
+    }
+}
+
+/**
+ * Build a binary protocol message for vbucket with a body of size bytes
+ */
+static string makeMessage(uint16_t vbucket, size_t size, char fill) {
+    string msg(24 + size, fill);
+    msg[0] = static_cast<char>(0x80);
+    uint16_t vb = htons(vbucket);
+    memcpy(&msg[6], &vb, sizeof(vb));
+    uint32_t bodylen = htonl(static_cast<uint32_t>(size));
+    memcpy(&msg[8], &bodylen, sizeof(bodylen));
+    return msg;
+}
+
+static void testRoundTrip() {
+    string path = tempPath("capture_test");
+    vector<string> messages;
+    {
+        // Small segments and buffer, so that we get several of each
+        CaptureWriter writer(path, 4096, 1024);
+        for (size_t ii = 0; ii < 200; ++ii) {
+            messages.push_back(makeMessage(ii % 4, ii * 7 % 300,
+                                           static_cast<char>('a' + ii % 26)));
+            writer.append(messages.back().data(), messages.back().size(),
+                          1000 + ii);
+        }
+        // A message bigger than a segment gets a segment of its own
+        messages.push_back(makeMessage(9, 10000, 'z'));
+        writer.append(messages.back().data(), messages.back().size(), 5000);
+        assert(writer.close());
+        assert(writer.getRecords() == messages.size());
+        assert(writer.getSegments() > 2);
+    }
+
+    CaptureReader reader(path);
+    CaptureRecord record;
+    size_t segment = 0;
+    size_t indexed = 0;
+    for (size_t ii = 0; ii < messages.size(); ++ii) {
+        assert(reader.next(record));
+        assert(string(record.message, record.size) == messages[ii]);
+        assert(record.time == (ii < 200 ? 1000 + ii : 5000));
+        if (ii == 0 || record.segment != segment) {
+            segment = record.segment;
+            const vector<CaptureIndexEntry> &index = reader.getIndex();
+            assert(!index.empty());
+            for (size_t jj = 0; jj < index.size(); ++jj) {
+                indexed += index[jj].records;
+            }
+        }
+    }
+    assert(!reader.next(record));
+    assert(indexed == messages.size());
+    removeCapture(path);
+}
+
+static void testBackPressure() {
+    string path = tempPath("capture_test");
+    {
+        CaptureWriter writer(path, 4096, 1024);
+        // The writer doesn't wait for the thread, but tells us to hold
+        // back once it falls behind
+        string small = makeMessage(1, 10, 'a');
+        string big = makeMessage(2, 2000, 'b');
+        assert(writer.append(small.data(), small.size()));
+        assert(!writer.append(big.data(), big.size()));
+        for (int ii = 0; ii < 1000 && !writer.hasCaughtUp(); ++ii) {
+            usleep(1000);
+        }
+        assert(writer.hasCaughtUp());
+        assert(writer.close());
+        assert(writer.getRecords() == 2);
+    }
+
+    CaptureReader reader(path);
+    CaptureRecord record;
+    assert(reader.next(record));
+    assert(reader.next(record));
+    assert(record.size == 24 + 2000);
+    assert(!reader.next(record));
+    removeCapture(path);
+}
+
+static void testIndex() {
+    string path = tempPath("capture_test");
+    {
+        CaptureWriter writer(path);
+        for (size_t ii = 0; ii < 10; ++ii) {
+            string msg = makeMessage(ii < 5 ? 1 : 2, 10, 'x');
+            writer.append(msg.data(), msg.size());
+        }
+        assert(writer.close());
+    }
+
+    CaptureReader reader(path);
+    const vector<CaptureIndexEntry> &index = reader.getIndex();
+    assert(index.size() == 2);
+    assert(index[1].vbucket == 2);
+    assert(index[1].records == 5);
+
+    // Jump straight to the records of vbucket 2
+    CaptureRecord record;
+    reader.seek(index[1].first);
+    assert(reader.next(record));
+    assert(record.offset == index[1].first);
+    uint16_t vb;
+    memcpy(&vb, record.message + 6, sizeof(vb));
+    assert(ntohs(vb) == 2);
+    removeCapture(path);
+}
+
+static void testCorruption() {
+    string path = tempPath("capture_test");
+    {
+        CaptureWriter writer(path);
+        string msg = makeMessage(1, 100, 'x');
+        writer.append(msg.data(), msg.size());
+        writer.append(msg.data(), msg.size());
+        assert(writer.close());
+    }
+
+    // Flip a byte in the value of the second message
+    int fd = open(CaptureWriter::getSegmentName(path, 0).c_str(), O_RDWR);
+    assert(fd != -1);
+    assert(pwrite(fd, "y", 1, 16 + 2 * 16 + 124 + 50) == 1);
+    close(fd);
+
+    CaptureReader reader(path);
+    CaptureRecord record;
+    assert(reader.next(record));
+    try {
+        reader.next(record);
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+    removeCapture(path);
+}
+
+static void testMissingCapture() {
+    try {
+        CaptureReader reader(tempPath("capture_test"));
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+}
+
+int main(void) {
+    testRoundTrip();
+    testBackPressure();
+    testIndex();
+    testCorruption();
+    testMissingCapture();
+
+    return 0;
+}
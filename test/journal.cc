@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "journal.h"
+#include "testutil.h"
+#include <iostream>
+#include <fstream>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static void testResume() {
+    string path = tempPath("journal_test");
+    ProgressJournal journal(path, "replication");
+    // A missing journal is a stream starting from scratch
+    journal.load();
+    assert(journal.getPreviousMessages() == 0);
+    assert(!journal.isBackfilled(1));
+    journal.received(1, 100);
+    journal.received(1, 50);
+    journal.received(2, 10);
+    journal.backfilled(1);
+    journal.update(1000);
+
+    // Nothing changed, so the file isn't written again
+    remove(path.c_str());
+    journal.update(1001);
+    assert(access(path.c_str(), F_OK) == -1);
+    journal.received(2, 10);
+    journal.update(1001);
+    assert(access(path.c_str(), F_OK) == 0);
+
+    ProgressJournal next(path, "replication");
+    next.load();
+    assert(next.getPreviousMessages() == 4);
+    assert(next.getPreviousBytes() == 170);
+    assert(next.isBackfilled(1));
+    assert(!next.isBackfilled(2));
+    vector<uint16_t> vbuckets(1, 1);
+    assert(next.isBackfilled(vbuckets));
+    vbuckets.push_back(2);
+    assert(!next.isBackfilled(vbuckets));
+    next.received(3, 5);
+    assert(next.getBytes() == 175);
+    assert(next.getPreviousBytes() == 170);
+    remove(path.c_str());
+}
+
+static void testOtherStream() {
+    string path = tempPath("journal_test");
+    ProgressJournal journal(path, "replication");
+    journal.received(1, 100);
+    journal.save();
+
+    ProgressJournal other(path, "backup");
+    try {
+        other.load();
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+    remove(path.c_str());
+}
+
+static void testInvalidFile() {
+    string path = tempPath("journal_test");
+    {
+        ofstream out(path.c_str());
+        out << "stream replication" << endl
+            << "1 10 1000 backfilled" << endl
+            << "2 10 1000 done" << endl;
+    }
+
+    ProgressJournal journal(path, "replication");
+    try {
+        journal.load();
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+
+    {
+        ofstream out(path.c_str());
+        out << "1 10 1000 backfilled" << endl;
+    }
+    try {
+        journal.load();
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+    remove(path.c_str());
+}
+
+int main(void) {
+    testResume();
+    testOtherStream();
+    testInvalidFile();
+
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "merge.h"
+#include "binarymessage.h"
+#include <cassert>
+
+using namespace std;
+
+static BinaryMessage *request(uint8_t opcode, uint32_t opaque,
+                              uint32_t bodylen) {
+    protocol_binary_request_header h;
+    memset(&h, 0, sizeof(h));
+    h.request.magic = PROTOCOL_BINARY_REQ;
+    h.request.opcode = opcode;
+    h.request.opaque = opaque;
+    h.request.bodylen = htonl(bodylen);
+    return new BinaryMessage(h);
+}
+
+static BinaryMessage *response(uint32_t opaque) {
+    return new ResponseBinaryMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, opaque,
+                                     PROTOCOL_BINARY_RESPONSE_SUCCESS);
+}
+
+static size_t sourceOf(const BinaryMessage *msg) {
+    return ntohl(msg->data.req->request.opaque) >> 24;
+}
+
+static void release(vector<pair<size_t, BinaryMessage*> > &ready) {
+    for (size_t ii = 0; ii < ready.size(); ++ii) {
+        delete ready[ii].second;
+    }
+    ready.clear();
+}
+
+static void testRoundRobin() {
+    MergeScheduler merger(1, 1000, 100);
+    assert(merger.addSource() == 0);
+    assert(merger.addSource() == 1);
+
+    // The same number of bytes from each source per round
+    for (int ii = 0; ii < 4; ++ii) {
+        merger.enqueue(0, 0, request(PROTOCOL_BINARY_CMD_TAP_MUTATION, 0, 76),
+                       false);
+    }
+    for (int ii = 0; ii < 8; ++ii) {
+        merger.enqueue(1, 0, request(PROTOCOL_BINARY_CMD_TAP_MUTATION, 0, 26),
+                       false);
+    }
+    assert(merger.getBacklog(0) == 4);
+    assert(merger.getBacklog(1) == 8);
+
+    vector<pair<size_t, BinaryMessage*> > ready;
+    merger.schedule(ready);
+    assert(ready.size() == 12);
+    size_t expected[] = { 0, 1, 1, 1, 1, 0, 0, 1, 1, 1, 1, 0 };
+    for (size_t ii = 0; ii < ready.size(); ++ii) {
+        assert(ready[ii].first == 0);
+        assert(sourceOf(ready[ii].second) == expected[ii]);
+    }
+
+    for (size_t ii = 0; ii < ready.size(); ++ii) {
+        assert(merger.sent(*ready[ii].second, 0));
+    }
+    assert(merger.getBacklog(0) == 0);
+    assert(merger.getBacklog(1) == 0);
+    assert(merger.getBytes(0) == 400);
+    assert(merger.getBytes(1) == 400);
+    release(ready);
+}
+
+static void testLimit() {
+    MergeScheduler merger(2, 2);
+    merger.addSource();
+    assert(merger.getWindow() == 4);
+
+    for (int ii = 0; ii < 3; ++ii) {
+        merger.enqueue(0, 1, request(PROTOCOL_BINARY_CMD_TAP_MUTATION, 0, 10),
+                       false);
+    }
+    vector<pair<size_t, BinaryMessage*> > ready;
+    merger.schedule(ready);
+    assert(ready.size() == 2);
+    assert(ready[0].first == 1 && ready[1].first == 1);
+
+    // Nothing more until a message leaves the connection
+    vector<pair<size_t, BinaryMessage*> > more;
+    merger.schedule(more);
+    assert(more.empty());
+    assert(merger.getBacklog(0) == 3);
+
+    // Our own NOOPs don't count
+    BinaryMessage *noop = new NoopBinaryMessage(0);
+    assert(!merger.sent(*noop, 1));
+    delete noop;
+
+    assert(merger.sent(*ready[0].second, 1));
+    merger.schedule(more);
+    assert(more.size() == 1);
+    assert(merger.getBacklog(0) == 2);
+    release(ready);
+    release(more);
+}
+
+static void testRoute() {
+    MergeScheduler merger(1, 10);
+    merger.addSource();
+    merger.addSource();
+
+    BinaryMessage *acked = request(PROTOCOL_BINARY_CMD_TAP_MUTATION, 1234, 0);
+    BinaryMessage *plain = request(PROTOCOL_BINARY_CMD_TAP_MUTATION, 5678, 0);
+    uint32_t first = merger.enqueue(1, 0, acked, true);
+    uint32_t second = merger.enqueue(1, 0, plain, false);
+    assert(first != second);
+    assert(acked->data.req->request.opaque == first);
+    assert(sourceOf(acked) == 1);
+
+    // The source gets back the opaque it sent the message with
+    size_t source = 0;
+    BinaryMessage *msg = response(first);
+    assert(merger.route(msg, source));
+    assert(source == 1);
+    assert(msg->data.res->response.opaque == 1234);
+    delete msg;
+
+    // Only the messages waiting for an ack are mapped
+    msg = response(second);
+    assert(merger.route(msg, source));
+    assert(source == 1);
+    assert(msg->data.res->response.opaque == second);
+    delete msg;
+
+    msg = response(htonl(5 << 24));
+    assert(!merger.route(msg, source));
+    delete msg;
+
+    vector<pair<size_t, BinaryMessage*> > ready;
+    merger.schedule(ready);
+    assert(ready.size() == 2);
+    release(ready);
+}
+
+int main(void) {
+    testRoundRobin();
+    testLimit();
+    testRoute();
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "merkle.h"
+#include <cassert>
+#include <sstream>
+
+using namespace std;
+
+static void add(MerkleTree &tree, int n, const string &value = "value") {
+    stringstream ss;
+    ss << "key" << n;
+    string key = ss.str();
+    tree.add(key.data(), key.length(),
+             MerkleTree::hashItem(key.data(), key.length(), value.data(),
+                                  value.length(), 0, 0, 0));
+}
+
+static void testOrder() {
+    MerkleTree a(64);
+    MerkleTree b(64);
+    for (int ii = 0; ii < 1000; ++ii) {
+        add(a, ii);
+        add(b, 999 - ii);
+    }
+    a.build();
+    b.build();
+    assert(a.getRoot() == b.getRoot());
+    assert(a.getItems() == 1000);
+
+    // Only the root is compared when the trees are the same
+    vector<size_t> leaves;
+    assert(a.diff(b, leaves) == 1);
+    assert(leaves.empty());
+}
+
+static void testDiff() {
+    MerkleTree a(256);
+    MerkleTree b(256);
+    for (int ii = 0; ii < 1000; ++ii) {
+        add(a, ii);
+        if (ii != 10) {
+            add(b, ii, ii == 500 ? "changed" : "value");
+        }
+    }
+    a.build();
+    b.build();
+    assert(a.getRoot() != b.getRoot());
+
+    vector<size_t> leaves;
+    size_t compared = a.diff(b, leaves);
+    size_t missing = a.getLeaf("key10", 5);
+    size_t changed = a.getLeaf("key500", 6);
+    if (missing == changed) {
+        assert(leaves.size() == 1);
+    } else {
+        assert(leaves.size() == 2);
+        assert(leaves[0] == min(missing, changed));
+        assert(leaves[1] == max(missing, changed));
+    }
+    // Two paths down the tree, not all of the 511 nodes
+    assert(compared <= 2 * 2 * 8 + 1);
+}
+
+static void testMetadata() {
+    MerkleTree a(1);
+    MerkleTree b(1);
+    a.add("key", 3, MerkleTree::hashItem("key", 3, "value", 5, 1, 0, 0));
+    b.add("key", 3, MerkleTree::hashItem("key", 3, "value", 5, 2, 0, 0));
+    a.build();
+    b.build();
+    vector<size_t> leaves;
+    assert(a.diff(b, leaves) == 1);
+    assert(leaves.size() == 1 && leaves[0] == 0);
+
+    // The boundary between the key and the value matters
+    assert(MerkleTree::hashItem("ke", 2, "yvalue", 6, 0, 0, 0) !=
+           MerkleTree::hashItem("key", 3, "value", 5, 0, 0, 0));
+}
+
+int main() {
+    testOrder();
+    testDiff();
+    testMetadata();
+    return 0;
+}
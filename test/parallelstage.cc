@@ -0,0 +1,172 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "parallelstage.h"
+#include "testutil.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t NUM_MESSAGES = 3000;
+static const uint16_t NUM_VBUCKETS = 8;
+
+/**
+ * The messages are numbered by their opaque, in the order they are
+ * submitted. Some of them act as barriers in the stage.
+ */
+static bool isNoop(uint32_t seq) {
+    return seq % 97 == 50;
+}
+
+static bool isTapOpaque(uint32_t seq) {
+    return seq % 151 == 20;
+}
+
+static bool isAckRequested(uint32_t seq) {
+    return seq % 61 == 30;
+}
+
+static bool isBarrier(uint32_t seq) {
+    return isNoop(seq) || isTapOpaque(seq) || isAckRequested(seq);
+}
+
+/**
+ * The processor drops some of the mutations (ack requested or not)
+ */
+static bool isDropped(uint32_t seq) {
+    return !isNoop(seq) && !isTapOpaque(seq) && seq % 7 == 3;
+}
+
+static uint16_t getVBucket(uint32_t seq) {
+    unsigned int seed = seq;
+    return static_cast<uint16_t>(rand_r(&seed) % NUM_VBUCKETS);
+}
+
+static BinaryMessage *createMessage(uint32_t seq) {
+    if (isNoop(seq)) {
+        return new NoopBinaryMessage(htonl(seq));
+    }
+
+    uint8_t opcode = isTapOpaque(seq) ?
+        PROTOCOL_BINARY_CMD_TAP_OPAQUE : PROTOCOL_BINARY_CMD_TAP_MUTATION;
+    BinaryMessage *msg = createTapMessage(opcode, "", "", getVBucket(seq));
+    msg->data.req->request.opaque = htonl(seq);
+    if (isAckRequested(seq)) {
+        msg->data.mutation->message.body.tap.flags = htons(TAP_FLAG_ACK);
+    }
+    return msg;
+}
+
+static uint32_t getSeq(BinaryMessage *msg) {
+    return ntohl(msg->data.req->request.opaque);
+}
+
+/**
+ * Takes a different time for each message, so that the batches
+ * complete out of order
+ */
+class DelayingProcessor : public MessageProcessor {
+public:
+    bool process(BinaryMessage *msg) {
+        uint32_t seq = getSeq(msg);
+        unsigned int seed = seq * 31;
+        usleep(rand_r(&seed) % 200);
+        return !isDropped(seq);
+    }
+};
+
+class RecordingCallback : public StageCallback {
+public:
+    void messageProcessed(BinaryMessage *msg, bool keep) {
+        uint32_t seq = getSeq(msg);
+        assert(keep == !isDropped(seq));
+        released.push_back(seq);
+        delete msg;
+    }
+
+    vector<uint32_t> released;
+};
+
+static void testOrder(size_t nthreads, size_t batchSize) {
+    struct event_base *base = event_init();
+    WorkerPool pool(nthreads);
+    DelayingProcessor processor;
+    RecordingCallback callback;
+    ParallelStage stage("test", pool, processor, callback, base, batchSize);
+
+    // Let the stage complete batches while more are submitted
+    for (uint32_t seq = 0; seq < NUM_MESSAGES; ++seq) {
+        stage.submit(createMessage(seq));
+        if (seq % 40 == 39) {
+            event_base_loop(base, EVLOOP_NONBLOCK);
+        }
+    }
+    stage.flush();
+    while (!stage.isIdle()) {
+        event_base_loop(base, EVLOOP_ONCE);
+    }
+
+    vector<uint32_t> &released = callback.released;
+    assert(released.size() == NUM_MESSAGES);
+    assert(stage.getQueueDepth() == 0);
+
+    // Within a vbucket the messages come out in the order they went in
+    vector<size_t> position(NUM_MESSAGES);
+    vector<uint32_t> last(NUM_VBUCKETS, 0);
+    vector<bool> seen(NUM_VBUCKETS, false);
+    for (size_t ii = 0; ii < released.size(); ++ii) {
+        uint32_t seq = released[ii];
+        position[seq] = ii;
+        if (isNoop(seq)) {
+            continue;
+        }
+        uint16_t vbucket = getVBucket(seq);
+        assert(!seen[vbucket] || last[vbucket] < seq);
+        last[vbucket] = seq;
+        seen[vbucket] = true;
+    }
+
+    // Nothing passes a barrier in either direction
+    vector<size_t> before(NUM_MESSAGES);
+    size_t latest = 0;
+    for (uint32_t seq = 0; seq < NUM_MESSAGES; ++seq) {
+        before[seq] = latest;
+        latest = max(latest, position[seq]);
+    }
+    size_t earliest = NUM_MESSAGES;
+    for (uint32_t seq = NUM_MESSAGES; seq-- > 0; ) {
+        if (isBarrier(seq)) {
+            assert(seq == 0 || before[seq] < position[seq]);
+            assert(earliest == NUM_MESSAGES || position[seq] < earliest);
+        }
+        earliest = min(earliest, position[seq]);
+    }
+
+    event_base_free(base);
+}
+
+int main(void) {
+    testOrder(1, 64);
+    testOrder(4, 64);
+    testOrder(4, 3);
+    testOrder(8, 1);
+
+    return 0;
+}
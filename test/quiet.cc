@@ -0,0 +1,137 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "quiet.h"
+#include "binarymessage.h"
+#include "testutil.h"
+#include <cassert>
+
+using namespace std;
+
+static void testTranslate() {
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                                          "key", "value");
+    translateQuiet(msg);
+    assert(msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_SETQ);
+    assert(msg->data.req->request.cas == 0);
+    assert(msg->size == sizeof(protocol_binary_request_set) + 8);
+    assert(ntohl(msg->data.req->request.bodylen) == msg->size - sizeof(*msg->data.req));
+    assert(msg->getKey() == "key");
+    assert(string(msg->getValueBytes(), msg->getValueLength()) == "value");
+    protocol_binary_request_set *set = reinterpret_cast<protocol_binary_request_set*>(msg->data.rawBytes);
+    assert(ntohl(set->message.body.flags) == 1);
+    assert(ntohl(set->message.body.expiration) == 2);
+    delete msg;
+
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_DELETE, "key", "");
+    translateQuiet(msg);
+    assert(msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_DELETEQ);
+    assert(msg->data.req->request.extlen == 0);
+    assert(msg->size == sizeof(*msg->data.req) + 3);
+    assert(msg->getKey() == "key");
+    delete msg;
+
+    // The engine specific data is dropped with the TAP header
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, "key", "value",
+                           0, 6);
+    translateQuiet(msg);
+    assert(msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_SETQ);
+    assert(msg->size == sizeof(protocol_binary_request_set) + 8);
+    assert(msg->getKey() == "key");
+    assert(string(msg->getValueBytes(), msg->getValueLength()) == "value");
+    delete msg;
+
+    // Anything else is left alone
+    msg = new NoopBinaryMessage(7);
+    size_t size = msg->size;
+    translateQuiet(msg);
+    assert(msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_NOOP);
+    assert(msg->size == size);
+    delete msg;
+}
+
+static void testInterval() {
+    QuietFences fences(2, 3);
+    assert(!fences.sent(0, 0, 1));
+    assert(!fences.sent(0, 0, 2));
+    assert(!fences.sent(1, 0, 3));
+    assert(fences.sent(0, 0, 4));
+    assert(!fences.sent(0, 0, 5));
+
+    // A fence for an ack starts the count over
+    assert(fences.sent(0, PROTOCOL_BINARY_CMD_TAP_MUTATION, 6));
+    assert(!fences.sent(0, 0, 7));
+    assert(!fences.sent(0, 0, 8));
+    assert(fences.sent(0, 0, 9));
+
+    // Nothing is due for the NOOPs sent for the interval
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_NOOP, 4,
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS) == 0);
+}
+
+static void testAcks() {
+    QuietFences fences(2, 100);
+    assert(fences.sent(0, PROTOCOL_BINARY_CMD_TAP_MUTATION, 1));
+    assert(fences.sent(0, PROTOCOL_BINARY_CMD_TAP_DELETE, 2));
+    assert(fences.sent(1, PROTOCOL_BINARY_CMD_TAP_MUTATION, 1));
+
+    // The ack is due once the NOOP is answered, on its own connection
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_NOOP, 1,
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS) == PROTOCOL_BINARY_CMD_TAP_MUTATION);
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_NOOP, 1,
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS) == 0);
+    assert(fences.answered(1, PROTOCOL_BINARY_CMD_NOOP, 1,
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS) == PROTOCOL_BINARY_CMD_TAP_MUTATION);
+
+    // A failed command fails the TAP message before its NOOP
+    uint16_t status = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+    assert(fences.failed(PROTOCOL_BINARY_CMD_DELETEQ, status));
+    assert(status == PROTOCOL_BINARY_RESPONSE_ENOMEM);
+    assert(fences.getErrors() == 1);
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_DELETEQ, 2, status) == PROTOCOL_BINARY_CMD_TAP_DELETE);
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_NOOP, 2,
+                           PROTOCOL_BINARY_RESPONSE_SUCCESS) == 0);
+}
+
+static void testErrors() {
+    QuietFences fences(1, 100);
+    assert(fences.sent(0, PROTOCOL_BINARY_CMD_TAP_DELETE, 1));
+
+    // Deleting an item the destination doesn't have is fine
+    uint16_t status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    assert(!fences.failed(PROTOCOL_BINARY_CMD_DELETEQ, status));
+    assert(status == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_DELETEQ, 1, status) == 0);
+    assert(fences.answered(0, PROTOCOL_BINARY_CMD_NOOP, 1, status) == PROTOCOL_BINARY_CMD_TAP_DELETE);
+
+    status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    assert(fences.failed(PROTOCOL_BINARY_CMD_SETQ, status));
+    status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    assert(!fences.failed(PROTOCOL_BINARY_CMD_NOOP, status));
+    status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    assert(!fences.failed(PROTOCOL_BINARY_CMD_SETQ, status));
+    assert(fences.getErrors() == 1);
+}
+
+int main(void) {
+    testTranslate();
+    testInterval();
+    testAcks();
+    testErrors();
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "rebalance.h"
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+
+using namespace std;
+
+static void testMoves() {
+    map<uint16_t, string> current;
+    map<uint16_t, string> target;
+    for (uint16_t vb = 0; vb < 8; ++vb) {
+        current[vb] = vb < 4 ? "a" : "b";
+        target[vb] = vb % 2 == 0 ? "a" : "b";
+    }
+
+    RebalancePlan plan(current, target, 1, 0);
+    assert(plan.size() == 4);
+
+    // One move out of and into each of the servers at a time
+    RebalanceMove m1, m2, m3;
+    assert(plan.next(m1));
+    assert(plan.next(m2));
+    assert(!plan.next(m3));
+    assert(m1.source != m2.source);
+    assert(m1.source == m2.destination);
+    assert(plan.getRunning() == 2);
+
+    plan.completed(m1);
+    assert(plan.next(m3));
+    assert(m3.source == m1.source);
+    assert(!plan.next(m3));
+    plan.completed(m2);
+    plan.completed(m3);
+
+    RebalanceMove m4;
+    assert(plan.next(m4));
+    assert(!plan.isDone());
+    plan.completed(m4);
+    assert(!plan.next(m4));
+    assert(plan.isDone());
+}
+
+static void testLongestQueueFirst() {
+    map<uint16_t, string> current;
+    map<uint16_t, string> target;
+    // c has three vbuckets to receive, d only one
+    for (uint16_t vb = 0; vb < 4; ++vb) {
+        current[vb] = "a";
+        target[vb] = vb == 0 ? "d" : "c";
+    }
+
+    RebalancePlan plan(current, target, 1, 0);
+    RebalanceMove move;
+    assert(plan.next(move));
+    assert(move.destination == "c");
+}
+
+static void testClusterLimit() {
+    map<uint16_t, string> current;
+    map<uint16_t, string> target;
+    current[0] = "a";
+    current[1] = "b";
+    current[2] = "c";
+    target[0] = "b";
+    target[1] = "c";
+    target[2] = "a";
+
+    RebalancePlan plan(current, target, 4, 2);
+    RebalanceMove m1, m2, m3;
+    assert(plan.next(m1));
+    assert(plan.next(m2));
+    assert(!plan.next(m3));
+    plan.completed(m1);
+    assert(plan.next(m3));
+
+    plan.cancel();
+    plan.completed(m2);
+    plan.completed(m3);
+    assert(plan.isDone());
+}
+
+static void testIllegalMaps() {
+    map<uint16_t, string> current;
+    map<uint16_t, string> target;
+    current[0] = "a";
+    target[0] = "a";
+    target[1] = "b";
+
+    try {
+        RebalancePlan plan(current, target, 1, 0);
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+
+    try {
+        RebalancePlan plan(target, current, 1, 0);
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+
+    try {
+        RebalancePlan plan(current, current, 0, 0);
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+
+    RebalancePlan plan(current, current, 1, 0);
+    assert(plan.size() == 0);
+    assert(plan.isDone());
+}
+
+int main(void) {
+    testMoves();
+    testLongestQueueFirst();
+    testClusterLimit();
+    testIllegalMaps();
+
+    return 0;
+}
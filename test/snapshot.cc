@@ -0,0 +1,191 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "snapshot.h"
+#include "testutil.h"
+#include <iostream>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static void removeDir(const string &dir) {
+    for (unsigned int vb = 0; vb < 16; ++vb) {
+        remove(SnapshotExporter::getSnapshotName(dir, vb).c_str());
+    }
+    int rv = rmdir(dir.c_str());
+    assert(rv == 0);
+    (void)rv;
+}
+
+static string makeKey(size_t n) {
+    stringstream ss;
+    ss << "key:" << (n * 7919) % 100003;
+    return ss.str();
+}
+
+static void add(SnapshotExporter &exporter, uint16_t vb, const string &key,
+                const string &value, uint32_t flags) {
+    exporter.add(vb, key.data(), static_cast<uint16_t>(key.length()),
+                 value.data(), static_cast<uint32_t>(value.length()),
+                 flags, 1234, 42, 0);
+}
+
+static void testLookup() {
+    string dir = tempDir("snapshot_test");
+    SnapshotExporter exporter(dir);
+    for (size_t ii = 0; ii < 5000; ++ii) {
+        string key = makeKey(ii);
+        add(exporter, ii % 2, key, "value of " + key, static_cast<uint32_t>(ii));
+    }
+    exporter.open(3);
+    assert(exporter.close());
+    assert(exporter.getItems() == 5000);
+    assert(exporter.getVBuckets() == 3);
+    assert(exporter.getRuns() == 0);
+
+    SnapshotReader reader(SnapshotExporter::getSnapshotName(dir, 1));
+    assert(reader.getVBucket() == 1);
+    assert(reader.getItems() == 2500);
+    for (size_t ii = 0; ii < 5000; ++ii) {
+        SnapshotItem item;
+        string key = makeKey(ii);
+        bool found = reader.get(key, item);
+        assert(found == (ii % 2 == 1));
+        if (found) {
+            assert(item.key == key);
+            assert(item.value == "value of " + key);
+            assert(item.flags == ii);
+            assert(item.expiry == 1234);
+            assert(item.cas == 42);
+        }
+    }
+
+    // The keys that aren't there are mostly caught by the Bloom filter
+    size_t passed = 0;
+    SnapshotItem item;
+    for (size_t ii = 0; ii < 10000; ++ii) {
+        stringstream ss;
+        ss << "missing:" << ii;
+        assert(!reader.get(ss.str(), item));
+        if (reader.mayContain(ss.str())) {
+            ++passed;
+        }
+    }
+    assert(passed < 300);
+    assert(!reader.get("", item));
+    assert(!reader.get("a", item));
+    assert(!reader.get("zzz", item));
+
+    // An empty vbucket still gets a snapshot
+    SnapshotReader empty(SnapshotExporter::getSnapshotName(dir, 3));
+    assert(empty.getItems() == 0);
+    assert(!empty.get(makeKey(1), item));
+
+    removeDir(dir);
+}
+
+static void testSpill() {
+    string dir = tempDir("snapshot_test");
+    // A little memory, so that every vbucket is sorted in many runs
+    SnapshotExporter exporter(dir, 16 * 1024);
+    for (size_t round = 0; round < 3; ++round) {
+        for (size_t ii = 0; ii < 3000; ++ii) {
+            stringstream value;
+            value << "round " << round;
+            add(exporter, ii % 4, makeKey(ii), value.str(),
+                static_cast<uint32_t>(round));
+        }
+    }
+    assert(exporter.getRuns() > 10);
+    assert(exporter.close());
+    // The later versions of the items replace the earlier ones
+    assert(exporter.getItems() == 3000);
+
+    for (uint16_t vb = 0; vb < 4; ++vb) {
+        SnapshotReader reader(SnapshotExporter::getSnapshotName(dir, vb));
+        assert(reader.getItems() == 750);
+        for (size_t ii = vb; ii < 3000; ii += 4) {
+            SnapshotItem item;
+            assert(reader.get(makeKey(ii), item));
+            assert(item.value == "round 2");
+            assert(item.flags == 2);
+        }
+    }
+
+    // The runs are gone
+    struct stat st;
+    assert(stat((SnapshotExporter::getSnapshotName(dir, 0) + ".run0").c_str(),
+                &st) == -1);
+    removeDir(dir);
+}
+
+static void testCorruption() {
+    string dir = tempDir("snapshot_test");
+    SnapshotExporter exporter(dir);
+    for (size_t ii = 0; ii < 1000; ++ii) {
+        add(exporter, 0, makeKey(ii), "value", 0);
+    }
+    assert(exporter.close());
+
+    // Flip a byte of the index
+    string name = SnapshotExporter::getSnapshotName(dir, 0);
+    struct stat st;
+    assert(stat(name.c_str(), &st) == 0);
+    int fd = open(name.c_str(), O_RDWR);
+    assert(fd != -1);
+    char c;
+    off_t offset = st.st_size - 56 - 200;
+    assert(pread(fd, &c, 1, offset) == 1);
+    c ^= 1;
+    assert(pwrite(fd, &c, 1, offset) == 1);
+    close(fd);
+
+    try {
+        SnapshotReader reader(name);
+        assert(false);
+    } catch (string &e) {
+        assert(e.find("Corrupt") != string::npos);
+    }
+
+    // A file that isn't a snapshot at all
+    FILE *fp = fopen(name.c_str(), "w");
+    assert(fp != NULL);
+    fprintf(fp, "This is not a snapshot, but it is long enough to have one's "
+            "header and trailer\n");
+    fclose(fp);
+    try {
+        SnapshotReader reader(name);
+        assert(false);
+    } catch (string &e) {
+        assert(e.find("Not a snapshot") != string::npos);
+    }
+    removeDir(dir);
+}
+
+int main(void) {
+    testLookup();
+    testSpill();
+    testCorruption();
+    return 0;
+}
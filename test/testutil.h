@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#ifndef TESTUTIL_H
+#define TESTUTIL_H 1
+
+#include "config.h"
+#include "binarymessage.h"
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+/**
+ * Get a fresh name for a file in /tmp (the file doesn't exist)
+ */
+inline std::string tempPath(const std::string &prefix) {
+    std::string pattern = "/tmp/" + prefix + ".XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    int fd = mkstemp(&name[0]);
+    assert(fd != -1);
+    close(fd);
+    remove(&name[0]);
+    return &name[0];
+}
+
+/**
+ * Create an empty directory in /tmp
+ */
+inline std::string tempDir(const std::string &prefix) {
+    std::string pattern = "/tmp/" + prefix + ".XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    char *dir = mkdtemp(&name[0]);
+    assert(dir != NULL);
+    (void)dir;
+    return &name[0];
+}
+
+/**
+ * Create a TAP message (a TAP_MUTATION unless opcode says otherwise),
+ * with the item flags 1 and expiry time 2, and nengine bytes of engine
+ * specific data between the extras and the key
+ */
+inline BinaryMessage *createTapMessage(uint8_t opcode, const std::string &key,
+                                       const std::string &value = "value",
+                                       uint16_t vbucket = 0,
+                                       uint16_t nengine = 0) {
+    protocol_binary_request_tap_mutation m;
+    memset(&m, 0, sizeof(m));
+    m.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    m.message.header.request.opcode = opcode;
+    m.message.header.request.keylen = htons(static_cast<uint16_t>(key.length()));
+    m.message.header.request.extlen = sizeof(m.message.body);
+    m.message.header.request.vbucket = htons(vbucket);
+    m.message.header.request.bodylen = htonl(static_cast<uint32_t>(sizeof(m.message.body) + nengine + key.length() + value.length()));
+    m.message.header.request.cas = 42;
+    m.message.body.tap.enginespecific_length = htons(nengine);
+    m.message.body.item.flags = htonl(1);
+    m.message.body.item.expiration = htonl(2);
+
+    BinaryMessage *msg = new BinaryMessage(m.message.header);
+    char *ptr = msg->data.rawBytes + sizeof(m.message.header);
+    memcpy(ptr, &m.message.body, sizeof(m.message.body));
+    ptr += sizeof(m.message.body);
+    memset(ptr, 'e', nengine);
+    ptr += nengine;
+    memcpy(ptr, key.data(), key.length());
+    memcpy(ptr + key.length(), value.data(), value.length());
+    return msg;
+}
+
+#endif
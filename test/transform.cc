@@ -0,0 +1,360 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "transform.h"
+#include "buckets.h"
+#include "testutil.h"
+#include <iostream>
+#include <sstream>
+#include <cassert>
+#include <cstdlib>
+#include <ctime>
+#ifdef HAVE_SNAPPY_C_H
+#include <snappy-c.h>
+#endif
+
+using namespace std;
+
+static string getValue(BinaryMessage *msg) {
+    const char *value = msg->getKeyBytes() + msg->getKeyLength();
+    return string(value, msg->data.rawBytes + msg->size - value);
+}
+
+class DropTransform : public Transform {
+public:
+    bool handles(uint8_t opcode) const {
+        return opcode == PROTOCOL_BINARY_CMD_TAP_DELETE;
+    }
+
+    bool apply(BinaryMessage *msg) {
+        (void)msg;
+        return false;
+    }
+};
+
+static void testExpiryAndFlags() {
+    TransformPipeline pipeline;
+    pipeline.add(new ExpiryTransform(10));
+    pipeline.add(new FlagsTransform(20));
+
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, "key");
+    assert(pipeline.apply(msg));
+    assert(ntohl(msg->data.mutation->message.body.item.expiration) == 10);
+    assert(ntohl(msg->data.mutation->message.body.item.flags) == 20);
+    delete msg;
+
+    // Only the mutations carry an expiry time and flags
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_OPAQUE, "key");
+    assert(pipeline.apply(msg));
+    assert(ntohl(msg->data.mutation->message.body.item.expiration) == 2);
+    assert(ntohl(msg->data.mutation->message.body.item.flags) == 1);
+    delete msg;
+}
+
+static bool expired(ExpiredItemTransform &t, uint16_t vbucket,
+                    uint32_t expiry) {
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                                          "key", "value", vbucket);
+    msg->data.mutation->message.body.item.expiration = htonl(expiry);
+    bool ret = !t.apply(msg);
+    delete msg;
+    return ret;
+}
+
+static void testExpired() {
+    uint32_t now = static_cast<uint32_t>(time(NULL));
+    ExpiredItemTransform t(60);
+
+    assert(!expired(t, 1, 0));
+    // Relative expiry times are never checked
+    assert(!expired(t, 1, 10));
+    assert(!expired(t, 1, now + 10));
+    // Within the skew
+    assert(!expired(t, 1, now - 30));
+    assert(expired(t, 1, now - 120));
+    assert(expired(t, 1, now - 120));
+    assert(expired(t, 3, now - 3600));
+    assert(t.getDropped() == 3);
+
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, "key");
+    size_t size = msg->size;
+    delete msg;
+    stringstream expected;
+    expected << "Dropped 3 expired items (" << 3 * size << " bytes)" << endl
+             << "  vbucket 1: 2 items (" << 2 * size << " bytes)" << endl
+             << "  vbucket 3: 1 items (" << size << " bytes)" << endl;
+    stringstream ss;
+    t.getStats(ss, true);
+    assert(ss.str() == expected.str());
+}
+
+#ifdef HAVE_SNAPPY_C_H
+static BinaryMessage *createValue(uint16_t vbucket, const string &value) {
+    return createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, "key", value,
+                            vbucket);
+}
+
+static void testCompress() {
+    CompressTransform t(100);
+    string json;
+    while (json.length() < 1000) {
+        json.append("{\"name\": \"value\", \"count\": 42},");
+    }
+
+    BinaryMessage *msg = createValue(1, json);
+    size_t size = msg->size;
+    assert(t.apply(msg));
+    assert(msg->size < size);
+    assert(msg->data.req->request.datatype == 0x02);
+    assert(msg->getKey() == "key");
+    assert(ntohl(msg->data.req->request.bodylen) == msg->size - sizeof(*msg->data.req));
+    char buffer[2000];
+    size_t length = sizeof(buffer);
+    assert(snappy_uncompress(msg->getValueBytes(), msg->getValueLength(),
+                             buffer, &length) == SNAPPY_OK);
+    assert(string(buffer, length) == json);
+
+    // Already compressed
+    size = msg->size;
+    assert(t.apply(msg));
+    assert(msg->size == size);
+    delete msg;
+
+    // Too small
+    msg = createValue(1, json.substr(0, 99));
+    assert(t.apply(msg));
+    assert(msg->data.req->request.datatype == PROTOCOL_BINARY_RAW_BYTES);
+    delete msg;
+
+    // Compression is turned off for vbucket 2 once it has seen enough
+    // values that don't compress, while vbucket 1 keeps compressing
+    srand(1);
+    for (int ii = 0; ii < 1000; ++ii) {
+        string random;
+        for (int jj = 0; jj < 200; ++jj) {
+            random.push_back(static_cast<char>(rand()));
+        }
+        msg = createValue(2, random);
+        assert(t.apply(msg));
+        assert(msg->data.req->request.datatype == PROTOCOL_BINARY_RAW_BYTES);
+        delete msg;
+    }
+    msg = createValue(1, json);
+    assert(t.apply(msg));
+    assert(msg->data.req->request.datatype == 0x02);
+    delete msg;
+
+    stringstream ss;
+    t.getStats(ss);
+    assert(ss.str().find("Compressed 2 values") == 0);
+    assert(ss.str().find("turned compression off 1 times") != string::npos);
+}
+#endif
+
+static void testKeyPrefix() {
+    TransformPipeline pipeline;
+    pipeline.add(new KeyPrefixTransform("user:", "u:"));
+    pipeline.add(new KeyPrefixTransform("u:", "customer:"));
+
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                                          "user:42");
+    size_t size = msg->size;
+    assert(pipeline.apply(msg));
+    assert(msg->getKey() == "customer:42");
+    assert(msg->size == size + 4);
+    assert(ntohl(msg->data.req->request.bodylen) == msg->size - sizeof(msg->data.req->bytes));
+    assert(getValue(msg) == "value");
+    assert(ntohl(msg->data.mutation->message.body.item.flags) == 1);
+    delete msg;
+
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_DELETE, "session:1");
+    assert(pipeline.apply(msg));
+    assert(msg->getKey() == "session:1");
+    delete msg;
+}
+
+static void testReshard() {
+    ReshardTransform reshard(1024);
+    KeyPrefixTransform prefix("user:", "customer:");
+
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                                          "user:42");
+    assert(reshard.handles(msg->data.req->request.opcode));
+    assert(reshard.apply(msg));
+    assert(msg->getVBucketId() == getVBucketByKey("user:42", 7, 1024));
+
+    // The rewritten key picks the vbucket when -n is used with -p
+    assert(prefix.apply(msg));
+    assert(reshard.apply(msg));
+    assert(msg->getVBucketId() == getVBucketByKey("customer:42", 11, 1024));
+    assert(msg->getVBucketId() != getVBucketByKey("user:42", 7, 1024));
+    delete msg;
+
+    assert(!reshard.handles(PROTOCOL_BINARY_CMD_TAP_OPAQUE));
+}
+
+static void testEngineSpecific() {
+    // The engine specific data sits between the extras and the key
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                                          "user:42", "value", 0, 5);
+    size_t extras = sizeof(msg->data.mutation->bytes);
+    assert(msg->getEngineSpecificLength() == 5);
+    assert(msg->getKey() == "user:42");
+    assert(getValue(msg) == "value");
+
+    KeyPrefixTransform prefix("user:", "customer:");
+    assert(prefix.apply(msg));
+    assert(msg->getKey() == "customer:42");
+    assert(getValue(msg) == "value");
+    assert(memcmp(msg->data.rawBytes + extras, "eeeee", 5) == 0);
+
+    ReshardTransform reshard(1024);
+    assert(reshard.apply(msg));
+    assert(msg->getVBucketId() == getVBucketByKey("customer:42", 11, 1024));
+    delete msg;
+
+    vector<string> include, none;
+    include.push_back("tenant1:");
+    KeyFilterTransform filter(include, none, none, none);
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_DELETE, "tenant1:a", "",
+                           0, 3);
+    assert(filter.apply(msg));
+    delete msg;
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_DELETE, "tenant2:a", "",
+                           0, 3);
+    assert(!filter.apply(msg));
+    delete msg;
+
+#ifdef HAVE_SNAPPY_C_H
+    string json;
+    while (json.length() < 1000) {
+        json.append("{\"name\": \"value\", \"count\": 42},");
+    }
+    CompressTransform compress(100);
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, "key", json,
+                           0, 4);
+    assert(compress.apply(msg));
+    assert(msg->data.req->request.datatype == 0x02);
+    assert(memcmp(msg->data.rawBytes + extras, "eeee", 4) == 0);
+    assert(msg->getKey() == "key");
+    char buffer[2000];
+    size_t length = sizeof(buffer);
+    assert(snappy_uncompress(msg->getValueBytes(), msg->getValueLength(),
+                             buffer, &length) == SNAPPY_OK);
+    assert(string(buffer, length) == json);
+    delete msg;
+#endif
+
+    // Nothing else carries engine specific data
+    msg = new ResponseBinaryMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, 1,
+                                    PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(msg->getEngineSpecificLength() == 0);
+    delete msg;
+}
+
+static void testDrop() {
+    TransformPipeline pipeline;
+    assert(pipeline.empty());
+    pipeline.add(new DropTransform);
+    pipeline.add(new ExpiryTransform(10));
+    assert(!pipeline.empty());
+
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_DELETE, "key");
+    assert(!pipeline.apply(msg));
+    delete msg;
+
+    msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, "key");
+    assert(pipeline.apply(msg));
+    delete msg;
+}
+
+static bool filter(KeyFilterTransform &f, const string &key) {
+    BinaryMessage *msg = createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, key);
+    bool keep = f.apply(msg);
+    delete msg;
+    return keep;
+}
+
+static void testPrefixSet() {
+    PrefixSet set;
+    assert(set.empty());
+    assert(!set.matches("abc", 3));
+    set.add("user:");
+    set.add("us");
+    set.add("session:");
+    assert(!set.empty());
+    assert(set.matches("user:1", 6));
+    assert(set.matches("us", 2));
+    assert(set.matches("session:", 8));
+    assert(!set.matches("u", 1));
+    assert(!set.matches("session", 7));
+    assert(!set.matches("", 0));
+    assert(!set.matches("abc", 3));
+}
+
+static void testKeyFilter() {
+    vector<string> include, exclude, none;
+    include.push_back("tenant1:");
+    include.push_back("tenant2:");
+    exclude.push_back("tenant2:session:");
+
+    KeyFilterTransform prefixes(include, exclude, none, none);
+    assert(filter(prefixes, "tenant1:a"));
+    assert(filter(prefixes, "tenant2:a"));
+    assert(!filter(prefixes, "tenant2:session:a"));
+    assert(!filter(prefixes, "tenant3:a"));
+
+    KeyFilterTransform excludeOnly(none, exclude, none, none);
+    assert(filter(excludeOnly, "tenant3:a"));
+    assert(!filter(excludeOnly, "tenant2:session:a"));
+
+#ifdef HAVE_REGEX_H
+    vector<string> includeRe, excludeRe;
+    includeRe.push_back("^[0-9]+$");
+    excludeRe.push_back("7");
+    KeyFilterTransform patterns(include, none, includeRe, excludeRe);
+    assert(filter(patterns, "tenant1:a"));
+    assert(filter(patterns, "12"));
+    assert(!filter(patterns, "17"));
+    assert(!filter(patterns, "tenant1:7"));
+    assert(!filter(patterns, "a12"));
+
+    try {
+        excludeRe.push_back("(");
+        KeyFilterTransform invalid(none, none, none, excludeRe);
+        abort();
+    } catch (string &e) {
+        /* Success! */
+    }
+#endif
+}
+
+int main(void) {
+    testExpiryAndFlags();
+    testExpired();
+#ifdef HAVE_SNAPPY_C_H
+    testCompress();
+#endif
+    testKeyPrefix();
+    testReshard();
+    testEngineSpecific();
+    testDrop();
+    testPrefixSet();
+    testKeyFilter();
+
+    return 0;
+}
@@ -0,0 +1,252 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * Measure the per message cost of the transform configurations.
+ * Run with "make bench".
+ */
+#include "config.h"
+#include "transform.h"
+#include "testutil.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <cstdlib>
+#include <sys/time.h>
+
+using namespace std;
+
+static const size_t NUM_MESSAGES = 4096;
+static const size_t ROUNDS = 500;
+
+static uint64_t now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/**
+ * The way the messages were rewritten before the transform pipeline:
+ * a check of every option (and of the opcode) for every message
+ */
+class FlagChecks {
+public:
+    FlagChecks(bool e, bool f) : hasExpiry(e), hasFlags(f) { }
+
+    bool apply(BinaryMessage *msg) {
+        if (hasExpiry &&
+            msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
+            msg->data.mutation->message.body.item.expiration = htonl(10);
+        }
+        if (hasFlags &&
+            msg->data.req->request.opcode == PROTOCOL_BINARY_CMD_TAP_MUTATION) {
+            msg->data.mutation->message.body.item.flags = htonl(20);
+        }
+        return true;
+    }
+
+private:
+    bool hasExpiry;
+    bool hasFlags;
+};
+
+template <class T>
+static void run(const char *name, T &transforms,
+                vector<BinaryMessage*> &messages) {
+    size_t forwarded = 0;
+    uint64_t start = now_usec();
+    for (size_t round = 0; round < ROUNDS; ++round) {
+        for (size_t ii = 0; ii < messages.size(); ++ii) {
+            if (transforms.apply(messages[ii])) {
+                forwarded += messages[ii]->size;
+            }
+        }
+    }
+    uint64_t elapsed = now_usec() - start;
+
+    double nsec = elapsed * 1000.0 / (ROUNDS * messages.size());
+    cout << setw(32) << left << name << fixed << setprecision(2)
+         << setw(8) << right << nsec << " ns/message";
+    if (forwarded == 0) {
+        cout << " (nothing forwarded)";
+    }
+    cout << endl;
+}
+
+#ifdef HAVE_SNAPPY_C_H
+static BinaryMessage *createDocument(const string &key, size_t ii, bool json) {
+    string value;
+    if (json) {
+        stringstream ss;
+        ss << "{\"id\": " << ii << ", \"type\": \"user\", \"name\": \"user"
+           << ii << "\", \"visits\": [";
+        for (size_t jj = 0; ss.str().length() < 1000; ++jj) {
+            ss << "{\"page\": \"/products/" << (ii * 7 + jj) % 100
+               << "\", \"duration\": " << (ii * 13 + jj) % 600 << "},";
+        }
+        ss << "{}]}";
+        value = ss.str();
+    } else {
+        for (size_t jj = 0; jj < 1000; ++jj) {
+            value.push_back(static_cast<char>(rand()));
+        }
+    }
+
+    return createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION, key, value);
+}
+
+static BinaryMessage *copyMessage(const BinaryMessage *msg) {
+    BinaryMessage *copy = new BinaryMessage(*msg->data.req);
+    memcpy(copy->data.rawBytes, msg->data.rawBytes, msg->size);
+    return copy;
+}
+
+/**
+ * Compare the throughput with and without compression on a link that
+ * may be the bottleneck: the message rate is bounded both by the time
+ * spent per message (including a copy of it, since the transforms
+ * modify the messages) and by the number of bytes sent per message.
+ */
+template <class T>
+static void runLink(const char *name, T &transforms,
+                    const vector<BinaryMessage*> &messages) {
+    static const size_t LINK_ROUNDS = 50;
+    static const double LINKS[] = { 100e6, 1e9, 10e9 };
+    uint64_t bytes = 0;
+    uint64_t start = now_usec();
+    for (size_t round = 0; round < LINK_ROUNDS; ++round) {
+        for (size_t ii = 0; ii < messages.size(); ++ii) {
+            BinaryMessage *msg = copyMessage(messages[ii]);
+            if (transforms.apply(msg)) {
+                bytes += msg->size;
+            }
+            delete msg;
+        }
+    }
+    uint64_t elapsed = now_usec() - start;
+
+    double count = static_cast<double>(LINK_ROUNDS * messages.size());
+    double nsec = elapsed * 1000.0 / count;
+    double size = bytes / count;
+    cout << setw(32) << left << name << fixed << setprecision(2)
+         << setw(8) << right << nsec << " ns/message "
+         << setw(7) << setprecision(0) << size << " bytes/message,";
+    for (size_t ii = 0; ii < sizeof(LINKS) / sizeof(LINKS[0]); ++ii) {
+        double rate = min(1e9 / nsec, LINKS[ii] / 8 / size);
+        cout << " " << setw(8) << rate << "/s @"
+             << LINKS[ii] / 1e6 << "Mbit";
+    }
+    cout << endl;
+}
+
+static void benchCompression() {
+    vector<BinaryMessage*> json, random;
+    for (size_t ii = 0; ii < NUM_MESSAGES; ++ii) {
+        stringstream key;
+        key << "user:" << ii;
+        json.push_back(createDocument(key.str(), ii, true));
+        random.push_back(createDocument(key.str(), ii, false));
+    }
+
+    NoTransform none;
+    runLink("JSON, uncompressed", none, json);
+    TransformPipeline compressJson;
+    compressJson.add(new CompressTransform(100));
+    runLink("JSON, -z 100", compressJson, json);
+
+    runLink("random, uncompressed", none, random);
+    TransformPipeline compressRandom;
+    compressRandom.add(new CompressTransform(100));
+    runLink("random, -z 100", compressRandom, random);
+
+    for (size_t ii = 0; ii < NUM_MESSAGES; ++ii) {
+        delete json[ii];
+        delete random[ii];
+    }
+}
+#endif
+
+int main(void) {
+    vector<BinaryMessage*> messages;
+    for (size_t ii = 0; ii < NUM_MESSAGES; ++ii) {
+        stringstream key;
+        key << "a:" << ii;
+        messages.push_back(createTapMessage(PROTOCOL_BINARY_CMD_TAP_MUTATION,
+                                            key.str(), string(100, 'x')));
+    }
+
+    NoTransform none;
+    run("no transforms", none, messages);
+
+    FlagChecks checks(false, false);
+    run("flag checks, nothing set", checks, messages);
+
+    FlagChecks checksBoth(true, true);
+    run("flag checks, -E and -f", checksBoth, messages);
+
+    TransformPipeline expiry;
+    expiry.add(new ExpiryTransform(10));
+    run("pipeline, -E", expiry, messages);
+
+    TransformPipeline both;
+    both.add(new ExpiryTransform(10));
+    both.add(new FlagsTransform(20));
+    run("pipeline, -E and -f", both, messages);
+
+    // Rewrite the keys back and forth, so that every round does the
+    // same amount of work
+    TransformPipeline prefix;
+    prefix.add(new KeyPrefixTransform("a:", "b:"));
+    prefix.add(new KeyPrefixTransform("b:", "a:"));
+    run("pipeline, 2x -p (same length)", prefix, messages);
+
+    TransformPipeline resize;
+    resize.add(new KeyPrefixTransform("a:", "bb:"));
+    resize.add(new KeyPrefixTransform("bb:", "a:"));
+    run("pipeline, 2x -p (resized)", resize, messages);
+
+    vector<string> prefixes, empty;
+    for (int ii = 0; ii < 16; ++ii) {
+        stringstream ss;
+        ss << "tenant" << ii << ":";
+        prefixes.push_back(ss.str());
+    }
+    prefixes.push_back("a:");
+    KeyFilterTransform *filter;
+    filter = new KeyFilterTransform(prefixes, empty, empty, empty);
+    TransformPipeline prefixFilter;
+    prefixFilter.add(filter);
+    run("pipeline, 17x -i", prefixFilter, messages);
+
+#ifdef HAVE_REGEX_H
+    vector<string> patterns;
+    patterns.push_back("^(tenant[0-9]+|a):");
+    filter = new KeyFilterTransform(empty, empty, patterns, empty);
+    TransformPipeline regexFilter;
+    regexFilter.add(filter);
+    run("pipeline, -I", regexFilter, messages);
+#endif
+
+    for (size_t ii = 0; ii < messages.size(); ++ii) {
+        delete messages[ii];
+    }
+
+#ifdef HAVE_SNAPPY_C_H
+    benchCompression();
+#endif
+    return 0;
+}
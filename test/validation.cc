@@ -0,0 +1,141 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "validation.h"
+#include "binarymessage.h"
+#include <cassert>
+#include <vector>
+
+using namespace std;
+
+static BinaryMessage *answer(const BinaryMessage *req, uint16_t status,
+                             uint32_t state) {
+    protocol_binary_response_header h;
+    memset(&h, 0, sizeof(h));
+    h.response.magic = PROTOCOL_BINARY_RES;
+    h.response.opcode = PROTOCOL_BINARY_CMD_GET_VBUCKET;
+    h.response.status = htons(status);
+    h.response.opaque = req->data.req->request.opaque;
+    h.response.bodylen = htonl(status == PROTOCOL_BINARY_RESPONSE_SUCCESS ?
+                               sizeof(state) : 0);
+    BinaryMessage *msg = new BinaryMessage(reinterpret_cast<protocol_binary_request_header&>(h));
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        state = htonl(state);
+        memcpy(msg->data.rawBytes + sizeof(h.bytes), &state, sizeof(state));
+    }
+    return msg;
+}
+
+static void testStates() {
+    StateValidator validator;
+    BinaryMessage *first = validator.request(3);
+    BinaryMessage *second = validator.request(700);
+    BinaryMessage *third = validator.request(9);
+    assert(first->data.req->request.opcode == PROTOCOL_BINARY_CMD_GET_VBUCKET);
+    assert(first->getVBucketId() == 3);
+    assert(validator.getAwaiting() == 3);
+
+    vbucket_state_t state = vbucket_state_dead;
+    string error;
+    assert(!validator.getState(3, state, error));
+
+    BinaryMessage *msg = answer(second, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                vbucket_state_active);
+    validator.answered(*msg);
+    delete msg;
+    assert(validator.getState(700, state, error));
+    assert(state == vbucket_state_active);
+    assert(error.empty());
+
+    msg = answer(first, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                 vbucket_state_replica);
+    validator.answered(*msg);
+    delete msg;
+    assert(validator.getState(3, state, error));
+    assert(state == vbucket_state_replica);
+
+    msg = answer(third, PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET, 0);
+    validator.answered(*msg);
+    delete msg;
+    assert(validator.getState(9, state, error));
+    assert(!error.empty());
+    assert(validator.getAwaiting() == 0);
+
+    delete first;
+    delete second;
+    delete third;
+}
+
+static void testShortResponse() {
+    StateValidator validator;
+    BinaryMessage *req = validator.request(1);
+    BinaryMessage *msg = answer(req, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0);
+    msg->size -= sizeof(uint32_t);
+
+    vbucket_state_t state = vbucket_state_dead;
+    string error;
+    validator.answered(*msg);
+    assert(validator.getState(1, state, error));
+    assert(error == "Invalid vbucket state response");
+    assert(state == vbucket_state_dead);
+
+    // An extra answer doesn't count as another request
+    validator.answered(*msg);
+    assert(validator.getAwaiting() == 0);
+    delete msg;
+    delete req;
+}
+
+static void testDestinations() {
+    // With -m every destination asks for the vbuckets it took over, and
+    // they answer in any order
+    StateValidator validator;
+    vector<BinaryMessage*> requests;
+    for (uint16_t vbucket = 0; vbucket < 16; ++vbucket) {
+        requests.push_back(validator.request(vbucket));
+    }
+    assert(validator.getAwaiting() == 16);
+
+    for (size_t dest = 0; dest < 4; ++dest) {
+        for (size_t ii = 0; ii < 4; ++ii) {
+            // The last destination answers first
+            BinaryMessage *req = requests[(3 - dest) * 4 + ii];
+            BinaryMessage *msg = answer(req, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                                        vbucket_state_active);
+            validator.answered(*msg);
+            delete msg;
+        }
+    }
+    assert(validator.getAwaiting() == 0);
+
+    for (uint16_t vbucket = 0; vbucket < 16; ++vbucket) {
+        vbucket_state_t state = vbucket_state_dead;
+        string error;
+        assert(validator.getState(vbucket, state, error));
+        assert(state == vbucket_state_active);
+        assert(error.empty());
+        delete requests[vbucket];
+    }
+}
+
+int main(void) {
+    testStates();
+    testDestinations();
+    testShortResponse();
+
+    return 0;
+}
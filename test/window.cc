@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "window.h"
+#include "binarymessage.h"
+#include <cassert>
+
+using namespace std;
+
+static BinaryMessage *request(uint8_t opcode, uint32_t opaque,
+                              uint32_t bodylen) {
+    protocol_binary_request_header h;
+    memset(&h, 0, sizeof(h));
+    h.request.magic = PROTOCOL_BINARY_REQ;
+    h.request.opcode = opcode;
+    h.request.opaque = opaque;
+    h.request.bodylen = htonl(bodylen);
+    BinaryMessage *msg = new BinaryMessage(h);
+    memset(msg->data.rawBytes + sizeof(h.bytes), opaque, bodylen);
+    return msg;
+}
+
+static void send(RetransmitWindow &window, uint8_t opcode, uint32_t opaque,
+                 uint32_t bodylen = 10) {
+    BinaryMessage *msg = request(opcode, opaque, bodylen);
+    window.sent(*msg);
+    delete msg;
+}
+
+static void testFence() {
+    RetransmitWindow window(1000, 100);
+    send(window, PROTOCOL_BINARY_CMD_SET, 1);
+    send(window, PROTOCOL_BINARY_CMD_SET, 2);
+    send(window, PROTOCOL_BINARY_CMD_NOOP, 3, 0);
+    send(window, PROTOCOL_BINARY_CMD_SET, 4);
+    assert(window.getMessages() == 4);
+
+    // The NOOP covers everything sent before it
+    window.answered(PROTOCOL_BINARY_CMD_NOOP, 3);
+    assert(window.getMessages() == 1);
+    assert(window.getBytes() == 34);
+    assert(window.isComplete());
+
+    vector<BinaryMessage*> replay;
+    window.replay(replay);
+    assert(replay.size() == 1);
+    assert(replay[0]->data.req->request.opaque == 4);
+    assert(replay[0]->size == 34);
+    assert(replay[0]->data.rawBytes[33] == 4);
+    delete replay[0];
+    assert(window.getMessages() == 0);
+}
+
+static void testAnswered() {
+    RetransmitWindow window(1000, 100);
+    send(window, PROTOCOL_BINARY_CMD_SETQ, 1);
+    send(window, PROTOCOL_BINARY_CMD_SETQ, 2);
+    send(window, PROTOCOL_BINARY_CMD_SETQ, 3);
+
+    // An error answers a message in the middle; it isn't replayed
+    window.answered(PROTOCOL_BINARY_CMD_SETQ, 2);
+    assert(window.getMessages() == 3);
+    window.answered(PROTOCOL_BINARY_CMD_SETQ, 1);
+    assert(window.getMessages() == 1);
+
+    send(window, PROTOCOL_BINARY_CMD_SETQ, 4);
+    window.answered(PROTOCOL_BINARY_CMD_DELETE, 3);
+    vector<BinaryMessage*> replay;
+    window.replay(replay);
+    assert(replay.size() == 2);
+    assert(replay[0]->data.req->request.opaque == 3);
+    assert(replay[1]->data.req->request.opaque == 4);
+    delete replay[0];
+    delete replay[1];
+}
+
+static void testOverflow() {
+    RetransmitWindow window(100, 100);
+    send(window, PROTOCOL_BINARY_CMD_SET, 1);
+    send(window, PROTOCOL_BINARY_CMD_SET, 2);
+    assert(window.needsFence());
+    send(window, PROTOCOL_BINARY_CMD_SET, 3);
+    assert(!window.isComplete());
+    assert(window.getMessages() == 0);
+
+    // The answer to a NOOP sent before the overflow doesn't help
+    send(window, PROTOCOL_BINARY_CMD_NOOP, 4, 0);
+    send(window, PROTOCOL_BINARY_CMD_SET, 5);
+    window.answered(PROTOCOL_BINARY_CMD_NOOP, 4);
+    assert(window.isComplete());
+    assert(window.getMessages() == 1);
+
+    RetransmitWindow early(100, 100);
+    send(early, PROTOCOL_BINARY_CMD_SET, 1);
+    send(early, PROTOCOL_BINARY_CMD_NOOP, 2, 0);
+    send(early, PROTOCOL_BINARY_CMD_SET, 3);
+    send(early, PROTOCOL_BINARY_CMD_SET, 4);
+    assert(!early.isComplete());
+    early.answered(PROTOCOL_BINARY_CMD_NOOP, 2);
+    assert(!early.isComplete());
+    send(early, PROTOCOL_BINARY_CMD_NOOP, 5, 0);
+    early.answered(PROTOCOL_BINARY_CMD_NOOP, 5);
+    assert(early.isComplete());
+    assert(early.getMessages() == 0);
+}
+
+static void testInterval() {
+    RetransmitWindow window(100000, 3);
+    send(window, PROTOCOL_BINARY_CMD_SET, 1);
+    send(window, PROTOCOL_BINARY_CMD_SET, 2);
+    assert(!window.needsFence());
+    send(window, PROTOCOL_BINARY_CMD_SET, 3);
+    assert(window.needsFence());
+    window.fenceQueued();
+    assert(!window.needsFence());
+    send(window, PROTOCOL_BINARY_CMD_SET, 4);
+    assert(!window.needsFence());
+    send(window, PROTOCOL_BINARY_CMD_NOOP, 5, 0);
+    assert(!window.needsFence());
+}
+
+int main() {
+    testFence();
+    testAnswered();
+    testOverflow();
+    testInterval();
+    return 0;
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 NorthScale, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "config.h"
+#include "workerpool.h"
+#include <assert.h>
+#include <iostream>
+#include <cassert>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t completed = 0;
+
+class CountingTask : public Task {
+public:
+    CountingTask() : count(0) { }
+
+    void run() {
+        ++count;
+        pthread_mutex_lock(&mutex);
+        ++completed;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    int count;
+};
+
+static size_t getCompleted() {
+    pthread_mutex_lock(&mutex);
+    size_t ret = completed;
+    pthread_mutex_unlock(&mutex);
+    return ret;
+}
+
+static void testAllTasksRun(size_t nthreads) {
+    const size_t ntasks = 10000;
+    vector<CountingTask> tasks(ntasks);
+    completed = 0;
+
+    WorkerPool pool(nthreads);
+    for (size_t ii = 0; ii < ntasks; ++ii) {
+        pool.schedule(&tasks[ii]);
+    }
+
+    for (int ii = 0; ii < 1000 && getCompleted() != ntasks; ++ii) {
+        usleep(10000);
+    }
+    pool.shutdown();
+
+    assert(getCompleted() == ntasks);
+    for (size_t ii = 0; ii < ntasks; ++ii) {
+        assert(tasks[ii].count == 1);
+    }
+}
+
+/**
+ * Blocks its worker until all of the other tasks are done
+ */
+class BlockingTask : public Task {
+public:
+    BlockingTask(size_t n) : others(n), done(false) { }
+
+    void run() {
+        for (int ii = 0; ii < 1000 && getCompleted() != others; ++ii) {
+            usleep(10000);
+        }
+        done = getCompleted() == others;
+    }
+
+    size_t others;
+    bool done;
+};
+
+static void testStealing() {
+    // The tasks queued behind the blocking one are stolen by the
+    // other workers
+    const size_t ntasks = 1000;
+    vector<CountingTask> tasks(ntasks);
+    BlockingTask blocker(ntasks);
+    completed = 0;
+
+    WorkerPool pool(4);
+    pool.schedule(&blocker);
+    for (size_t ii = 0; ii < ntasks; ++ii) {
+        pool.schedule(&tasks[ii]);
+    }
+
+    for (int ii = 0; ii < 1000 && getCompleted() != ntasks; ++ii) {
+        usleep(10000);
+    }
+    pool.shutdown();
+    assert(blocker.done);
+}
+
+static void testShutdownIdle() {
+    WorkerPool pool(4);
+    assert(pool.getNumThreads() == 4);
+    pool.shutdown();
+    // A second shutdown (from the destructor) should be harmless
+    pool.shutdown();
+}
+
+int main(void)
+{
+    testAllTasksRun(1);
+    testAllTasksRun(4);
+    testStealing();
+    testShutdownIdle();
+    return 0;
+}